@@ -88,6 +88,19 @@ function NaClProcessManager() {
   // Size of the terminal, must be set before spawning.
   self.ttyWidth = null;
   self.ttyHeight = null;
+
+  // Requests issued by handleMessagePrefetch_ keyed by URL, so that each
+  // library is only prefetched once while a fetch is in flight.
+  self.prefetches = {};
+
+  // Chrome trace-event records collected since startTracing(), or null when
+  // tracing is off.
+  self.traceEvents = null;
+
+  // Next id for async trace events (module loads, pipe blocks and waits).
+  self.traceAsyncId = 1;
+
+  self.pipeServer.setTraceListener(self.traceAsync_.bind(self));
 }
 
 /**
@@ -263,6 +276,26 @@ NaClProcessManager.EMBED_WIDTH_DEFAULT = '100%';
  */
 NaClProcessManager.EMBED_HEIGHT_DEFAULT  = '50%';
 
+/**
+ * Environment variable set to ENV_TRACE_VALUE in spawned processes while
+ * tracing is active, asking nacl_spawn to report its own trace events.
+ * @const
+ */
+NaClProcessManager.ENV_TRACE = 'NACL_TRACE';
+
+/**
+ * Value for ENV_TRACE that enables tracing in nacl_spawn.
+ * @const
+ */
+NaClProcessManager.ENV_TRACE_VALUE = '1';
+
+/**
+ * The trace-event thread id used for events recorded by the process manager
+ * on behalf of a process. Threads reported by nacl_spawn start at 1.
+ * @const
+ */
+NaClProcessManager.TRACE_MANAGER_TID = 0;
+
 /**
  * Handles an architecture gotten event.
  * @callback naclArchCallback
@@ -294,6 +327,124 @@ NaClProcessManager.prototype.naclArch = function(callback) {
   }, 0);
 };
 
+/**
+ * Returns the current time in microseconds since the epoch, the unit and
+ * origin nacl_spawn uses for its trace events.
+ * @returns {number}
+ */
+NaClProcessManager.traceNow = function() {
+  if (window.performance && performance.timing && performance.now) {
+    return (performance.timing.navigationStart + performance.now()) * 1000;
+  }
+  return Date.now() * 1000;
+};
+
+/**
+ * Start recording trace events for all processes spawned from now on, and
+ * for the ones already running.
+ */
+NaClProcessManager.prototype.startTracing = function() {
+  this.traceEvents = [];
+  for (var pid in this.processes) {
+    this.traceProcessName_(parseInt(pid),
+                           this.processes[pid].domElement.commandName);
+  }
+};
+
+/**
+ * Stop recording trace events.
+ * @returns {Object} The recorded events in the Chrome trace-event format,
+ *     suitable for JSON.stringify() and loading into chrome://tracing, or
+ *     null if tracing was not started.
+ */
+NaClProcessManager.prototype.stopTracing = function() {
+  var events = this.traceEvents;
+  this.traceEvents = null;
+  if (events === null) {
+    return null;
+  }
+  return {
+    traceEvents: events,
+    displayTimeUnit: 'ms',
+  };
+};
+
+/**
+ * Is tracing active?
+ * @returns {boolean}
+ */
+NaClProcessManager.prototype.isTracing = function() {
+  return this.traceEvents !== null;
+};
+
+/**
+ * Record a trace event if tracing is active.
+ * @private
+ * @param {Object} event The trace event; pid, ts and tid are filled in if
+ *     missing, and the parent pid is added to the arguments.
+ */
+NaClProcessManager.prototype.traceEvent_ = function(event) {
+  if (this.traceEvents === null) {
+    return;
+  }
+  if (event.ts === undefined) {
+    event.ts = NaClProcessManager.traceNow();
+  }
+  if (event.tid === undefined) {
+    event.tid = NaClProcessManager.TRACE_MANAGER_TID;
+  }
+  if (event.cat === undefined) {
+    event.cat = 'process';
+  }
+  event.args = event.args || {};
+  if (this.processes[event.pid] !== undefined) {
+    event.args.ppid = this.processes[event.pid].ppid;
+  }
+  this.traceEvents.push(event);
+};
+
+/**
+ * Record the begin or end of an async trace event, used for spans which
+ * may overlap within a process (module loads, pipe blocks and waits).
+ * @private
+ * @param {string} name The name of the span.
+ * @param {string} phase 'b' to begin or 'e' to end the span.
+ * @param {number} pid The process the span belongs to.
+ * @param {number} id The id returned when the span was begun, for 'e'.
+ * @returns {number} The id of the span.
+ */
+NaClProcessManager.prototype.traceAsync_ = function(name, phase, pid, id) {
+  if (id === undefined) {
+    id = this.traceAsyncId++;
+  }
+  this.traceEvent_({
+    name: name,
+    ph: phase,
+    pid: pid,
+    id: id,
+  });
+  return id;
+};
+
+/**
+ * Record the name of a process as trace metadata.
+ * @private
+ */
+NaClProcessManager.prototype.traceProcessName_ = function(pid, name) {
+  this.traceEvent_({
+    name: 'process_name',
+    ph: 'M',
+    pid: pid,
+    args: {name: name + ' (' + pid + ')'},
+  });
+  this.traceEvent_({
+    name: 'thread_name',
+    ph: 'M',
+    pid: pid,
+    args: {name: 'process manager'},
+  });
+};
+
 /**
  * Handles a stdout event.
  * @callback stdoutCallback
@@ -401,6 +552,35 @@ NaClProcessManager.prototype.syncMountStatus_ = function() {
   return result;
 };
 
+/**
+ * Converts a path as seen by a NaCl process to a URL the browser can fetch.
+ * @private
+ * @param {string} path The absolute path within the NaCl file system.
+ * @returns {string} The URL.
+ */
+NaClProcessManager.prototype.pathToUrl_ = function(path) {
+  // TODO(bradnelson): Generalize this.
+  var html5MountPoint = '/mnt/html5/';
+  var homeMountPoint = '/home/user/';
+  var tmpMountPoint = '/tmp/';
+  if (path.indexOf(html5MountPoint) === 0) {
+    return path.replace(html5MountPoint,
+                        'filesystem:' + location.origin + '/persistent/');
+  } else if (path.indexOf(homeMountPoint) === 0) {
+    return path.replace(homeMountPoint,
+                        'filesystem:' + location.origin +
+                        '/persistent/home/');
+  } else if (path.indexOf(tmpMountPoint) === 0) {
+    return path.replace(tmpMountPoint,
+                        'filesystem:' + location.origin +
+                        '/temporary/');
+  } else {
+    // This is for the dynamic loader.
+    var base = location.href.match('.*/')[0];
+    return base + path;
+  }
+};
+
 /**
  * Makes the path in a NMF entry to fully specified path.
  * @private
@@ -419,26 +599,7 @@ NaClProcessManager.prototype.adjustNmfEntry_ = function(entry) {
       }
       var path = entry[arch]['url'];
     }
-    // TODO(bradnelson): Generalize this.
-    var html5MountPoint = '/mnt/html5/';
-    var homeMountPoint = '/home/user/';
-    var tmpMountPoint = '/tmp/';
-    if (path.indexOf(html5MountPoint) === 0) {
-      path = path.replace(html5MountPoint,
-                          'filesystem:' + location.origin + '/persistent/');
-    } else if (path.indexOf(homeMountPoint) === 0) {
-      path = path.replace(homeMountPoint,
-                          'filesystem:' + location.origin +
-                          '/persistent/home/');
-    } else if (path.indexOf(tmpMountPoint) === 0) {
-      path = path.replace(tmpMountPoint,
-                          'filesystem:' + location.origin +
-                          '/temporary/');
-    } else {
-      // This is for the dynamic loader.
-      var base = location.href.match('.*/')[0];
-      path = base + path;
-    }
+    path = this.pathToUrl_(path);
     if (arch === 'portable') {
       entry[arch]['pnacl-translate']['url'] = path;
     } else {
@@ -476,6 +637,8 @@ NaClProcessManager.prototype.handleMessage_ = function(e) {
     nacl_jseval: [this, this.handleMessageJSEval_],
     nacl_deadpid: [this, this.handleMessageDeadPid_],
     nacl_mountfs: [this,this.handleMessageMountFs_],
+    nacl_trace: [this, this.handleMessageTrace_],
+    nacl_prefetch: [this, this.handleMessagePrefetch_],
   };
 
   // TODO(channingh): Once pinned applications support "result" instead of
@@ -529,6 +692,13 @@ NaClProcessManager.prototype.handleMessageSpawn_ = function(msg, reply, src) {
   var cwd = msg['cwd'];
   var executable = args[0];
   var nmf = msg['nmf'];
+  self.traceEvent_({
+    name: 'spawn_requested',
+    ph: 'i',
+    s: 'p',
+    pid: src.pid,
+    args: {argv: args},
+  });
   if (nmf) {
     if (nmf['files']) {
       for (var key in nmf['files'])
@@ -739,6 +909,49 @@ NaClProcessManager.prototype.handleMessageMountFs_ = function(msg, reply, src) {
   }
 };
 
+/**
+ * Handle a hint from nacl_spawn that the listed files will be needed by a
+ * process about to be spawned. Fetching them now warms the browser cache
+ * while the rest of the NMF is being built. No reply is sent.
+ * @private
+ */
+NaClProcessManager.prototype.handleMessagePrefetch_ = function(
+    msg, reply, src) {
+  var self = this;
+  var files = msg['files'];
+  for (var i = 0; i < files.length; i++) {
+    var url = self.pathToUrl_(files[i]);
+    if (url in self.prefetches) {
+      continue;
+    }
+    var request = new XMLHttpRequest();
+    request.open('GET', url, true);
+    request.responseType = 'arraybuffer';
+    request.onloadend = (function(url) {
+      return function() {
+        delete self.prefetches[url];
+      };
+    })(url);
+    self.prefetches[url] = request;
+    request.send();
+  }
+};
+
+/**
+ * Handle a trace event reported by nacl_spawn. No reply is sent.
+ * @private
+ */
+NaClProcessManager.prototype.handleMessageTrace_ = function(msg, reply, src) {
+  this.traceEvent_({
+    name: msg['name'],
+    cat: 'nacl_spawn',
+    ph: msg['ph'],
+    ts: msg['ts'],
+    pid: src.pid,
+    tid: msg['tid'],
+  });
+};
+
 /**
  * Handle progress event from NaCl.
  * @private
@@ -756,11 +969,23 @@ NaClProcessManager.prototype.handleProgress_ = function(e) {
  */
 NaClProcessManager.prototype.handleLoad_ = function(e) {
   e.srcElement.moduleResponded = true;
+  this.traceModuleLoaded_(e.srcElement);
   if (this.isRootProcess(e.srcElement)) {
     this.onRootLoad();
   }
 };
 
+/**
+ * End the module_load trace span of a process, if one is open.
+ * @private
+ */
+NaClProcessManager.prototype.traceModuleLoaded_ = function(element) {
+  if (element.traceLoadId !== undefined) {
+    this.traceAsync_('module_load', 'e', element.pid, element.traceLoadId);
+    delete element.traceLoadId;
+  }
+};
+
 /**
  * Handle a timeout around module startup.
  * @private
@@ -857,6 +1082,19 @@ NaClProcessManager.prototype.exit = function(code, element) {
   var ppid = this.processes[pid].ppid;
   var pgid = this.processes[pid].pgid;
 
+  this.traceModuleLoaded_(element);
+  if (element.traceSpawnTime !== undefined) {
+    var now = NaClProcessManager.traceNow();
+    this.traceEvent_({
+      name: 'process',
+      ph: 'X',
+      ts: element.traceSpawnTime,
+      dur: now - element.traceSpawnTime,
+      pid: pid,
+      args: {argv0: element.commandName, exitCode: code},
+    });
+  }
+
   this.pipeServer.deleteProcess(pid);
   this.deleteProcessFromGroup_(pid);
 
@@ -872,6 +1110,7 @@ NaClProcessManager.prototype.exit = function(code, element) {
     for (var j = 0; j < currPidWaiters.length; j++) {
       var waiter = currPidWaiters[j];
       if (waiter.srcPid === ppid) {
+        this.traceAsync_('wait', 'e', ppid, waiter.traceId);
         waiter.reply(pid, code);
         reaped = true;
       }
@@ -1018,6 +1257,7 @@ NaClProcessManager.prototype.spawn = function(
 
     fg.pid = self.pid;
     ++self.pid;
+    fg.traceSpawnTime = NaClProcessManager.traceNow();
 
     fg.width = 0;
     fg.height = 0;
@@ -1049,6 +1289,15 @@ NaClProcessManager.prototype.spawn = function(
     }
     self.processGroups[pgid].processes[fg.pid] = true;
 
+    if (self.isTracing()) {
+      self.traceProcessName_(fg.pid, argv[0]);
+      if (nmf !== null) {
+        fg.traceLoadId = self.traceAsync_('module_load', 'b', fg.pid);
+      }
+      envs.push(NaClProcessManager.ENV_TRACE + '=' +
+                NaClProcessManager.ENV_TRACE_VALUE);
+    }
+
     var params = {};
 
     envs.push('NACL_PID=' + fg.pid);
@@ -1276,7 +1525,8 @@ NaClProcessManager.prototype.waitpid = function(pid, options, reply, srcPid) {
   this.waiters[pid].push({
     reply: reply,
     options: options,
-    srcPid: srcPid
+    srcPid: srcPid,
+    traceId: this.traceAsync_('wait', 'b', srcPid),
   });
 };
 
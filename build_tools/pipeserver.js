@@ -13,6 +13,35 @@ function PipeServer() {
 
   // Status of anonymous pipes.
   this.anonymousPipes = {};
+
+  // Called to record the begin and end of blocked pipe reads for tracing.
+  this.onTrace = function() {};
+}
+
+/**
+ * Handles the begin or end of a traced span.
+ * @callback traceCallback
+ * @param {string} name The name of the span.
+ * @param {string} phase 'b' for begin or 'e' for end.
+ * @param {number} pid The process the span belongs to.
+ * @param {number} [id] The id returned when the span was begun.
+ * @returns {number} The id of the span.
+ */
+
+/**
+ * Listen for pipe operations which block a process.
+ * @param {traceCallback} callback
+ */
+PipeServer.prototype.setTraceListener = function(callback) {
+  this.onTrace = callback;
+}
+
+/**
+ * Reply to a pending read, ending its traced span.
+ */
+PipeServer.prototype.replyPendingRead = function(item, contents) {
+  this.onTrace('pipe_block', 'e', item.pid, item.traceId);
+  item.reply(contents);
 }
 
 /**
@@ -59,7 +88,7 @@ PipeServer.prototype.handleMessageAPipeWrite = function(
   while (data.byteLength > 0 && pipe.readsPending.length > 0) {
     var item = pipe.readsPending.shift();
     var part = data.slice(0, item.count);
-    item.reply({
+    this.replyPendingRead(item, {
       data: part,
     });
     data = data.slice(part.byteLength);
@@ -135,6 +164,7 @@ PipeServer.prototype.handleMessageAPipeRead = function(
         count: count,
         reply: reply,
         pid: src.pid,
+        traceId: this.onTrace('pipe_block', 'b', src.pid),
       });
     } else {
       reply({
@@ -161,7 +191,7 @@ PipeServer.prototype.closeAPipe = function(pid, pipeId, writer) {
     } else if (Object.keys(pipe.writers).length === 0) {
       for (var i = 0; i < pipe.readsPending.length; i++) {
         var item = pipe.readsPending[i];
-        item.reply({
+        this.replyPendingRead(item, {
           data: new ArrayBuffer(0),
         });
       }
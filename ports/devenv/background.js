@@ -89,6 +89,15 @@ chrome.runtime.onConnectExternal.addListener(function(port) {
       case 'nacl_sigint':
         manager.sigint();
         break;
+      case 'nacl_trace_start':
+        manager.startTracing();
+        break;
+      case 'nacl_trace_stop':
+        port.postMessage({
+          name: 'nacl_trace_stop_reply',
+          trace: JSON.stringify(manager.stopTracing())
+        });
+        break;
 
       case 'file_init':
         files.init().then(
@@ -0,0 +1,206 @@
+/*
+ * Channel benchmark.
+ *
+ * Producers send count messages each to consumers, first through a
+ * dthr_channel and then through the queue people wrote before there
+ * were channels:  a ring guarded by a semaphore, with a "not empty" and
+ * a "not full" event that are broadcast on every put and get.  Reports
+ * the time per message for each, for the given buffer capacity (0 is an
+ * unbuffered channel; the ring then holds one message).
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dreadthread.h"
+
+#define STACKSIZE (16 * 1024)
+#define COUNT     200000
+
+int                   nproducers = 1;
+int                   nconsumers = 1;
+int                   capacity = 0;
+int                   count = COUNT;
+
+struct dthr_channel   ch;
+
+struct queue {
+  struct dthr_semaphore lock;
+  struct dthr_event     not_empty, not_full;
+  void                  **ring;
+  int                   size, head, n, closed;
+} q;
+
+struct dthr_thread    *all_producer_th, *all_consumer_th, main_th;
+struct dthr_semaphore done_sema;
+long                  checksum;
+
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void queue_put(void *msg)
+{
+  dthr_semaphore_take(&q.lock);
+  while (q.n == q.size)
+    dthr_event_wait(&q.not_full,&q.lock);
+  q.ring[(q.head + q.n++) % q.size] = msg;
+  dthr_event_broadcast_no_yield(&q.not_empty);
+  dthr_semaphore_drop(&q.lock);
+}
+
+static int queue_get(void **msg)
+{
+  dthr_semaphore_take(&q.lock);
+  while (q.n == 0 && !q.closed)
+    dthr_event_wait(&q.not_empty,&q.lock);
+  if (q.n == 0) {
+    dthr_semaphore_drop(&q.lock);
+    return 0;
+  }
+  *msg = q.ring[q.head];
+  q.head = (q.head + 1) % q.size;
+  q.n--;
+  dthr_event_broadcast_no_yield(&q.not_full);
+  dthr_semaphore_drop(&q.lock);
+  return 1;
+}
+
+static void queue_close(void)
+{
+  dthr_semaphore_take(&q.lock);
+  q.closed = 1;
+  dthr_event_broadcast_no_yield(&q.not_empty);
+  dthr_semaphore_drop(&q.lock);
+}
+
+void *producer(void *arg)
+{
+  int use_queue = (uintptr_t) arg;
+  int i;
+
+  for (i = 1; i <= count; i++)
+    if (use_queue) queue_put((void *) (uintptr_t) i);
+    else (void) dthr_channel_send(&ch,(void *) (uintptr_t) i);
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *consumer(void *arg)
+{
+  int   use_queue = (uintptr_t) arg;
+  void  *msg;
+  long  sum = 0;
+
+  while (use_queue ? queue_get(&msg) : dthr_channel_recv(&ch,&msg))
+    sum += (uintptr_t) msg;
+  (void) __sync_fetch_and_add(&checksum,sum);
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+static void run(int use_queue)
+{
+  struct dthr_thread  *producer_th, *consumer_th;
+  double              start, elapsed;
+  long                msgs = (long) nproducers * count;
+  int                 i;
+
+  /* a run's threads may not have finished exiting when the next starts */
+  producer_th = all_producer_th + use_queue * nproducers;
+  consumer_th = all_consumer_th + use_queue * nconsumers;
+
+  checksum = 0;
+  start = now_ns();
+  for (i = 0; i < nconsumers; i++) {
+    (void) dthr_thread_init(&consumer_th[i],consumer,
+                            (void *) (uintptr_t) use_queue,STACKSIZE);
+    (void) dthr_thread_detach(dthr_thread_run(&consumer_th[i]));
+  }
+  for (i = 0; i < nproducers; i++) {
+    (void) dthr_thread_init(&producer_th[i],producer,
+                            (void *) (uintptr_t) use_queue,STACKSIZE);
+    (void) dthr_thread_detach(dthr_thread_run(&producer_th[i]));
+  }
+  for (i = 0; i < nproducers; i++)
+    dthr_semaphore_take(&done_sema);
+  if (use_queue) queue_close();
+  else dthr_channel_close(&ch);
+  for (i = 0; i < nconsumers; i++)
+    dthr_semaphore_take(&done_sema);
+  elapsed = now_ns() - start;
+  printf("%-22s %d:%d cap %d: %.1f ns/msg%s\n",
+         use_queue ? "semaphore+event queue" : "channel",
+         nproducers,nconsumers,capacity,elapsed / msgs,
+         checksum == (long) nproducers * count * (count + 1) / 2
+             ? "" : "  (bad checksum)");
+}
+
+void *goForIt(void *unused)
+{
+  dthr_semaphore_init(&done_sema,0);
+  if (!dthr_channel_init(&ch,capacity)) {
+    fprintf(stderr,"out of space for channel\n");
+    exit(1);
+  }
+  dthr_semaphore_init(&q.lock,1);
+  dthr_event_init(&q.not_empty);
+  dthr_event_init(&q.not_full);
+  q.size = capacity ? capacity : 1;
+  if (!(q.ring = (void **) malloc(q.size * sizeof *q.ring))) {
+    fprintf(stderr,"out of space for queue\n");
+    exit(1);
+  }
+  run(0);
+  run(1);
+  dthr_channel_destroy(&ch);
+  (void) dthr_thread_detach(dthr_cur_thread);
+  return 0;
+}
+
+extern int  getopt();
+extern char *optarg;
+
+char    *me;
+
+void usage()
+{
+  fprintf(stderr,"Usage: %s [-c count] [-p producers] [-q capacity]"
+          " [-r consumers]\n",me);
+}
+
+int main(int ac, char **av)
+{
+  int   opt;
+
+  if (!(me = strrchr(*av,'/'))) me = *av;
+  else ++me;
+
+  while ((opt = getopt(ac,av,"c:p:q:r:")) != EOF) switch (opt) {
+  case 'c': count = atoi(optarg);       break;
+  case 'p': nproducers = atoi(optarg);  break;
+  case 'q': capacity = atoi(optarg);    break;
+  case 'r': nconsumers = atoi(optarg);  break;
+  default:  usage(); exit(1);
+  }
+
+  all_producer_th = (struct dthr_thread *)
+      malloc(2 * nproducers * sizeof *all_producer_th);
+  all_consumer_th = (struct dthr_thread *)
+      malloc(2 * nconsumers * sizeof *all_consumer_th);
+  if (!all_producer_th || !all_consumer_th) {
+    perror(me);
+    fprintf(stderr,"%s:  insufficient space for thread descriptors\n", me);
+    exit(1);
+  }
+
+  dthr_init();
+  (void) dthr_thread_init(&main_th,goForIt,(void *) 0,STACKSIZE);
+  dthr_thread_multithread(&main_th);
+  return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Context switch benchmark.
+ *
+ * Two threads yield to each other in a loop; reports the time per
+ * context switch.  For comparison it also times a bare save/load pair of
+ * the context primitives in use and of setjmp/longjmp, which is what
+ * dreadthread uses when built with -DDREAD_THREAD_FAST_CTXT=0.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "dreadthread.h"
+
+#define STACKSIZE (16 * 1024)
+#define COUNT     1000000
+
+int                 count = COUNT;
+int                 stacksize = STACKSIZE;
+struct dthr_thread  ping_th, pong_th, main_th;
+struct dthr_semaphore done_sema;
+
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void *pingpong(void *arg)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    dthr_thread_yield();
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *goForIt(void *unused)
+{
+  double  start, elapsed;
+
+  dthr_semaphore_init(&done_sema,0);
+  (void) dthr_thread_detach(dthr_thread_run(&ping_th));
+  (void) dthr_thread_detach(dthr_thread_run(&pong_th));
+  /* let both threads get their stacks before timing */
+  dthr_thread_yield();
+  start = now_ns();
+  dthr_semaphore_take(&done_sema);
+  dthr_semaphore_take(&done_sema);
+  elapsed = now_ns() - start;
+  /* each iteration of each thread switches once */
+  printf("yield ping-pong (%s): %.1f ns/switch\n",
+         DREAD_THREAD_FAST_CTXT ? "register swap" : "setjmp/longjmp",
+         elapsed / (2.0 * count));
+  (void) dthr_thread_detach(dthr_cur_thread);
+  return 0;
+}
+
+static void time_setjmp(void)
+{
+  jmp_buf         buf;
+  volatile int    i;
+  double          start;
+
+  start = now_ns();
+  for (i = 0; i < count; i++) {
+    if (!setjmp(buf))
+      longjmp(buf,1);
+  }
+  printf("setjmp+longjmp: %.1f ns/pair\n",(now_ns() - start) / count);
+}
+
+#if DREAD_THREAD_FAST_CTXT
+static void time_md(void)
+{
+  dthr_md_jmp_buf buf;
+  volatile int    i;
+  double          start;
+
+  start = now_ns();
+  for (i = 0; i < count; i++) {
+    if (!dthr_md_save(buf))
+      dthr_md_load(buf,1);
+  }
+  printf("dthr_md_save+dthr_md_load: %.1f ns/pair\n",
+         (now_ns() - start) / count);
+}
+#endif
+
+extern int  getopt();
+extern char *optarg;
+
+char    *me;
+
+void usage()
+{
+  fprintf(stderr,"Usage: %s [-s stackbytes] [-c count]\n",me);
+}
+
+int main(int ac, char **av)
+{
+  int   opt;
+
+  if (!(me = strrchr(*av,'/'))) me = *av;
+  else ++me;
+
+  while ((opt = getopt(ac,av,"c:s:")) != EOF) switch (opt) {
+  case 'c': count = atoi(optarg);   break;
+  case 's': stacksize = atoi(optarg); break;
+  default:  usage(); exit(1);
+  }
+
+  time_setjmp();
+#if DREAD_THREAD_FAST_CTXT
+  time_md();
+#endif
+
+  dthr_init();
+  (void) dthr_thread_init(&ping_th,pingpong,(void *) 0,stacksize);
+  (void) dthr_thread_init(&pong_th,pingpong,(void *) 0,stacksize);
+  dthr_thread_init(&main_th,goForIt,(void *) 0,stacksize);
+  dthr_thread_multithread(&main_th);
+  return 0;
+}
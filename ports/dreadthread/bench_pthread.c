@@ -0,0 +1,155 @@
+/*
+ * pthread benchmark, built twice from this source:  as bench_pthread,
+ * with -DDREAD_THREAD_PTHREAD_NAMES against the dreadthread shim, and as
+ * bench_pthread_native against the system's pthreads.  Times thread
+ * create+join, one at a time and in batches, uncontended mutex
+ * lock+unlock, and a mutex/condition variable ping-pong between two
+ * threads.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(DREAD_THREAD_PTHREAD_NAMES)
+# include "dreadthread_pthread.h"
+# define IMPL "dreadthread"
+#else
+# include <pthread.h>
+# define IMPL "native"
+#endif
+
+#define CREATES   20000
+#define BATCH     100
+#define ROUNDS    100000
+
+int             ncarriers = 1;
+int             creates = CREATES;
+int             batch = BATCH;
+int             rounds = ROUNDS;
+
+pthread_mutex_t pp_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  pp_cond[2] = { PTHREAD_COND_INITIALIZER,
+                               PTHREAD_COND_INITIALIZER };
+int             turn = 0;
+
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void *nothing(void *arg)
+{
+  return arg;
+}
+
+void *player(void *arg)
+{
+  int me = (uintptr_t) arg;
+  int i;
+
+  pthread_mutex_lock(&pp_lock);
+  for (i = 0; i < rounds; i++) {
+    while (turn != me)
+      pthread_cond_wait(&pp_cond[me],&pp_lock);
+    turn = !me;
+    pthread_cond_signal(&pp_cond[!me]);
+  }
+  pthread_mutex_unlock(&pp_lock);
+  return 0;
+}
+
+int bench_main(int ac, char **av)
+{
+  pthread_t       *th;
+  pthread_mutex_t lock;
+  double          start;
+  void            *rv;
+  int             i, j, errors = 0;
+
+  if (!(th = (pthread_t *) malloc(batch * sizeof *th))) {
+    perror("bench_pthread");
+    return 1;
+  }
+
+  start = now_ns();
+  for (i = 0; i < creates; i++) {
+    if (pthread_create(&th[0],0,nothing,(void *) (uintptr_t) i)
+        || pthread_join(th[0],&rv) || rv != (void *) (uintptr_t) i)
+      errors++;
+  }
+  printf("%-12s create+join:  %.1f ns\n",IMPL,(now_ns() - start) / creates);
+
+  start = now_ns();
+  for (i = 0; i < creates; i += batch) {
+    for (j = 0; j < batch; j++)
+      if (pthread_create(&th[j],0,nothing,(void *) 0)) errors++;
+    for (j = 0; j < batch; j++)
+      if (pthread_join(th[j],0)) errors++;
+  }
+  printf("%-12s create+join, %d at a time:  %.1f ns\n",IMPL,batch,
+         (now_ns() - start) / (creates / batch * batch));
+
+  pthread_mutex_init(&lock,0);
+  start = now_ns();
+  for (i = 0; i < rounds * 10; i++) {
+    pthread_mutex_lock(&lock);
+    pthread_mutex_unlock(&lock);
+  }
+  printf("%-12s mutex lock+unlock:  %.1f ns\n",IMPL,
+         (now_ns() - start) / (rounds * 10));
+  pthread_mutex_destroy(&lock);
+
+  start = now_ns();
+  if (pthread_create(&th[0],0,player,(void *) 0)
+      || pthread_create(&th[1],0,player,(void *) 1)
+      || pthread_join(th[0],0) || pthread_join(th[1],0))
+    errors++;
+  printf("%-12s mutex+cond ping-pong:  %.1f ns/round trip\n",IMPL,
+         (now_ns() - start) / rounds);
+
+  if (errors) fprintf(stderr,"bench_pthread:  %d errors\n",errors);
+  return errors != 0;
+}
+
+extern int  getopt();
+extern char *optarg;
+
+char    *me;
+
+void usage()
+{
+  fprintf(stderr,"Usage: %s [-C carriers] [-b batch] [-c creates]"
+          " [-r rounds]\n",me);
+}
+
+int main(int ac, char **av)
+{
+  int   opt;
+
+  if (!(me = strrchr(*av,'/'))) me = *av;
+  else ++me;
+
+  while ((opt = getopt(ac,av,"C:b:c:r:")) != EOF) switch (opt) {
+  case 'C': ncarriers = atoi(optarg); break;
+  case 'b': batch = atoi(optarg);     break;
+  case 'c': creates = atoi(optarg);   break;
+  case 'r': rounds = atoi(optarg);    break;
+  default:  usage(); exit(1);
+  }
+  if (batch < 2) batch = 2;
+
+#if defined(DREAD_THREAD_PTHREAD_NAMES)
+  if (dthr_pthread_main(bench_main,ac,av,ncarriers) < 0) {
+    fprintf(stderr,"%s:  cannot use %d carriers\n",me,ncarriers);
+    exit(1);
+  }
+  return 0;
+#else
+  return bench_main(ac,av);
+#endif
+}
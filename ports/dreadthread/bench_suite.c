@@ -0,0 +1,395 @@
+/*
+ * Benchmark suite, with its results as one JSON object on stdout so that
+ * runs before and after a scheduler or stack allocator change can be
+ * compared by a script.  Also built as bench_suite_mt, with -C carriers.
+ *
+ *   idle_memory       memory per thread blocked on a semaphore:  the
+ *                     growth of the resident set, the stack bytes grown,
+ *                     and the descriptor
+ *   create_join       thread create, exit and join, one at a time
+ *   create_join_batch the same, n threads at a time
+ *   yield_pingpong    two threads yielding to each other, per switch
+ *   sema_handoff      a token passed around a ring of n threads, each
+ *                     waiting on its own semaphore, per hand-off
+ *   event_fanout      a broadcast waking n waiters on one event, per
+ *                     wakeup (until the last of them has run)
+ *   cond_fanout       the same with a condition variable, which queues
+ *                     the waiters on the lock instead of waking them
+ *   rwlock_mixed      n threads reading shared state, one access in ten
+ *                     a write, under a rwlock; per access
+ *   sema_mixed        the same under a semaphore
+ *
+ * "Join" is waiting for a semaphore dropped by the thread's on-exit
+ * routine; a descriptor is reused once its on-release routine has run.
+ * idle_memory runs first, since the resident set only grows for stack the
+ * process has not touched before.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "dreadthread.h"
+
+#define STACKSIZE (16 * 1024)
+#define NTHREADS  100
+#define CREATES   20000
+#define ROUNDS    20000
+#define SWITCHES  1000000
+
+int                   ncarriers = 1;
+int                   nthreads = NTHREADS;
+int                   creates = CREATES;
+int                   rounds = ROUNDS;
+int                   switches = SWITCHES;
+int                   stacksize = STACKSIZE;
+int                   stack_mode = 0;
+
+struct dthr_thread    main_th, *th;
+volatile int          *th_busy;         /* not yet released */
+struct dthr_semaphore done_sema, joined_sema, *ring_sema;
+struct dthr_semaphore fan_lock;
+struct dthr_event     fan_ev;
+struct dthr_cond      fan_cond;
+struct dthr_rwlock    mix_rw;
+struct dthr_semaphore mix_sema;
+long                  mix_state;
+int                   fan_gen, fan_stop, fan_ready, fan_arrived;
+int                   nresults = 0;
+
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long rss_bytes(void)
+{
+  FILE  *fp;
+  long  size, resident;
+
+  if (!(fp = fopen("/proc/self/statm","r"))) return -1;
+  if (fscanf(fp,"%ld %ld",&size,&resident) != 2) resident = -1;
+  fclose(fp);
+  return resident < 0 ? -1 : resident * sysconf(_SC_PAGESIZE);
+}
+
+static void result(char *name, int threads, long ops, double elapsed)
+{
+  printf("%s\n    {\"name\": \"%s\", \"threads\": %d, \"ops\": %ld,"
+         " \"ns_per_op\": %.1f}",nresults++ ? "," : "",name,threads,ops,
+         elapsed / ops);
+}
+
+static void exited(struct dthr_thread *t, void *unused)
+{
+  dthr_semaphore_drop_no_yield(&joined_sema);
+}
+
+static void released(struct dthr_thread *t)
+{
+  th_busy[t - th] = 0;
+}
+
+static void start(int i, void *(*fn)(void *), void *arg)
+{
+  while (th_busy[i])
+    dthr_thread_yield();
+  th_busy[i] = 1;
+  (void) dthr_thread_init(&th[i],fn,arg,stacksize);
+  (void) dthr_thread_on_exit(&th[i],exited,0);
+  dthr_thread_on_release(&th[i],released);
+  (void) dthr_thread_detach(dthr_thread_run(&th[i]));
+}
+
+/* waits for n threads started by start to exit */
+static void join(int n)
+{
+  while (n-- > 0)
+    dthr_semaphore_take(&joined_sema);
+}
+
+void *nothing(void *arg)
+{
+  return arg;
+}
+
+void *idle(void *arg)
+{
+  dthr_semaphore_take(&done_sema);
+  return 0;
+}
+
+void *yielder(void *arg)
+{
+  int i;
+
+  for (i = 0; i < switches; i++)
+    dthr_thread_yield();
+  return 0;
+}
+
+void *passer(void *arg)
+{
+  int i = (uintptr_t) arg;
+  int r;
+
+  for (r = 0; r < rounds; r++) {
+    dthr_semaphore_take(&ring_sema[i]);
+    dthr_semaphore_drop_no_yield(&ring_sema[(i + 1) % nthreads]);
+  }
+  return 0;
+}
+
+void *waiter(void *arg)
+{
+  int use_cond = (uintptr_t) arg;
+  int gen = 0;
+
+  dthr_semaphore_take(&fan_lock);
+  fan_ready++;
+  for (;;) {
+    while (fan_gen == gen && !fan_stop)
+      if (use_cond) dthr_cond_wait(&fan_cond,&fan_lock);
+      else dthr_event_wait(&fan_ev,&fan_lock);
+    if (fan_stop) break;
+    gen = fan_gen;
+    if (++fan_arrived == nthreads)
+      dthr_semaphore_drop_no_yield(&done_sema);
+  }
+  dthr_semaphore_drop(&fan_lock);
+  return 0;
+}
+
+/* the read side does some waiting, so readers overlap */
+void *mixer(void *arg)
+{
+  int   use_rw = (uintptr_t) arg;
+  int   i;
+  long  seen = 0;
+
+  for (i = 0; i < rounds / 10; i++) {
+    if (i % 10 == 0) {
+      if (use_rw) dthr_rwlock_wrlock(&mix_rw);
+      else dthr_semaphore_take_no_yield(&mix_sema);
+      mix_state++;
+    } else {
+      if (use_rw) dthr_rwlock_rdlock(&mix_rw);
+      else dthr_semaphore_take_no_yield(&mix_sema);
+      seen += mix_state;
+      dthr_thread_yield();
+    }
+    if (use_rw) dthr_rwlock_unlock(&mix_rw);
+    else dthr_semaphore_drop_no_yield(&mix_sema);
+    dthr_thread_yield();
+  }
+  return (void *) seen;
+}
+
+static void idle_memory(void)
+{
+  struct dthr_stack_stats before, after;
+  long                    rss_before, rss_after;
+  int                     i;
+
+  rss_before = rss_bytes();
+  (void) dthr_get_stack_stats(&before);
+  for (i = 0; i < nthreads; i++)
+    start(i,idle,0);
+  /* all of them blocked */
+  while (dthr_semaphore_waiters(&done_sema) < nthreads)
+    dthr_thread_yield();
+  rss_after = rss_bytes();
+  (void) dthr_get_stack_stats(&after);
+  printf("%s\n    {\"name\": \"idle_memory\", \"threads\": %d,"
+         " \"rss_bytes_per_thread\": ",nresults++ ? "," : "",nthreads);
+  if (rss_before < 0 || rss_after < 0) printf("null");
+  else printf("%.1f",(double) (rss_after - rss_before) / nthreads);
+  printf(", \"stack_bytes_per_thread\": %.1f, \"descriptor_bytes\": %lu}",
+         (double) (after.bytes_total - before.bytes_total) / nthreads,
+         (unsigned long) sizeof (struct dthr_thread));
+  for (i = 0; i < nthreads; i++)
+    dthr_semaphore_drop_no_yield(&done_sema);
+  join(nthreads);
+}
+
+static void create_join(void)
+{
+  double  start_ns;
+  int     i, j;
+
+  start_ns = now_ns();
+  for (i = 0; i < creates; i++) {
+    start(i & 1,nothing,0);
+    join(1);
+  }
+  result("create_join",1,creates,now_ns() - start_ns);
+
+  start_ns = now_ns();
+  for (i = 0; i + nthreads <= creates; i += nthreads) {
+    for (j = 0; j < nthreads; j++)
+      start(j,nothing,0);
+    join(nthreads);
+  }
+  result("create_join_batch",nthreads,i,now_ns() - start_ns);
+}
+
+static void yield_pingpong(void)
+{
+  double  start_ns;
+
+  start_ns = now_ns();
+  start(0,yielder,0);
+  start(1,yielder,0);
+  join(2);
+  /* each iteration of each thread switches once */
+  result("yield_pingpong",2,2l * switches,now_ns() - start_ns);
+}
+
+static void sema_handoff(void)
+{
+  double  start_ns;
+  int     i;
+
+  for (i = 0; i < nthreads; i++)
+    dthr_semaphore_init(&ring_sema[i],0);
+  for (i = 0; i < nthreads; i++)
+    start(i,passer,(void *) (uintptr_t) i);
+  start_ns = now_ns();
+  dthr_semaphore_drop_no_yield(&ring_sema[0]);
+  join(nthreads);
+  result("sema_handoff",nthreads,(long) rounds * nthreads,
+         now_ns() - start_ns);
+}
+
+static void fanout(int use_cond)
+{
+  double  start_ns;
+  int     i, r, n = rounds / 10 ? rounds / 10 : 1;
+
+  fan_gen = fan_stop = fan_ready = 0;
+  for (i = 0; i < nthreads; i++)
+    start(i,waiter,(void *) (uintptr_t) use_cond);
+  /* counted in under the lock, so waiting once it is free */
+  do {
+    dthr_semaphore_take(&fan_lock);
+    r = fan_ready;
+    dthr_semaphore_drop(&fan_lock);
+  } while (r < nthreads);
+  start_ns = now_ns();
+  for (r = 0; r < n; r++) {
+    dthr_semaphore_take(&fan_lock);
+    fan_arrived = 0;
+    fan_gen++;
+    if (use_cond) dthr_cond_broadcast(&fan_cond);
+    else dthr_event_broadcast_no_yield(&fan_ev);
+    dthr_semaphore_drop(&fan_lock);
+    dthr_semaphore_take(&done_sema);
+  }
+  result(use_cond ? "cond_fanout" : "event_fanout",nthreads,
+         (long) n * nthreads,now_ns() - start_ns);
+  dthr_semaphore_take(&fan_lock);
+  fan_stop = 1;
+  if (use_cond) dthr_cond_broadcast(&fan_cond);
+  else dthr_event_broadcast_no_yield(&fan_ev);
+  dthr_semaphore_drop(&fan_lock);
+  join(nthreads);
+}
+
+static void mixed(int use_rw)
+{
+  double  start_ns;
+  int     i;
+
+  start_ns = now_ns();
+  for (i = 0; i < nthreads; i++)
+    start(i,mixer,(void *) (uintptr_t) use_rw);
+  join(nthreads);
+  result(use_rw ? "rwlock_mixed" : "sema_mixed",nthreads,
+         (long) (rounds / 10) * nthreads,now_ns() - start_ns);
+}
+
+void *goForIt(void *unused)
+{
+  dthr_semaphore_init(&done_sema,0);
+  dthr_semaphore_init(&joined_sema,0);
+  dthr_semaphore_init(&fan_lock,1);
+  dthr_event_init(&fan_ev);
+  dthr_cond_init(&fan_cond);
+  dthr_rwlock_init(&mix_rw);
+  dthr_semaphore_init(&mix_sema,1);
+
+  printf("{\n  \"suite\": \"dreadthread\",\n  \"carriers\": %d,\n"
+         "  \"context_switch\": \"%s\",\n  \"stacks\": \"%s\",\n"
+         "  \"stack_size\": %d,\n  \"results\": [",ncarriers,
+         DREAD_THREAD_FAST_CTXT ? "register swap" : "setjmp/longjmp",
+         stack_mode & DREAD_THREAD_STACK_MAPPED ? "mapped" : "carved",
+         stacksize);
+  idle_memory();
+  create_join();
+  yield_pingpong();
+  sema_handoff();
+  fanout(0);
+  fanout(1);
+  mixed(1);
+  mixed(0);
+  printf("\n  ]\n}\n");
+  (void) dthr_thread_detach(dthr_cur_thread);
+  return 0;
+}
+
+extern int  getopt();
+extern char *optarg;
+
+char    *me;
+
+void usage()
+{
+  fprintf(stderr,"Usage: %s [-C carriers] [-c creates] [-m] [-n threads]"
+          " [-r rounds] [-s stacksize] [-y switches]\n",me);
+}
+
+int main(int ac, char **av)
+{
+  int   opt;
+
+  if (!(me = strrchr(*av,'/'))) me = *av;
+  else ++me;
+
+  while ((opt = getopt(ac,av,"C:c:mn:r:s:y:")) != EOF) switch (opt) {
+  case 'C': ncarriers = atoi(optarg);               break;
+  case 'c': creates = atoi(optarg);                 break;
+  case 'm': stack_mode = DREAD_THREAD_STACK_MAPPED; break;
+  case 'n': nthreads = atoi(optarg);                break;
+  case 'r': rounds = atoi(optarg);                  break;
+  case 's': stacksize = atoi(optarg);               break;
+  case 'y': switches = atoi(optarg);                break;
+  default:  usage(); exit(1);
+  }
+  if (nthreads < 2) nthreads = 2;
+
+  th = (struct dthr_thread *) malloc(nthreads * sizeof *th);
+  th_busy = (volatile int *) calloc(nthreads,sizeof *th_busy);
+  ring_sema = (struct dthr_semaphore *) malloc(nthreads * sizeof *ring_sema);
+  if (!th || !th_busy || !ring_sema) {
+    perror(me);
+    fprintf(stderr,"%s:  insufficient space for thread descriptors\n",me);
+    exit(1);
+  }
+
+  dthr_init();
+  if (!dthr_set_carriers(ncarriers,0)) {
+    fprintf(stderr,"%s:  cannot use %d carriers\n",me,ncarriers);
+    exit(1);
+  }
+  if (stack_mode && !dthr_set_stack_mode(stack_mode)) {
+    fprintf(stderr,"%s:  mapped stacks not supported\n",me);
+    exit(1);
+  }
+  (void) dthr_thread_init(&main_th,goForIt,(void *) 0,STACKSIZE);
+  dthr_thread_multithread(&main_th);
+  return 0;
+}
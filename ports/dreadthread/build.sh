@@ -7,17 +7,29 @@ BuildStep() {
   ChangeDir ${SRC_DIR}
   ${NACLCC} -c ${START_DIR}/dread.c -o dread.o
   ${NACLCC} -c ${START_DIR}/dread_chain.c -o dread_chain.o
+  ${NACLCC} -c ${START_DIR}/dread_pthread.c -o dread_pthread.o
   ${NACLAR} rcs libdreadthread.a \
       dread.o \
-      dread_chain.o
+      dread_chain.o \
+      dread_pthread.o
   ${NACLRANLIB} libdreadthread.a
+  ${NACLCC} -DDREAD_THREAD_MULTI=1 -c ${START_DIR}/dread.c -o dread_mt.o
+  ${NACLCC} -DDREAD_THREAD_MULTI=1 -c ${START_DIR}/dread_pthread.c \
+      -o dread_pthread_mt.o
+  ${NACLAR} rcs libdreadthread_mt.a \
+      dread_mt.o \
+      dread_chain.o \
+      dread_pthread_mt.o
+  ${NACLRANLIB} libdreadthread_mt.a
 }
 
 InstallStep() {
   MakeDir ${DESTDIR_LIB}
   MakeDir ${DESTDIR_INCLUDE}
   LogExecute cp ${SRC_DIR}/libdreadthread.a ${DESTDIR_LIB}/
+  LogExecute cp ${SRC_DIR}/libdreadthread_mt.a ${DESTDIR_LIB}/
   LogExecute cp ${START_DIR}/dreadthread.h ${DESTDIR_INCLUDE}/
   LogExecute cp ${START_DIR}/dreadthread_ctxt.h ${DESTDIR_INCLUDE}/
   LogExecute cp ${START_DIR}/dreadthread_chain.h ${DESTDIR_INCLUDE}/
+  LogExecute cp ${START_DIR}/dreadthread_pthread.h ${DESTDIR_INCLUDE}/
 }
@@ -54,12 +54,22 @@
  * Preemption via timers / signals.
  */
 #include <stdio.h>
+#include <stdint.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
 
 #include "dreadthread.h"
 
+#if defined(DREAD_THREAD_MD_START)
+# include <sys/mman.h>
+# define DREAD_THREAD_MAP_STACKS  1
+#else
+# define DREAD_THREAD_MAP_STACKS  0
+#endif
+
 #define MAGIC_TEST      1
 
 #define DEBUG           0
@@ -100,33 +110,225 @@ void dbprint(char *fmt, ...)
 #define DREAD_THREAD_CSW_EXIT   3
 #define DREAD_THREAD_CSW_MAX    4
 
+/*
+ * Free stacks are kept in size-class bins.  Each power of two is split
+ * into DREAD_THREAD_STACK_SUBCLASSES classes, and new stacks are grown to
+ * the upper bound of their class, so that any stack in the bin of a
+ * request (or of a larger class) fits it.  Bin 0 holds the smallest
+ * class; the last bin holds stacks too large for any class and is
+ * searched best fit.
+ */
+#define DREAD_THREAD_STACK_MIN_SHIFT    10
+#define DREAD_THREAD_STACK_MAX_SHIFT    28
+#define DREAD_THREAD_STACK_SUBCLASSES   4
+#define DREAD_THREAD_STACK_HUGE_BIN \
+  ((DREAD_THREAD_STACK_MAX_SHIFT - DREAD_THREAD_STACK_MIN_SHIFT) \
+   * DREAD_THREAD_STACK_SUBCLASSES + 1)
+#define DREAD_THREAD_STACK_NBINS  (DREAD_THREAD_STACK_HUGE_BIN + 1)
+
+/*
+ * DREAD_THREAD_STACK_MEASURE paints stacks with this word, from a little
+ * below the painting frame down to stack_top, as in stack_est.c.  Only
+ * the part dirtied by the last thread is repainted on reuse.
+ */
+#define DREAD_THREAD_STACK_PAINT        0x5ca1ab1eul
+#define DREAD_THREAD_STACK_PAINT_MARGIN 256
+
+/*
+ * Descriptors threads are parked on are polled whenever the run queue
+ * drains, and also, without waiting, every this many yields, so that a
+ * few threads that only ever yield cannot starve I/O.
+ */
+#define DREAD_THREAD_IO_POLL_YIELDS     64
+
+/*
+ * A run queue is a FIFO per priority level and a mask of the nonempty
+ * levels, so the most urgent runnable thread is found in constant time.
+ * Each level also keeps the scheduling latency of its dispatches, while
+ * time slices are accounted.  With DREAD_THREAD_MULTI the lock guards
+ * all of it, as other carriers steal from the queue.
+ */
+struct dthr_runq {
+  struct dthr_chain         level[DREAD_THREAD_PRIO_LEVELS];
+  unsigned int              nonempty;   /* bit per level */
+  struct dthr_sched_latency latency[DREAD_THREAD_PRIO_LEVELS];
+#if DREAD_THREAD_MULTI
+  dthr_lock_t               lock;
+#endif
+};
+
+/*
+ * A carrier is an OS thread running green threads:  its run queue, its
+ * new thread queue, and the topmost (launcher) thread carving stacks for
+ * new threads out of its own stack.  Without DREAD_THREAD_MULTI there is
+ * just the one, and nothing is locked.
+ *
+ * With DREAD_THREAD_MULTI, a thread blocking or yielding must not be
+ * resumed by another carrier before its context is saved, so the queue
+ * insertion (or lock release) that makes it visible is left pending on
+ * the carrier and done by dthr_finish_switch in the context switched to.
+ * The topmost thread doubles as the scheduler:  it is switched to when
+ * nothing else is runnable, steals from other carriers, and idles the
+ * carrier.  It never sits on a queue, so it never migrates.
+ */
+#define DREAD_THREAD_MAX_CARRIERS       64
+#define DREAD_THREAD_CARRIER_STACK      (64 * 1024 * 1024)
+
+struct dthr_carrier {
+  struct dthr_runq      runq;
+  struct dthr_chain     newq;
+  struct dthr_stack     topmost_stack;
+  struct dthr_thread    topmost_thread;
+  dthr_ctxt_t           deadlock;
+  struct dthr_stack     *pending_free;  /* exited on it; free once off */
+  struct dthr_thread    *pending_release;   /* the thread that exited */
+  struct dthr_stack     *starting;      /* mapped stack being entered */
+  dthr_ctxt_t           launch_return;
+  unsigned int          yields;         /* since the last poll */
+  unsigned int          select_seed;    /* rotates select's first op */
+  struct dthr_sched_stats stats;
+  unsigned long long    switch_at;      /* if run times are accounted */
+#if DREAD_THREAD_MULTI
+  int                   id;
+  unsigned int          steal_seed;
+  pthread_t             pthread;
+  struct dthr_thread    *cur_thread;
+  struct dthr_thread    *pending_ready;
+  dthr_lock_t           *pending_unlock;
+  void                  (*pending_call)(void *);  /* ditto, generalized */
+  void                  *pending_arg;
+  struct dthr_chain     deferred;       /* woken by an exiting thread */
+#else
+  struct dthr_semaphore newq_sema;
+  struct dthr_event     newq_event;
+#endif
+};
+
+#if DREAD_THREAD_MULTI
+# define DTHR_LOCK(l)       (void) pthread_mutex_lock(l)
+# define DTHR_UNLOCK(l)     (void) pthread_mutex_unlock(l)
+# define DTHR_LOCK_INIT(l)  (void) pthread_mutex_init(l,0)
+# define DTHR_TRYLOCK(l)    (pthread_mutex_trylock(l) == 0)
+# define DTHR_LOCK_OF(obj)  (&(obj)->lock)
+# define DTHR_TIMERS_LOCK   (&dthr_timers_lock)
+# define DTHR_IO_LOCK       (&dthr_io_lock)
+# define DTHR_SELF          dthr_self()
+
+static struct dthr_carrier    dthr_carriers[DREAD_THREAD_MAX_CARRIERS];
+static int                    dthr_ncarriers = 1;
+static size_t                 dthr_carrier_stack_size
+                                  = DREAD_THREAD_CARRIER_STACK;
+static dthr_lock_t            dthr_stacks_lock = PTHREAD_MUTEX_INITIALIZER;
+static dthr_lock_t            dthr_timers_lock = PTHREAD_MUTEX_INITIALIZER;
+static dthr_lock_t            dthr_io_lock = PTHREAD_MUTEX_INITIALIZER;
+/* written to get a carrier out of poll when there is other work */
+static int                    dthr_io_wake[2] = { -1, -1 };
+static volatile int           dthr_io_blocked;
+static pthread_mutex_t        dthr_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t         dthr_idle_cond;   /* on dthr_time_now clock */
+static volatile int           dthr_idle_carriers, dthr_shutdown;
+static __thread struct dthr_carrier * volatile  dthr_self_carrier;
+
+/*
+ * Not inlined, and reading a volatile, so that the compiler cannot reuse
+ * a carrier address computed before a context switch after it:  the
+ * thread may have been resumed by another carrier.
+ */
+static struct dthr_carrier *dthr_self(void) __attribute__((noinline));
+static struct dthr_carrier *dthr_self(void)
+{
+  return dthr_self_carrier;
+}
+
+struct dthr_thread  **dthr_cur_thread_location(void)
+{
+  return &dthr_self()->cur_thread;
+}
+#else
+typedef int dthr_lock_t;
+# define DTHR_LOCK(l)
+# define DTHR_UNLOCK(l)
+# define DTHR_LOCK_INIT(l)
+# define DTHR_TRYLOCK(l)    1
+# define DTHR_LOCK_OF(obj)  ((dthr_lock_t *) 0)
+# define DTHR_TIMERS_LOCK   ((dthr_lock_t *) 0)
+# define DTHR_IO_LOCK       ((dthr_lock_t *) 0)
+# define DTHR_SELF          (&dthr_carrier0)
+
 struct dthr_thread            *dthr_cur_thread = 0;
+static struct dthr_carrier    dthr_carrier0;
+#endif
 
-static struct dthr_stack      dthr_topmost_stack;
-static struct dthr_thread     dthr_topmost_thread;
-static struct dthr_chain      dthr_free_stacks, dthr_active_stacks,
-                              dthr_runq, dthr_newq;
-static struct dthr_semaphore  dthr_newq_sema;
-static struct dthr_event      dthr_newq_event;
-static dthr_ctxt_t            dthr_deadlock;
+static struct dthr_chain      dthr_free_stacks[DREAD_THREAD_STACK_NBINS],
+                              dthr_active_stacks;
+static struct dthr_stack_stats  dthr_stack_counters;
+static int                    dthr_stack_mode;
+static size_t                 dthr_stack_cache_limit;
+static unsigned long          dthr_timeslice;   /* usec; 0:  none */
+static unsigned long long     dthr_timeslice_since;
+static int                    dthr_run_accounting;
+static unsigned long long     dthr_run_accounting_since;
+static int                    dthr_prio_used;   /* not all default */
 int       (*dthr_on_deadlock)() = 0;
 
+/*
+ * Threads in timed waits, in a binary min-heap on wake_at.  Each thread
+ * knows its slot, so a wait that ends early is cancelled in log time.
+ * dthr_timer_next caches the earliest deadline for unlocked peeking.
+ */
+static struct dthr_thread     **dthr_timer_heap;
+static int                    dthr_timer_alloc;
+static volatile int           dthr_timer_count;
+static volatile unsigned long long  dthr_timer_next;
+
+/*
+ * Threads parked on descriptors:  dthr_io_fds[i] is what
+ * dthr_io_threads[i] waits for, and the thread knows its index.  Only
+ * the carrier polling (dthr_io_polling) takes entries out, so those it
+ * copied into dthr_io_polled keep their index until it is done.
+ */
+static struct pollfd          *dthr_io_fds, *dthr_io_polled;
+static struct dthr_thread     **dthr_io_threads;
+static int                    dthr_io_alloc, dthr_io_polled_alloc;
+static volatile int           dthr_io_count, dthr_io_polling;
+
 #if DEBUG_QUEUES
 void dthr_show_queues(void)
 {
 #define SHOW(var) fprintf(stderr,"\n" #var ":\n"); dthr_chain_show(stderr,&var);
-  SHOW(dthr_free_stacks);
+  struct dthr_carrier *c = DTHR_SELF;
+  int bin;
+
+  for (bin = 0; bin < DREAD_THREAD_STACK_NBINS; bin++) {
+    if (!DREAD_THREAD_CHAIN_EMPTY(&dthr_free_stacks[bin])) {
+      fprintf(stderr,"\ndthr_free_stacks[%d]:\n",bin);
+      dthr_chain_show(stderr,&dthr_free_stacks[bin]);
+    }
+  }
   SHOW(dthr_active_stacks);
-  SHOW(dthr_runq);
-  SHOW(dthr_newq);
-  SHOW(dthr_newq_event.threadq);
-  SHOW(dthr_newq_sema.threadq);
+  for (bin = DREAD_THREAD_PRIO_LEVELS; --bin >= 0; ) {
+    if (!DREAD_THREAD_CHAIN_EMPTY(&c->runq.level[bin])) {
+      fprintf(stderr,"\nc->runq.level[%d]:\n",bin);
+      dthr_chain_show(stderr,&c->runq.level[bin]);
+    }
+  }
+  SHOW(c->newq);
+#if !DREAD_THREAD_MULTI
+  SHOW(c->newq_event.threadq);
+  SHOW(c->newq_sema.threadq);
+#endif
 }
 #else
 # define  dthr_show_queues()  do { ;} while (0)
 #endif
 
 
+#if DREAD_THREAD_MULTI
+struct dthr_thread  *dthr_this_thread(void)
+{
+  return dthr_cur_thread;
+}
+#else
 /* may eventually want to sort stacks by addresses */
 struct dthr_thread  *dthr_this_thread(void)
 {
@@ -158,25 +360,710 @@ struct dthr_thread  *dthr_this_thread(void)
   if (DEBUG) {  /* DCE */
     if (p == &dthr_active_stacks) {
       printf("dthr_this_thread: NOT FOUND, assuming TOPMOST (%p)\n",
-             (void *) &dthr_topmost_thread);
+             (void *) &dthr_carrier0.topmost_thread);
     } else {
       printf("dthr_this_thread: thread %p",
              (void *) ((struct dthr_stack *) p)->thread);
     }
   }
   return (p == &dthr_active_stacks) ?
-      &dthr_topmost_thread : ((struct dthr_stack *) p)->thread;
+      &dthr_carrier0.topmost_thread : ((struct dthr_stack *) p)->thread;
 }
+#endif
 
 static void dthr_csw(struct dthr_stack  *target, int  op);
+static void dthr_timers_expire(void);
+static void dthr_thread_sleep(int leave, dthr_lock_t *unlock);
+static void dthr_free_stack(struct dthr_stack *stk);
+static void dthr_thread_finish(struct dthr_thread *th);
+static void dthr_account_run(struct dthr_thread *th);
+#if DREAD_THREAD_MAP_STACKS
+static void dthr_unmap_stack(struct dthr_stack *stk);
+#endif
+
+#if DREAD_THREAD_MULTI
+static void dthr_wake_idle_carrier(void)
+{
+  static const char nudge = 0;
+
+  __sync_synchronize();
+  if (dthr_idle_carriers) {
+    pthread_mutex_lock(&dthr_idle_lock);
+    pthread_cond_signal(&dthr_idle_cond);
+    pthread_mutex_unlock(&dthr_idle_lock);
+  }
+  /* the polling carrier is not idle, but must look again too */
+  if (dthr_io_blocked && __sync_lock_test_and_set(&dthr_io_blocked,0))
+    (void) write(dthr_io_wake[1],&nudge,1);
+}
+
+static int dthr_carriers_busy(void)
+{
+  int i;
+
+  for (i = 0; i < dthr_ncarriers; i++)
+    if (dthr_carriers[i].runq.nonempty)
+      return 1;
+  return 0;
+}
+#endif
+
+#define DTHR_TOP_LEVEL(mask) \
+  ((int) (sizeof (unsigned int) * CHAR_BIT - 1) - __builtin_clz(mask))
+/* threads queued before time slices were set have waited since then */
+#define DTHR_READY_AT(th) \
+  ((th)->ready_at > dthr_timeslice_since ? (th)->ready_at \
+   : dthr_timeslice_since)
+
+static void dthr_runq_init(struct dthr_runq *rq)
+{
+  int level;
+
+  for (level = 0; level < DREAD_THREAD_PRIO_LEVELS; level++)
+    (void) dthr_chain_init(&rq->level[level]);
+  rq->nonempty = 0;
+  memset(rq->latency,0,sizeof rq->latency);
+  DTHR_LOCK_INIT(&rq->lock);
+}
+
+/* rq locked, as for the rest of these */
+static inline void dthr_runq_put(struct dthr_runq   *rq,
+                                 struct dthr_thread *th)
+{
+  int level = th->eff_prio;
+
+  dthr_chain_enqueue(&rq->level[level],&th->link);
+  rq->nonempty |= 1u << level;
+  th->runq = rq;
+  th->runq_level = level;
+  if (dthr_timeslice)
+    th->ready_at = dthr_time_now();
+}
+
+static inline void dthr_runq_remove(struct dthr_runq    *rq,
+                                    struct dthr_thread  *th)
+{
+  (void) dthr_chain_delete(&th->link);
+  if (DREAD_THREAD_CHAIN_EMPTY(&rq->level[th->runq_level]))
+    rq->nonempty &= ~(1u << th->runq_level);
+  th->runq = 0;
+}
+
+/*
+ * dthr_runq_take with time slices accounted:  the first thread of any
+ * level that has waited too long is taken instead, whatever min, and
+ * the wait is recorded.
+ */
+static struct dthr_thread *dthr_runq_take_timed(struct dthr_runq  *rq,
+                                                int               min,
+                                                int               steal)
+{
+  struct dthr_thread        *th;
+  struct dthr_sched_latency *lat;
+  unsigned long long        now, wait;
+  unsigned int              lower;
+  int                       level, starved = 0;
+
+  now = dthr_time_now();
+  level = DTHR_TOP_LEVEL(rq->nonempty);
+  /* the top level too, if it is not to be taken anyway */
+  for (lower = rq->nonempty & (level < min ? ~0u : (1u << level) - 1);
+       lower && !starved;
+       lower &= ~(1u << level)) {
+    level = DTHR_TOP_LEVEL(lower);
+    th = (struct dthr_thread *) rq->level[level].next;
+    starved = now - DTHR_READY_AT(th)
+        > DREAD_THREAD_STARVE_SLICES * (unsigned long long) dthr_timeslice;
+  }
+  if (!starved) {
+    level = DTHR_TOP_LEVEL(rq->nonempty);
+    if (level < min) return 0;
+  }
+  th = (struct dthr_thread *) (steal && !starved ? rq->level[level].prev
+                               : rq->level[level].next);
+  dthr_runq_remove(rq,th);
+  lat = &rq->latency[level];
+  wait = now > DTHR_READY_AT(th) ? now - DTHR_READY_AT(th) : 0;
+  lat->dispatches++;
+  lat->wait_usec += wait;
+  if (wait > lat->max_wait_usec) lat->max_wait_usec = wait;
+  lat->starved += starved;
+  th->slice_start = now;
+  return th;
+}
+
+/*
+ * Takes the first thread of the highest nonempty level, or the last if
+ * stealing, but none below level min.
+ */
+static inline struct dthr_thread *dthr_runq_take(struct dthr_runq *rq,
+                                                 int              min,
+                                                 int              steal)
+{
+  struct dthr_thread  *th;
+  int                 level;
+
+  if (!rq->nonempty) return 0;
+  if (dthr_timeslice) return dthr_runq_take_timed(rq,min,steal);
+  if ((level = DTHR_TOP_LEVEL(rq->nonempty)) < min) return 0;
+  th = (struct dthr_thread *) (steal ? rq->level[level].prev
+                               : rq->level[level].next);
+  dthr_runq_remove(rq,th);
+  return th;
+}
+
+static void dthr_runq_append(struct dthr_carrier  *c,
+                             struct dthr_thread   *th)
+{
+  DTHR_LOCK(&c->runq.lock);
+  dthr_runq_put(&c->runq,th);
+  DTHR_UNLOCK(&c->runq.lock);
+#if DREAD_THREAD_MULTI
+  dthr_wake_idle_carrier();
+#endif
+}
+
+/* the most urgent runnable thread, if of priority min or more */
+static struct dthr_thread *dthr_runq_next(struct dthr_carrier  *c,
+                                          int                  min)
+{
+  struct dthr_thread  *th;
+
+  DTHR_LOCK(&c->runq.lock);
+  th = dthr_runq_take(&c->runq,min,0);
+  DTHR_UNLOCK(&c->runq.lock);
+  return th;
+}
+
+/*
+ * Moves th to the level of priority prio if it is queued; otherwise it
+ * is queued there next time.  A thread being taken off a queue by
+ * another carrier at the time may still run at its old priority.
+ */
+static void dthr_thread_requeue(struct dthr_thread  *th,
+                                int                 prio)
+{
+  struct dthr_runq    *rq;
+  unsigned long long  ready_at;
+
+  th->eff_prio = prio;
+  while ((rq = th->runq) != 0) {
+    DTHR_LOCK(&rq->lock);
+    if (th->runq == rq) {
+      if (th->runq_level != prio) {
+        ready_at = th->ready_at;
+        dthr_runq_remove(rq,th);
+        dthr_runq_put(rq,th);
+        th->ready_at = ready_at;
+      }
+      DTHR_UNLOCK(&rq->lock);
+      break;
+    }
+    DTHR_UNLOCK(&rq->lock);
+  }
+}
+
+/*
+ * Takes the waiter of highest priority off a semaphore or event queue,
+ * the first of them if several.
+ */
+static struct dthr_thread *dthr_waitq_dequeue_prio(struct dthr_chain *q)
+{
+  struct dthr_chain *p, *best;
+
+  best = 0;
+  for (p = q->next; p != q; p = p->next)
+    if (!best || ((struct dthr_thread *) p)->eff_prio
+        > ((struct dthr_thread *) best)->eff_prio)
+      best = p;
+  return best ? (struct dthr_thread *) dthr_chain_delete(best) : 0;
+}
+
+/* just the first unless priorities are in use */
+#define DTHR_WAITQ_DEQUEUE(q) \
+  (dthr_prio_used ? dthr_waitq_dequeue_prio(q) \
+   : (struct dthr_thread *) DREAD_THREAD_CHAIN_DEQUEUE(q))
+
+static void dthr_make_runnable(struct dthr_thread  *th)
+{
+  struct dthr_carrier *c = DTHR_SELF;
+
+  th->state = DREAD_THREAD_TH_RUNNABLE;
+#if DREAD_THREAD_MULTI
+  /*
+   * An exiting thread's descriptor may be freed by whomever it wakes
+   * (see mark_of_death), so hold those until it is off its stack.
+   */
+  if (c->cur_thread && c->cur_thread->stack
+      && c->cur_thread->stack->exiting) {
+    dthr_chain_enqueue(&c->deferred,&th->link);
+    return;
+  }
+#endif
+  dthr_runq_append(c,th);
+}
+
+unsigned long long dthr_time_now(void)
+{
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  (void) clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+#else
+  struct timeval  tv;
+
+  (void) gettimeofday(&tv,(struct timezone *) 0);
+  return tv.tv_sec * 1000000ull + tv.tv_usec;
+#endif
+}
+
+static void dthr_timer_place(int slot, struct dthr_thread *th)
+{
+  dthr_timer_heap[slot] = th;
+  th->timer_slot = slot;
+}
+
+/*
+ * Moves the thread at slot up or down the heap to where it belongs.
+ */
+static void dthr_timer_sift(int slot)
+{
+  struct dthr_thread  *th = dthr_timer_heap[slot];
+  int                 parent, child;
+
+  while (slot > 0
+         && dthr_timer_heap[parent = (slot - 1) / 2]->wake_at > th->wake_at) {
+    dthr_timer_place(slot,dthr_timer_heap[parent]);
+    slot = parent;
+  }
+  while ((child = 2 * slot + 1) < dthr_timer_count) {
+    if (child + 1 < dthr_timer_count
+        && dthr_timer_heap[child + 1]->wake_at
+           < dthr_timer_heap[child]->wake_at)
+      child++;
+    if (dthr_timer_heap[child]->wake_at >= th->wake_at) break;
+    dthr_timer_place(slot,dthr_timer_heap[child]);
+    slot = child;
+  }
+  dthr_timer_place(slot,th);
+}
+
+/* timers lock held */
+static void dthr_timer_insert_locked(struct dthr_thread *th)
+{
+  struct dthr_thread  **heap;
+  int                 n;
+
+  if (th->timer_slot >= 0) return;
+  if (dthr_timer_count == dthr_timer_alloc) {
+    n = dthr_timer_alloc ? 2 * dthr_timer_alloc : 64;
+    heap = (struct dthr_thread **)
+        realloc(dthr_timer_heap,n * sizeof *heap);
+    if (!heap) {
+      fprintf(stderr,"dthr_thread:  No space for timer heap\n");
+      abort();
+    }
+    dthr_timer_heap = heap;
+    dthr_timer_alloc = n;
+  }
+  dthr_timer_heap[dthr_timer_count] = th;
+  dthr_timer_sift(dthr_timer_count++);
+  dthr_timer_next = dthr_timer_heap[0]->wake_at;
+}
+
+/* timers lock held */
+static void dthr_timer_remove_locked(struct dthr_thread *th)
+{
+  int slot = th->timer_slot;
+
+  if (slot < 0) return;
+  th->timer_slot = -1;
+  if (slot != --dthr_timer_count) {
+    dthr_timer_place(slot,dthr_timer_heap[dthr_timer_count]);
+    dthr_timer_sift(slot);
+  }
+  if (dthr_timer_count)
+    dthr_timer_next = dthr_timer_heap[0]->wake_at;
+}
+
+/*
+ * Arms the current thread's timer.  It must already be on the queue
+ * of its timed wait, whose lock is held.
+ */
+static void dthr_timer_insert(struct dthr_thread *th)
+{
+  DTHR_LOCK(&dthr_timers_lock);
+  dthr_timer_insert_locked(th);
+  DTHR_UNLOCK(&dthr_timers_lock);
+#if DREAD_THREAD_MULTI
+  /* an idle carrier may be waiting for a later deadline */
+  dthr_wake_idle_carrier();
+#endif
+}
+
+/*
+ * Disarms the current thread's timer once its wait is over.  Also
+ * orders the read of timed_out after any expiry in progress.
+ */
+static void dthr_timer_cancel(struct dthr_thread *th)
+{
+  DTHR_LOCK(&dthr_timers_lock);
+  dthr_timer_remove_locked(th);
+  DTHR_UNLOCK(&dthr_timers_lock);
+}
+
+/*
+ * Makes threads whose deadline has passed runnable, taking them off the
+ * semaphore or event queue they wait on.  With DREAD_THREAD_MULTI, queue
+ * locks are taken while arming a timer, that is in the other order, so
+ * they are only tried here; a busy one is left for the next call.
+ */
+static void dthr_timers_expire(void)
+{
+  struct dthr_thread  *th;
+  unsigned long long  now;
+
+  if (!dthr_timer_count || (now = dthr_time_now()) < dthr_timer_next)
+    return;
+  DTHR_LOCK(&dthr_timers_lock);
+  while (dthr_timer_count && (th = dthr_timer_heap[0])->wake_at <= now) {
+#if MAGIC_TEST
+    if (th->magic != DREAD_THREAD_TH_MAGIC) {
+      fprintf(stderr,
+              "dthr_thread:  thread structure corruption detected"
+              " in dthr_timers_expire()\n");
+      abort();
+    }
+#endif
+    if (th->state == DREAD_THREAD_TH_SLEEP_WAIT) {
+      dthr_timer_remove_locked(th);
+      dthr_make_runnable(th);
+      continue;
+    }
+    if (!DTHR_TRYLOCK(th->wait_lock)) break;
+    dthr_timer_remove_locked(th);
+    /* else already woken, and about to cancel */
+    if (th->state != DREAD_THREAD_TH_RUNNABLE) {
+      DBOUT(("dthr_timers_expire: %p timed out\n",(void *) th));
+      (void) dthr_chain_delete(&th->link);
+      th->timed_out = 1;
+      dthr_make_runnable(th);
+    }
+    DTHR_UNLOCK(th->wait_lock);
+  }
+  DTHR_UNLOCK(&dthr_timers_lock);
+}
+
+/* msec until the earliest deadline, rounded up, for poll; -1 if none */
+static int dthr_timers_poll_timeout(void)
+{
+  unsigned long long  now, wait;
+
+  if (!dthr_timer_count) return -1;
+  if (dthr_timer_next <= (now = dthr_time_now())) return 0;
+  wait = (dthr_timer_next - now + 999) / 1000;
+  return wait > INT_MAX ? INT_MAX : (int) wait;
+}
+
+/*
+ * Parks the current thread until fd has one of events (or an error).
+ */
+int dthr_io_wait(int fd, int events)
+{
+  struct dthr_thread  *th = dthr_cur_thread;
+  struct pollfd       *fds;
+  struct dthr_thread  **threads;
+  int                 n;
+
+  SHOWTHREAD;
+  DBOUT(("dthr_io_wait(%d,0x%x)\n",fd,events));
+#if MAGIC_TEST
+  if (th->magic != DREAD_THREAD_TH_MAGIC) {
+    fprintf(stderr,
+            "dthr_thread:  thread structure corruption detected"
+            " in dthr_io_wait(%d,0x%x)\n",
+            fd,events);
+    abort();
+  }
+#endif
+  /* held until switched out, so the poller cannot wake us before */
+  DTHR_LOCK(&dthr_io_lock);
+  if (dthr_io_count == dthr_io_alloc) {
+    n = dthr_io_alloc ? 2 * dthr_io_alloc : 64;
+    if (!(fds = (struct pollfd *) realloc(dthr_io_fds,n * sizeof *fds))
+        || (dthr_io_fds = fds,
+            !(threads = (struct dthr_thread **)
+              realloc(dthr_io_threads,n * sizeof *threads)))) {
+      fprintf(stderr,"dthr_thread:  No space for poll set\n");
+      abort();
+    }
+    dthr_io_threads = threads;
+    dthr_io_alloc = n;
+  }
+  th->io_slot = dthr_io_count++;
+  dthr_io_fds[th->io_slot].fd = fd;
+  dthr_io_fds[th->io_slot].events = events;
+  dthr_io_fds[th->io_slot].revents = 0;
+  dthr_io_threads[th->io_slot] = th;
+  th->io_revents = 0;
+  th->state = DREAD_THREAD_TH_IO_WAIT;
+  DTHR_SELF->stats.io_waits++;
+#if DREAD_THREAD_MULTI
+  /* the polling carrier must add fd, or an idle one start polling */
+  dthr_wake_idle_carrier();
+#endif
+  dthr_thread_sleep(0,DTHR_IO_LOCK);
+  SHOWTHREAD;
+  DBOUT(("LV dthr_io_wait -> 0x%x\n",th->io_revents));
+  return th->io_revents;
+}
+
+/*
+ * Polls the parked descriptors for up to timeout msec (-1:  until one is
+ * ready) and makes the threads of ready ones runnable.  Returns 0 if
+ * there is nothing to poll or another carrier is polling.
+ */
+static int dthr_io_poll(int timeout)
+{
+  struct dthr_thread  *th;
+  struct pollfd       *fds;
+  int                 i, n, nfds;
+
+  DTHR_LOCK(&dthr_io_lock);
+  if (!dthr_io_count || dthr_io_polling) {
+    DTHR_UNLOCK(&dthr_io_lock);
+    return 0;
+  }
+  dthr_io_polling = 1;
+  n = dthr_io_count;
+  if (n + 1 > dthr_io_polled_alloc) {
+    fds = (struct pollfd *)
+        realloc(dthr_io_polled,(dthr_io_alloc + 1) * sizeof *fds);
+    if (!fds) {
+      fprintf(stderr,"dthr_thread:  No space for poll set\n");
+      abort();
+    }
+    dthr_io_polled = fds;
+    dthr_io_polled_alloc = dthr_io_alloc + 1;
+  }
+  memcpy(dthr_io_polled,dthr_io_fds,n * sizeof *dthr_io_polled);
+  nfds = n;
+#if DREAD_THREAD_MULTI
+  dthr_io_polled[nfds].fd = dthr_io_wake[0];
+  dthr_io_polled[nfds].events = POLLIN;
+  dthr_io_polled[nfds++].revents = 0;
+  if (timeout) {
+    dthr_io_blocked = 1;
+    /* pairs with dthr_wake_idle_carrier:  see new work, or be nudged */
+    __sync_synchronize();
+    if (dthr_carriers_busy()) timeout = 0;
+  }
+#endif
+  DTHR_UNLOCK(&dthr_io_lock);
+
+  DBOUT(("dthr_io_poll: %d fds, timeout %d\n",n,timeout));
+  (void) poll(dthr_io_polled,nfds,timeout);
+#if DREAD_THREAD_MULTI
+  dthr_io_blocked = 0;
+  if (dthr_io_polled[n].revents) {
+    char  drain[64];
+
+    while (read(dthr_io_wake[0],drain,sizeof drain) > 0)
+      ;
+  }
+#endif
+
+  DTHR_LOCK(&dthr_io_lock);
+  /* downwards, so that moving the last entry in disturbs nothing unseen */
+  for (i = n; --i >= 0; ) {
+    if (!dthr_io_polled[i].revents) continue;
+    th = dthr_io_threads[i];
+    th->io_revents = dthr_io_polled[i].revents;
+    th->io_slot = -1;
+    if (i != --dthr_io_count) {
+      dthr_io_fds[i] = dthr_io_fds[dthr_io_count];
+      dthr_io_threads[i] = dthr_io_threads[dthr_io_count];
+      dthr_io_threads[i]->io_slot = i;
+    }
+    DBOUT(("dthr_io_poll: %p ready\n",(void *) th));
+    dthr_make_runnable(th);
+  }
+  dthr_io_polling = 0;
+  DTHR_UNLOCK(&dthr_io_lock);
+  DTHR_SELF->stats.io_polls++;
+  return 1;
+}
+
+/*
+ * So that the calls below return EAGAIN instead of stalling every
+ * thread.
+ */
+static int dthr_io_nonblock(int fd)
+{
+  int flags;
+
+  if ((flags = fcntl(fd,F_GETFL,0)) < 0) return -1;
+  if (!(flags & O_NONBLOCK) && fcntl(fd,F_SETFL,flags | O_NONBLOCK) < 0)
+    return -1;
+  return 0;
+}
+
+#define DTHR_IO_AGAIN(e)  ((e) == EAGAIN || (e) == EWOULDBLOCK)
+
+ssize_t dthr_read(int fd, void *buf, size_t nbytes)
+{
+  ssize_t rv;
+
+  if (dthr_io_nonblock(fd)) return -1;
+  while ((rv = read(fd,buf,nbytes)) < 0) {
+    if (DTHR_IO_AGAIN(errno)) (void) dthr_io_wait(fd,POLLIN);
+    else if (errno != EINTR) break;
+  }
+  return rv;
+}
+
+ssize_t dthr_write(int fd, const void *buf, size_t nbytes)
+{
+  ssize_t rv;
+
+  if (dthr_io_nonblock(fd)) return -1;
+  while ((rv = write(fd,buf,nbytes)) < 0) {
+    if (DTHR_IO_AGAIN(errno)) (void) dthr_io_wait(fd,POLLOUT);
+    else if (errno != EINTR) break;
+  }
+  return rv;
+}
+
+int dthr_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+  int rv;
+
+  if (dthr_io_nonblock(fd)) return -1;
+  while ((rv = accept(fd,addr,addrlen)) < 0) {
+    if (DTHR_IO_AGAIN(errno)) (void) dthr_io_wait(fd,POLLIN);
+    else if (errno != EINTR && errno != ECONNABORTED) break;
+  }
+  return rv;
+}
+
+int dthr_connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+  int       err;
+  socklen_t len = sizeof err;
+
+  if (dthr_io_nonblock(fd)) return -1;
+  if (connect(fd,addr,addrlen) == 0) return 0;
+  /* either way the connection is now being made in the background */
+  if (errno != EINPROGRESS && errno != EINTR) return -1;
+  (void) dthr_io_wait(fd,POLLOUT);
+  if (getsockopt(fd,SOL_SOCKET,SO_ERROR,(void *) &err,&len) < 0) return -1;
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+#if !DREAD_THREAD_MULTI
+/*
+ * Nothing is runnable:  block the process until the earliest deadline.
+ */
+static void dthr_timers_block(void)
+{
+  unsigned long long  now = dthr_time_now(), wait;
+  struct timespec     ts;
+
+  if (dthr_timer_next <= now) return;
+  wait = dthr_timer_next - now;
+  ts.tv_sec = wait / 1000000;
+  ts.tv_nsec = (wait % 1000000) * 1000;
+  DBOUT(("dthr_timers_block: %llu usec\n",wait));
+  /* a signal may have made work; let the caller look */
+  (void) nanosleep(&ts,(struct timespec *) 0);
+}
+#endif
+
+/*
+ * Called on arrival in a context:  frees the stack of a thread that has
+ * just exited (and runs its release routine) and, with
+ * DREAD_THREAD_MULTI, publishes the thread switched away from, now that
+ * its context is saved.
+ */
+static void dthr_finish_switch(void)
+{
+  struct dthr_carrier *c = DTHR_SELF;
+  struct dthr_stack   *stk;
+  struct dthr_thread  *gone;
+#if DREAD_THREAD_MULTI
+  struct dthr_thread  *th;
+  dthr_lock_t         *lock;
+  void                (*call)(void *);
+#endif
+
+  c->stats.switches++;
+  if (dthr_run_accounting)
+    dthr_cur_thread->run_start = c->switch_at;
+#if DREAD_THREAD_MULTI
+  if ((lock = c->pending_unlock) != 0) {
+    c->pending_unlock = 0;
+    DTHR_UNLOCK(lock);
+  }
+  if ((call = c->pending_call) != 0) {
+    c->pending_call = 0;
+    (*call)(c->pending_arg);
+  }
+#endif
+  if ((stk = c->pending_free) != 0) {
+    c->pending_free = 0;
+    dthr_free_stack(stk);
+  }
+  if ((gone = c->pending_release) != 0) {
+    c->pending_release = 0;
+    (*gone->release)(gone);
+  }
+#if DREAD_THREAD_MULTI
+  if ((th = c->pending_ready) != 0) {
+    c->pending_ready = 0;
+    dthr_runq_append(c,th);
+  }
+  while ((th = (struct dthr_thread *)
+          DREAD_THREAD_CHAIN_DEQUEUE(&c->deferred)) != 0)
+    dthr_runq_append(c,th);
+#endif
+}
+
+#if DREAD_THREAD_MULTI
+# define DTHR_READY_AFTER_SWITCH(c,th)  ((c)->pending_ready = (th))
+#else
+# define DTHR_READY_AFTER_SWITCH(c,th)  dthr_runq_put(&(c)->runq,th)
+#endif
 
 void dthr_thread_yield(void)
 {
-  struct dthr_thread  *next_runnable;
+  struct dthr_carrier *c = DTHR_SELF;
+  struct dthr_thread  *cur, *next_runnable;
+  int                 min;
 
   SHOWTHREAD;
   DBOUT(("dthr_thread_yield\n"));
-  next_runnable = (struct dthr_thread *) DREAD_THREAD_CHAIN_DEQUEUE(&dthr_runq);
+#if DREAD_THREAD_MULTI
+  /* the scheduler thread is not queued; see dthr_carrier_schedule */
+  if (dthr_cur_thread == &c->topmost_thread)
+    return;
+#endif
+  c->stats.yields++;
+  if (dthr_io_count && !(++c->yields % DREAD_THREAD_IO_POLL_YIELDS))
+    (void) dthr_io_poll(0);
+  dthr_timers_expire();
+  /* none before multithreading starts */
+  if (!(cur = dthr_cur_thread))
+    return;
+  /* within its slice, only a more urgent thread preempts */
+  min = cur->eff_prio;
+  if (dthr_timeslice && dthr_time_now() - cur->slice_start < dthr_timeslice)
+    min++;
+  next_runnable = dthr_runq_next(c,min);
   if (next_runnable) {
 #if MAGIC_TEST
     if (next_runnable->magic != DREAD_THREAD_TH_MAGIC) {
@@ -187,44 +1074,118 @@ void dthr_thread_yield(void)
     }
 #endif
     DBOUT((" found runnable thread %p\n",(void *) next_runnable));
-    (void) dthr_chain_enqueue(&dthr_runq,&dthr_cur_thread->link);
+    DTHR_READY_AFTER_SWITCH(c,cur);
     dthr_csw(next_runnable->stack,DREAD_THREAD_CSW_NORM);
   }
   SHOWTHREAD;
   DBOUT(("LV dthr_thread_yield\n"));
 }
 
+/*
+ * Switches straight to th, which must be parked with its context saved,
+ * leaving the current thread runnable; just queues th if it is the less
+ * urgent.
+ */
+static void dthr_thread_handoff(struct dthr_thread *th)
+{
+  struct dthr_carrier *c = DTHR_SELF;
+
+  if (th->eff_prio < dthr_cur_thread->eff_prio
+#if DREAD_THREAD_MULTI
+      || dthr_cur_thread == &c->topmost_thread
+      || dthr_cur_thread->stack->exiting
+#endif
+      ) {
+    dthr_make_runnable(th);
+    return;
+  }
+  DBOUT(("dthr_thread_handoff(%p)\n",(void *) th));
+  th->state = DREAD_THREAD_TH_RUNNABLE;
+  DTHR_READY_AFTER_SWITCH(c,dthr_cur_thread);
+  dthr_csw(th->stack,DREAD_THREAD_CSW_NORM);
+}
+
 struct dthr_semaphore *dthr_semaphore_init(struct dthr_semaphore  *sema,
                int      init)
 {
   sema->value = init;
   (void) dthr_chain_init(&sema->threadq);
+  sema->inherit = 0;
+  sema->holder = 0;
+  sema->held_next = 0;
+  sema->boost = -1;
+  DTHR_LOCK_INIT(&sema->lock);
   sema->magic = DREAD_THREAD_SEMA_MAGIC;
   return sema;
 }
 
-/* current thread must already be enqueued somewhere */
-static void dthr_thread_sleep(int leave)
+/*
+ * A semaphore at 1 that is a lock:  the thread that takes it drops it,
+ * and its waiters lend that thread their priority meanwhile.
+ */
+struct dthr_semaphore *dthr_semaphore_init_lock(struct dthr_semaphore *sema)
+{
+  (void) dthr_semaphore_init(sema,1);
+  sema->inherit = 1;
+  return sema;
+}
+
+/*
+ * current thread must already be enqueued somewhere; unlock, which
+ * guards that queue, is released once the thread is switched out.
+ */
+static void dthr_thread_sleep(int leave, dthr_lock_t *unlock)
 {
+  struct dthr_carrier *c = DTHR_SELF;
   struct dthr_thread  *next_thread;
+  struct dthr_stack   *target;
 
   SHOWTHREAD;
   DBOUT(("dthr_thread_sleep(%d):",leave));
   dthr_show_queues();
 
-  do {
-    next_thread = (struct dthr_thread *) DREAD_THREAD_CHAIN_DEQUEUE(&dthr_runq);
+#if DREAD_THREAD_MULTI
+  if (dthr_cur_thread == &c->topmost_thread) {
+    fprintf(stderr,"dthr_thread:  carrier scheduler thread blocked\n");
+    abort();
+  }
+  /* with nothing else to run here, the scheduler thread looks further */
+  next_thread = dthr_runq_next(c,0);
+  DBOUT((" %sthread found %p\n",next_thread?"":"NO ",(void *) next_thread));
+  target = next_thread ? next_thread->stack : &c->topmost_stack;
+  c->pending_unlock = unlock;
+#else
+  /*
+   * While threads sleep or wait for I/O the process waits for them; only
+   * when none do is dthr_on_deadlock consulted.
+   */
+  for (;;) {
+    dthr_timers_expire();
+    next_thread = dthr_runq_next(c,0);
     DBOUT((" %sthread found %p\n",next_thread?"":"NO ",(void *) next_thread));
-
-  } while (!next_thread && dthr_on_deadlock && (*dthr_on_deadlock)());
+    if (next_thread) break;
+    if (dthr_io_count)
+      (void) dthr_io_poll(dthr_timers_poll_timeout());
+    else if (dthr_timer_count)
+      dthr_timers_block();
+    else if (!dthr_on_deadlock || !(*dthr_on_deadlock)())
+      break;
+  }
 
   if (!next_thread) {
-    dthr_load_ctxt(&dthr_deadlock,1);
+    dthr_load_ctxt(&c->deadlock,1);
     fprintf(stderr,"dthr_thread:  DEADLOCK load context returned\n");
     abort();
   }
+  /* a sleeper that expired, or I/O done, with nothing else to run */
+  if (next_thread == dthr_cur_thread) {
+    DBOUT(("LV dthr_thread_sleep, woke self\n"));
+    return;
+  }
+  target = next_thread->stack;
+#endif
 #if MAGIC_TEST
-  if (next_thread->magic != DREAD_THREAD_TH_MAGIC) {
+  if (next_thread && next_thread->magic != DREAD_THREAD_TH_MAGIC) {
     fprintf(stderr,
             "dthr_thread:  thread structure corruption detected"
             " in dthr_thread_sleep(%d)\n",
@@ -232,12 +1193,86 @@ static void dthr_thread_sleep(int leave)
     abort();
   }
 #endif
-  dthr_csw(next_thread->stack,leave ? DREAD_THREAD_CSW_EXIT
+  dthr_csw(target,leave ? DREAD_THREAD_CSW_EXIT
            : DREAD_THREAD_CSW_NORM);
   SHOWTHREAD;
   DBOUT(("LV dthr_thread_sleep\n"));
 }
 
+/*
+ * sema locked and held:  a waiter of priority prio lends it to the
+ * holder, which runs at least at that priority until it drops the lock.
+ * A waiter that times out leaves its loan until then.
+ */
+static void dthr_lock_lend(struct dthr_semaphore  *sema,
+                           int                    prio)
+{
+  struct dthr_thread  *holder = sema->holder;
+
+  DTHR_LOCK(&holder->held_lock);
+  if (sema->boost < prio) sema->boost = prio;
+  DTHR_UNLOCK(&holder->held_lock);
+  if (holder->eff_prio < prio)
+    dthr_thread_requeue(holder,prio);
+}
+
+/*
+ * sema locked, and th has just taken it:  it is added to th's locks,
+ * with the loans of the waiters still queued on it.
+ */
+static void dthr_lock_taken(struct dthr_semaphore *sema,
+                            struct dthr_thread    *th)
+{
+  struct dthr_chain *p;
+  int               boost = -1;
+
+  sema->holder = th;
+  if (dthr_prio_used)
+    for (p = sema->threadq.next; p != &sema->threadq; p = p->next)
+      if (((struct dthr_thread *) p)->eff_prio > boost)
+        boost = ((struct dthr_thread *) p)->eff_prio;
+  DTHR_LOCK(&th->held_lock);
+  sema->boost = boost;
+  sema->held_next = th->held;
+  th->held = sema;
+  DTHR_UNLOCK(&th->held_lock);
+  if (th->eff_prio < boost)
+    dthr_thread_requeue(th,boost);
+}
+
+/*
+ * sema locked and held:  it is dropped, and its holder goes back to the
+ * greater of its own priority and the loans on the locks it still holds.
+ */
+static void dthr_lock_dropped(struct dthr_semaphore *sema)
+{
+  struct dthr_thread    *holder = sema->holder;
+  struct dthr_semaphore **pp, *s;
+  int                   prio;
+
+  sema->holder = 0;
+  DTHR_LOCK(&holder->held_lock);
+  for (pp = &holder->held; *pp; pp = &(*pp)->held_next)
+    if (*pp == sema) {
+      *pp = sema->held_next;
+      break;
+    }
+  sema->held_next = 0;
+  prio = holder->prio;
+  for (s = holder->held; s; s = s->held_next)
+    if (s->boost > prio) prio = s->boost;
+  DTHR_UNLOCK(&holder->held_lock);
+  if (holder->eff_prio != prio)
+    dthr_thread_requeue(holder,prio);
+}
+
+/* sema locked, and the current thread about to wait on it */
+static void dthr_semaphore_inherit(struct dthr_semaphore *sema)
+{
+  if (sema->holder && sema->holder != dthr_cur_thread)
+    dthr_lock_lend(sema,dthr_cur_thread->eff_prio);
+}
+
 int dthr_semaphore_try(struct dthr_semaphore  *sema)
 {
   register int  rv;
@@ -253,17 +1288,20 @@ int dthr_semaphore_try(struct dthr_semaphore  *sema)
     abort();
   }
 #endif
+  DTHR_LOCK(&sema->lock);
   if (sema->value == 0) {
     rv = 0;
   } else {
     sema->value--;
+    if (sema->inherit) dthr_lock_taken(sema,dthr_cur_thread);
     rv = 1;
   }
+  DTHR_UNLOCK(&sema->lock);
   DBOUT(("\n"));
   return rv;
 }
 
-static void dthr_semaphore_take_no_yield(struct dthr_semaphore  *sema)
+void  dthr_semaphore_take_no_yield(struct dthr_semaphore  *sema)
 {
   SHOWTHREAD;
   DBOUT(("dthr_semaphore_take_no_yield(%p)\n",(void *) sema));
@@ -276,11 +1314,14 @@ static void dthr_semaphore_take_no_yield(struct dthr_semaphore  *sema)
     abort();
   }
 #endif
+  DTHR_LOCK(&sema->lock);
   while (sema->value == 0) {
     DBOUT(("dthr_semaphore_take_no_yield: not available\n"));
+    DTHR_SELF->stats.sema_waits++;
+    dthr_semaphore_inherit(sema);
     dthr_chain_enqueue(&sema->threadq,&dthr_cur_thread->link);
     dthr_cur_thread->state = DREAD_THREAD_TH_SEMA_WAIT;
-    dthr_thread_sleep(0);
+    dthr_thread_sleep(0,DTHR_LOCK_OF(sema));
 #if MAGIC_TEST
     if (sema->magic != DREAD_THREAD_SEMA_MAGIC) {
       fprintf(stderr,
@@ -290,8 +1331,11 @@ static void dthr_semaphore_take_no_yield(struct dthr_semaphore  *sema)
       abort();
     }
 #endif
+    DTHR_LOCK(&sema->lock);
   }
   sema->value--;
+  if (sema->inherit) dthr_lock_taken(sema,dthr_cur_thread);
+  DTHR_UNLOCK(&sema->lock);
   SHOWTHREAD;
   DBOUT(("LV dthr_semaphore_take_no_yield\n"));
 }
@@ -307,7 +1351,7 @@ void  dthr_semaphore_take(struct dthr_semaphore *sema)
   DBOUT(("LV dthr_semaphore_take\n"));
 }
 
-static void dthr_semaphore_drop_no_yield(struct dthr_semaphore  *sema)
+void  dthr_semaphore_drop_no_yield(struct dthr_semaphore  *sema)
 {
   struct dthr_thread  *waker;
 
@@ -322,16 +1366,67 @@ static void dthr_semaphore_drop_no_yield(struct dthr_semaphore  *sema)
     abort();
   }
 #endif
+  DTHR_LOCK(&sema->lock);
   ++sema->value;
-  waker = (struct dthr_thread *) DREAD_THREAD_CHAIN_DEQUEUE(&sema->threadq);
-  if (waker) {
+  if (sema->holder)
+    dthr_lock_dropped(sema);
+  waker = DTHR_WAITQ_DEQUEUE(&sema->threadq);
+  /* off the queue, as far as dthr_timers_expire is concerned */
+  if (waker)
     waker->state = DREAD_THREAD_TH_RUNNABLE;
-    dthr_chain_enqueue(&dthr_runq,&waker->link);
-  }
+  DTHR_UNLOCK(&sema->lock);
+  if (waker)
+    dthr_make_runnable(waker);
   SHOWTHREAD;
   DBOUT(("LV dthr_semaphore_drop_no_yield\n"));
 }
 
+int dthr_semaphore_timedtake(struct dthr_semaphore  *sema,
+                             unsigned long          usec)
+{
+  struct dthr_thread  *th;
+  int                 rv;
+
+  SHOWTHREAD;
+  DBOUT(("dthr_semaphore_timedtake(%p,%lu)\n",(void *) sema,usec));
+#if MAGIC_TEST
+  if (sema->magic != DREAD_THREAD_SEMA_MAGIC) {
+    fprintf(stderr,
+            "dthr_thread:  semaphore structure corruption detected"
+            " in dthr_semaphore_timedtake(%p,%lu)\n",
+            (void *) sema,usec);
+    abort();
+  }
+#endif
+  dthr_thread_yield();
+  th = dthr_cur_thread;
+  th->wake_at = dthr_time_now() + usec;
+  th->timed_out = 0;
+#if DREAD_THREAD_MULTI
+  th->wait_lock = &sema->lock;
+#endif
+  DTHR_LOCK(&sema->lock);
+  while (sema->value == 0 && !th->timed_out) {
+    DTHR_SELF->stats.sema_waits++;
+    dthr_semaphore_inherit(sema);
+    dthr_chain_enqueue(&sema->threadq,&th->link);
+    th->state = DREAD_THREAD_TH_SEMA_WAIT;
+    dthr_timer_insert(th);
+    dthr_thread_sleep(0,DTHR_LOCK_OF(sema));
+    DTHR_LOCK(&sema->lock);
+  }
+  if ((rv = sema->value != 0)) {
+    sema->value--;
+    if (sema->inherit) dthr_lock_taken(sema,th);
+  }
+  DTHR_UNLOCK(&sema->lock);
+  dthr_timer_cancel(th);
+  if (!rv) DTHR_SELF->stats.sema_timeouts++;
+  SHOWTHREAD;
+  DBOUT(("LV dthr_semaphore_timedtake -> %d\n",rv));
+  return rv;
+}
+
 void  dthr_semaphore_drop(struct dthr_semaphore *sema)
 {
   SHOWTHREAD;
@@ -365,6 +1460,8 @@ void  dthr_event_wait(struct dthr_event *event,
 #if DEBUG
   dthr_chain_show(stderr,&event->threadq);
 #endif
+  DTHR_SELF->stats.event_waits++;
+  DTHR_LOCK(&event->lock);
   dthr_chain_enqueue(&event->threadq,&dthr_cur_thread->link);
   dthr_cur_thread->state = DREAD_THREAD_TH_EVENT_WAIT;
   DBOUT(("p_e_w: dropping lock %p\n",(void *) lock));
@@ -375,7 +1472,7 @@ void  dthr_event_wait(struct dthr_event *event,
   dthr_chain_show(stderr,&event->threadq);
 #endif
   DBOUT(("p_e_w: sleeping\n"));
-  dthr_thread_sleep(0);
+  dthr_thread_sleep(0,DTHR_LOCK_OF(event));
   DBOUT(("p_e_w: awaken, retaking lock %p\n",(void *) lock));
   dthr_semaphore_take_no_yield(lock);
 
@@ -385,13 +1482,83 @@ void  dthr_event_wait(struct dthr_event *event,
 #if DEBUG
   dthr_chain_show(stderr,&event->threadq);
 #endif
-  DBOUT(("LV dthr_event_wait\n"));
+  DBOUT(("LV dthr_event_wait\n"));
+}
+
+int dthr_event_timedwait(struct dthr_event      *event,
+                         struct dthr_semaphore  *lock,
+                         unsigned long          usec)
+{
+  struct dthr_thread  *th = dthr_cur_thread;
+
+  SHOWTHREAD;
+  DBOUT(("dthr_event_timedwait(%p,%p,%lu)\n",
+         (void *) event,(void *) lock,usec));
+#if MAGIC_TEST
+  if (event->magic != DREAD_THREAD_EV_MAGIC) {
+    fprintf(stderr,
+            "dthr_thread:  event structure corruption detected"
+            " in dthr_event_timedwait(%p,%p,%lu)\n",
+            (void *) event,(void *) lock,usec);
+    abort();
+  }
+#endif
+  th->wake_at = dthr_time_now() + usec;
+  th->timed_out = 0;
+#if DREAD_THREAD_MULTI
+  th->wait_lock = &event->lock;
+#endif
+  DTHR_SELF->stats.event_waits++;
+  DTHR_LOCK(&event->lock);
+  dthr_chain_enqueue(&event->threadq,&th->link);
+  th->state = DREAD_THREAD_TH_EVENT_WAIT;
+  dthr_timer_insert(th);
+  dthr_semaphore_drop_no_yield(lock);
+  dthr_thread_sleep(0,DTHR_LOCK_OF(event));
+  /* before retaking the lock, whose queue the timer knows nothing of */
+  dthr_timer_cancel(th);
+  dthr_semaphore_take_no_yield(lock);
+  if (th->timed_out) DTHR_SELF->stats.event_timeouts++;
+  SHOWTHREAD;
+  DBOUT(("LV dthr_event_timedwait, %s\n",
+         th->timed_out ? "timed out" : "signalled"));
+  return !th->timed_out;
+}
+
+void  dthr_sleep(unsigned long usec)
+{
+  struct dthr_thread  *th = dthr_cur_thread;
+
+  SHOWTHREAD;
+  DBOUT(("dthr_sleep(%lu)\n",usec));
+#if MAGIC_TEST
+  if (th->magic != DREAD_THREAD_TH_MAGIC) {
+    fprintf(stderr,
+            "dthr_thread:  thread structure corruption detected"
+            " in dthr_sleep(%lu)\n",
+            usec);
+    abort();
+  }
+#endif
+  DTHR_SELF->stats.sleeps++;
+  th->wake_at = dthr_time_now() + usec;
+  /* held until switched out, so the timer cannot fire before */
+  DTHR_LOCK(&dthr_timers_lock);
+  th->state = DREAD_THREAD_TH_SLEEP_WAIT;
+  dthr_timer_insert_locked(th);
+#if DREAD_THREAD_MULTI
+  dthr_wake_idle_carrier();
+#endif
+  dthr_thread_sleep(0,DTHR_TIMERS_LOCK);
+  SHOWTHREAD;
+  DBOUT(("LV dthr_sleep\n"));
 }
 
 static void dthr_eventq_to_runq(struct dthr_event *event,
             unsigned int  max)
 {
   struct dthr_thread  *th;
+  unsigned long       woken = 0;
 
 #if MAGIC_TEST
   if (event->magic != DREAD_THREAD_EV_MAGIC) {
@@ -402,8 +1569,11 @@ static void dthr_eventq_to_runq(struct dthr_event *event,
     abort();
   }
 #endif
+  DTHR_LOCK(&event->lock);
+  /* a broadcast leaves the run queue to order them */
   while (max > 0 &&
-         NULL != (th = (struct dthr_thread *)
+         NULL != (th = max == 1 ? DTHR_WAITQ_DEQUEUE(&event->threadq)
+                  : (struct dthr_thread *)
                   DREAD_THREAD_CHAIN_DEQUEUE(&event->threadq))) {
 #if MAGIC_TEST
     if (th->magic != DREAD_THREAD_TH_MAGIC) {
@@ -417,11 +1587,13 @@ static void dthr_eventq_to_runq(struct dthr_event *event,
 #if DEBUG
     dthr_chain_show(stderr,&event->threadq);
 #endif
-    th->state = DREAD_THREAD_TH_RUNNABLE;
-    dthr_chain_enqueue(&dthr_runq,&th->link);
+    dthr_make_runnable(th);
     DBOUT(("dthr_eventq_move: %p is now runnable\n",(void *) th));
     --max;
+    woken++;
   }
+  DTHR_UNLOCK(&event->lock);
+  if (woken) DTHR_SELF->stats.event_wakeups += woken;
 }
 
 void  dthr_event_broadcast_no_yield(struct dthr_event *event)
@@ -487,10 +1659,619 @@ void  dthr_event_signal(struct dthr_event *event)
 struct dthr_event *dthr_event_init(struct dthr_event  *ev)
 {
   (void) dthr_chain_init(&ev->threadq);
+  DTHR_LOCK_INIT(&ev->lock);
   ev->magic = DREAD_THREAD_EV_MAGIC;
   return ev;
 }
 
+struct dthr_cond *dthr_cond_init(struct dthr_cond *cond)
+{
+  (void) dthr_chain_init(&cond->threadq);
+  cond->lock_sema = 0;
+  DTHR_LOCK_INIT(&cond->lock);
+  cond->magic = DREAD_THREAD_COND_MAGIC;
+  return cond;
+}
+
+void  dthr_cond_wait(struct dthr_cond       *cond,
+                     struct dthr_semaphore  *lock)
+{
+  SHOWTHREAD;
+  DBOUT(("dthr_cond_wait(%p,%p)\n",(void *) cond,(void *) lock));
+#if MAGIC_TEST
+  if (cond->magic != DREAD_THREAD_COND_MAGIC) {
+    fprintf(stderr,
+            "dthr_thread:  condition structure corruption detected"
+            " in dthr_cond_wait(%p,%p)\n",
+            (void *) cond,(void *) lock);
+    abort();
+  }
+#endif
+  DTHR_SELF->stats.event_waits++;
+  DTHR_LOCK(&cond->lock);
+  cond->lock_sema = lock;
+  dthr_chain_enqueue(&cond->threadq,&dthr_cur_thread->link);
+  dthr_cur_thread->state = DREAD_THREAD_TH_EVENT_WAIT;
+  dthr_semaphore_drop_no_yield(lock);
+  dthr_thread_sleep(0,DTHR_LOCK_OF(cond));
+  /* woken by a drop of the lock, or signalled while it was free */
+  dthr_semaphore_take_no_yield(lock);
+  SHOWTHREAD;
+  DBOUT(("LV dthr_cond_wait\n"));
+}
+
+/*
+ * Wait morphing:  with the lock held, up to max waiters go straight onto
+ * its queue, lending their priority to the holder as they would have
+ * had they tried to take it.  If the lock is free the first is woken to
+ * take it, and the rest queue behind it.
+ */
+static void dthr_cond_move(struct dthr_cond *cond, unsigned int max)
+{
+  struct dthr_semaphore *sema;
+  struct dthr_thread    *th, *woken = 0;
+  unsigned long         moved = 0;
+
+#if MAGIC_TEST
+  if (cond->magic != DREAD_THREAD_COND_MAGIC) {
+    fprintf(stderr,
+            "dthr_thread:  condition structure corruption detected"
+            " in dthr_cond_move(%p,%u)\n",
+            (void *) cond,max);
+    abort();
+  }
+#endif
+  DTHR_LOCK(&cond->lock);
+  if (DREAD_THREAD_CHAIN_EMPTY(&cond->threadq)) {
+    DTHR_UNLOCK(&cond->lock);
+    return;
+  }
+  sema = cond->lock_sema;
+  DTHR_LOCK(&sema->lock);
+  while (max > 0 &&
+         NULL != (th = DTHR_WAITQ_DEQUEUE(&cond->threadq))) {
+    if (!woken && sema->value > 0) {
+      woken = th;
+      th->state = DREAD_THREAD_TH_RUNNABLE;
+    } else {
+      if (sema->holder)
+        dthr_lock_lend(sema,th->eff_prio);
+      dthr_chain_enqueue(&sema->threadq,&th->link);
+      th->state = DREAD_THREAD_TH_SEMA_WAIT;
+    }
+    --max;
+    moved++;
+  }
+  DTHR_UNLOCK(&sema->lock);
+  if (DREAD_THREAD_CHAIN_EMPTY(&cond->threadq))
+    cond->lock_sema = 0;
+  DTHR_UNLOCK(&cond->lock);
+  if (woken)
+    dthr_make_runnable(woken);
+  DTHR_SELF->stats.event_wakeups += moved;
+}
+
+void  dthr_cond_signal(struct dthr_cond *cond)
+{
+  SHOWTHREAD;
+  DBOUT(("dthr_cond_signal(%p)\n",(void *) cond));
+  dthr_cond_move(cond,1);
+}
+
+void  dthr_cond_broadcast(struct dthr_cond *cond)
+{
+  SHOWTHREAD;
+  DBOUT(("dthr_cond_broadcast(%p)\n",(void *) cond));
+  dthr_cond_move(cond,UINT_MAX);
+}
+
+struct dthr_rwlock *dthr_rwlock_init(struct dthr_rwlock *rw)
+{
+  rw->readers = 0;
+  rw->writer = 0;
+  (void) dthr_chain_init(&rw->readq);
+  (void) dthr_chain_init(&rw->writeq);
+  DTHR_LOCK_INIT(&rw->lock);
+  rw->magic = DREAD_THREAD_RW_MAGIC;
+  return rw;
+}
+
+#if MAGIC_TEST
+static void dthr_rwlock_check(struct dthr_rwlock *rw, char *where)
+{
+  if (rw->magic != DREAD_THREAD_RW_MAGIC) {
+    fprintf(stderr,
+            "dthr_thread:  rwlock structure corruption detected"
+            " in %s(%p)\n",
+            where,(void *) rw);
+    abort();
+  }
+}
+#else
+# define dthr_rwlock_check(rw,where)
+#endif
+
+/* rw locked; returns with it unlocked, and the lock handed over */
+static void dthr_rwlock_wait(struct dthr_rwlock *rw, struct dthr_chain *q)
+{
+  DTHR_SELF->stats.sema_waits++;
+  dthr_chain_enqueue(q,&dthr_cur_thread->link);
+  dthr_cur_thread->state = DREAD_THREAD_TH_SEMA_WAIT;
+  dthr_thread_sleep(0,DTHR_LOCK_OF(rw));
+}
+
+void  dthr_rwlock_rdlock(struct dthr_rwlock *rw)
+{
+  SHOWTHREAD;
+  DBOUT(("dthr_rwlock_rdlock(%p)\n",(void *) rw));
+  dthr_rwlock_check(rw,"dthr_rwlock_rdlock");
+  DTHR_LOCK(&rw->lock);
+  if (rw->writer || !DREAD_THREAD_CHAIN_EMPTY(&rw->writeq)) {
+    dthr_rwlock_wait(rw,&rw->readq);
+    return;
+  }
+  rw->readers++;
+  DTHR_UNLOCK(&rw->lock);
+}
+
+void  dthr_rwlock_wrlock(struct dthr_rwlock *rw)
+{
+  SHOWTHREAD;
+  DBOUT(("dthr_rwlock_wrlock(%p)\n",(void *) rw));
+  dthr_rwlock_check(rw,"dthr_rwlock_wrlock");
+  DTHR_LOCK(&rw->lock);
+  if (rw->writer || rw->readers) {
+    dthr_rwlock_wait(rw,&rw->writeq);
+    return;
+  }
+  rw->writer = 1;
+  DTHR_UNLOCK(&rw->lock);
+}
+
+int dthr_rwlock_tryrdlock(struct dthr_rwlock *rw)
+{
+  int rv;
+
+  dthr_rwlock_check(rw,"dthr_rwlock_tryrdlock");
+  DTHR_LOCK(&rw->lock);
+  if ((rv = !rw->writer && DREAD_THREAD_CHAIN_EMPTY(&rw->writeq)))
+    rw->readers++;
+  DTHR_UNLOCK(&rw->lock);
+  return rv;
+}
+
+int dthr_rwlock_trywrlock(struct dthr_rwlock *rw)
+{
+  int rv;
+
+  dthr_rwlock_check(rw,"dthr_rwlock_trywrlock");
+  DTHR_LOCK(&rw->lock);
+  if ((rv = !rw->writer && !rw->readers))
+    rw->writer = 1;
+  DTHR_UNLOCK(&rw->lock);
+  return rv;
+}
+
+void  dthr_rwlock_unlock(struct dthr_rwlock *rw)
+{
+  struct dthr_chain   woken;
+  struct dthr_thread  *th;
+
+  SHOWTHREAD;
+  DBOUT(("dthr_rwlock_unlock(%p)\n",(void *) rw));
+  dthr_rwlock_check(rw,"dthr_rwlock_unlock");
+  (void) dthr_chain_init(&woken);
+  DTHR_LOCK(&rw->lock);
+  if (rw->writer) {
+    rw->writer = 0;
+    /* the readers that queued behind this writer go first */
+    while ((th = (struct dthr_thread *)
+            DREAD_THREAD_CHAIN_DEQUEUE(&rw->readq)) != 0) {
+      rw->readers++;
+      th->state = DREAD_THREAD_TH_RUNNABLE;
+      dthr_chain_enqueue(&woken,&th->link);
+    }
+  } else {
+    rw->readers--;
+  }
+  if (!rw->writer && !rw->readers
+      && (th = DTHR_WAITQ_DEQUEUE(&rw->writeq)) != 0) {
+    rw->writer = 1;
+    th->state = DREAD_THREAD_TH_RUNNABLE;
+    dthr_chain_enqueue(&woken,&th->link);
+  }
+  DTHR_UNLOCK(&rw->lock);
+  while ((th = (struct dthr_thread *)
+          DREAD_THREAD_CHAIN_DEQUEUE(&woken)) != 0)
+    dthr_make_runnable(th);
+  DBOUT(("LV dthr_rwlock_unlock\n"));
+}
+
+/*
+ * A thread parked in dthr_channel_select (or a send or receive):  the
+ * first peer to move fired from -1 to the index of one of its ops
+ * completes that op, and leaves the rest to be withdrawn as stale.
+ */
+struct dthr_channel_park {
+  struct dthr_thread  *thread;
+  volatile int        fired;
+};
+
+#if DREAD_THREAD_MULTI
+# define DTHR_CAS(p,o,n)    __sync_bool_compare_and_swap(p,o,n)
+#else
+# define DTHR_CAS(p,o,n)    (*(p) == (o) ? (*(p) = (n), 1) : 0)
+#endif
+
+struct dthr_channel *dthr_channel_init(struct dthr_channel *ch,
+                                       int                 capacity)
+{
+  ch->ring = 0;
+  if (capacity > 0
+      && !(ch->ring = (void **) malloc(capacity * sizeof *ch->ring)))
+    return 0;
+  ch->capacity = capacity;
+  ch->head = ch->count = ch->closed = 0;
+  (void) dthr_chain_init(&ch->recvq);
+  (void) dthr_chain_init(&ch->sendq);
+  DTHR_LOCK_INIT(&ch->lock);
+  ch->magic = DREAD_THREAD_CHAN_MAGIC;
+  return ch;
+}
+
+void  dthr_channel_destroy(struct dthr_channel *ch)
+{
+  free(ch->ring);
+  ch->ring = 0;
+  ch->magic = 0;
+}
+
+#if DREAD_THREAD_MULTI
+/*
+ * The distinct channels of a select in address order, so that selects
+ * sharing channels lock them in the same order.
+ */
+struct dthr_channel_set {
+  struct dthr_channel **ch;
+  int                 n;
+};
+
+static void dthr_channel_set_init(struct dthr_channel_set *set,
+                                  struct dthr_channel_op  *ops,
+                                  int                     nops)
+{
+  struct dthr_channel *ch;
+  int                 i, j;
+
+  set->n = 0;
+  for (i = 0; i < nops; i++) {
+    ch = ops[i].channel;
+    for (j = set->n;
+         j > 0 && (unsigned long) set->ch[j - 1] > (unsigned long) ch;
+         j--)
+      ;
+    if (j > 0 && set->ch[j - 1] == ch) continue;
+    memmove(&set->ch[j + 1],&set->ch[j],(set->n - j) * sizeof *set->ch);
+    set->ch[j] = ch;
+    set->n++;
+  }
+}
+
+static void dthr_channel_lock_all(struct dthr_channel_set *set)
+{
+  int i;
+
+  for (i = 0; i < set->n; i++)
+    DTHR_LOCK(&set->ch[i]->lock);
+}
+
+/* also run as a pending call, once a parking thread is switched out */
+static void dthr_channel_unlock_all(void *arg)
+{
+  struct dthr_channel_set *set = (struct dthr_channel_set *) arg;
+  int                     i;
+
+  for (i = set->n; --i >= 0; )
+    DTHR_UNLOCK(&set->ch[i]->lock);
+}
+#endif
+
+/*
+ * Takes the first op on q whose thread no other op has fired yet.
+ */
+static struct dthr_channel_op *dthr_channel_claim(struct dthr_chain *q)
+{
+  struct dthr_channel_op  *op;
+
+  while ((op = (struct dthr_channel_op *) DREAD_THREAD_CHAIN_DEQUEUE(q)) != 0)
+    if (DTHR_CAS(&op->park->fired,-1,op->index))
+      return op;
+  return 0;
+}
+
+/*
+ * Does op if it can proceed now; the channel is locked.  A parked peer
+ * it completes is moved to woken, to be woken once unlocked.
+ */
+static int dthr_channel_try(struct dthr_channel_op  *op,
+                            struct dthr_chain       *woken)
+{
+  struct dthr_channel     *ch = op->channel;
+  struct dthr_channel_op  *peer;
+
+  if (op->send) {
+    if (ch->closed) {
+      op->ok = 0;
+      return 1;
+    }
+    if ((peer = dthr_channel_claim(&ch->recvq)) != 0) {
+      peer->msg = op->msg;
+      peer->ok = 1;
+      dthr_chain_enqueue(woken,&peer->link);
+    } else if (ch->count < ch->capacity) {
+      ch->ring[(ch->head + ch->count++) % ch->capacity] = op->msg;
+    } else {
+      return 0;
+    }
+  } else if (ch->count) {
+    op->msg = ch->ring[ch->head];
+    ch->head = (ch->head + 1) % ch->capacity;
+    ch->count--;
+    /* the longest parked sender takes the slot freed */
+    if ((peer = dthr_channel_claim(&ch->sendq)) != 0) {
+      ch->ring[(ch->head + ch->count++) % ch->capacity] = peer->msg;
+      peer->ok = 1;
+      dthr_chain_enqueue(woken,&peer->link);
+    }
+  } else if ((peer = dthr_channel_claim(&ch->sendq)) != 0) {
+    op->msg = peer->msg;
+    peer->ok = 1;
+    dthr_chain_enqueue(woken,&peer->link);
+  } else if (ch->closed) {
+    op->msg = 0;
+    op->ok = 0;
+    return 1;
+  } else {
+    return 0;
+  }
+  op->ok = 1;
+  return 1;
+}
+
+/*
+ * Wakes the threads of completed peer ops, switching straight to the
+ * last if handoff is set.
+ */
+static void dthr_channel_wake(struct dthr_chain *woken, int handoff)
+{
+  struct dthr_channel_op  *op;
+  struct dthr_thread      *th;
+
+  while ((op = (struct dthr_channel_op *)
+          DREAD_THREAD_CHAIN_DEQUEUE(woken)) != 0) {
+    /* op is gone as soon as th runs */
+    th = op->park->thread;
+    if (handoff && DREAD_THREAD_CHAIN_EMPTY(woken))
+      dthr_thread_handoff(th);
+    else
+      dthr_make_runnable(th);
+  }
+}
+
+static int dthr_channel_run(struct dthr_channel_op  *ops,
+                            int                     nops,
+                            int                     block,
+                            int                     handoff)
+{
+  struct dthr_carrier       *c;
+  struct dthr_channel_park  park;
+  struct dthr_chain         woken;
+  struct dthr_channel_op    *op;
+  int                       i, start, done = -1;
+#if DREAD_THREAD_MULTI
+  struct dthr_channel       *chbuf[8];
+  struct dthr_channel_set   set;
+#endif
+
+  SHOWTHREAD;
+  DBOUT(("dthr_channel_run(%p,%d,%d,%d)\n",(void *) ops,nops,block,handoff));
+#if MAGIC_TEST
+  for (i = 0; i < nops; i++)
+    if (ops[i].channel->magic != DREAD_THREAD_CHAN_MAGIC) {
+      fprintf(stderr,
+              "dthr_thread:  channel structure corruption detected"
+              " in dthr_channel_run(%p,%d), op %d\n",
+              (void *) ops,nops,i);
+      abort();
+    }
+#endif
+  (void) dthr_chain_init(&woken);
+#if DREAD_THREAD_MULTI
+  set.ch = nops <= sizeof chbuf / sizeof *chbuf ? chbuf
+      : (struct dthr_channel **) malloc((unsigned) nops * sizeof *set.ch);
+  if (!set.ch) {
+    fprintf(stderr,"dthr_thread:  No space for channel select\n");
+    abort();
+  }
+  dthr_channel_set_init(&set,ops,nops);
+  dthr_channel_lock_all(&set);
+#endif
+  c = DTHR_SELF;
+  /* from a rotating start, so that no op always wins */
+  start = nops > 1 ? c->select_seed++ % nops : 0;
+  for (i = 0; i < nops && done < 0; i++)
+    if (dthr_channel_try(&ops[(start + i) % nops],&woken))
+      done = (start + i) % nops;
+  if (done < 0 && block) {
+    park.thread = dthr_cur_thread;
+    park.fired = -1;
+    for (i = 0; i < nops; i++) {
+      op = &ops[i];
+      op->park = &park;
+      op->index = i;
+      dthr_chain_enqueue(op->send ? &op->channel->sendq
+                         : &op->channel->recvq,&op->link);
+    }
+    dthr_cur_thread->state = DREAD_THREAD_TH_CHAN_WAIT;
+    c->stats.chan_waits++;
+#if DREAD_THREAD_MULTI
+    c->pending_call = dthr_channel_unlock_all;
+    c->pending_arg = &set;
+#endif
+    dthr_thread_sleep(0,(dthr_lock_t *) 0);
+    done = park.fired;
+    DBOUT(("dthr_channel_run: op %d done by a peer\n",done));
+    if (nops > 1) {
+      /* withdraw the rest */
+#if DREAD_THREAD_MULTI
+      dthr_channel_lock_all(&set);
+#endif
+      for (i = 0; i < nops; i++)
+        if (ops[i].link.next != &ops[i].link)
+          (void) dthr_chain_delete(&ops[i].link);
+#if DREAD_THREAD_MULTI
+      dthr_channel_unlock_all(&set);
+#endif
+    }
+  } else {
+#if DREAD_THREAD_MULTI
+    dthr_channel_unlock_all(&set);
+#endif
+  }
+#if DREAD_THREAD_MULTI
+  if (set.ch != chbuf) free(set.ch);
+#endif
+  dthr_channel_wake(&woken,handoff);
+  return done;
+}
+
+int dthr_channel_send(struct dthr_channel *ch, void *msg)
+{
+  struct dthr_channel_op  op;
+
+  op.channel = ch;
+  op.send = 1;
+  op.msg = msg;
+  (void) dthr_channel_run(&op,1,1,1);
+  return op.ok;
+}
+
+int dthr_channel_send_no_yield(struct dthr_channel *ch, void *msg)
+{
+  struct dthr_channel_op  op;
+
+  op.channel = ch;
+  op.send = 1;
+  op.msg = msg;
+  (void) dthr_channel_run(&op,1,1,0);
+  return op.ok;
+}
+
+int dthr_channel_recv(struct dthr_channel *ch, void **msg)
+{
+  struct dthr_channel_op  op;
+
+  op.channel = ch;
+  op.send = 0;
+  (void) dthr_channel_run(&op,1,1,0);
+  if (msg) *msg = op.msg;
+  return op.ok;
+}
+
+int dthr_channel_try_send(struct dthr_channel *ch, void *msg)
+{
+  struct dthr_channel_op  op;
+
+  op.channel = ch;
+  op.send = 1;
+  op.msg = msg;
+  if (dthr_channel_run(&op,1,0,0) < 0) return 0;
+  return op.ok ? 1 : -1;
+}
+
+int dthr_channel_try_recv(struct dthr_channel *ch, void **msg)
+{
+  struct dthr_channel_op  op;
+
+  op.channel = ch;
+  op.send = 0;
+  if (dthr_channel_run(&op,1,0,0) < 0) return 0;
+  if (msg) *msg = op.msg;
+  return op.ok ? 1 : -1;
+}
+
+int dthr_channel_select(struct dthr_channel_op  *ops,
+                        int                     nops,
+                        int                     block)
+{
+  if (nops <= 0) return -1;
+  return dthr_channel_run(ops,nops,block,0);
+}
+
+void  dthr_channel_close(struct dthr_channel *ch)
+{
+  struct dthr_channel_op  *op;
+  struct dthr_chain       woken;
+
+  SHOWTHREAD;
+  DBOUT(("dthr_channel_close(%p)\n",(void *) ch));
+#if MAGIC_TEST
+  if (ch->magic != DREAD_THREAD_CHAN_MAGIC) {
+    fprintf(stderr,
+            "dthr_thread:  channel structure corruption detected"
+            " in dthr_channel_close(%p)\n",
+            (void *) ch);
+    abort();
+  }
+#endif
+  (void) dthr_chain_init(&woken);
+  DTHR_LOCK(&ch->lock);
+  ch->closed = 1;
+  while ((op = dthr_channel_claim(&ch->recvq)) != 0) {
+    op->msg = 0;
+    op->ok = 0;
+    dthr_chain_enqueue(&woken,&op->link);
+  }
+  while ((op = dthr_channel_claim(&ch->sendq)) != 0) {
+    op->ok = 0;
+    dthr_chain_enqueue(&woken,&op->link);
+  }
+  DTHR_UNLOCK(&ch->lock);
+  dthr_channel_wake(&woken,0);
+}
+
+static void dthr_carrier_init(struct dthr_carrier *c)
+{
+  dthr_runq_init(&c->runq);
+  (void) dthr_chain_init(&c->newq);
+  c->topmost_thread.stack = 0;
+  c->topmost_thread.magic = DREAD_THREAD_TH_MAGIC;
+  c->topmost_thread.prio = c->topmost_thread.eff_prio
+      = DREAD_THREAD_PRIO_DEFAULT;
+  c->topmost_thread.held = 0;
+  DTHR_LOCK_INIT(&c->topmost_thread.held_lock);
+  c->topmost_thread.runq = 0;
+  c->topmost_thread.slice_start = 0;
+  c->pending_free = 0;
+  c->pending_release = 0;
+  c->starting = 0;
+  c->yields = 0;
+  c->select_seed = 0;
+  memset(&c->stats,0,sizeof c->stats);
+  c->switch_at = 0;
+#if DREAD_THREAD_MULTI
+  c->steal_seed = 2654435761u * (c->id + 1);
+  c->cur_thread = 0;
+  c->pending_ready = 0;
+  c->pending_unlock = 0;
+  c->pending_call = 0;
+  (void) dthr_chain_init(&c->deferred);
+#else
+  (void) dthr_semaphore_init_lock(&c->newq_sema);
+  (void) dthr_event_init(&c->newq_event);
+#endif
+}
+
 /*
  * Should be first dthr_* routine to be called.
  */
@@ -499,27 +2280,75 @@ void  dthr_init(void)
 #if DEBUG
   setbuf(stdout,0);
 #endif
-  (void) dthr_chain_init(&dthr_free_stacks);
+  int bin;
+
+  for (bin = 0; bin < DREAD_THREAD_STACK_NBINS; bin++)
+    (void) dthr_chain_init(&dthr_free_stacks[bin]);
+  memset(&dthr_stack_counters,0,sizeof dthr_stack_counters);
   (void) dthr_chain_init(&dthr_active_stacks);
-  (void) dthr_chain_init(&dthr_runq);
-  (void) dthr_chain_init(&dthr_newq);
-  dthr_topmost_thread.stack = 0;
-  dthr_topmost_thread.magic = DREAD_THREAD_TH_MAGIC;
-  (void) dthr_semaphore_init(&dthr_newq_sema,1);
-  (void) dthr_event_init(&dthr_newq_event);
+#if DREAD_THREAD_MULTI
+  {
+    int id;
+
+    for (id = 0; id < DREAD_THREAD_MAX_CARRIERS; id++) {
+      dthr_carriers[id].id = id;
+      dthr_carrier_init(&dthr_carriers[id]);
+    }
+  }
+  dthr_self_carrier = &dthr_carriers[0];
+  {
+    pthread_condattr_t  attr;
+
+    (void) pthread_condattr_init(&attr);
+#if defined(CLOCK_MONOTONIC)
+    (void) pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+#endif
+    (void) pthread_cond_init(&dthr_idle_cond,&attr);
+    (void) pthread_condattr_destroy(&attr);
+  }
+  if (dthr_io_wake[0] < 0) {
+    if (pipe(dthr_io_wake)
+        || fcntl(dthr_io_wake[0],F_SETFL,O_NONBLOCK) < 0
+        || fcntl(dthr_io_wake[1],F_SETFL,O_NONBLOCK) < 0) {
+      perror("dthr_init");
+      abort();
+    }
+  }
+#else
+  dthr_carrier_init(&dthr_carrier0);
+#endif
 }
 
-void  dthr_thread_exit(void *status)
+#if DREAD_THREAD_MULTI
+int dthr_set_carriers(int ncarriers, size_t carrier_stack_size)
+{
+  if (ncarriers < 1 || ncarriers > DREAD_THREAD_MAX_CARRIERS) return 0;
+  dthr_ncarriers = ncarriers;
+  dthr_carrier_stack_size = carrier_stack_size ? carrier_stack_size
+      : DREAD_THREAD_CARRIER_STACK;
+  return 1;
+}
+
+int dthr_carrier_id(void)
+{
+  return dthr_self()->id;
+}
+#else
+int dthr_set_carriers(int ncarriers, size_t carrier_stack_size)
+{
+  return ncarriers == 1;
+}
+
+int dthr_carrier_id(void)
 {
-  struct dthr_thread_exit   *x;
+  return 0;
+}
+#endif
 
+void  dthr_thread_exit(void *status)
+{
   SHOWTHREAD;
   DBOUT(("dthr_thread_exit\n"));
-  while ((x = dthr_cur_thread->on_exit) != 0) {
-    dthr_cur_thread->on_exit = x->next;
-    (*x->fn)(dthr_cur_thread,x->arg);
-    free(x);
-  }
 #if MAGIC_TEST
   if (dthr_cur_thread->magic != DREAD_THREAD_TH_MAGIC) {
     fprintf(stderr,
@@ -530,14 +2359,7 @@ void  dthr_thread_exit(void *status)
     }
 #endif
   dthr_cur_thread->exit_value = status;
-  dthr_cur_thread->state = DREAD_THREAD_TH_EXITED;
-
-  SHOWTHREAD;
-  DBOUT(("dthr_thread_exit -> sleep"));
-  dthr_thread_sleep(1);
-
-  fprintf(stderr,"dthr_thread_exit:  exited thread still running\n");
-  abort();
+  dthr_thread_finish(dthr_cur_thread);
 }
 
 struct dthr_thread  *dthr_thread_init(struct dthr_thread  *th,
@@ -553,10 +2375,24 @@ struct dthr_thread  *dthr_thread_init(struct dthr_thread  *th,
   th->stack_size = requested_stack_size;
 
   th->exit_value = (void *) 0;
+  th->stack_used = 0;
   th->state = DREAD_THREAD_TH_RUNNABLE;
   th->stack = 0;
+  th->wake_at = 0;
+  th->timer_slot = -1;
+  th->timed_out = 0;
+  th->io_slot = -1;
+  th->io_revents = 0;
+  th->prio = th->eff_prio = DREAD_THREAD_PRIO_DEFAULT;
+  th->held = 0;
+  DTHR_LOCK_INIT(&th->held_lock);
+  th->runq = 0;
+  th->ready_at = th->slice_start = 0;
+  th->run_start = 0;
+  th->run_usec = 0;
   (void) dthr_semaphore_init(&th->exit_sema,0);
   th->on_exit = 0;
+  th->release = 0;
   th->magic = DREAD_THREAD_TH_MAGIC;
   /*
    * no stack bound to this thread yet
@@ -589,6 +2425,21 @@ int dthr_thread_on_exit(struct dthr_thread  *th,
   return 1;
 }
 
+void  dthr_thread_on_release(struct dthr_thread  *th,
+                            void                (*fn)(struct dthr_thread *))
+{
+#if MAGIC_TEST
+  if (th->magic != DREAD_THREAD_TH_MAGIC) {
+    fprintf(stderr,
+            "dthr_thread:  thread structure corruption detected"
+            " in dthr_thread_on_release(%p,%p)\n",
+            (void *) th,(void *) fn);
+    abort();
+  }
+#endif
+  th->release = fn;
+}
+
 /*
  * Place onto new thread queue.  Topmost thread creates stack space and
  * moves thread from new queue to run queue.
@@ -606,11 +2457,24 @@ struct dthr_thread  *dthr_thread_run(struct dthr_thread *th)
 #endif
   SHOWTHREAD;
   DBOUT(("dthr_thread_run(%p)\n",(void *) th));
-  dthr_semaphore_take_no_yield(&dthr_newq_sema);
-  dthr_chain_enqueue(&dthr_newq,&th->link);
-  dthr_event_signal_no_yield(&dthr_newq_event);
-  dthr_semaphore_drop_no_yield(&dthr_newq_sema);
+#if DREAD_THREAD_MULTI
+  {
+    /* only this carrier's threads use its newq */
+    struct dthr_carrier *c = DTHR_SELF;
+
+    c->stats.threads_run++;
+    dthr_chain_enqueue(&c->newq,&th->link);
+    DTHR_READY_AFTER_SWITCH(c,dthr_cur_thread);
+    dthr_csw(&c->topmost_stack,DREAD_THREAD_CSW_NORM);
+  }
+#else
+  dthr_carrier0.stats.threads_run++;
+  dthr_semaphore_take_no_yield(&dthr_carrier0.newq_sema);
+  dthr_chain_enqueue(&dthr_carrier0.newq,&th->link);
+  dthr_event_signal_no_yield(&dthr_carrier0.newq_event);
+  dthr_semaphore_drop_no_yield(&dthr_carrier0.newq_sema);
   dthr_thread_yield();
+#endif
   SHOWTHREAD;
   DBOUT(("LV dthr_thread_run\n"));
   return th;
@@ -649,19 +2513,98 @@ struct dthr_thread  *dthr_thread_detach(struct dthr_thread *th)
 }
 
 /*
- * Returns a stack descriptor from free list -- best fit.
+ * Maps a requested stack size to its size-class bin, and the size to
+ * which stacks of that class are grown.
+ */
+static int dthr_stack_class(size_t size, size_t *class_size)
+{
+  int     shift, sub;
+  size_t  base, step;
+
+  if (size <= (1ul << DREAD_THREAD_STACK_MIN_SHIFT)) {
+    *class_size = 1ul << DREAD_THREAD_STACK_MIN_SHIFT;
+    return 0;
+  }
+  if (size > (1ul << DREAD_THREAD_STACK_MAX_SHIFT)) {
+    *class_size = size;
+    return DREAD_THREAD_STACK_HUGE_BIN;
+  }
+  for (shift = DREAD_THREAD_STACK_MIN_SHIFT; (2ul << shift) < size; shift++)
+    ;
+  /* 2^shift < size <= 2^(shift+1) */
+  base = 1ul << shift;
+  step = base / DREAD_THREAD_STACK_SUBCLASSES;
+  sub = (size - base + step - 1) / step;
+  *class_size = base + sub * step;
+  return 1 + (shift - DREAD_THREAD_STACK_MIN_SHIFT)
+      * DREAD_THREAD_STACK_SUBCLASSES + (sub - 1);
+}
+
+/*
+ * Moves an exited thread's stack from the active list to its bin, or
+ * unmaps it once the cache limit is reached.
+ */
+static void dthr_free_stack(struct dthr_stack *stk)
+{
+  size_t  class_size;
+  int     bin;
+
+  DTHR_LOCK(&dthr_stacks_lock);
+  (void) dthr_chain_delete(&stk->link);
+#if DREAD_THREAD_MAP_STACKS
+  if (stk->map_size && dthr_stack_cache_limit
+      && dthr_stack_counters.bytes_cached + stk->stack_size
+         > dthr_stack_cache_limit) {
+    dthr_stack_counters.stacks_released++;
+    DTHR_UNLOCK(&dthr_stacks_lock);
+    dthr_unmap_stack(stk);
+    return;
+  }
+#endif
+  /* a bin's stacks must all fit its class; page rounding may not */
+  bin = dthr_stack_class(stk->stack_size,&class_size);
+  if (class_size > stk->stack_size) bin--;
+  dthr_chain_enqueue(&dthr_free_stacks[bin],&stk->link);
+  dthr_stack_counters.stacks_cached++;
+  dthr_stack_counters.bytes_cached += stk->stack_size;
+  DTHR_UNLOCK(&dthr_stacks_lock);
+}
+
+/*
+ * Returns a stack descriptor from the free bins -- the first stack in the
+ * smallest non-empty bin that fits, which is the request's own bin unless
+ * it is empty.
  */
 static struct dthr_stack  *dthr_find_free_stack(int size)
 {
-  struct dthr_stack *stk, *best_so_far;
-  int     best_size_diff = INT_MAX, size_diff;
+  struct dthr_stack *stk, *best_so_far = 0;
+  size_t            class_size;
+  int               bin;
 
   DBOUT(("dthr_find_free_stack\n"));
-  for (best_so_far = 0, stk = (struct dthr_stack *) dthr_free_stacks.next;
-       (struct dthr_chain *) stk != &dthr_free_stacks;
-       stk = (struct dthr_stack *) stk->link.next) {
+  DTHR_LOCK(&dthr_stacks_lock);
+  for (bin = dthr_stack_class(size,&class_size);
+       bin < DREAD_THREAD_STACK_HUGE_BIN && !best_so_far;
+       bin++) {
+    best_so_far = (struct dthr_stack *)
+        DREAD_THREAD_CHAIN_DEQUEUE(&dthr_free_stacks[bin]);
+  }
+  if (!best_so_far) {
+    for (stk = (struct dthr_stack *)
+             dthr_free_stacks[DREAD_THREAD_STACK_HUGE_BIN].next;
+         (struct dthr_chain *) stk
+             != &dthr_free_stacks[DREAD_THREAD_STACK_HUGE_BIN];
+         stk = (struct dthr_stack *) stk->link.next) {
+      if (stk->stack_size >= size
+          && (!best_so_far || stk->stack_size < best_so_far->stack_size))
+        best_so_far = stk;
+    }
+    if (best_so_far)
+      (void) dthr_chain_delete(&best_so_far->link);
+  }
+  if (best_so_far) {
 #if MAGIC_TEST
-    if (stk->magic != DREAD_THREAD_STACK_MAGIC) {
+    if (best_so_far->magic != DREAD_THREAD_STACK_MAGIC) {
       fprintf(stderr,
               "dthr_thread: stack descriptor corruption detected"
               " by dthr_find_free_stack(0x%08x)\n",
@@ -669,16 +2612,28 @@ static struct dthr_stack  *dthr_find_free_stack(int size)
       abort();
     }
 #endif
-    if ((size_diff = stk->stack_size - size) > 0
-        && size_diff < best_size_diff) {
-      best_size_diff = size_diff;
-      best_so_far = stk;
-    }
+    dthr_stack_counters.hits++;
+    dthr_stack_counters.stacks_cached--;
+    dthr_stack_counters.bytes_cached -= best_so_far->stack_size;
+  } else {
+    dthr_stack_counters.misses++;
   }
+  DTHR_UNLOCK(&dthr_stacks_lock);
   DBOUT(("dthr_find_free_stack -> %p\n",(void *) best_so_far));
   return best_so_far;
 }
 
+/*
+ * Statistics on stack reuse.
+ */
+struct dthr_stack_stats *dthr_get_stack_stats(struct dthr_stack_stats *st)
+{
+  DTHR_LOCK(&dthr_stacks_lock);
+  *st = dthr_stack_counters;
+  DTHR_UNLOCK(&dthr_stacks_lock);
+  return st;
+}
+
 static void dthr_thread_launcher(void);
 
 static void dthr_new_topmost_thread(struct dthr_stack *stk,
@@ -751,37 +2706,596 @@ static void dthr_new_topmost_thread(struct dthr_stack *stk,
    */
   DBOUT(("dthr_new_topmost_thread:  marking thread %p as runnable\n",
          (void *) stk->thread));
-  dthr_chain_enqueue(&dthr_runq,&stk->thread->link);
+  dthr_make_runnable(stk->thread);
 
   DBOUT(("dthr_new_topmost_thread -> launcher\n"));
   dthr_thread_launcher();
 }
 
+#define DTHR_WORD_ALIGN(a)  ((unsigned long *) \
+  (((unsigned long) (a) + sizeof (long) - 1) & ~(sizeof (long) - 1)))
+
+/*
+ * Paints the current thread's stack below this frame; see
+ * DREAD_THREAD_STACK_PAINT.
+ */
+static void dthr_stack_paint(struct dthr_stack *stk)
+{
+  /* an address, not an object, lest the compiler bound it */
+  uintptr_t               here = (uintptr_t) __builtin_frame_address(0);
+  register unsigned long  *p, *end;
+
+#if DREAD_THREAD_STACK_GROWS_DOWN
+  p = DTHR_WORD_ALIGN(stk->painted);
+  end = (unsigned long *) (here - DREAD_THREAD_STACK_PAINT_MARGIN);
+  while (p < end)
+    *p++ = DREAD_THREAD_STACK_PAINT;
+#else
+  p = (unsigned long *) stk->painted;
+  end = (unsigned long *) (here + DREAD_THREAD_STACK_PAINT_MARGIN);
+  while (p > end)
+    *--p = DREAD_THREAD_STACK_PAINT;
+#endif
+  stk->painted = (caddr_t) p;
+}
+
+/*
+ * Returns the stack high-water mark of the thread that ran on stk since
+ * it was painted, and how much paint is left intact.
+ */
+static size_t dthr_stack_measure(struct dthr_stack *stk)
+{
+  register unsigned long  *p, *end;
+  size_t                  used;
+
+#if DREAD_THREAD_STACK_GROWS_DOWN
+  p = DTHR_WORD_ALIGN(stk->stack_top);
+  end = (unsigned long *) stk->painted;
+  while (p < end && *p == DREAD_THREAD_STACK_PAINT)
+    p++;
+  used = stk->stack_base - (caddr_t) p;
+  if (p == DTHR_WORD_ALIGN(stk->stack_top) && p < end)
+#else
+  p = (unsigned long *) stk->stack_top;
+  end = (unsigned long *) stk->painted;
+  while (p > end && p[-1] == DREAD_THREAD_STACK_PAINT)
+    p--;
+  used = (caddr_t) p - stk->stack_base;
+  if (p == (unsigned long *) stk->stack_top && p > end)
+#endif
+    fprintf(stderr,
+            "dthr_thread:  thread %p used all %lu bytes of its stack\n",
+            (void *) stk->thread,(unsigned long) stk->stack_size);
+  stk->painted = (caddr_t) p;
+  return used;
+}
+
+/*
+ * The rest of a thread's life once its function is done:  shared by
+ * returning from it and dthr_thread_exit.
+ */
+static void dthr_thread_finish(struct dthr_thread *th)
+{
+  struct dthr_thread_exit *x;
+
+  if (dthr_stack_mode & DREAD_THREAD_STACK_MEASURE) {
+    th->stack_used = dthr_stack_measure(th->stack);
+    DTHR_LOCK(&dthr_stacks_lock);
+    if (th->stack_used > dthr_stack_counters.max_stack_used)
+      dthr_stack_counters.max_stack_used = th->stack_used;
+    DTHR_UNLOCK(&dthr_stacks_lock);
+  } else {
+    th->stack->painted = th->stack->stack_top;
+  }
+#if DREAD_THREAD_MULTI
+  th->stack->exiting = 1;
+#endif
+  while ((x = th->on_exit) != 0) {
+    th->on_exit = x->next;
+    (*x->fn)(th,x->arg);
+    free(x);
+  }
+#if MAGIC_TEST
+  if (th->magic != DREAD_THREAD_TH_MAGIC) {
+    fprintf(stderr,
+            "dthr_thread:  thread structure corruption detected"
+            " in dthr_thread_finish(%p)\n",
+            (void *) th);
+    abort();
+  }
+#endif
+
+  DBOUT(("dthr_thread_finish: thread %p exited\n",(void *) th));
+  if (dthr_run_accounting)
+    dthr_account_run(th);
+  th->state = DREAD_THREAD_TH_EXITED;
+  DTHR_SELF->stats.threads_exited++;
+
+  dthr_thread_sleep(1,0);
+  fprintf(stderr,"dthr_thread_finish:  exited thread still running\n");
+  abort();
+}
+
+/*
+ * Bottom frame of every thread stack.  The thread starts here, and so
+ * does every later thread the stack is reused for, its regs having been
+ * reset to base.
+ */
+static void dthr_thread_base(struct dthr_stack *stk)
+{
+  struct dthr_thread  *th;
+
+  for (;;) {
+    DBOUT(("dthr_thread_base.dthr_save_ctxt(%p) [base]\n",
+           (void *) &stk->base));
+    (void) dthr_save_ctxt(&stk->base);
+
+    /* launch the thread */
+    th = stk->thread;
+    dthr_cur_thread = th;
+    dthr_finish_switch();
+#if MAGIC_TEST
+    if (th->magic != DREAD_THREAD_TH_MAGIC) {
+      fprintf(stderr,
+              "dthr_thread:  thread structure corruption detected"
+              " in dthr_thread_base(), launch\n");
+      abort();
+    }
+#endif
+    if (dthr_stack_mode & DREAD_THREAD_STACK_MEASURE)
+      dthr_stack_paint(stk);
+    th->exit_value = (*th->fn)(th->fn_arg);
+    dthr_thread_finish(th);
+  }
+}
+
+#if DREAD_THREAD_MAP_STACKS
+/*
+ * Maps stk->stack_size bytes (rounded to pages) of stack, with a guard
+ * page beyond its top.
+ */
+static void dthr_map_stack(struct dthr_stack *stk)
+{
+  static size_t page;
+  caddr_t       map;
+
+  if (!page) page = sysconf(_SC_PAGESIZE);
+  stk->stack_size = (stk->stack_size + page - 1) & ~(page - 1);
+  stk->map_size = stk->stack_size + page;
+  map = mmap(0,stk->map_size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,
+             -1,0);
+#if DREAD_THREAD_STACK_GROWS_DOWN
+  if (map == MAP_FAILED || mprotect(map,page,PROT_NONE)) {
+#else
+  if (map == MAP_FAILED
+      || mprotect(map + stk->stack_size,page,PROT_NONE)) {
+#endif
+    perror("dthr_thread");
+    fprintf(stderr,"dthr_thread:  cannot map a %lu byte stack\n",
+            (unsigned long) stk->stack_size);
+    abort();
+  }
+#if DREAD_THREAD_STACK_GROWS_DOWN
+  stk->stack_top = map + page;
+  stk->stack_base = map + stk->map_size;
+#else
+  stk->stack_base = map;
+  stk->stack_top = map + stk->stack_size;
+#endif
+}
+
+static void dthr_unmap_stack(struct dthr_stack *stk)
+{
+#if DREAD_THREAD_STACK_GROWS_DOWN
+  (void) munmap(stk->stack_base - stk->map_size,stk->map_size);
+#else
+  (void) munmap(stk->stack_base,stk->map_size);
+#endif
+  stk->magic = 0;
+  free(stk);
+}
+
+/*
+ * Entered on a new mapped stack by the launcher, which it returns to
+ * once the thread's starting context is saved.
+ */
+static void dthr_mapped_stack_entry(void)
+{
+  struct dthr_stack *stk = DTHR_SELF->starting;
+
+  if (!dthr_save_ctxt(&stk->regs))
+    dthr_load_ctxt(&DTHR_SELF->launch_return,1);
+  dthr_thread_base(stk);
+}
+#endif
+
+int dthr_set_stack_mode(int mode)
+{
+#if !DREAD_THREAD_MAP_STACKS
+  if (mode & DREAD_THREAD_STACK_MAPPED) return 0;
+#endif
+  dthr_stack_mode = mode;
+  return 1;
+}
+
+void  dthr_set_stack_cache_limit(size_t bytes)
+{
+  dthr_stack_cache_limit = bytes;
+}
+
+/* a thread that has inherited more keeps it until it drops the lock */
+int dthr_thread_set_priority(struct dthr_thread *th, int prio)
+{
+  int old;
+
+  if (prio < 0 || prio >= DREAD_THREAD_PRIO_LEVELS) return 0;
+#if MAGIC_TEST
+  if (th->magic != DREAD_THREAD_TH_MAGIC) {
+    fprintf(stderr,
+            "dthr_thread:  thread structure corruption detected"
+            " in dthr_thread_set_priority(%p,%d)\n",
+            (void *) th,prio);
+    abort();
+  }
+#endif
+  if (prio != DREAD_THREAD_PRIO_DEFAULT) dthr_prio_used = 1;
+  old = th->prio;
+  th->prio = prio;
+  if (th->eff_prio == old || th->eff_prio < prio)
+    dthr_thread_requeue(th,prio);
+  return 1;
+}
+
+int dthr_thread_get_priority(struct dthr_thread *th)
+{
+  return th->prio;
+}
+
+void  dthr_set_timeslice(unsigned long usec)
+{
+  dthr_timeslice_since = dthr_time_now();
+  dthr_timeslice = usec;
+}
+
+struct dthr_sched_latency *dthr_get_sched_latency(
+                                  int                       prio,
+                                  struct dthr_sched_latency *st)
+{
+  struct dthr_sched_latency *lat;
+  struct dthr_carrier       *c;
+  int                       i, n;
+
+  if (prio < 0 || prio >= DREAD_THREAD_PRIO_LEVELS) return 0;
+  memset(st,0,sizeof *st);
+#if DREAD_THREAD_MULTI
+  c = dthr_carriers;
+  n = dthr_ncarriers;
+#else
+  c = &dthr_carrier0;
+  n = 1;
+#endif
+  for (i = 0; i < n; i++, c++) {
+    DTHR_LOCK(&c->runq.lock);
+    lat = &c->runq.latency[prio];
+    st->dispatches += lat->dispatches;
+    st->wait_usec += lat->wait_usec;
+    if (lat->max_wait_usec > st->max_wait_usec)
+      st->max_wait_usec = lat->max_wait_usec;
+    st->starved += lat->starved;
+    DTHR_UNLOCK(&c->runq.lock);
+  }
+  return st;
+}
+
+struct dthr_sched_stats *dthr_get_sched_stats(struct dthr_sched_stats *st)
+{
+  struct dthr_carrier     *c;
+  struct dthr_sched_stats *from;
+  int                     i, n;
+
+  memset(st,0,sizeof *st);
+#if DREAD_THREAD_MULTI
+  c = dthr_carriers;
+  n = dthr_ncarriers;
+#else
+  c = &dthr_carrier0;
+  n = 1;
+#endif
+  /* racy reads of the other carriers' are good enough */
+  for (i = 0; i < n; i++, c++) {
+    from = &c->stats;
+    st->switches        += from->switches;
+    st->yields          += from->yields;
+    st->sema_waits      += from->sema_waits;
+    st->sema_timeouts   += from->sema_timeouts;
+    st->event_waits     += from->event_waits;
+    st->event_wakeups   += from->event_wakeups;
+    st->event_timeouts  += from->event_timeouts;
+    st->chan_waits      += from->chan_waits;
+    st->sleeps          += from->sleeps;
+    st->io_waits        += from->io_waits;
+    st->io_polls        += from->io_polls;
+    st->threads_run     += from->threads_run;
+    st->threads_started += from->threads_started;
+    st->threads_exited  += from->threads_exited;
+    st->steals          += from->steals;
+  }
+  return st;
+}
+
+struct dthr_sched_snapshot *dthr_get_sched_snapshot(
+                                  struct dthr_sched_snapshot *snap)
+{
+  struct dthr_sched_stats st;
+  struct dthr_carrier     *c;
+  struct dthr_chain       *p;
+  unsigned long           k;
+  int                     i, level, n;
+
+  memset(snap,0,sizeof *snap);
+#if DREAD_THREAD_MULTI
+  c = dthr_carriers;
+  n = dthr_ncarriers;
+  snap->idle_carriers = dthr_idle_carriers;
+#else
+  c = &dthr_carrier0;
+  n = 1;
+#endif
+  snap->carriers = n;
+  for (i = 0; i < n; i++, c++) {
+    DTHR_LOCK(&c->runq.lock);
+    for (level = 0; level < DREAD_THREAD_PRIO_LEVELS; level++) {
+      for (k = 0, p = c->runq.level[level].next;
+           p != &c->runq.level[level]; p = p->next)
+        k++;
+      snap->runq_depth[level] += k;
+      snap->runq_total += k;
+    }
+    DTHR_UNLOCK(&c->runq.lock);
+  }
+  (void) dthr_get_sched_stats(&st);
+  snap->new_threads = st.threads_run - st.threads_started;
+
+  DTHR_LOCK(&dthr_stacks_lock);
+  for (p = dthr_active_stacks.next; p != &dthr_active_stacks; p = p->next) {
+    switch (((struct dthr_stack *) p)->thread->state) {
+    case DREAD_THREAD_TH_RUNNABLE:    snap->runnable++;       break;
+    case DREAD_THREAD_TH_SEMA_WAIT:   snap->sema_waiting++;   break;
+    case DREAD_THREAD_TH_EVENT_WAIT:  snap->event_waiting++;  break;
+    case DREAD_THREAD_TH_SLEEP_WAIT:  snap->sleeping++;       break;
+    case DREAD_THREAD_TH_IO_WAIT:     snap->io_waiting++;     break;
+    case DREAD_THREAD_TH_CHAN_WAIT:   snap->chan_waiting++;   break;
+    default:                          continue;
+    }
+    snap->threads++;
+  }
+  DTHR_UNLOCK(&dthr_stacks_lock);
+  snap->timers = dthr_timer_count;
+  return snap;
+}
+
+int dthr_semaphore_waiters(struct dthr_semaphore *sema)
+{
+  struct dthr_chain *p;
+  int               n = 0;
+
+  DTHR_LOCK(&sema->lock);
+  for (p = sema->threadq.next; p != &sema->threadq; p = p->next)
+    n++;
+  DTHR_UNLOCK(&sema->lock);
+  return n;
+}
+
+int dthr_event_waiters(struct dthr_event *event)
+{
+  struct dthr_chain *p;
+  int               n = 0;
+
+  DTHR_LOCK(&event->lock);
+  for (p = event->threadq.next; p != &event->threadq; p = p->next)
+    n++;
+  DTHR_UNLOCK(&event->lock);
+  return n;
+}
+
+void dthr_set_run_accounting(int on)
+{
+  unsigned long long  now = dthr_time_now();
+
+  if (on && !dthr_run_accounting) {
+    dthr_run_accounting_since = now;
+    if (dthr_cur_thread) dthr_cur_thread->run_start = now;
+  }
+  dthr_run_accounting = on;
+}
+
+void dthr_print_sched_stats(FILE *fp)
+{
+  struct dthr_sched_stats     st;
+  struct dthr_sched_snapshot  snap;
+  struct dthr_stack_stats     stk;
+  struct dthr_sched_latency   lat;
+  int                         level;
+
+  (void) dthr_get_sched_stats(&st);
+  (void) dthr_get_sched_snapshot(&snap);
+  (void) dthr_get_stack_stats(&stk);
+  fprintf(fp,"switches %lu, yields %lu, steals %lu\n",
+          st.switches,st.yields,st.steals);
+  fprintf(fp,"threads run %lu, started %lu, exited %lu\n",
+          st.threads_run,st.threads_started,st.threads_exited);
+  fprintf(fp,"semaphore waits %lu (%lu timed out), event waits %lu"
+          " (%lu timed out), wakeups %lu\n",st.sema_waits,st.sema_timeouts,
+          st.event_waits,st.event_timeouts,st.event_wakeups);
+  fprintf(fp,"channel waits %lu, sleeps %lu, io waits %lu, polls %lu\n",
+          st.chan_waits,st.sleeps,st.io_waits,st.io_polls);
+  fprintf(fp,"stacks:  %lu reused, %lu grown, %lu cached, %lu released\n",
+          stk.hits,stk.misses,stk.stacks_cached,stk.stacks_released);
+  fprintf(fp,"now:  %lu threads, %lu new, %lu runnable (%lu queued),"
+          " %lu on semaphores, %lu on events, %lu sleeping, %lu on io,"
+          " %lu on channels, %lu timers; %d of %d carriers idle\n",
+          snap.threads,snap.new_threads,snap.runnable,snap.runq_total,
+          snap.sema_waiting,snap.event_waiting,snap.sleeping,
+          snap.io_waiting,snap.chan_waiting,snap.timers,
+          snap.idle_carriers,snap.carriers);
+  for (level = DREAD_THREAD_PRIO_LEVELS - 1; level >= 0; level--) {
+    (void) dthr_get_sched_latency(level,&lat);
+    if (lat.dispatches)
+      fprintf(fp,"level %d:  %lu dispatches, mean wait %llu usec, max %llu,"
+              " %lu starved\n",level,lat.dispatches,
+              lat.wait_usec / lat.dispatches,lat.max_wait_usec,lat.starved);
+  }
+}
+
+#if DREAD_THREAD_MULTI
+/*
+ * Takes a runnable thread from the far end of the most urgent level of
+ * another carrier's run queue, starting at a random victim.
+ */
+static struct dthr_thread *dthr_steal(struct dthr_carrier *self)
+{
+  struct dthr_carrier *victim;
+  struct dthr_thread  *th;
+  int                 i, start;
+
+  self->steal_seed = self->steal_seed * 1103515245u + 12345u;
+  start = (self->steal_seed >> 16) % dthr_ncarriers;
+  for (i = 0; i < dthr_ncarriers; i++) {
+    victim = &dthr_carriers[(start + i) % dthr_ncarriers];
+    if (victim == self || !victim->runq.nonempty)
+      continue;
+    DTHR_LOCK(&victim->runq.lock);
+    th = dthr_runq_take(&victim->runq,0,1);
+    DTHR_UNLOCK(&victim->runq.lock);
+    if (th) {
+      self->stats.steals++;
+      DBOUT(("dthr_steal: carrier %d took %p from %d\n",
+             self->id,(void *) th,victim->id));
+      return th;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Blocks the carrier until some run queue has work or the earliest timer
+ * is due.  When every carrier is idle with no timer armed, no thread can
+ * become runnable again:  that is the deadlock that ends
+ * dthr_thread_multithread, and 0 is returned.
+ */
+static int dthr_carrier_idle(void)
+{
+  int                 busy;
+  unsigned long long  next;
+  struct timespec     ts;
+
+  pthread_mutex_lock(&dthr_idle_lock);
+  dthr_idle_carriers++;
+  __sync_synchronize();
+  while (!dthr_shutdown) {
+    if (dthr_carriers_busy()) break;
+    /* nobody is polling parked descriptors:  go and do it */
+    if (dthr_io_count && !dthr_io_polling) break;
+    if (dthr_timer_count) {
+      if ((next = dthr_timer_next) <= dthr_time_now()) break;
+      ts.tv_sec = next / 1000000;
+      ts.tv_nsec = (next % 1000000) * 1000;
+      (void) pthread_cond_timedwait(&dthr_idle_cond,&dthr_idle_lock,&ts);
+      continue;
+    }
+    if (dthr_idle_carriers == dthr_ncarriers) {
+      if (dthr_on_deadlock) {
+        pthread_mutex_unlock(&dthr_idle_lock);
+        busy = (*dthr_on_deadlock)();
+        pthread_mutex_lock(&dthr_idle_lock);
+        if (busy) continue;
+      }
+      DBOUT(("dthr_carrier_idle: all carriers idle\n"));
+      dthr_shutdown = 1;
+      pthread_cond_broadcast(&dthr_idle_cond);
+      break;
+    }
+    pthread_cond_wait(&dthr_idle_cond,&dthr_idle_lock);
+  }
+  dthr_idle_carriers--;
+  pthread_mutex_unlock(&dthr_idle_lock);
+  return !dthr_shutdown;
+}
+
+/*
+ * Run by the topmost thread whenever it has no threads to launch:  runs
+ * this carrier's threads, or stolen ones, returning when a new thread
+ * is queued.  The topmost thread is never queued itself; a thread
+ * blocking with an empty run queue switches back to it.
+ */
+static void dthr_carrier_schedule(struct dthr_carrier *c)
+{
+  struct dthr_thread  *next;
+
+  while (DREAD_THREAD_CHAIN_EMPTY(&c->newq)) {
+    dthr_timers_expire();
+    if ((next = dthr_runq_next(c,0)) != 0 || (next = dthr_steal(c)) != 0) {
+#if MAGIC_TEST
+      if (next->magic != DREAD_THREAD_TH_MAGIC) {
+        fprintf(stderr,
+                "dthr_thread:  thread structure corruption detected"
+                " in dthr_carrier_schedule()\n");
+        abort();
+      }
+#endif
+      dthr_csw(next->stack,DREAD_THREAD_CSW_NORM);
+    } else if (dthr_io_poll(dthr_timers_poll_timeout())) {
+      continue;
+    } else if (!dthr_carrier_idle()) {
+      dthr_load_ctxt(&c->deadlock,1);
+      fprintf(stderr,"dthr_thread:  carrier exit load context returned\n");
+      abort();
+    }
+  }
+}
+
+static void *dthr_carrier_main(void *arg)
+{
+  struct dthr_carrier *c = (struct dthr_carrier *) arg;
+
+  dthr_self_carrier = c;
+  c->cur_thread = &c->topmost_thread;
+  if (!dthr_save_ctxt(&c->deadlock))
+    dthr_thread_launcher();
+  return 0;
+}
+#endif
+
 static void dthr_thread_launcher(void)
 {
   unsigned long           magic = DREAD_THREAD_MAGIC2;
+  struct dthr_carrier     *c = DTHR_SELF;
   struct dthr_thread      *new_th;
   struct dthr_stack       *new_stk;
   dthr_ctxt_t             continuation;
-  struct dthr_thread_exit *x;
 
   DBOUT(("dthr_thread_launcher\n"));
 
-  dthr_topmost_stack.stack_size = 0;
-  dthr_topmost_stack.stack_base = (void *) &magic;
-  dthr_topmost_stack.stack_top = 0;
-  dthr_topmost_stack.thread = &dthr_topmost_thread;
-  dthr_topmost_stack.magic = DREAD_THREAD_STACK_MAGIC;
+  c->topmost_stack.stack_size = 0;
+  c->topmost_stack.stack_base = (void *) &magic;
+  c->topmost_stack.stack_top = 0;
+  c->topmost_stack.thread = &c->topmost_thread;
+  c->topmost_stack.magic = DREAD_THREAD_STACK_MAGIC;
+#if DREAD_THREAD_MULTI
+  c->topmost_stack.exiting = 0;
+#endif
 
-  dthr_topmost_thread.stack = &dthr_topmost_stack;
+  c->topmost_thread.stack = &c->topmost_stack;
 
+#if !DREAD_THREAD_MULTI
   DBOUT(("p_t_l: grabbing new thread queue lock\n"));
-  dthr_semaphore_take_no_yield(&dthr_newq_sema);
+  dthr_semaphore_take_no_yield(&c->newq_sema);
+#endif
   for (;;) {
     DBOUT(("p_t_l: getting thread\n"));
     dthr_show_queues();
     while ((new_th = (struct dthr_thread *)
-            DREAD_THREAD_CHAIN_DEQUEUE(&dthr_newq)) != 0) {
+            DREAD_THREAD_CHAIN_DEQUEUE(&c->newq)) != 0) {
 #if MAGIC_TEST
       if (new_th->magic != DREAD_THREAD_TH_MAGIC) {
         fprintf(stderr,
@@ -791,6 +3305,7 @@ static void dthr_thread_launcher(void)
       }
 #endif
       DBOUT(("p_t_l: launching thread %p\n",(void *) new_th));
+      c->stats.threads_started++;
       /* dthr_find_free_stack does magic test */
       if (0 != (new_stk = dthr_find_free_stack(new_th->stack_size))) {
         /*
@@ -805,9 +3320,14 @@ static void dthr_thread_launcher(void)
         memcpy((void *) &new_stk->regs,(void *) &new_stk->base,
                sizeof new_stk->regs);
         new_stk->thread = new_th;
+#if DREAD_THREAD_MULTI
+        new_stk->exiting = 0;
+#endif
         new_th->stack = new_stk;
-        new_th->state = DREAD_THREAD_TH_RUNNABLE;
-        dthr_chain_enqueue(&dthr_runq,&new_th->link);
+        DTHR_LOCK(&dthr_stacks_lock);
+        dthr_chain_push(&dthr_active_stacks,&new_stk->link);
+        DTHR_UNLOCK(&dthr_stacks_lock);
+        dthr_make_runnable(new_th);
       } else {
         DBOUT(("p_t_l:  no sufficiently large stack on free list,"
                " allocating new stack descriptor\n"));
@@ -817,14 +3337,23 @@ static void dthr_thread_launcher(void)
                   "dthr_thread:  top_thread:  No space for stack descriptor\n");
           abort();
         }
-        /* copy and correct */
-        new_stk->stack_base = dthr_topmost_stack.stack_base;
-        new_stk->stack_size = new_th->stack_size;
+        (void) dthr_stack_class(new_th->stack_size,&new_stk->stack_size);
+#if DREAD_THREAD_MAP_STACKS
+        if (dthr_stack_mode & DREAD_THREAD_STACK_MAPPED) {
+          dthr_map_stack(new_stk);
+        } else
+#endif
+        {
+          /* copy and correct */
+          new_stk->map_size = 0;
+          new_stk->stack_base = c->topmost_stack.stack_base;
 #if DREAD_THREAD_STACK_GROWS_DOWN
-        new_stk->stack_top = new_stk->stack_base - new_stk->stack_size;
+          new_stk->stack_top = new_stk->stack_base - new_stk->stack_size;
 #else
-        new_stk->stack_top = new_stk->stack_base + new_stk->stack_size;
+          new_stk->stack_top = new_stk->stack_base + new_stk->stack_size;
 #endif
+        }
+        new_stk->painted = new_stk->stack_top;
         new_stk->magic = DREAD_THREAD_STACK_MAGIC;
 
         /*
@@ -834,61 +3363,59 @@ static void dthr_thread_launcher(void)
          * current thread.
          */
         new_stk->thread = new_th;
+#if DREAD_THREAD_MULTI
+        new_stk->exiting = 0;
+#endif
         new_th->stack = new_stk;
         new_th->state = DREAD_THREAD_TH_RUNNABLE;
         /*
          * Ensure that dthr_this_thread will make sense
          */
+        DTHR_LOCK(&dthr_stacks_lock);
+        dthr_stack_counters.stacks_total++;
+        dthr_stack_counters.bytes_total += new_stk->stack_size;
         dthr_chain_push(&dthr_active_stacks,&new_stk->link);
+        DTHR_UNLOCK(&dthr_stacks_lock);
+#if DREAD_THREAD_MAP_STACKS
+        if (new_stk->map_size) {
+          /* enter it once, leaving regs there for the thread to start */
+          DBOUT(("p_t_l: entering mapped stack %p\n",(void *) new_stk));
+          c->starting = new_stk;
+          if (!dthr_save_ctxt(&c->launch_return))
+            DREAD_THREAD_MD_START(new_stk->stack_base,
+                                  dthr_mapped_stack_entry);
+          dthr_make_runnable(new_th);
+          continue;
+        }
+#endif
         /*
-         * Grow stack; dthr_topmost_stack is updated
+         * Grow stack; the topmost stack is updated
          * as a side effect.
          */
+#if !DREAD_THREAD_MULTI
         DBOUT(("p_t_l: dropping new thread queue lock\n"));
-        dthr_semaphore_drop_no_yield(&dthr_newq_sema);
+        dthr_semaphore_drop_no_yield(&c->newq_sema);
+#endif
         DBOUT(("p_t_l: growing stack\n"));
         DBOUT(("p_t_l.save_ctxt(%p) [cont]\n",(void *) &continuation));
         if (!dthr_save_ctxt(&continuation))
-          dthr_new_topmost_thread(new_stk,new_th->stack_size,1,&continuation);
-        for (;;) {
-          /* base, allowing for stack reuse */
-          DBOUT(("p_t_l.dthr_save_ctxt(%p) [base]\n",(void *) &new_stk->base));
-          (void) dthr_save_ctxt(&new_stk->base);
-
-          /* launch the thread */
-          new_th = new_stk->thread;
-          dthr_cur_thread = new_th;
-#if MAGIC_TEST
-          if (new_th->magic != DREAD_THREAD_TH_MAGIC) {
-            fprintf(stderr,
-                    "dthr_thread:  thread structure corruption detected"
-                    " in dthr_thread_launcher(), base launch\n");
-            abort();
-          }
-#endif
-          new_th->exit_value = (*new_th->fn)(new_th->fn_arg);
-
-          while ((x = new_th->on_exit) != 0) {
-            new_th->on_exit = x->next;
-            (*x->fn)(new_th,x->arg);
-            free(x);
-          }
-
-          DBOUT(("p_t_l: thread %p exited\n",(void *) dthr_cur_thread));
-          /* same as dthr_thread_exit here */
-          new_th->state = DREAD_THREAD_TH_EXITED;
-
-          dthr_thread_sleep(1);
-          fprintf(stderr,"dthr_thread_launcher: exited thread still runs\n");
-          abort();
-        }
+          dthr_new_topmost_thread(new_stk,new_stk->stack_size,1,&continuation);
+        /*
+         * From here on this frame is the base of the new thread's stack,
+         * which may be running on any carrier:  c must not be used.
+         */
+        dthr_thread_base(new_stk);
       }
     }
     /*
      * wait for more threads to launch
      */
     DBOUT(("p_t_l: waiting for a new thread to launch\n"));
-    dthr_event_wait(&dthr_newq_event,&dthr_newq_sema);
+#if DREAD_THREAD_MULTI
+    dthr_carrier_schedule(c);
+#else
+    dthr_event_wait(&c->newq_event,&c->newq_sema);
+#endif
     DBOUT(("p_t_l: event wait returned\n"));
   }
 }
@@ -902,22 +3429,63 @@ static void dthr_thread_launcher(void)
  */
 void  dthr_thread_multithread(struct dthr_thread  *th)
 {
+  struct dthr_carrier *c = DTHR_SELF;
+#if DREAD_THREAD_MULTI
+  pthread_attr_t      attr;
+  int                 i;
+#endif
+
   DBOUT(("dthr_thread_multithread\n"));
 
   dthr_show_queues();
 
   /* no need to lock it yet, since we are only thread running */
-  dthr_chain_enqueue(&dthr_newq,&th->link);
-  dthr_cur_thread = &dthr_topmost_thread;
+  dthr_chain_enqueue(&c->newq,&th->link);
+  c->stats.threads_run++;
+  dthr_cur_thread = &c->topmost_thread;
+#if DREAD_THREAD_MULTI
+  dthr_shutdown = 0;
+  (void) pthread_attr_init(&attr);
+  (void) pthread_attr_setstacksize(&attr,dthr_carrier_stack_size);
+  for (i = 1; i < dthr_ncarriers; i++) {
+    if (pthread_create(&dthr_carriers[i].pthread,&attr,
+                       dthr_carrier_main,&dthr_carriers[i])) {
+      perror("dthr_thread_multithread");
+      fprintf(stderr,"dthr_thread:  cannot start carrier %d\n",i);
+      abort();
+    }
+  }
+  (void) pthread_attr_destroy(&attr);
+#endif
 
   dthr_show_queues();
   DBOUT(("dthr_thread_multithread -> launch\n"));
-  if (!dthr_save_ctxt(&dthr_deadlock))
+  if (!dthr_save_ctxt(&c->deadlock))
     dthr_thread_launcher();
+#if DREAD_THREAD_MULTI
+  for (i = 1; i < dthr_ncarriers; i++)
+    (void) pthread_join(dthr_carriers[i].pthread,0);
+  dthr_shutdown = 0;
+#endif
 }
 
 
 
+/*
+ * Charges the running thread for its time since it was switched to (or
+ * since accounting started, or it was last charged), and stamps the
+ * switch for the next.
+ */
+static void dthr_account_run(struct dthr_thread *th)
+{
+  unsigned long long  now = dthr_time_now();
+
+  th->run_usec += now - (th->run_start > dthr_run_accounting_since
+                         ? th->run_start : dthr_run_accounting_since);
+  th->run_start = now;
+  DTHR_SELF->switch_at = now;
+}
+
 /*
  * Context switch to thread th_next, doing op to current thread.
  * Interrupts are masked.
@@ -937,6 +3505,8 @@ static void dthr_csw(struct dthr_stack  *target, int  op)
     fprintf(stderr,"dthr_csw:  no current stack\n");
     abort();
   }
+  if (dthr_run_accounting)
+    dthr_account_run(dthr_cur_thread);
   if (op == DREAD_THREAD_CSW_EXIT) {
     DBOUT((" leaving exited thread\n"));
 
@@ -944,14 +3514,15 @@ static void dthr_csw(struct dthr_stack  *target, int  op)
 
     memset(&this_stack->regs,0,sizeof this_stack->regs);
     dthr_show_queues();
-    (void) dthr_chain_delete(&this_stack->link);
-    dthr_show_queues();
-    dthr_chain_enqueue(&dthr_free_stacks,&this_stack->link);
+    /* still running on it, so it is freed by the context switched to */
+    DTHR_SELF->pending_free = this_stack;
     dthr_show_queues();
 
     dthr_cur_thread->fn = 0;
     dthr_cur_thread->fn_arg = 0;
     dthr_cur_thread->stack_size = 0;
+    if (dthr_cur_thread->release)
+      DTHR_SELF->pending_release = dthr_cur_thread;
 
     DBOUT(("dthr_csw.long(%p,DREAD_THREAD_CSW_NORM)\n",(void *) &target->regs));
     dthr_load_ctxt(&target->regs,DREAD_THREAD_CSW_NORM);
@@ -974,7 +3545,8 @@ static void dthr_csw(struct dthr_stack  *target, int  op)
               (void *) dthr_cur_thread);
       abort();
     }
-    if ((dthr_cur_thread = this_stack->thread) != &dthr_topmost_thread) {
+    if ((dthr_cur_thread = this_stack->thread)
+        != &DTHR_SELF->topmost_thread) {
       fprintf(stderr,"dthr_csw:  create csw, am not topmost\n");
       abort();
     }
@@ -988,6 +3560,7 @@ static void dthr_csw(struct dthr_stack  *target, int  op)
       abort();
     }
     dthr_cur_thread = this_stack->thread;
+    dthr_finish_switch();
     DBOUT(("dthr_csw/ret: cur thread %p\n",(void *) dthr_cur_thread));
     return;
   default:
@@ -1113,9 +3686,7 @@ int DThr_Thread_Run(void    *(*fn)(void *),
   case 2:
     th = (struct dthr_thread *) malloc(sizeof *th);
     if (!th) return 0;
-    th->fn = fn;
-    th->fn_arg = fn_arg;
-    th->stack_size = req_stack_size;
+    (void) dthr_thread_init(th,fn,fn_arg,req_stack_size);
 
     dthr_semaphore_drop(&numDThr_Threads);
 
@@ -0,0 +1,536 @@
+/*
+ * pthread interface over dreadthread; see dreadthread_pthread.h.
+ *
+ * A pthread is a malloc'd struct dthr_pthread with the dthr_thread
+ * first, so the current thread is the current pthread.  It drops done
+ * for its joiner as it returns, but the joiner may run before it is off
+ * its stack, so whichever of the joiner (or detacher) and the thread's
+ * release routine comes last frees it.  Mutexes are binary semaphores
+ * taken and dropped without yielding, and condition variables are
+ * events.
+ */
+#include <stdio.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "dreadthread_pthread.h"
+
+#define DREAD_THREAD_PTHREAD_MAGIC      0x70746872ul
+#define DREAD_THREAD_PTHREAD_MAIN_STACK (1024 * 1024)
+
+#define DTHR_PTHREAD_JOINABLE   0
+#define DTHR_PTHREAD_DETACHED   1   /* release frees */
+#define DTHR_PTHREAD_JOINED     2   /* release frees */
+#define DTHR_PTHREAD_RELEASED   3   /* joiner or detacher frees */
+
+/* the generation tells a deleted key's old values from the new key's */
+struct dthr_pthread_specific {
+  unsigned int  gen;
+  void          *value;
+};
+
+struct dthr_pthread {
+  struct dthr_thread            th;
+  unsigned long                 magic;
+  void                          *(*fn)(void *);
+  void                          *arg;
+  volatile int                  state;
+  struct dthr_semaphore         done;
+  void                          *value;   /* returned, for the joiner */
+  struct dthr_pthread_specific  *specific;
+};
+
+static struct {
+  unsigned int  gen;      /* odd while the key is in use */
+  void          (*destructor)(void *);
+} dthr_pthread_keys[DREAD_THREAD_PTHREAD_KEYS_MAX];
+static struct dthr_semaphore  dthr_pthread_keys_lock;
+
+static int    (*dthr_pthread_main_fn)(int, char **);
+static int    dthr_pthread_main_ac;
+static char   **dthr_pthread_main_av;
+
+static struct dthr_pthread *dthr_pthread_cur(void)
+{
+  struct dthr_pthread *p = (struct dthr_pthread *) dthr_cur_thread;
+
+  if (p->magic != DREAD_THREAD_PTHREAD_MAGIC) {
+    fprintf(stderr,"dthr_pthread:  called from a thread it did not create\n");
+    abort();
+  }
+  return p;
+}
+
+/*
+ * Runs the destructors of the thread's keys, again while they leave
+ * values behind, up to DREAD_THREAD_PTHREAD_DESTRUCTOR_ITERATIONS.
+ */
+static void dthr_pthread_cleanup(struct dthr_pthread *p)
+{
+  void  (*destructor)(void *);
+  void  *value;
+  int   iter, key, again;
+
+  if (!p->specific) return;
+  for (iter = 0, again = 1;
+       again && iter < DREAD_THREAD_PTHREAD_DESTRUCTOR_ITERATIONS; iter++)
+    for (again = 0, key = 0; key < DREAD_THREAD_PTHREAD_KEYS_MAX; key++) {
+      if (!(value = p->specific[key].value)
+          || p->specific[key].gen != dthr_pthread_keys[key].gen)
+        continue;
+      p->specific[key].value = 0;
+      if ((destructor = dthr_pthread_keys[key].destructor) != 0) {
+        (*destructor)(value);
+        again = 1;
+      }
+    }
+  free(p->specific);
+  p->specific = 0;
+}
+
+static void dthr_pthread_release(struct dthr_thread *th)
+{
+  struct dthr_pthread *p = (struct dthr_pthread *) th;
+
+  if (!__sync_bool_compare_and_swap(&p->state,DTHR_PTHREAD_JOINABLE,
+                                    DTHR_PTHREAD_RELEASED))
+    free(p);
+}
+
+static void dthr_pthread_finish(struct dthr_pthread *p, void *value)
+{
+  dthr_pthread_cleanup(p);
+  p->value = value;
+  dthr_semaphore_drop_no_yield(&p->done);
+}
+
+static void *dthr_pthread_start(void *arg)
+{
+  struct dthr_pthread *p = (struct dthr_pthread *) arg;
+  void                *value;
+
+  value = (*p->fn)(p->arg);
+  dthr_pthread_finish(p,value);
+  return value;
+}
+
+static void *dthr_pthread_main_start(void *arg)
+{
+  struct dthr_pthread *p = (struct dthr_pthread *) arg;
+  int                 rv;
+
+  rv = (*dthr_pthread_main_fn)(dthr_pthread_main_ac,dthr_pthread_main_av);
+  dthr_pthread_cleanup(p);
+  exit(rv);
+}
+
+static struct dthr_pthread *dthr_pthread_new(void    *(*start)(void *),
+                                             size_t  stack_size,
+                                             int     detached)
+{
+  struct dthr_pthread *p;
+
+  if (!(p = (struct dthr_pthread *) malloc(sizeof *p))) return 0;
+  (void) dthr_thread_init(&p->th,start,(void *) p,stack_size);
+  dthr_thread_on_release(&p->th,dthr_pthread_release);
+  p->magic = DREAD_THREAD_PTHREAD_MAGIC;
+  p->state = detached ? DTHR_PTHREAD_DETACHED : DTHR_PTHREAD_JOINABLE;
+  (void) dthr_semaphore_init(&p->done,0);
+  p->value = 0;
+  p->specific = 0;
+  return p;
+}
+
+int dthr_pthread_main(int (*fn)(int, char **), int ac, char **av,
+                      int ncarriers)
+{
+  struct dthr_pthread *p;
+
+  dthr_init();
+  if (!dthr_set_carriers(ncarriers,0)) return -1;
+  (void) dthr_semaphore_init_lock(&dthr_pthread_keys_lock);
+  dthr_pthread_main_fn = fn;
+  dthr_pthread_main_ac = ac;
+  dthr_pthread_main_av = av;
+  if (!(p = dthr_pthread_new(dthr_pthread_main_start,
+                             DREAD_THREAD_PTHREAD_MAIN_STACK,0))) {
+    perror("dthr_pthread_main");
+    abort();
+  }
+  dthr_thread_multithread(&p->th);
+  return 0;
+}
+
+int dthr_pthread_create(dthr_pthread_t            *thread,
+                        const dthr_pthread_attr_t *attr,
+                        void                      *(*fn)(void *),
+                        void                      *arg)
+{
+  struct dthr_pthread *p;
+
+  p = dthr_pthread_new(dthr_pthread_start,
+                       attr ? attr->stack_size : DREAD_THREAD_PTHREAD_STACK,
+                       attr && attr->detach_state == PTHREAD_CREATE_DETACHED);
+  if (!p) return EAGAIN;
+  p->fn = fn;
+  p->arg = arg;
+  *thread = p;
+  (void) dthr_thread_run(&p->th);
+  return 0;
+}
+
+int dthr_pthread_join(dthr_pthread_t thread, void **value)
+{
+  if (thread == dthr_pthread_cur()) return EDEADLK;
+  if (thread->state == DTHR_PTHREAD_DETACHED) return EINVAL;
+  dthr_semaphore_take_no_yield(&thread->done);
+  if (value) *value = thread->value;
+  if (!__sync_bool_compare_and_swap(&thread->state,DTHR_PTHREAD_JOINABLE,
+                                    DTHR_PTHREAD_JOINED))
+    free(thread);
+  return 0;
+}
+
+int dthr_pthread_detach(dthr_pthread_t thread)
+{
+  switch (__sync_val_compare_and_swap(&thread->state,DTHR_PTHREAD_JOINABLE,
+                                      DTHR_PTHREAD_DETACHED)) {
+  case DTHR_PTHREAD_JOINABLE:
+    return 0;
+  case DTHR_PTHREAD_RELEASED:
+    /* nobody will join it now */
+    free(thread);
+    return 0;
+  default:
+    return EINVAL;
+  }
+}
+
+void  dthr_pthread_exit(void *value)
+{
+  dthr_pthread_finish(dthr_pthread_cur(),value);
+  dthr_thread_exit(value);
+}
+
+dthr_pthread_t  dthr_pthread_self(void)
+{
+  return dthr_pthread_cur();
+}
+
+int dthr_pthread_equal(dthr_pthread_t a, dthr_pthread_t b)
+{
+  return a == b;
+}
+
+int dthr_pthread_yield(void)
+{
+  dthr_thread_yield();
+  return 0;
+}
+
+int dthr_pthread_attr_init(dthr_pthread_attr_t *attr)
+{
+  attr->stack_size = DREAD_THREAD_PTHREAD_STACK;
+  attr->detach_state = PTHREAD_CREATE_JOINABLE;
+  return 0;
+}
+
+int dthr_pthread_attr_destroy(dthr_pthread_attr_t *attr)
+{
+  return 0;
+}
+
+int dthr_pthread_attr_setstacksize(dthr_pthread_attr_t *attr, size_t size)
+{
+  if (size < PTHREAD_STACK_MIN) return EINVAL;
+  attr->stack_size = size;
+  return 0;
+}
+
+int dthr_pthread_attr_getstacksize(const dthr_pthread_attr_t *attr,
+                                   size_t                    *size)
+{
+  *size = attr->stack_size;
+  return 0;
+}
+
+int dthr_pthread_attr_setdetachstate(dthr_pthread_attr_t *attr, int state)
+{
+  if (state != PTHREAD_CREATE_JOINABLE && state != PTHREAD_CREATE_DETACHED)
+    return EINVAL;
+  attr->detach_state = state;
+  return 0;
+}
+
+int dthr_pthread_attr_getdetachstate(const dthr_pthread_attr_t *attr,
+                                     int                       *state)
+{
+  *state = attr->detach_state;
+  return 0;
+}
+
+/*
+ * Sets up a statically initialized object (or runs a once routine) on
+ * first use.  Whoever moves state from 0 to 1 does it; anyone else
+ * waits for 2.
+ */
+#define DTHR_PTHREAD_SETUP(state,setup)                               \
+  do {                                                                \
+    while ((state) != 2) {                                            \
+      if (__sync_bool_compare_and_swap(&(state),0,1)) {               \
+        setup;                                                        \
+        __sync_synchronize();                                         \
+        (state) = 2;                                                  \
+      } else {                                                        \
+        dthr_thread_yield();                                          \
+      }                                                               \
+    }                                                                 \
+  } while (0)
+
+static void dthr_pthread_mutex_setup(dthr_pthread_mutex_t *mutex)
+{
+  DTHR_PTHREAD_SETUP(mutex->init_state,
+                     (void) dthr_semaphore_init_lock(&mutex->sema);
+                     mutex->owner = 0;
+                     mutex->count = 0);
+}
+
+int dthr_pthread_mutex_init(dthr_pthread_mutex_t            *mutex,
+                            const dthr_pthread_mutexattr_t  *attr)
+{
+  mutex->type = attr ? attr->type : PTHREAD_MUTEX_DEFAULT;
+  (void) dthr_semaphore_init_lock(&mutex->sema);
+  mutex->owner = 0;
+  mutex->count = 0;
+  mutex->init_state = 2;
+  return 0;
+}
+
+int dthr_pthread_mutex_destroy(dthr_pthread_mutex_t *mutex)
+{
+  if (mutex->init_state == 2 && mutex->owner) return EBUSY;
+  mutex->init_state = 0;
+  return 0;
+}
+
+int dthr_pthread_mutex_lock(dthr_pthread_mutex_t *mutex)
+{
+  struct dthr_thread  *self = dthr_cur_thread;
+
+  if (mutex->init_state != 2) dthr_pthread_mutex_setup(mutex);
+  if (mutex->owner == self) {
+    if (mutex->type == PTHREAD_MUTEX_RECURSIVE) {
+      mutex->count++;
+      return 0;
+    }
+    if (mutex->type == PTHREAD_MUTEX_ERRORCHECK) return EDEADLK;
+  }
+  dthr_semaphore_take_no_yield(&mutex->sema);
+  mutex->owner = self;
+  mutex->count = 1;
+  return 0;
+}
+
+int dthr_pthread_mutex_trylock(dthr_pthread_mutex_t *mutex)
+{
+  struct dthr_thread  *self = dthr_cur_thread;
+
+  if (mutex->init_state != 2) dthr_pthread_mutex_setup(mutex);
+  if (mutex->owner == self && mutex->type == PTHREAD_MUTEX_RECURSIVE) {
+    mutex->count++;
+    return 0;
+  }
+  if (!dthr_semaphore_try(&mutex->sema)) return EBUSY;
+  mutex->owner = self;
+  mutex->count = 1;
+  return 0;
+}
+
+int dthr_pthread_mutex_unlock(dthr_pthread_mutex_t *mutex)
+{
+  if (mutex->init_state != 2) return EPERM;
+  if (mutex->type == PTHREAD_MUTEX_RECURSIVE
+      || mutex->type == PTHREAD_MUTEX_ERRORCHECK) {
+    if (mutex->owner != dthr_cur_thread) return EPERM;
+    if (--mutex->count > 0) return 0;
+  }
+  mutex->owner = 0;
+  dthr_semaphore_drop_no_yield(&mutex->sema);
+  return 0;
+}
+
+int dthr_pthread_mutexattr_init(dthr_pthread_mutexattr_t *attr)
+{
+  attr->type = PTHREAD_MUTEX_DEFAULT;
+  return 0;
+}
+
+int dthr_pthread_mutexattr_destroy(dthr_pthread_mutexattr_t *attr)
+{
+  return 0;
+}
+
+int dthr_pthread_mutexattr_settype(dthr_pthread_mutexattr_t *attr,
+                                   int                      type)
+{
+  if (type != PTHREAD_MUTEX_NORMAL && type != PTHREAD_MUTEX_RECURSIVE
+      && type != PTHREAD_MUTEX_ERRORCHECK && type != PTHREAD_MUTEX_DEFAULT)
+    return EINVAL;
+  attr->type = type;
+  return 0;
+}
+
+int dthr_pthread_mutexattr_gettype(const dthr_pthread_mutexattr_t *attr,
+                                   int                            *type)
+{
+  *type = attr->type;
+  return 0;
+}
+
+static void dthr_pthread_cond_setup(dthr_pthread_cond_t *cond)
+{
+  DTHR_PTHREAD_SETUP(cond->init_state,(void) dthr_event_init(&cond->ev));
+}
+
+int dthr_pthread_cond_init(dthr_pthread_cond_t           *cond,
+                           const dthr_pthread_condattr_t *attr)
+{
+  (void) dthr_event_init(&cond->ev);
+  cond->init_state = 2;
+  return 0;
+}
+
+int dthr_pthread_cond_destroy(dthr_pthread_cond_t *cond)
+{
+  if (cond->init_state == 2 && !DREAD_THREAD_CHAIN_EMPTY(&cond->ev.threadq))
+    return EBUSY;
+  cond->init_state = 0;
+  return 0;
+}
+
+/*
+ * Waits on cond, with mutex dropped and retaken (usec 0:  for ever).
+ * A recursive mutex is released entirely, and its count restored.
+ */
+static int dthr_pthread_cond_wait_usec(dthr_pthread_cond_t  *cond,
+                                       dthr_pthread_mutex_t *mutex,
+                                       unsigned long        usec)
+{
+  struct dthr_thread  *self = dthr_cur_thread;
+  int                 count, woken = 1;
+
+  if (cond->init_state != 2) dthr_pthread_cond_setup(cond);
+  if (mutex->init_state != 2 || mutex->owner != self) return EPERM;
+  count = mutex->count;
+  mutex->owner = 0;
+  if (usec) woken = dthr_event_timedwait(&cond->ev,&mutex->sema,usec);
+  else dthr_event_wait(&cond->ev,&mutex->sema);
+  mutex->owner = self;
+  mutex->count = count;
+  return woken ? 0 : ETIMEDOUT;
+}
+
+int dthr_pthread_cond_wait(dthr_pthread_cond_t  *cond,
+                           dthr_pthread_mutex_t *mutex)
+{
+  return dthr_pthread_cond_wait_usec(cond,mutex,0);
+}
+
+int dthr_pthread_cond_timedwait(dthr_pthread_cond_t   *cond,
+                                dthr_pthread_mutex_t  *mutex,
+                                const struct timespec *abstime)
+{
+  struct timeval      now;
+  unsigned long long  at, from;
+
+  (void) gettimeofday(&now,(struct timezone *) 0);
+  at = abstime->tv_sec * 1000000ull + abstime->tv_nsec / 1000;
+  from = now.tv_sec * 1000000ull + now.tv_usec;
+  if (at <= from) {
+    if (mutex->init_state != 2 || mutex->owner != dthr_cur_thread)
+      return EPERM;
+    return ETIMEDOUT;
+  }
+  return dthr_pthread_cond_wait_usec(cond,mutex,(unsigned long) (at - from));
+}
+
+int dthr_pthread_cond_signal(dthr_pthread_cond_t *cond)
+{
+  if (cond->init_state != 2) dthr_pthread_cond_setup(cond);
+  dthr_event_signal_no_yield(&cond->ev);
+  return 0;
+}
+
+int dthr_pthread_cond_broadcast(dthr_pthread_cond_t *cond)
+{
+  if (cond->init_state != 2) dthr_pthread_cond_setup(cond);
+  dthr_event_broadcast_no_yield(&cond->ev);
+  return 0;
+}
+
+int dthr_pthread_once(dthr_pthread_once_t *once, void (*fn)(void))
+{
+  DTHR_PTHREAD_SETUP(*once,(*fn)());
+  return 0;
+}
+
+int dthr_pthread_key_create(dthr_pthread_key_t  *key,
+                            void                (*destructor)(void *))
+{
+  int i;
+
+  dthr_semaphore_take_no_yield(&dthr_pthread_keys_lock);
+  for (i = 0; i < DREAD_THREAD_PTHREAD_KEYS_MAX; i++)
+    if (!(dthr_pthread_keys[i].gen & 1)) {
+      dthr_pthread_keys[i].gen++;
+      dthr_pthread_keys[i].destructor = destructor;
+      *key = i;
+      break;
+    }
+  dthr_semaphore_drop_no_yield(&dthr_pthread_keys_lock);
+  return i < DREAD_THREAD_PTHREAD_KEYS_MAX ? 0 : EAGAIN;
+}
+
+int dthr_pthread_key_delete(dthr_pthread_key_t key)
+{
+  int rv = 0;
+
+  if (key >= DREAD_THREAD_PTHREAD_KEYS_MAX) return EINVAL;
+  dthr_semaphore_take_no_yield(&dthr_pthread_keys_lock);
+  if (dthr_pthread_keys[key].gen & 1) {
+    dthr_pthread_keys[key].gen++;
+    dthr_pthread_keys[key].destructor = 0;
+  } else {
+    rv = EINVAL;
+  }
+  dthr_semaphore_drop_no_yield(&dthr_pthread_keys_lock);
+  return rv;
+}
+
+void  *dthr_pthread_getspecific(dthr_pthread_key_t key)
+{
+  struct dthr_pthread *p = dthr_pthread_cur();
+
+  if (key >= DREAD_THREAD_PTHREAD_KEYS_MAX || !p->specific
+      || p->specific[key].gen != dthr_pthread_keys[key].gen)
+    return 0;
+  return p->specific[key].value;
+}
+
+int dthr_pthread_setspecific(dthr_pthread_key_t key, const void *value)
+{
+  struct dthr_pthread *p = dthr_pthread_cur();
+
+  if (key >= DREAD_THREAD_PTHREAD_KEYS_MAX
+      || !(dthr_pthread_keys[key].gen & 1))
+    return EINVAL;
+  if (!p->specific
+      && !(p->specific = (struct dthr_pthread_specific *)
+           calloc(DREAD_THREAD_PTHREAD_KEYS_MAX,sizeof *p->specific)))
+    return ENOMEM;
+  p->specific[key].gen = dthr_pthread_keys[key].gen;
+  p->specific[key].value = (void *) value;
+  return 0;
+}
@@ -53,9 +53,28 @@
 /* select(2) req'mt, and caddr_t */
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <errno.h>
+#include <poll.h>
+#include <stdio.h>
 #include <unistd.h>
 
+/*
+ * DREAD_THREAD_MULTI builds the multi-carrier scheduler, in which green
+ * threads are run by several pthreads ("carriers"), each with its own
+ * run queue, stealing runnable threads from one another when idle.
+ * Semaphores and events then carry a lock.  Code including this header
+ * must be compiled with the same setting as the library it links with
+ * (libdreadthread_mt.a for DREAD_THREAD_MULTI=1).
+ */
+#if !defined(DREAD_THREAD_MULTI)
+# define DREAD_THREAD_MULTI 0
+#endif
+#if DREAD_THREAD_MULTI
+# include <pthread.h>
+typedef pthread_mutex_t dthr_lock_t;
+#endif
+
 #define DREAD_THREAD_MAGIC    0x31415926ul
   /* for stack corruption test dthr_csw */
 #define DREAD_THREAD_MAGIC2   0x27182818ul
@@ -89,23 +108,103 @@ struct dthr_stack {
   caddr_t             stack_base,   /* approximate */
                       stack_top;
   struct dthr_thread  *thread;
+  size_t              map_size;     /* incl. guard page; 0 if carved */
+  caddr_t             painted;      /* paint intact from stack_top */
+#if DREAD_THREAD_MULTI
+  int                 exiting;  /* defer wakeups until switched out */
+#endif
   dthr_ctxt_t         regs,     /* user thread regs */
                       base;     /* stack reuse */
 };
 
 struct dthr_semaphore {
-  unsigned long     magic;
+  unsigned long       magic;
 #define DREAD_THREAD_SEMA_MAGIC   0x68657265ul
-  int               value;      /* binary for lock */
-  struct dthr_chain threadq;
+  int                 value;    /* binary for lock */
+  struct dthr_chain   threadq;
+  int                 inherit;  /* initialized as a lock */
+  struct dthr_thread  *holder;  /* of a lock, while taken */
+  /* under the holder's held_lock:  its other locks, waiters' priority */
+  struct dthr_semaphore *held_next;
+  int                 boost;
+#if DREAD_THREAD_MULTI
+  dthr_lock_t         lock;
+#endif
 };
 
 struct dthr_event {
   unsigned long     magic;
 #define DREAD_THREAD_EV_MAGIC   0x83651fc2ul
   struct dthr_chain threadq;
+#if DREAD_THREAD_MULTI
+  dthr_lock_t       lock;
+#endif
+};
+
+/*
+ * Condition variable:  an event whose waiters are moved onto the lock's
+ * queue when signalled, rather than woken to fight over it.
+ */
+struct dthr_cond {
+  unsigned long         magic;
+#define DREAD_THREAD_COND_MAGIC   0x636f6e64ul
+  struct dthr_chain     threadq;
+  struct dthr_semaphore *lock_sema; /* the waiters' lock */
+#if DREAD_THREAD_MULTI
+  dthr_lock_t           lock;
+#endif
+};
+
+struct dthr_rwlock {
+  unsigned long     magic;
+#define DREAD_THREAD_RW_MAGIC     0x72776c6bul
+  int               readers;    /* holding it */
+  int               writer;     /* holding it */
+  struct dthr_chain readq, writeq;
+#if DREAD_THREAD_MULTI
+  dthr_lock_t       lock;
+#endif
+};
+
+/*
+ * Bounded channel:  a ring of capacity messages (0:  every send waits
+ * for a receiver), with the threads parked sending to and receiving
+ * from it.
+ */
+struct dthr_channel {
+  unsigned long     magic;
+#define DREAD_THREAD_CHAN_MAGIC   0x6368616eul
+  void              **ring;
+  int               capacity,
+                    head,       /* oldest message */
+                    count,
+                    closed;
+  struct dthr_chain recvq, sendq;   /* of struct dthr_channel_op */
+#if DREAD_THREAD_MULTI
+  dthr_lock_t       lock;
+#endif
+};
+
+struct dthr_channel_park;
+
+/*
+ * One send or receive of a dthr_channel_select; also what a parked
+ * thread leaves on a channel's queue.
+ */
+struct dthr_channel_op {
+  /* Private stuff */
+  struct dthr_chain         link;
+  struct dthr_channel_park  *park;
+  int                       index;
+  /* Public stuff */
+  struct dthr_channel       *channel;
+  int                       send;   /* else receive */
+  void                      *msg;   /* to send, or received */
+  int                       ok;     /* 0:  done because channel closed */
 };
 
+struct dthr_runq;
+
 struct dthr_thread_exit {
   struct dthr_thread_exit *next;
   void                    (*fn)(struct dthr_thread *,void *);
@@ -125,12 +224,34 @@ struct dthr_thread {
 #define   DREAD_THREAD_TH_RUNNABLE  0
 #define   DREAD_THREAD_TH_SEMA_WAIT 1
 #define   DREAD_THREAD_TH_EVENT_WAIT  2
+#define   DREAD_THREAD_TH_SLEEP_WAIT  3
+#define   DREAD_THREAD_TH_IO_WAIT     4
+#define   DREAD_THREAD_TH_CHAN_WAIT   5
   struct dthr_stack       *stack;
   struct dthr_semaphore   exit_sema;
   struct dthr_thread_exit *on_exit;
-  jmp_buf                 io_timeout;
+  void                    (*release)(struct dthr_thread *);
+  unsigned long long      wake_at;      /* usec, dthr_time_now() clock */
+  int                     timer_slot;   /* timer heap index, or -1 */
+  int                     timed_out;
+  int                     io_slot;      /* poll set index, or -1 */
+  int                     io_revents;
+  int                     prio;         /* see dthr_thread_set_priority */
+  int                     eff_prio;     /* raised by waiters on its locks */
+  struct dthr_semaphore   *held;        /* locks it holds */
+  struct dthr_runq        *runq;        /* queued on, or 0 */
+  int                     runq_level;
+  unsigned long long      ready_at,     /* if time slices are accounted */
+                          slice_start;
+  unsigned long long      run_start;    /* if run times are accounted */
+#if DREAD_THREAD_MULTI
+  dthr_lock_t             *wait_lock;   /* guards queue of a timed wait */
+  dthr_lock_t             held_lock;    /* taken last; guards held */
+#endif
   /* Public stuff */
   void                    *exit_value;
+  size_t                  stack_used;   /* if DREAD_THREAD_STACK_MEASURE */
+  unsigned long long      run_usec;     /* see dthr_set_run_accounting */
   void                    *data;
   /*
    * For implementing mailboxes etc --
@@ -143,15 +264,85 @@ struct dthr_thread {
    */
 };
 
+/*
+ * Stack reuse statistics.  Stacks freed by exiting threads are cached in
+ * size-class bins for reuse by new threads.
+ */
+struct dthr_stack_stats {
+  unsigned long hits;           /* thread starts reusing a cached stack */
+  unsigned long misses;         /* thread starts growing a new stack */
+  unsigned long stacks_cached;  /* stacks currently in the free bins */
+  unsigned long stacks_total;   /* stacks ever grown */
+  size_t        bytes_cached;   /* stack bytes currently in the free bins */
+  size_t        bytes_total;    /* stack bytes ever grown */
+  unsigned long stacks_released;  /* mapped stacks unmapped past the limit */
+  size_t        max_stack_used; /* deepest measured thread stack use */
+};
+
+/*
+ * Scheduling latency of one priority level, while time slices are
+ * accounted:  how long threads queued at that level waited to run.
+ */
+struct dthr_sched_latency {
+  unsigned long       dispatches;
+  unsigned long long  wait_usec;      /* total */
+  unsigned long long  max_wait_usec;
+  unsigned long       starved;        /* run ahead of higher levels */
+};
+
+/*
+ * Scheduler counters, since dthr_init.  Each carrier counts its own,
+ * unlocked; dthr_get_sched_stats sums them.  Stack allocation and reuse
+ * are counted in struct dthr_stack_stats.
+ */
+struct dthr_sched_stats {
+  unsigned long switches;         /* context switches */
+  unsigned long yields;           /* calls of dthr_thread_yield */
+  unsigned long sema_waits;       /* semaphore takes that had to wait */
+  unsigned long sema_timeouts;    /* timed takes that gave up */
+  unsigned long event_waits;
+  unsigned long event_wakeups;    /* waiters signalled or broadcast to */
+  unsigned long event_timeouts;
+  unsigned long chan_waits;       /* channel ops that had to park */
+  unsigned long sleeps;
+  unsigned long io_waits;
+  unsigned long io_polls;
+  unsigned long threads_run;      /* calls of dthr_thread_run */
+  unsigned long threads_started;  /* given a stack */
+  unsigned long threads_exited;
+  unsigned long steals;           /* threads taken from other carriers */
+};
+
+#if DREAD_THREAD_MULTI
+/*
+ * Each carrier has its own current thread, and a thread may resume on a
+ * different carrier than the one it blocked on, so the address is looked
+ * up afresh on every use.
+ */
+extern struct dthr_thread **dthr_cur_thread_location(void);
+# define dthr_cur_thread  (*dthr_cur_thread_location())
+#else
 extern struct dthr_thread *dthr_cur_thread;
+#endif
 struct dthr_thread *dthr_this_thread(void);
 /* signal handlers? who needs it? */
 void  dthr_thread_yield(void);
 struct dthr_semaphore *dthr_semaphore_init(struct dthr_semaphore  *sema,
                                            int                    init);
+/*
+ * As dthr_semaphore_init(sema,1), for a lock:  it must be dropped by the
+ * thread that took it, whose priority its waiters raise till then.
+ */
+struct dthr_semaphore *dthr_semaphore_init_lock(struct dthr_semaphore *sema);
 int dthr_semaphore_try(struct dthr_semaphore  *sema);
 void  dthr_semaphore_take(struct dthr_semaphore *sema);
 void  dthr_semaphore_drop(struct dthr_semaphore *sema);
+/* as above, without first (or afterwards) letting other threads run */
+void  dthr_semaphore_take_no_yield(struct dthr_semaphore *sema);
+void  dthr_semaphore_drop_no_yield(struct dthr_semaphore *sema);
+/* as dthr_semaphore_take, but gives up after usec; returns 1 if taken */
+int dthr_semaphore_timedtake(struct dthr_semaphore  *sema,
+                             unsigned long          usec);
 
 void  dthr_event_wait(struct dthr_event     *event,
                       struct dthr_semaphore *lock);
@@ -159,9 +350,90 @@ void  dthr_event_broadcast_no_yield(struct dthr_event *event);
 void  dthr_event_broadcast(struct dthr_event *event);
 void  dthr_event_signal_no_yield(struct dthr_event *event);
 void  dthr_event_signal(struct dthr_event *event);
+/*
+ * As dthr_event_wait, but wakes after usec even if not signalled.  The
+ * lock is retaken either way; returns 0 if the wait timed out.
+ */
+int dthr_event_timedwait(struct dthr_event      *event,
+                         struct dthr_semaphore  *lock,
+                         unsigned long          usec);
+
+/*
+ * Condition variables.  dthr_cond_wait is dthr_event_wait, but a signal
+ * or broadcast does not make the waiters runnable while the lock is
+ * held:  it moves them onto the lock's queue, so each is woken by the
+ * drop that lets it have the lock.  All the waiters at one time must
+ * use the same lock.  Neither yields, since the caller usually still
+ * holds the lock the waiters need.
+ */
+struct dthr_cond *dthr_cond_init(struct dthr_cond *cond);
+void  dthr_cond_wait(struct dthr_cond       *cond,
+                     struct dthr_semaphore  *lock);
+void  dthr_cond_signal(struct dthr_cond *cond);
+void  dthr_cond_broadcast(struct dthr_cond *cond);
+
+/*
+ * Reader-writer locks.  Readers share the lock and writers have it to
+ * themselves; a waiting writer holds back new readers, and a writer's
+ * unlock lets in all the readers waiting before the next writer, so
+ * neither side starves.  The lock is handed to the threads it wakes.
+ * The try calls return 1 if taken; unlock does not yield.
+ */
+struct dthr_rwlock *dthr_rwlock_init(struct dthr_rwlock *rw);
+void  dthr_rwlock_rdlock(struct dthr_rwlock *rw);
+void  dthr_rwlock_wrlock(struct dthr_rwlock *rw);
+int   dthr_rwlock_tryrdlock(struct dthr_rwlock *rw);
+int   dthr_rwlock_trywrlock(struct dthr_rwlock *rw);
+void  dthr_rwlock_unlock(struct dthr_rwlock *rw);
+
+/*
+ * Sleeping threads wait in a timer heap consulted by the scheduler; with
+ * nothing else runnable the process (or carrier) blocks until the
+ * earliest deadline.  dthr_time_now is the clock used, in microseconds.
+ */
+void  dthr_sleep(unsigned long usec);
+unsigned long long dthr_time_now(void);
+
+/*
+ * Descriptor I/O.  These behave as their system calls, but leave the
+ * descriptor non-blocking and, where the call would block, park the
+ * calling thread until poll(2) finds it ready.  The scheduler polls the
+ * parked descriptors when its run queue drains (and every so many
+ * yields otherwise), so one process can serve many connections.
+ * dthr_io_wait parks for POLLIN/POLLOUT and returns the revents.
+ */
+int     dthr_io_wait(int fd, int events);
+ssize_t dthr_read(int fd, void *buf, size_t nbytes);
+ssize_t dthr_write(int fd, const void *buf, size_t nbytes);
+int     dthr_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+int     dthr_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
 
 struct dthr_event *dthr_event_init(struct dthr_event *ev);
 
+/*
+ * Channels.  A message sent to a channel with a receiver parked on it
+ * goes straight to that receiver, which dthr_channel_send then switches
+ * to directly; dthr_channel_send_no_yield just makes it runnable.  Sends
+ * return 0 if the channel is closed, receives once it is also drained.
+ * The try forms return 1 if done, 0 if they would block and -1 if the
+ * channel is closed.  dthr_channel_select does the first of nops ops
+ * that can proceed, waiting for one if block is set, and returns its
+ * index (-1 if none could and !block, or nops is 0).  Closing wakes
+ * every thread parked on the channel.  init returns 0 if out of space.
+ */
+struct dthr_channel *dthr_channel_init(struct dthr_channel *ch,
+                                       int                 capacity);
+void  dthr_channel_destroy(struct dthr_channel *ch);
+int   dthr_channel_send(struct dthr_channel *ch, void *msg);
+int   dthr_channel_send_no_yield(struct dthr_channel *ch, void *msg);
+int   dthr_channel_recv(struct dthr_channel *ch, void **msg);
+int   dthr_channel_try_send(struct dthr_channel *ch, void *msg);
+int   dthr_channel_try_recv(struct dthr_channel *ch, void **msg);
+void  dthr_channel_close(struct dthr_channel *ch);
+int   dthr_channel_select(struct dthr_channel_op  *ops,
+                          int                     nops,
+                          int                     block);
+
 void  dthr_init(void);
 void  dthr_thread_exit(void *status);
 struct dthr_thread  *dthr_thread_init(struct dthr_thread  *th,
@@ -171,6 +443,80 @@ struct dthr_thread  *dthr_thread_init(struct dthr_thread  *th,
 int dthr_thread_on_exit(struct dthr_thread  *th,
                         void                (*fn)(struct dthr_thread *,void *),
                         void                *arg);
+/*
+ * fn is called with th once th has exited and been switched away from,
+ * by whatever runs next, so it may free th.  It must not block.
+ */
+void  dthr_thread_on_release(struct dthr_thread  *th,
+                             void                (*fn)(struct dthr_thread *));
+
+/*
+ * Priorities.  The runnable thread of highest priority runs first,
+ * threads of equal priority in turn; a yield only gives way to threads
+ * of at least the yielder's priority.  A thread waiting on a semaphore
+ * initialized to 1 (a lock) lends its priority to the thread holding it
+ * until that drops it.  dthr_thread_init sets DREAD_THREAD_PRIO_DEFAULT;
+ * set_priority returns 0 if prio is out of range.
+ */
+#define DREAD_THREAD_PRIO_LEVELS    8
+#define DREAD_THREAD_PRIO_DEFAULT   3
+int   dthr_thread_set_priority(struct dthr_thread *th, int prio);
+int   dthr_thread_get_priority(struct dthr_thread *th);
+
+/*
+ * Time slices, off (0) by default.  With a slice set, a yield does not
+ * give way to threads of equal priority until the yielder has run for
+ * usec, a thread that has waited DREAD_THREAD_STARVE_SLICES slices runs
+ * ahead of higher priorities, and the wait of every dispatch from the
+ * run queue is recorded per priority level.  get_sched_latency returns
+ * 0 if prio is out of range.
+ */
+#define DREAD_THREAD_STARVE_SLICES  4
+void  dthr_set_timeslice(unsigned long usec);
+struct dthr_sched_latency *dthr_get_sched_latency(
+                                  int                       prio,
+                                  struct dthr_sched_latency *st);
+
+/*
+ * What the threads are doing at one moment, by walking the queues.
+ * Threads with a stack are counted by state; the running threads and
+ * those in the run queues are all "runnable".  Wait-queue depths of
+ * particular semaphores and events are given by dthr_semaphore_waiters
+ * and dthr_event_waiters.
+ */
+struct dthr_sched_snapshot {
+  unsigned long runq_depth[DREAD_THREAD_PRIO_LEVELS];
+  unsigned long runq_total;
+  unsigned long new_threads;      /* run, not yet given a stack */
+  unsigned long threads;          /* with a stack */
+  unsigned long runnable;
+  unsigned long sema_waiting;
+  unsigned long event_waiting;
+  unsigned long sleeping;
+  unsigned long io_waiting;
+  unsigned long chan_waiting;
+  unsigned long timers;           /* timed waits armed */
+  int           carriers;
+  int           idle_carriers;
+};
+
+/*
+ * Introspection, always compiled in.  The counters cost an increment
+ * each; per-thread run times (run_usec, accumulated as each thread is
+ * switched away from and as it exits) read the clock on every switch,
+ * so they are only kept after dthr_set_run_accounting(1).  The snapshot
+ * takes each queue lock in turn, so under DREAD_THREAD_MULTI it need not
+ * be consistent between queues.  dthr_print_sched_stats writes both,
+ * and the latency of each priority level, to fp; it may be called from
+ * dthr_on_deadlock or any thread.
+ */
+struct dthr_sched_stats *dthr_get_sched_stats(struct dthr_sched_stats *st);
+struct dthr_sched_snapshot *dthr_get_sched_snapshot(
+                                  struct dthr_sched_snapshot  *snap);
+int   dthr_semaphore_waiters(struct dthr_semaphore *sema);
+int   dthr_event_waiters(struct dthr_event *event);
+void  dthr_set_run_accounting(int on);
+void  dthr_print_sched_stats(FILE *fp);
 
 struct dthr_thread  *dthr_thread_run(struct dthr_thread *th);
 struct dthr_thread  *dthr_thread_wait(struct dthr_thread *th);
@@ -178,10 +524,37 @@ struct dthr_thread  *dthr_thread_detach(struct dthr_thread *th);
 
 void  dthr_thread_multithread(struct dthr_thread  *th);
 
+/*
+ * Number of carriers dthr_thread_multithread runs threads on, and the
+ * pthread stack size of each carrier other than the calling thread (0
+ * for the default); new thread stacks are carved from it.  Call after
+ * dthr_init.  Returns 0 if not supported by this build.
+ */
+int   dthr_set_carriers(int ncarriers, size_t carrier_stack_size);
+int   dthr_carrier_id(void);
+
 int DThr_Thread_Run(void    *(*fn)(void *),
                     void    *fn_arg,
                     size_t  req_stack_size);
 
+struct dthr_stack_stats *dthr_get_stack_stats(struct dthr_stack_stats *st);
+
+/*
+ * Stack allocation.  Thread stacks are normally carved out of the
+ * launcher's own C stack, so their total is bounded by the process
+ * stack limit.  DREAD_THREAD_STACK_MAPPED gives each stack a mapping of
+ * its own with an inaccessible guard page below it, so that overflow
+ * faults at once.  DREAD_THREAD_STACK_MEASURE paints each stack as its
+ * thread starts and sets stack_used when it exits, before the on-exit
+ * routines run.  Returns 0 if the mode is not supported here (mapped
+ * stacks need the register-swap context switch).
+ */
+#define DREAD_THREAD_STACK_MAPPED   0x1
+#define DREAD_THREAD_STACK_MEASURE  0x2
+int   dthr_set_stack_mode(int mode);
+/* unmap freed mapped stacks once this many bytes are cached; 0: never */
+void  dthr_set_stack_cache_limit(size_t bytes);
+
 extern int  (*dthr_on_deadlock)();
 
 #endif
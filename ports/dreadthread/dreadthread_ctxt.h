@@ -3,9 +3,49 @@
  * Context switch routine.
  */
 
+/*
+ * DREAD_THREAD_FAST_CTXT selects the register-swap context switch in
+ * dread_ctxt.S, which saves only the callee-saved registers, stack
+ * pointer and return address.  It is the default where implemented;
+ * build with -DDREAD_THREAD_FAST_CTXT=0 to use setjmp/longjmp instead.
+ * NaCl requires sandboxed control flow, so it always uses setjmp.
+ */
+#if !defined(DREAD_THREAD_FAST_CTXT)
+# if (__x86_64__ || __i386__ || __arm__) && !__native_client__
+#  define DREAD_THREAD_FAST_CTXT  1
+# else
+#  define DREAD_THREAD_FAST_CTXT  0
+# endif
+#endif
+
+#if !defined(__ASSEMBLER__)
+
 #define DREAD_THREAD_CTXT_MAGIC   1
 
-#if i386 || sparc || __x86_64__ || __x86_32__ || __native_client__
+#if DREAD_THREAD_FAST_CTXT
+# include <setjmp.h>
+/*
+ * x86-64: rbx rbp r12-r15 sp pc.  i386: ebx esi edi ebp sp pc.
+ * arm: r4-r11 sp lr, then d8-d15 when the VFP registers are in use.
+ */
+# if __x86_64__
+typedef unsigned long dthr_md_jmp_buf[8];
+# elif __i386__
+typedef unsigned long dthr_md_jmp_buf[6];
+# else
+typedef unsigned long dthr_md_jmp_buf[10 + 16];
+# endif
+extern int  dthr_md_save(dthr_md_jmp_buf regs)
+    __attribute__((returns_twice));
+extern void dthr_md_load(dthr_md_jmp_buf regs, int val)
+    __attribute__((noreturn));
+extern void dthr_md_start(void *sp, void (*fn)(void))
+    __attribute__((noreturn));
+# define DREAD_THREAD_MD_SAVE(regs)   dthr_md_save((regs)->r)
+# define DREAD_THREAD_MD_LOAD(regs,val) dthr_md_load((regs)->r,val)
+/* run fn on the stack ending at sp; only needed for mapped stacks */
+# define DREAD_THREAD_MD_START(sp,fn)   dthr_md_start(sp,fn)
+#elif i386 || sparc || __x86_64__ || __x86_32__ || __native_client__
 # include <setjmp.h>
 # if  posix_signals
 #  define DREAD_THREAD_MD_SAVE(regs)   setjmp((regs)->r)
@@ -27,11 +67,15 @@
 # error "What kind of machine am I being compiled on?"
 #endif
 
+#if !DREAD_THREAD_FAST_CTXT
+typedef jmp_buf dthr_md_jmp_buf;
+#endif
+
 #if DREAD_THREAD_CTXT_MAGIC
 typedef struct {
   unsigned long magic1;
 # define  DREAD_THREAD_CTXT_MAGIC_1 0x38127483ul
-  jmp_buf   r;
+  dthr_md_jmp_buf r;
   unsigned long magic2;
 # define  DREAD_THREAD_CTXT_MAGIC_2 0xc843fa73ul
 } dthr_ctxt_t;
@@ -53,10 +97,12 @@ typedef struct {
 #else
 
 typedef struct {
-  jmp_buf   r;
+  dthr_md_jmp_buf r;
 } dthr_ctxt_t;
 # define  dthr_save_ctxt(regs)      DREAD_THREAD_MD_SAVE((regs))
 # define  dthr_load_ctxt(regs,val)  DREAD_THREAD_MD_LOAD((regs),val)
 #endif
 
+#endif  /* !__ASSEMBLER__ */
+
 #endif
@@ -0,0 +1,180 @@
+#if !defined(DREAD_THREAD_PTHREAD_KEYS_MAX)
+/*
+ * pthread interface over dreadthread threads, for porting programs
+ * written to pthreads:  create/join/detach/exit, mutexes, condition
+ * variables, once and thread-specific keys.  Each pthread is a green
+ * thread with a small stack, so thread-per-connection programs can run
+ * thousands of them.
+ *
+ * The program's main must run as a thread too:  rename it and call
+ * dthr_pthread_main, which runs it on ncarriers carriers and returns
+ * once every thread is done, or -1 if this build cannot use that many.
+ * As with pthreads, the process exits when the main thread returns
+ * rather than calling pthread_exit.
+ *
+ * Compiling with -DDREAD_THREAD_PTHREAD_NAMES maps the pthread_* names
+ * used after this header onto these, so that a program need only
+ * include it in place of <pthread.h> (or with -include) and be relinked
+ * against libdreadthread.a (or libdreadthread_mt.a, compiled with
+ * DREAD_THREAD_MULTI=1).  The shim functions may only be called from
+ * threads it created.
+ *
+ * Blocking system calls block the carrier, and with it every thread on
+ * it; use dthr_read and friends for descriptor I/O.
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include "dreadthread.h"
+
+#define DREAD_THREAD_PTHREAD_KEYS_MAX   128
+#define DREAD_THREAD_PTHREAD_STACK      (64 * 1024)   /* default size */
+#define DREAD_THREAD_PTHREAD_DESTRUCTOR_ITERATIONS  4
+
+typedef struct dthr_pthread *dthr_pthread_t;
+
+typedef struct {
+  size_t  stack_size;
+  int     detach_state;   /* PTHREAD_CREATE_JOINABLE or _DETACHED */
+} dthr_pthread_attr_t;
+
+/*
+ * Statically initialized objects are set up on first use; init_state
+ * is 0 until then, and 2 once they are ready.
+ */
+typedef struct {
+  volatile int          init_state;
+  int                   type;     /* PTHREAD_MUTEX_NORMAL etc. */
+  struct dthr_semaphore sema;
+  struct dthr_thread    *owner;
+  int                   count;    /* recursive locks held */
+} dthr_pthread_mutex_t;
+
+typedef struct {
+  int type;
+} dthr_pthread_mutexattr_t;
+
+typedef struct {
+  volatile int      init_state;
+  struct dthr_event ev;
+} dthr_pthread_cond_t;
+
+typedef struct {
+  int unused;
+} dthr_pthread_condattr_t;
+
+typedef volatile int  dthr_pthread_once_t;
+typedef unsigned int  dthr_pthread_key_t;
+
+#define DTHR_PTHREAD_MUTEX_INITIALIZER  { 0, PTHREAD_MUTEX_DEFAULT }
+#define DTHR_PTHREAD_COND_INITIALIZER   { 0 }
+#define DTHR_PTHREAD_ONCE_INIT          0
+
+int   dthr_pthread_main(int (*fn)(int, char **), int ac, char **av,
+                        int ncarriers);
+
+int   dthr_pthread_create(dthr_pthread_t            *thread,
+                          const dthr_pthread_attr_t *attr,
+                          void                      *(*fn)(void *),
+                          void                      *arg);
+int   dthr_pthread_join(dthr_pthread_t thread, void **value);
+int   dthr_pthread_detach(dthr_pthread_t thread);
+void  dthr_pthread_exit(void *value);
+dthr_pthread_t  dthr_pthread_self(void);
+int   dthr_pthread_equal(dthr_pthread_t a, dthr_pthread_t b);
+int   dthr_pthread_yield(void);
+
+int   dthr_pthread_attr_init(dthr_pthread_attr_t *attr);
+int   dthr_pthread_attr_destroy(dthr_pthread_attr_t *attr);
+int   dthr_pthread_attr_setstacksize(dthr_pthread_attr_t *attr, size_t size);
+int   dthr_pthread_attr_getstacksize(const dthr_pthread_attr_t *attr,
+                                     size_t                    *size);
+int   dthr_pthread_attr_setdetachstate(dthr_pthread_attr_t *attr, int state);
+int   dthr_pthread_attr_getdetachstate(const dthr_pthread_attr_t *attr,
+                                       int                       *state);
+
+int   dthr_pthread_mutex_init(dthr_pthread_mutex_t            *mutex,
+                              const dthr_pthread_mutexattr_t  *attr);
+int   dthr_pthread_mutex_destroy(dthr_pthread_mutex_t *mutex);
+int   dthr_pthread_mutex_lock(dthr_pthread_mutex_t *mutex);
+int   dthr_pthread_mutex_trylock(dthr_pthread_mutex_t *mutex);
+int   dthr_pthread_mutex_unlock(dthr_pthread_mutex_t *mutex);
+int   dthr_pthread_mutexattr_init(dthr_pthread_mutexattr_t *attr);
+int   dthr_pthread_mutexattr_destroy(dthr_pthread_mutexattr_t *attr);
+int   dthr_pthread_mutexattr_settype(dthr_pthread_mutexattr_t *attr,
+                                     int                      type);
+int   dthr_pthread_mutexattr_gettype(const dthr_pthread_mutexattr_t *attr,
+                                     int                            *type);
+
+int   dthr_pthread_cond_init(dthr_pthread_cond_t           *cond,
+                             const dthr_pthread_condattr_t *attr);
+int   dthr_pthread_cond_destroy(dthr_pthread_cond_t *cond);
+int   dthr_pthread_cond_wait(dthr_pthread_cond_t  *cond,
+                             dthr_pthread_mutex_t *mutex);
+/* abstime is CLOCK_REALTIME, as for pthread_cond_timedwait */
+int   dthr_pthread_cond_timedwait(dthr_pthread_cond_t   *cond,
+                                  dthr_pthread_mutex_t  *mutex,
+                                  const struct timespec *abstime);
+int   dthr_pthread_cond_signal(dthr_pthread_cond_t *cond);
+int   dthr_pthread_cond_broadcast(dthr_pthread_cond_t *cond);
+
+int   dthr_pthread_once(dthr_pthread_once_t *once, void (*fn)(void));
+
+int   dthr_pthread_key_create(dthr_pthread_key_t  *key,
+                              void                (*destructor)(void *));
+int   dthr_pthread_key_delete(dthr_pthread_key_t key);
+void  *dthr_pthread_getspecific(dthr_pthread_key_t key);
+int   dthr_pthread_setspecific(dthr_pthread_key_t key, const void *value);
+
+#if defined(DREAD_THREAD_PTHREAD_NAMES)
+# define pthread_t              dthr_pthread_t
+# define pthread_attr_t         dthr_pthread_attr_t
+# define pthread_mutex_t        dthr_pthread_mutex_t
+# define pthread_mutexattr_t    dthr_pthread_mutexattr_t
+# define pthread_cond_t         dthr_pthread_cond_t
+# define pthread_condattr_t     dthr_pthread_condattr_t
+# define pthread_once_t         dthr_pthread_once_t
+# define pthread_key_t          dthr_pthread_key_t
+# undef  PTHREAD_MUTEX_INITIALIZER
+# define PTHREAD_MUTEX_INITIALIZER  DTHR_PTHREAD_MUTEX_INITIALIZER
+# undef  PTHREAD_COND_INITIALIZER
+# define PTHREAD_COND_INITIALIZER   DTHR_PTHREAD_COND_INITIALIZER
+# undef  PTHREAD_ONCE_INIT
+# define PTHREAD_ONCE_INIT          DTHR_PTHREAD_ONCE_INIT
+# define pthread_create         dthr_pthread_create
+# define pthread_join           dthr_pthread_join
+# define pthread_detach         dthr_pthread_detach
+# define pthread_exit           dthr_pthread_exit
+# define pthread_self           dthr_pthread_self
+# define pthread_equal          dthr_pthread_equal
+# define pthread_yield          dthr_pthread_yield
+# define sched_yield            dthr_pthread_yield
+# define pthread_attr_init      dthr_pthread_attr_init
+# define pthread_attr_destroy   dthr_pthread_attr_destroy
+# define pthread_attr_setstacksize    dthr_pthread_attr_setstacksize
+# define pthread_attr_getstacksize    dthr_pthread_attr_getstacksize
+# define pthread_attr_setdetachstate  dthr_pthread_attr_setdetachstate
+# define pthread_attr_getdetachstate  dthr_pthread_attr_getdetachstate
+# define pthread_mutex_init     dthr_pthread_mutex_init
+# define pthread_mutex_destroy  dthr_pthread_mutex_destroy
+# define pthread_mutex_lock     dthr_pthread_mutex_lock
+# define pthread_mutex_trylock  dthr_pthread_mutex_trylock
+# define pthread_mutex_unlock   dthr_pthread_mutex_unlock
+# define pthread_mutexattr_init     dthr_pthread_mutexattr_init
+# define pthread_mutexattr_destroy  dthr_pthread_mutexattr_destroy
+# define pthread_mutexattr_settype  dthr_pthread_mutexattr_settype
+# define pthread_mutexattr_gettype  dthr_pthread_mutexattr_gettype
+# define pthread_cond_init      dthr_pthread_cond_init
+# define pthread_cond_destroy   dthr_pthread_cond_destroy
+# define pthread_cond_wait      dthr_pthread_cond_wait
+# define pthread_cond_timedwait dthr_pthread_cond_timedwait
+# define pthread_cond_signal    dthr_pthread_cond_signal
+# define pthread_cond_broadcast dthr_pthread_cond_broadcast
+# define pthread_once           dthr_pthread_once
+# define pthread_key_create     dthr_pthread_key_create
+# define pthread_key_delete     dthr_pthread_key_delete
+# define pthread_getspecific    dthr_pthread_getspecific
+# define pthread_setspecific    dthr_pthread_setspecific
+#endif
+
+#endif
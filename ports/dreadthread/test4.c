@@ -13,6 +13,7 @@ int                   count = COUNT;
 int                   nthreads = NTHREADS;
 size_t                stacksize = STACKSIZE;
 
+int                   stack_mode = 0;
 int                   all_at_once = 0;
 int                   all_go = 0;
 struct dthr_event     go_eva;
@@ -85,19 +86,21 @@ char    *me;
 void usage()
 {
   fprintf(stderr,
-          "Usage: %s [-aA] [-s stackbytes] [-c count] [-t nthreads]\n",
+          "Usage: %s [-aAmM] [-s stackbytes] [-c count] [-t nthreads]\n",
           me);
 }
 
 int main(int ac, char **av)
 {
-  int opt;
-  int i;
+  int     opt;
+  int     i;
+  size_t  max_used, total_used;
+  struct dthr_stack_stats st;
 
   if (!(me = strrchr(*av,'/'))) me = *av;
   else ++me;
 
-  while ((opt = getopt(ac,av,"aAc:s:t:")) != EOF) {
+  while ((opt = getopt(ac,av,"aAc:mMs:t:")) != EOF) {
     switch (opt) {
       case 'a': all_at_once = 1;
         break;
@@ -105,6 +108,10 @@ int main(int ac, char **av)
         break;
       case 'c': count = atoi(optarg);
         break;
+      case 'm': stack_mode |= DREAD_THREAD_STACK_MAPPED;
+        break;
+      case 'M': stack_mode |= DREAD_THREAD_STACK_MEASURE;
+        break;
       case 's': stacksize = strtoull(optarg, (char **) 0, 0);
         break;
       case 't': nthreads = atoi(optarg);
@@ -127,6 +134,10 @@ int main(int ac, char **av)
   }
 
   dthr_init();
+  if (!dthr_set_stack_mode(stack_mode)) {
+    fprintf(stderr,"%s:  stack mode 0x%x not supported\n",me,stack_mode);
+    exit(1);
+  }
 
   for (i = 0; i < nthreads; i++) {
     (void) dthr_thread_init(&th[i],myThread,(void *) (uintptr_t) i,stacksize);
@@ -143,5 +154,18 @@ int main(int ac, char **av)
 
   dthr_thread_multithread(&main_th);
   fprintf(stderr,"All threads exited, all done!\n");
+  if (stack_mode & DREAD_THREAD_STACK_MEASURE) {
+    for (max_used = total_used = 0, i = 0; i < nthreads; i++) {
+      total_used += th[i].stack_used;
+      if (th[i].stack_used > max_used) max_used = th[i].stack_used;
+    }
+    (void) dthr_get_stack_stats(&st);
+    fprintf(stderr,"stack use:  max %lu, mean %lu of %lu bytes;"
+            " %lu stacks, %lu bytes\n",
+            (unsigned long) max_used,
+            (unsigned long) (nthreads ? total_used / nthreads : 0),
+            (unsigned long) stacksize,
+            st.stacks_total,(unsigned long) st.bytes_total);
+  }
   return 0;
 }
@@ -0,0 +1,220 @@
+/*
+ * Channels:  a producer/filter/consumer pipeline over a buffered and an
+ * unbuffered channel, shut down by closing; a select over several
+ * channels; and the try forms.  Also built as test_chan_mt, with -C.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dreadthread.h"
+
+#define NPRODUCERS  20
+#define NFILTERS    5
+#define COUNT       1000
+#define STACKSIZE   (16 * 1024)
+
+int                   ncarriers = 1;
+int                   nproducers = NPRODUCERS;
+int                   nfilters = NFILTERS;
+int                   count = COUNT;
+
+struct dthr_channel   numbers, doubled, sel_a, sel_b, sel_quit;
+struct dthr_semaphore done_sema, filters_sema;
+int                   filters_left;
+long                  from_a, from_b;
+int                   errors = 0;
+
+void *producer(void *unused)
+{
+  int i;
+
+  for (i = 1; i <= count; i++)
+    if (!dthr_channel_send(&numbers,(void *) (uintptr_t) i)) {
+      fprintf(stderr,"producer:  channel closed early\n");
+      errors++;
+    }
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *filter(void *unused)
+{
+  void  *msg;
+
+  while (dthr_channel_recv(&numbers,&msg))
+    (void) dthr_channel_send(&doubled,(void *) (2 * (uintptr_t) msg));
+  dthr_semaphore_take(&filters_sema);
+  if (--filters_left == 0)
+    dthr_channel_close(&doubled);
+  dthr_semaphore_drop(&filters_sema);
+  return 0;
+}
+
+void *closer(void *unused)
+{
+  int i;
+
+  for (i = 0; i < nproducers; i++)
+    dthr_semaphore_take(&done_sema);
+  dthr_channel_close(&numbers);
+  return 0;
+}
+
+void *sel_sender(void *arg)
+{
+  struct dthr_channel *ch = (struct dthr_channel *) arg;
+  int                 i;
+
+  for (i = 0; i < count; i++)
+    (void) dthr_channel_send(ch,(void *) 1);
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *selector(void *unused)
+{
+  struct dthr_channel_op  ops[3];
+  int                     block = 1;
+
+  memset(ops,0,sizeof ops);
+  ops[0].channel = &sel_a;
+  ops[1].channel = &sel_b;
+  ops[2].channel = &sel_quit;
+  /* once told to quit, drain what is still buffered without waiting */
+  for (;;) {
+    switch (dthr_channel_select(ops,block ? 3 : 2,block)) {
+    case 0: from_a += (uintptr_t) ops[0].msg; break;
+    case 1: from_b += (uintptr_t) ops[1].msg; break;
+    case 2:
+      if (!ops[2].ok) block = 0;
+      break;
+    default:
+      if (block) {
+        fprintf(stderr,"selector:  blocking select returned -1\n");
+        errors++;
+      }
+      dthr_semaphore_drop(&done_sema);
+      return 0;
+    }
+  }
+}
+
+void expect(char *what, int got, int want)
+{
+  if (got != want) {
+    fprintf(stderr,"%s:  got %d, expected %d\n",what,got,want);
+    errors++;
+  }
+}
+
+struct dthr_thread    *producer_th, *filter_th, main_th, closer_th;
+struct dthr_thread    sel_th[3];
+
+void *goForIt(void *unused)
+{
+  struct dthr_channel small;
+  void                *msg;
+  long                sum, want;
+  int                 i;
+
+  dthr_semaphore_init(&done_sema,0);
+  dthr_semaphore_init(&filters_sema,1);
+  if (!dthr_channel_init(&numbers,4) || !dthr_channel_init(&doubled,0)
+      || !dthr_channel_init(&sel_a,0) || !dthr_channel_init(&sel_b,2)
+      || !dthr_channel_init(&sel_quit,0) || !dthr_channel_init(&small,1)) {
+    fprintf(stderr,"out of space for channels\n");
+    errors++;
+    return 0;
+  }
+
+  filters_left = nfilters;
+  for (i = 0; i < nfilters; i++) {
+    (void) dthr_thread_init(&filter_th[i],filter,(void *) 0,STACKSIZE);
+    (void) dthr_thread_detach(dthr_thread_run(&filter_th[i]));
+  }
+  for (i = 0; i < nproducers; i++) {
+    (void) dthr_thread_init(&producer_th[i],producer,(void *) 0,STACKSIZE);
+    (void) dthr_thread_detach(dthr_thread_run(&producer_th[i]));
+  }
+  (void) dthr_thread_init(&closer_th,closer,(void *) 0,STACKSIZE);
+  (void) dthr_thread_detach(dthr_thread_run(&closer_th));
+  for (sum = 0; dthr_channel_recv(&doubled,&msg); )
+    sum += (uintptr_t) msg;
+  want = (long) nproducers * count * (count + 1);
+  printf("pipeline:  sum %ld (expected %ld)\n",sum,want);
+  if (sum != want) errors++;
+
+  (void) dthr_thread_init(&sel_th[0],selector,(void *) 0,STACKSIZE);
+  (void) dthr_thread_init(&sel_th[1],sel_sender,(void *) &sel_a,STACKSIZE);
+  (void) dthr_thread_init(&sel_th[2],sel_sender,(void *) &sel_b,STACKSIZE);
+  for (i = 0; i < 3; i++)
+    (void) dthr_thread_detach(dthr_thread_run(&sel_th[i]));
+  dthr_semaphore_take(&done_sema);
+  dthr_semaphore_take(&done_sema);
+  dthr_channel_close(&sel_quit);
+  dthr_semaphore_take(&done_sema);
+  printf("select:  %ld from a, %ld from b (expected %d each)\n",
+         from_a,from_b,count);
+  if (from_a != count || from_b != count) errors++;
+
+  expect("try_recv of empty",dthr_channel_try_recv(&small,&msg),0);
+  expect("try_send to empty",dthr_channel_try_send(&small,(void *) 7),1);
+  expect("try_send to full",dthr_channel_try_send(&small,(void *) 8),0);
+  dthr_channel_close(&small);
+  expect("try_send to closed",dthr_channel_try_send(&small,(void *) 9),-1);
+  expect("try_recv of closed",dthr_channel_try_recv(&small,&msg),1);
+  expect("message left in closed",(int) (uintptr_t) msg,7);
+  expect("recv of drained",dthr_channel_recv(&small,&msg),0);
+
+  dthr_channel_destroy(&numbers);
+  dthr_channel_destroy(&doubled);
+  dthr_channel_destroy(&sel_a);
+  dthr_channel_destroy(&sel_b);
+  dthr_channel_destroy(&sel_quit);
+  dthr_channel_destroy(&small);
+  (void) dthr_thread_detach(dthr_cur_thread);
+  return 0;
+}
+
+extern int  getopt();
+extern char *optarg;
+
+char    *me;
+
+void usage()
+{
+  fprintf(stderr,"Usage: %s [-C carriers] [-c count]\n",me);
+}
+
+int main(int ac, char **av)
+{
+  int   opt;
+
+  if (!(me = strrchr(*av,'/'))) me = *av;
+  else ++me;
+
+  while ((opt = getopt(ac,av,"C:c:")) != EOF) switch (opt) {
+  case 'C': ncarriers = atoi(optarg); break;
+  case 'c': count = atoi(optarg);     break;
+  default:  usage(); exit(1);
+  }
+
+  producer_th = (struct dthr_thread *) malloc(nproducers * sizeof *producer_th);
+  filter_th = (struct dthr_thread *) malloc(nfilters * sizeof *filter_th);
+  if (!producer_th || !filter_th) {
+    perror(me);
+    fprintf(stderr,"%s:  insufficient space for thread descriptors\n", me);
+    exit(1);
+  }
+
+  dthr_init();
+  if (!dthr_set_carriers(ncarriers,0)) {
+    fprintf(stderr,"%s:  cannot use %d carriers\n",me,ncarriers);
+    exit(1);
+  }
+  (void) dthr_thread_init(&main_th,goForIt,(void *) 0,STACKSIZE);
+  dthr_thread_multithread(&main_th);
+  if (errors) fprintf(stderr,"%s:  %d errors\n",me,errors);
+  return errors != 0;
+}
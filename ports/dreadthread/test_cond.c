@@ -0,0 +1,292 @@
+/*
+ * Condition variables and reader-writer locks.  A broadcast made while
+ * holding the lock leaves every waiter queued on the lock rather than
+ * runnable, a signal with the lock free lets the waiter in, and a
+ * bounded queue built on them loses nothing.  Readers share a rwlock
+ * while writers have it alone, a waiting writer gets in past a stream of
+ * readers, and the try calls refuse what would block.  Also built as
+ * test_cond_mt, with -C carriers.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dreadthread.h"
+
+#define STACKSIZE (16 * 1024)
+#define NWAITERS  20
+#define NREADERS  10
+#define NWRITERS  3
+#define COUNT     1000
+#define QSIZE     4
+
+int                   ncarriers = 1;
+int                   count = COUNT;
+
+struct dthr_thread    main_th, waiter_th[NWAITERS], one_th,
+                      producer_th, consumer_th,
+                      reader_th[NREADERS], writer_th[NWRITERS],
+                      stream_th[NREADERS], late_th;
+struct dthr_semaphore lock, done_sema;
+struct dthr_cond      cond, not_empty, not_full;
+struct dthr_rwlock    rw;
+int                   go = 0, nwaiting = 0, nwoken = 0;
+int                   q[QSIZE], q_head = 0, q_n = 0;
+long                  sum = 0;
+volatile int          readers_in = 0, writers_in = 0, max_readers = 0;
+volatile int          overlaps = 0, late_done = 0, stream_after_late = 0;
+int                   errors = 0;
+
+void expect(char *what, long got, long want)
+{
+  if (got != want) {
+    fprintf(stderr,"%s:  got %ld, expected %ld\n",what,got,want);
+    errors++;
+  }
+}
+
+void *waiter(void *unused)
+{
+  dthr_semaphore_take(&lock);
+  nwaiting++;
+  while (!go)
+    dthr_cond_wait(&cond,&lock);
+  nwoken++;
+  dthr_semaphore_drop(&lock);
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *producer(void *unused)
+{
+  int i;
+
+  for (i = 1; i <= count; i++) {
+    dthr_semaphore_take(&lock);
+    while (q_n == QSIZE)
+      dthr_cond_wait(&not_full,&lock);
+    q[(q_head + q_n++) % QSIZE] = i;
+    dthr_cond_signal(&not_empty);
+    dthr_semaphore_drop(&lock);
+  }
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *consumer(void *unused)
+{
+  int i;
+
+  for (i = 1; i <= count; i++) {
+    dthr_semaphore_take(&lock);
+    while (q_n == 0)
+      dthr_cond_wait(&not_empty,&lock);
+    sum += q[q_head];
+    q_head = (q_head + 1) % QSIZE;
+    q_n--;
+    dthr_cond_signal(&not_full);
+    dthr_semaphore_drop(&lock);
+  }
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+static void note_reader(void)
+{
+  int n = __sync_add_and_fetch(&readers_in,1);
+
+  if (n > max_readers) max_readers = n;
+  if (writers_in) overlaps++;
+}
+
+void *reader(void *unused)
+{
+  int i, j;
+
+  for (i = 0; i < count / 10; i++) {
+    dthr_rwlock_rdlock(&rw);
+    note_reader();
+    for (j = 0; j < 3; j++)
+      dthr_thread_yield();
+    (void) __sync_sub_and_fetch(&readers_in,1);
+    dthr_rwlock_unlock(&rw);
+    dthr_thread_yield();
+  }
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *writer(void *unused)
+{
+  int i;
+
+  for (i = 0; i < count / 20; i++) {
+    dthr_rwlock_wrlock(&rw);
+    if (__sync_add_and_fetch(&writers_in,1) != 1 || readers_in) overlaps++;
+    dthr_thread_yield();
+    (void) __sync_sub_and_fetch(&writers_in,1);
+    dthr_rwlock_unlock(&rw);
+    dthr_thread_yield();
+  }
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+/* readers that keep the lock read-held between them */
+void *stream(void *unused)
+{
+  int i;
+
+  for (i = 0; i < count; i++) {
+    dthr_rwlock_rdlock(&rw);
+    if (late_done) stream_after_late++;
+    dthr_thread_yield();
+    dthr_rwlock_unlock(&rw);
+  }
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *late_writer(void *unused)
+{
+  dthr_rwlock_wrlock(&rw);
+  late_done = 1;
+  dthr_rwlock_unlock(&rw);
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+static void start(struct dthr_thread *t, void *(*fn)(void *))
+{
+  (void) dthr_thread_init(t,fn,(void *) 0,STACKSIZE);
+  (void) dthr_thread_detach(dthr_thread_run(t));
+}
+
+void *goForIt(void *unused)
+{
+  int   i, ready;
+
+  dthr_semaphore_init_lock(&lock);
+  dthr_semaphore_init(&done_sema,0);
+  dthr_cond_init(&cond);
+  dthr_cond_init(&not_empty);
+  dthr_cond_init(&not_full);
+  dthr_rwlock_init(&rw);
+
+  /* broadcast under the lock:  all of them move to the lock's queue */
+  for (i = 0; i < NWAITERS; i++)
+    start(&waiter_th[i],waiter);
+  do {
+    dthr_semaphore_take(&lock);
+    if (!(ready = nwaiting == NWAITERS))
+      dthr_semaphore_drop(&lock);
+  } while (!ready);
+  go = 1;
+  dthr_cond_broadcast(&cond);
+  for (i = 0; i < 10; i++)
+    dthr_thread_yield();
+  printf("broadcast:  %d queued on the lock, %d through while it was held\n",
+         dthr_semaphore_waiters(&lock),nwoken);
+  expect("queued on the lock",dthr_semaphore_waiters(&lock),NWAITERS);
+  expect("through the held lock",nwoken,0);
+  dthr_semaphore_drop(&lock);
+  for (i = 0; i < NWAITERS; i++)
+    dthr_semaphore_take(&done_sema);
+  expect("woken",nwoken,NWAITERS);
+
+  /* signalled with the lock free */
+  go = 0;
+  nwaiting = 0;
+  start(&one_th,waiter);
+  do {
+    dthr_semaphore_take(&lock);
+    ready = nwaiting == 1;
+    dthr_semaphore_drop(&lock);
+  } while (!ready);
+  go = 1;
+  dthr_cond_signal(&cond);
+  dthr_semaphore_take(&done_sema);
+  expect("signalled",nwoken,NWAITERS + 1);
+
+  start(&consumer_th,consumer);
+  start(&producer_th,producer);
+  for (i = 0; i < 2; i++)
+    dthr_semaphore_take(&done_sema);
+  printf("queue:  sum %ld (expected %ld)\n",sum,(long) count * (count + 1) / 2);
+  expect("queue sum",sum,(long) count * (count + 1) / 2);
+
+  for (i = 0; i < NREADERS; i++)
+    start(&reader_th[i],reader);
+  for (i = 0; i < NWRITERS; i++)
+    start(&writer_th[i],writer);
+  for (i = 0; i < NREADERS + NWRITERS; i++)
+    dthr_semaphore_take(&done_sema);
+  printf("rwlock:  up to %d readers at once, %d overlaps\n",max_readers,
+         overlaps);
+  expect("overlaps",overlaps,0);
+  if (max_readers < 2) {
+    fprintf(stderr,"readers never shared the lock\n");
+    errors++;
+  }
+
+  dthr_rwlock_rdlock(&rw);
+  expect("trywrlock while read",dthr_rwlock_trywrlock(&rw),0);
+  expect("tryrdlock while read",dthr_rwlock_tryrdlock(&rw),1);
+  dthr_rwlock_unlock(&rw);
+  dthr_rwlock_unlock(&rw);
+  expect("trywrlock while free",dthr_rwlock_trywrlock(&rw),1);
+  expect("tryrdlock while written",dthr_rwlock_tryrdlock(&rw),0);
+  dthr_rwlock_unlock(&rw);
+
+  /* a writer arriving in a stream of readers is not starved */
+  for (i = 0; i < NREADERS; i++)
+    start(&stream_th[i],stream);
+  for (i = 0; i < 20; i++)
+    dthr_thread_yield();
+  start(&late_th,late_writer);
+  for (i = 0; i < NREADERS + 1; i++)
+    dthr_semaphore_take(&done_sema);
+  printf("writer in a stream of readers:  %d reads after it\n",
+         stream_after_late);
+  if (!stream_after_late) {
+    fprintf(stderr,"writer waited for the stream of readers to end\n");
+    errors++;
+  }
+
+  (void) dthr_thread_detach(dthr_cur_thread);
+  return 0;
+}
+
+extern int  getopt();
+extern char *optarg;
+
+char    *me;
+
+void usage()
+{
+  fprintf(stderr,"Usage: %s [-C carriers] [-c count]\n",me);
+}
+
+int main(int ac, char **av)
+{
+  int   opt;
+
+  if (!(me = strrchr(*av,'/'))) me = *av;
+  else ++me;
+
+  while ((opt = getopt(ac,av,"C:c:")) != EOF) switch (opt) {
+  case 'C': ncarriers = atoi(optarg); break;
+  case 'c': count = atoi(optarg);     break;
+  default:  usage(); exit(1);
+  }
+
+  dthr_init();
+  if (!dthr_set_carriers(ncarriers,0)) {
+    fprintf(stderr,"%s:  cannot use %d carriers\n",me,ncarriers);
+    exit(1);
+  }
+  (void) dthr_thread_init(&main_th,goForIt,(void *) 0,STACKSIZE);
+  dthr_thread_multithread(&main_th);
+  if (errors) fprintf(stderr,"%s:  %d errors\n",me,errors);
+  return errors != 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * Descriptor I/O:  clients and echo servers talk over loopback TCP, all
+ * in one process, while one more thread does nothing but yield, so that
+ * the I/O only gets done if the scheduler polls without waiting for the
+ * run queue to drain.  Also built as test_io_mt, with -C carriers.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "dreadthread.h"
+
+#define NCONNS    200
+#define NCONNS_CARVED 50  /* 2 * NCONNS threads don't fit in 8 MB of stack */
+#define COUNT     20
+#define STACKSIZE (16 * 1024)
+
+int                   ncarriers = 1;
+int                   nconns = 0;
+int                   count = COUNT;
+int                   spin = 1;
+
+int                   listen_fd;
+struct sockaddr_in    server_addr;
+struct dthr_thread    *client_th, *server_th, acceptor_th, spinner_th;
+int                   *server_fd;
+struct dthr_semaphore done_sema;
+volatile int          clients_done = 0;
+long                  bytes = 0;
+int                   errors = 0;
+
+/* whole buffers, as a short read or write may return part */
+int xfer(int fd, char *buf, int n, int writing)
+{
+  int got, rv;
+
+  for (got = 0; got < n; got += rv) {
+    rv = writing ? dthr_write(fd,buf + got,n - got)
+        : dthr_read(fd,buf + got,n - got);
+    if (rv <= 0) return got;
+  }
+  return got;
+}
+
+void *server(void *arg)
+{
+  int   fd = server_fd[(uintptr_t) arg];
+  char  buf[256];
+  int   n;
+
+  while ((n = dthr_read(fd,buf,sizeof buf)) > 0)
+    if (xfer(fd,buf,n,1) != n) break;
+  (void) close(fd);
+  return 0;
+}
+
+void *acceptor(void *unused)
+{
+  int i;
+
+  for (i = 0; i < nconns; i++) {
+    if ((server_fd[i] = dthr_accept(listen_fd,0,0)) < 0) {
+      perror("dthr_accept");
+      errors++;
+      break;
+    }
+    (void) dthr_thread_init(&server_th[i],server,(void *) (uintptr_t) i,
+                            STACKSIZE);
+    (void) dthr_thread_detach(dthr_thread_run(&server_th[i]));
+  }
+  return 0;
+}
+
+void *client(void *arg)
+{
+  int   id = (uintptr_t) arg;
+  int   fd, i, n;
+  char  out[64], in[64];
+
+  if ((fd = socket(AF_INET,SOCK_STREAM,0)) < 0
+      || dthr_connect(fd,(struct sockaddr *) &server_addr,
+                      sizeof server_addr) < 0) {
+    perror("client");
+    errors++;
+  } else {
+    for (i = 0; i < count; i++) {
+      n = sprintf(out,"client %d message %d",id,i);
+      if (xfer(fd,out,n,1) != n || xfer(fd,in,n,0) != n
+          || memcmp(in,out,n)) {
+        fprintf(stderr,"client %d:  bad echo of message %d\n",id,i);
+        errors++;
+        break;
+      }
+      (void) __sync_fetch_and_add(&bytes,2 * n);
+    }
+  }
+  if (fd >= 0) (void) close(fd);
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *spinner(void *unused)
+{
+  unsigned long yields = 0;
+
+  while (!clients_done) {
+    dthr_thread_yield();
+    yields++;
+  }
+  printf("spinner yielded %lu times\n",yields);
+  return 0;
+}
+
+struct dthr_thread    main_th;
+
+void *goForIt(void *unused)
+{
+  unsigned long long  start;
+  socklen_t           len = sizeof server_addr;
+  int                 i;
+
+  dthr_semaphore_init(&done_sema,0);
+  memset(&server_addr,0,sizeof server_addr);
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((listen_fd = socket(AF_INET,SOCK_STREAM,0)) < 0
+      || bind(listen_fd,(struct sockaddr *) &server_addr,sizeof server_addr)
+      || listen(listen_fd,nconns)
+      || getsockname(listen_fd,(struct sockaddr *) &server_addr,&len)) {
+    perror("listen");
+    errors++;
+    return 0;
+  }
+
+  start = dthr_time_now();
+  if (spin) {
+    (void) dthr_thread_init(&spinner_th,spinner,(void *) 0,STACKSIZE);
+    (void) dthr_thread_detach(dthr_thread_run(&spinner_th));
+  }
+  (void) dthr_thread_init(&acceptor_th,acceptor,(void *) 0,STACKSIZE);
+  (void) dthr_thread_detach(dthr_thread_run(&acceptor_th));
+  for (i = 0; i < nconns; i++) {
+    (void) dthr_thread_init(&client_th[i],client,(void *) (uintptr_t) i,
+                            STACKSIZE);
+    (void) dthr_thread_detach(dthr_thread_run(&client_th[i]));
+  }
+  for (i = 0; i < nconns; i++)
+    dthr_semaphore_take(&done_sema);
+  clients_done = 1;
+  printf("%d connections, %ld bytes echoed in %llu usec\n",
+         nconns,bytes,dthr_time_now() - start);
+  (void) close(listen_fd);
+  (void) dthr_thread_detach(dthr_cur_thread);
+  return 0;
+}
+
+extern int  getopt();
+extern char *optarg;
+
+char    *me;
+
+void usage()
+{
+  fprintf(stderr,"Usage: %s [-n] [-C carriers] [-c count] [-t nconns]\n",me);
+}
+
+int main(int ac, char **av)
+{
+  int   opt;
+
+  if (!(me = strrchr(*av,'/'))) me = *av;
+  else ++me;
+
+  while ((opt = getopt(ac,av,"C:c:nt:")) != EOF) switch (opt) {
+  case 'C': ncarriers = atoi(optarg); break;
+  case 'c': count = atoi(optarg);     break;
+  case 'n': spin = 0;                 break;
+  case 't': nconns = atoi(optarg);    break;
+  default:  usage(); exit(1);
+  }
+
+  dthr_init();
+  /* mapped stacks, so that many threads need not fit in the C stack */
+  if (dthr_set_stack_mode(DREAD_THREAD_STACK_MAPPED)) {
+    if (!nconns) nconns = NCONNS;
+  } else if (!nconns) nconns = NCONNS_CARVED;
+
+  client_th = (struct dthr_thread *) malloc(nconns * sizeof *client_th);
+  server_th = (struct dthr_thread *) malloc(nconns * sizeof *server_th);
+  server_fd = (int *) malloc(nconns * sizeof *server_fd);
+  if (!client_th || !server_th || !server_fd) {
+    perror(me);
+    fprintf(stderr,"%s:  insufficient space for thread descriptors\n", me);
+    exit(1);
+  }
+
+  if (!dthr_set_carriers(ncarriers,0)) {
+    fprintf(stderr,"%s:  cannot use %d carriers\n",me,ncarriers);
+    exit(1);
+  }
+  (void) dthr_thread_init(&main_th,goForIt,(void *) 0,STACKSIZE);
+  dthr_thread_multithread(&main_th);
+  if (errors) fprintf(stderr,"%s:  %d errors\n",me,errors);
+  return errors != 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * Multi-carrier test:  threads contend on a semaphore and yield while
+ * spread over several carriers, and must neither lose updates nor
+ * deadlock.  Build against libdreadthread_mt.a with DREAD_THREAD_MULTI=1.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dreadthread.h"
+
+#define NCARRIERS 4
+#define NTHREADS  200
+#define STACKSIZE (16 * 1024)
+#define COUNT     1000
+#define WORK      2000
+
+int                   ncarriers = NCARRIERS;
+int                   nthreads = NTHREADS;
+int                   stacksize = STACKSIZE;
+int                   count = COUNT;
+int                   work = WORK;
+int                   stack_mode = 0;
+
+struct dthr_semaphore count_sema, done_sema, go_sema;
+struct dthr_event     go_ev;
+int                   all_go = 0;
+long                  total = 0;
+unsigned long         carriers_used = 0;
+long                  migrations = 0;
+
+void *myThread(void *arg)
+{
+  volatile double v = 1.0;
+  int             i, j, carrier, last_carrier;
+
+  dthr_semaphore_take(&go_sema);
+  while (!all_go)
+    dthr_event_wait(&go_ev,&go_sema);
+  dthr_semaphore_drop(&go_sema);
+
+  last_carrier = dthr_carrier_id();
+  for (i = 0; i < count; i++) {
+    for (j = 0; j < work; j++)
+      v = v * 1.0000001;
+    carrier = dthr_carrier_id();
+    dthr_semaphore_take(&count_sema);
+    total++;
+    carriers_used |= 1ul << carrier;
+    if (carrier != last_carrier) migrations++;
+    dthr_semaphore_drop(&count_sema);
+    last_carrier = carrier;
+    dthr_thread_yield();
+  }
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+struct dthr_thread  *th, main_th;
+int                 status = 1;
+
+void *goForIt(void *unused)
+{
+  int i, used;
+
+  dthr_semaphore_init(&count_sema,1);
+  dthr_semaphore_init(&done_sema,0);
+  dthr_semaphore_init(&go_sema,1);
+  dthr_event_init(&go_ev);
+  for (i = 0; i < nthreads; i++)
+    (void) dthr_thread_detach(dthr_thread_run(&th[i]));
+  dthr_semaphore_take(&go_sema);
+  all_go = 1;
+  dthr_semaphore_drop(&go_sema);
+  dthr_event_broadcast(&go_ev);
+
+  for (i = 0; i < nthreads; i++)
+    dthr_semaphore_take(&done_sema);
+
+  for (used = 0, i = 0; i < ncarriers; i++)
+    if (carriers_used & (1ul << i)) used++;
+  printf("total %ld (expected %ld), %d of %d carriers used,"
+         " %ld migrations\n",
+         total,(long) nthreads * count,used,ncarriers,migrations);
+  status = total != (long) nthreads * count;
+  (void) dthr_thread_detach(dthr_cur_thread);
+  return 0;
+}
+
+extern int  getopt();
+extern char *optarg;
+
+char    *me;
+
+void usage()
+{
+  fprintf(stderr,
+          "Usage: %s [-m] [-C carriers] [-s stackbytes] [-c count]"
+          " [-t nthreads] [-w work]\n",
+          me);
+}
+
+int main(int ac, char **av)
+{
+  int   opt;
+  int   i;
+
+  if (!(me = strrchr(*av,'/'))) me = *av;
+  else ++me;
+
+  while ((opt = getopt(ac,av,"C:c:ms:t:w:")) != EOF) switch (opt) {
+  case 'C': ncarriers = atoi(optarg); break;
+  case 'c': count = atoi(optarg);     break;
+  case 'm': stack_mode = DREAD_THREAD_STACK_MAPPED; break;
+  case 's': stacksize = atoi(optarg); break;
+  case 't': nthreads = atoi(optarg);  break;
+  case 'w': work = atoi(optarg);      break;
+  default:  usage(); exit(1);
+  }
+
+  th = (struct dthr_thread *) malloc(nthreads * sizeof *th);
+  if (!th) {
+    perror(me);
+    fprintf(stderr,"%s:  insufficient space for thread descriptors\n", me);
+    exit(1);
+  }
+
+  dthr_init();
+  if (!dthr_set_stack_mode(stack_mode)) {
+    fprintf(stderr,"%s:  mapped stacks not supported\n",me);
+    exit(1);
+  }
+  if (!dthr_set_carriers(ncarriers,0)) {
+    fprintf(stderr,"%s:  cannot use %d carriers\n",me,ncarriers);
+    exit(1);
+  }
+  for (i = 0; i < nthreads; i++)
+    (void) dthr_thread_init(&th[i],myThread,(void *) (uintptr_t) i,
+                            stacksize);
+  (void) dthr_thread_init(&main_th,goForIt,(void *) 0,stacksize);
+  dthr_thread_multithread(&main_th);
+  return status;
+}
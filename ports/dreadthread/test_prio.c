@@ -0,0 +1,323 @@
+/*
+ * Priorities:  threads woken together must run most urgent first, a
+ * low priority thread holding a lock a high priority one waits for must
+ * run ahead of a busy middle priority thread, one that took a semaphore
+ * that is not a lock must not be lent anything, and with time slices set
+ * a thread starved by a busy higher priority one must still get to run,
+ * within a few slices.  Also built as test_prio_mt, with -C carriers;
+ * with more than one carrier only the latter two are checked, and less
+ * strictly.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dreadthread.h"
+
+#define STACKSIZE (16 * 1024)
+#define SLICE     1000      /* usec */
+#define BUSY      30000     /* usec the high priority thread spins */
+#define YIELDS    2000      /* by the middle priority thread */
+
+int                   ncarriers = 1;
+unsigned long         slice = SLICE;
+
+struct dthr_thread    main_th, worker_th[DREAD_THREAD_PRIO_LEVELS - 1],
+                      low_th, mid_th, high_th, starved_th, busy_th,
+                      nested_th, waiter_th, taker_th, signalled_th;
+struct dthr_semaphore go_sema, ready_sema, done_sema, lock, locked_sema,
+                      lock2, signal_sema;
+struct dthr_event     go_ev;
+int                   all_go = 0;
+int                   nrun = 0;
+int                   run_order[DREAD_THREAD_PRIO_LEVELS - 1];
+volatile int          mid_done, high_done;
+int                   mid_done_at_take, low_max_prio, low_prio_after;
+int                   nested_prio_between = -1, nested_prio_after = -1;
+int                   taker_max_prio = -1;
+unsigned long long    busy_start, low_first_run;
+int                   low_runs_during;
+int                   errors = 0;
+
+void *worker(void *arg)
+{
+  dthr_semaphore_take(&go_sema);
+  dthr_semaphore_drop_no_yield(&ready_sema);
+  while (!all_go)
+    dthr_event_wait(&go_ev,&go_sema);
+  dthr_semaphore_drop(&go_sema);
+  run_order[__sync_fetch_and_add(&nrun,1)] = (int) (uintptr_t) arg;
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *low(void *unused)
+{
+  int i;
+
+  dthr_semaphore_take(&lock);
+  dthr_semaphore_drop(&locked_sema);
+  for (i = 0; i < 20; i++) {
+    if (dthr_cur_thread->eff_prio > low_max_prio)
+      low_max_prio = dthr_cur_thread->eff_prio;
+    dthr_thread_yield();
+  }
+  dthr_semaphore_drop_no_yield(&lock);
+  low_prio_after = dthr_cur_thread->eff_prio;
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+/* holds lock and lock2, and drops lock2 while high waits for lock */
+void *nested(void *unused)
+{
+  int i;
+
+  dthr_semaphore_take(&lock);
+  dthr_semaphore_take(&lock2);
+  dthr_semaphore_drop(&locked_sema);
+  for (i = 0; i < 1000 && dthr_cur_thread->eff_prio != 6; i++)
+    dthr_thread_yield();
+  dthr_semaphore_drop_no_yield(&lock2);
+  nested_prio_between = dthr_cur_thread->eff_prio;
+  dthr_semaphore_drop_no_yield(&lock);
+  nested_prio_after = dthr_cur_thread->eff_prio;
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+/* takes signal_sema, which main rather than it will drop */
+void *taker(void *unused)
+{
+  int i;
+
+  dthr_semaphore_take(&signal_sema);
+  dthr_semaphore_drop(&locked_sema);
+  for (i = 0; i < 1000 && !dthr_semaphore_waiters(&signal_sema); i++)
+    dthr_thread_yield();
+  for (i = 0; i < 20; i++) {
+    if (dthr_cur_thread->eff_prio > taker_max_prio)
+      taker_max_prio = dthr_cur_thread->eff_prio;
+    dthr_thread_yield();
+  }
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *signalled(void *unused)
+{
+  dthr_semaphore_take(&signal_sema);
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *mid(void *unused)
+{
+  int i;
+
+  for (i = 0; i < YIELDS; i++)
+    dthr_thread_yield();
+  mid_done = 1;
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *high(void *unused)
+{
+  dthr_semaphore_take(&lock);
+  mid_done_at_take = mid_done;
+  dthr_semaphore_drop(&lock);
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *starved(void *unused)
+{
+  while (!high_done) {
+    if (busy_start) {
+      if (!low_first_run) low_first_run = dthr_time_now();
+      low_runs_during++;
+    }
+    dthr_thread_yield();
+  }
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *busy(void *unused)
+{
+  busy_start = dthr_time_now();
+  while (dthr_time_now() - busy_start < BUSY)
+    dthr_thread_yield();
+  high_done = 1;
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+static void start(struct dthr_thread *th, void *(*fn)(void *), void *arg,
+                  int prio)
+{
+  (void) dthr_thread_init(th,fn,arg,STACKSIZE);
+  if (!dthr_thread_set_priority(th,prio)) {
+    fprintf(stderr,"set_priority(%d) refused\n",prio);
+    errors++;
+  }
+  (void) dthr_thread_detach(dthr_thread_run(th));
+}
+
+void *goForIt(void *unused)
+{
+  struct dthr_sched_latency lat;
+  int                       i, prio, nworkers = DREAD_THREAD_PRIO_LEVELS - 1;
+
+  dthr_semaphore_init(&go_sema,1);
+  dthr_semaphore_init(&ready_sema,0);
+  dthr_semaphore_init(&done_sema,0);
+  dthr_semaphore_init_lock(&lock);
+  dthr_semaphore_init(&locked_sema,0);
+  dthr_semaphore_init_lock(&lock2);
+  dthr_semaphore_init(&signal_sema,1);
+  dthr_event_init(&go_ev);
+
+  if (dthr_thread_set_priority(&main_th,DREAD_THREAD_PRIO_LEVELS)
+      || dthr_thread_set_priority(&main_th,-1)) {
+    fprintf(stderr,"out of range priority accepted\n");
+    errors++;
+  }
+
+  /* every level below main's, started in a scrambled order */
+  for (i = 0; i < nworkers; i++) {
+    prio = (i * 3) % nworkers;
+    start(&worker_th[i],worker,(void *) (uintptr_t) prio,prio);
+  }
+  for (i = 0; i < nworkers; i++)
+    dthr_semaphore_take(&ready_sema);
+  dthr_semaphore_take(&go_sema);
+  all_go = 1;
+  dthr_event_broadcast_no_yield(&go_ev);
+  dthr_semaphore_drop_no_yield(&go_sema);
+  for (i = 0; i < nworkers; i++)
+    dthr_semaphore_take(&done_sema);
+  for (i = 0; ncarriers == 1 && i < nworkers; i++) {
+    if (run_order[i] != nworkers - 1 - i) {
+      fprintf(stderr,"woken workers ran out of priority order:  %d at %d\n",
+              run_order[i],i);
+      errors++;
+      break;
+    }
+  }
+
+  /* low takes the lock; high waits for it while mid keeps busy */
+  start(&low_th,low,0,1);
+  dthr_semaphore_take(&locked_sema);
+  start(&high_th,high,0,6);
+  start(&mid_th,mid,0,4);
+  for (i = 0; i < 3; i++)
+    dthr_semaphore_take(&done_sema);
+  printf("inheritance:  low ran at up to %d, then %d; mid %s when high"
+         " got the lock\n",low_max_prio,low_prio_after,
+         mid_done_at_take ? "was done" : "was not done");
+  if (ncarriers == 1 && (mid_done_at_take || low_max_prio != 6)) {
+    fprintf(stderr,"lock holder did not inherit the waiter's priority\n");
+    errors++;
+  }
+  if (low_prio_after != 1) {
+    fprintf(stderr,"lock holder kept priority %d after dropping the lock\n",
+            low_prio_after);
+    errors++;
+  }
+
+  /* dropping another lock keeps what was lent through the first */
+  start(&nested_th,nested,0,1);
+  dthr_semaphore_take(&locked_sema);
+  start(&waiter_th,high,0,6);
+  for (i = 0; i < 2; i++)
+    dthr_semaphore_take(&done_sema);
+  printf("nested locks:  holder at %d after dropping the other lock,"
+         " %d after dropping the one waited for\n",nested_prio_between,
+         nested_prio_after);
+  if (nested_prio_between != 6 || nested_prio_after != 1) {
+    fprintf(stderr,"dropping one lock lost the priority lent through"
+            " another\n");
+    errors++;
+  }
+
+  /* a semaphore that is not a lock lends its taker nothing */
+  start(&taker_th,taker,0,1);
+  dthr_semaphore_take(&locked_sema);
+  start(&signalled_th,signalled,0,6);
+  dthr_semaphore_take(&done_sema);
+  dthr_semaphore_drop(&signal_sema);
+  dthr_semaphore_take(&done_sema);
+  printf("signal semaphore:  taker ran at up to %d while waited on\n",
+         taker_max_prio);
+  if (taker_max_prio != 1) {
+    fprintf(stderr,"semaphore that is not a lock lent its taker"
+            " priority %d\n",taker_max_prio);
+    errors++;
+  }
+
+  /* busy never blocks, and outranks starved */
+  dthr_set_timeslice(slice);
+  start(&starved_th,starved,0,1);
+  start(&busy_th,busy,0,6);
+  for (i = 0; i < 2; i++)
+    dthr_semaphore_take(&done_sema);
+  dthr_set_timeslice(0);
+  (void) dthr_get_sched_latency(1,&lat);
+  printf("time slices:  starved thread ran %d times in %d usec, first"
+         " after %lld usec; level 1 max wait %llu usec, %lu starved\n",
+         low_runs_during,BUSY,
+         low_first_run ? (long long) (low_first_run - busy_start) : -1ll,
+         lat.max_wait_usec,lat.starved);
+  if (!low_runs_during) {
+    fprintf(stderr,"starved thread never ran while the busy one did\n");
+    errors++;
+  }
+  if (ncarriers == 1 && !lat.starved) {
+    fprintf(stderr,"no starved dispatches recorded\n");
+    errors++;
+  }
+  if (dthr_get_sched_latency(DREAD_THREAD_PRIO_LEVELS,&lat)) {
+    fprintf(stderr,"latency of out of range level returned\n");
+    errors++;
+  }
+
+  (void) dthr_thread_detach(dthr_cur_thread);
+  return 0;
+}
+
+extern int  getopt();
+extern char *optarg;
+
+char    *me;
+
+void usage()
+{
+  fprintf(stderr,"Usage: %s [-C carriers] [-s slice usec]\n",me);
+}
+
+int main(int ac, char **av)
+{
+  int   opt;
+
+  if (!(me = strrchr(*av,'/'))) me = *av;
+  else ++me;
+
+  while ((opt = getopt(ac,av,"C:s:")) != EOF) switch (opt) {
+  case 'C': ncarriers = atoi(optarg); break;
+  case 's': slice = atol(optarg);     break;
+  default:  usage(); exit(1);
+  }
+
+  dthr_init();
+  if (!dthr_set_carriers(ncarriers,0)) {
+    fprintf(stderr,"%s:  cannot use %d carriers\n",me,ncarriers);
+    exit(1);
+  }
+  (void) dthr_thread_init(&main_th,goForIt,(void *) 0,STACKSIZE);
+  (void) dthr_thread_set_priority(&main_th,DREAD_THREAD_PRIO_LEVELS - 1);
+  dthr_thread_multithread(&main_th);
+  if (errors) fprintf(stderr,"%s:  %d errors\n",me,errors);
+  return errors != 0;
+}
@@ -0,0 +1,263 @@
+/*
+ * pthread shim:  a program written to pthreads, relinked onto dreadthread
+ * threads.  Joins collect return values, a mutex keeps count under
+ * contention, a condition variable runs a bounded queue, detached
+ * threads clean up after themselves, once runs once, key destructors run
+ * at exit, and recursive, error-checking and timed operations behave.
+ * Also built as test_pthread_mt, with -C carriers.
+ */
+#define DREAD_THREAD_PTHREAD_NAMES
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "dreadthread_pthread.h"
+
+#define NTHREADS  500
+#define COUNT     100
+#define QSIZE     4
+
+int               ncarriers = 1;
+int               nthreads = NTHREADS;
+int               count = COUNT;
+
+pthread_mutex_t   count_lock = PTHREAD_MUTEX_INITIALIZER;
+long              total = 0;
+
+pthread_mutex_t   q_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t    q_not_empty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t    q_not_full = PTHREAD_COND_INITIALIZER;
+int               q[QSIZE], q_head = 0, q_n = 0;
+
+pthread_mutex_t   done_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t    done_cond = PTHREAD_COND_INITIALIZER;
+int               ndone = 0;
+
+pthread_once_t    once = PTHREAD_ONCE_INIT;
+int               once_runs = 0;
+
+pthread_key_t     key;
+int               destructor_runs = 0;
+
+int               errors = 0;
+
+void expect(char *what, long got, long want)
+{
+  if (got != want) {
+    fprintf(stderr,"%s:  got %ld, expected %ld\n",what,got,want);
+    errors++;
+  }
+}
+
+void once_fn(void)
+{
+  once_runs++;
+  sched_yield();
+}
+
+void destructor(void *value)
+{
+  pthread_mutex_lock(&count_lock);
+  destructor_runs++;
+  pthread_mutex_unlock(&count_lock);
+  free(value);
+}
+
+void *counter(void *arg)
+{
+  int i;
+
+  pthread_once(&once,once_fn);
+  pthread_setspecific(key,malloc(16));
+  for (i = 0; i < count; i++) {
+    pthread_mutex_lock(&count_lock);
+    total++;
+    pthread_mutex_unlock(&count_lock);
+    if (i % 10 == 0) sched_yield();
+  }
+  if (!pthread_getspecific(key)) errors++;
+  return (void *) (2 * (uintptr_t) arg);
+}
+
+void *producer(void *unused)
+{
+  int i;
+
+  for (i = 1; i <= count * 10; i++) {
+    pthread_mutex_lock(&q_lock);
+    while (q_n == QSIZE)
+      pthread_cond_wait(&q_not_full,&q_lock);
+    q[(q_head + q_n++) % QSIZE] = i;
+    pthread_cond_signal(&q_not_empty);
+    pthread_mutex_unlock(&q_lock);
+  }
+  return 0;
+}
+
+void *consumer(void *unused)
+{
+  long  sum = 0;
+  int   i;
+
+  for (i = 1; i <= count * 10; i++) {
+    pthread_mutex_lock(&q_lock);
+    while (q_n == 0)
+      pthread_cond_wait(&q_not_empty,&q_lock);
+    sum += q[q_head];
+    q_head = (q_head + 1) % QSIZE;
+    q_n--;
+    pthread_cond_signal(&q_not_full);
+    pthread_mutex_unlock(&q_lock);
+  }
+  return (void *) sum;
+}
+
+void *detached(void *unused)
+{
+  sched_yield();
+  pthread_mutex_lock(&done_lock);
+  ndone++;
+  pthread_cond_broadcast(&done_cond);
+  pthread_mutex_unlock(&done_lock);
+  if (ndone % 2) pthread_exit(0);
+  return 0;
+}
+
+void *quick(void *arg)
+{
+  return arg;
+}
+
+void *try_other(void *arg)
+{
+  return (void *) (uintptr_t) pthread_mutex_trylock((pthread_mutex_t *) arg);
+}
+
+int test_main(int ac, char **av)
+{
+  pthread_t           *th, t;
+  pthread_attr_t      attr;
+  pthread_mutex_t     rec;
+  pthread_mutexattr_t mattr;
+  pthread_cond_t      never;
+  struct timeval      tv;
+  struct timespec     abstime;
+  void                *rv;
+  long                want;
+  int                 i;
+
+  if (!(th = (pthread_t *) malloc(nthreads * sizeof *th))) {
+    perror("test_pthread");
+    return 1;
+  }
+  expect("key_create",pthread_key_create(&key,destructor),0);
+
+  for (i = 0; i < nthreads; i++)
+    expect("create",pthread_create(&th[i],0,counter,(void *) (uintptr_t) i),0);
+  for (i = 0; i < nthreads; i++) {
+    expect("join",pthread_join(th[i],&rv),0);
+    expect("joined value",(uintptr_t) rv,2 * i);
+  }
+  printf("counters:  total %ld (expected %ld)\n",total,(long) nthreads * count);
+  expect("total",total,(long) nthreads * count);
+  expect("once runs",once_runs,1);
+  expect("destructor runs",destructor_runs,nthreads);
+
+  expect("create producer",pthread_create(&th[0],0,producer,0),0);
+  expect("create consumer",pthread_create(&th[1],0,consumer,0),0);
+  expect("join producer",pthread_join(th[0],0),0);
+  expect("join consumer",pthread_join(th[1],&rv),0);
+  want = (long) count * 10 * (count * 10 + 1) / 2;
+  printf("queue:  sum %ld (expected %ld)\n",(long) rv,want);
+  expect("queue sum",(long) rv,want);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attr,32 * 1024);
+  for (i = 0; i < nthreads; i++)
+    expect("create detached",pthread_create(&t,&attr,detached,0),0);
+  pthread_attr_destroy(&attr);
+  pthread_mutex_lock(&done_lock);
+  while (ndone < nthreads)
+    pthread_cond_wait(&done_cond,&done_lock);
+  pthread_mutex_unlock(&done_lock);
+  /* detached after it has exited */
+  expect("create",pthread_create(&t,0,quick,0),0);
+  for (i = 0; i < 10; i++)
+    sched_yield();
+  expect("detach",pthread_detach(t),0);
+
+  pthread_mutexattr_init(&mattr);
+  pthread_mutexattr_settype(&mattr,PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&rec,&mattr);
+  expect("recursive lock",pthread_mutex_lock(&rec),0);
+  expect("recursive relock",pthread_mutex_lock(&rec),0);
+  expect("recursive unlock",pthread_mutex_unlock(&rec),0);
+  pthread_create(&t,0,try_other,&rec);
+  pthread_join(t,&rv);
+  expect("trylock of held",(uintptr_t) rv,EBUSY);
+  expect("recursive last unlock",pthread_mutex_unlock(&rec),0);
+  expect("unlock of unheld",pthread_mutex_unlock(&rec),EPERM);
+  pthread_create(&t,0,try_other,&rec);
+  pthread_join(t,&rv);
+  expect("trylock of free",(uintptr_t) rv,0);
+  pthread_mutex_destroy(&rec);
+  pthread_mutexattr_settype(&mattr,PTHREAD_MUTEX_ERRORCHECK);
+  pthread_mutex_init(&rec,&mattr);
+  pthread_mutex_lock(&rec);
+  expect("errorcheck relock",pthread_mutex_lock(&rec),EDEADLK);
+  pthread_mutex_unlock(&rec);
+  pthread_mutex_destroy(&rec);
+  pthread_mutexattr_destroy(&mattr);
+
+  pthread_cond_init(&never,0);
+  gettimeofday(&tv,0);
+  abstime.tv_sec = tv.tv_sec;
+  abstime.tv_nsec = (tv.tv_usec + 20000) * 1000;
+  if (abstime.tv_nsec >= 1000000000) {
+    abstime.tv_sec++;
+    abstime.tv_nsec -= 1000000000;
+  }
+  pthread_mutex_lock(&count_lock);
+  expect("timedwait",pthread_cond_timedwait(&never,&count_lock,&abstime),
+         ETIMEDOUT);
+  pthread_mutex_unlock(&count_lock);
+  pthread_cond_destroy(&never);
+  expect("join self",pthread_join(pthread_self(),0),EDEADLK);
+
+  if (errors) fprintf(stderr,"test_pthread:  %d errors\n",errors);
+  return errors != 0;
+}
+
+extern int  getopt();
+extern char *optarg;
+
+char    *me;
+
+void usage()
+{
+  fprintf(stderr,"Usage: %s [-C carriers] [-c count] [-t nthreads]\n",me);
+}
+
+int main(int ac, char **av)
+{
+  int   opt;
+
+  if (!(me = strrchr(*av,'/'))) me = *av;
+  else ++me;
+
+  while ((opt = getopt(ac,av,"C:c:t:")) != EOF) switch (opt) {
+  case 'C': ncarriers = atoi(optarg); break;
+  case 'c': count = atoi(optarg);     break;
+  case 't': nthreads = atoi(optarg);  break;
+  default:  usage(); exit(1);
+  }
+
+  if (dthr_pthread_main(test_main,ac,av,ncarriers) < 0) {
+    fprintf(stderr,"%s:  cannot use %d carriers\n",me,ncarriers);
+    exit(1);
+  }
+  /* test_main exits; only reached if it calls pthread_exit */
+  return 1;
+}
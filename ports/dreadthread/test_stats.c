@@ -0,0 +1,234 @@
+/*
+ * Introspection:  the scheduler counters add up after a workload of
+ * contended locks and broadcasts, a snapshot taken while threads wait on
+ * a semaphore, an event and the clock finds each of them where it is,
+ * and with run accounting on a spinning thread is charged for its spin
+ * and a sleeping one is not.  Also built as test_stats_mt, with -C
+ * carriers.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dreadthread.h"
+
+#define STACKSIZE (16 * 1024)
+#define NTHREADS  50
+#define NSEMA     5         /* waiting on a semaphore in the snapshot */
+#define NEVENT    7         /* on an event */
+#define NSLEEP    3         /* asleep */
+#define NAP       200000    /* usec they sleep */
+#define SPIN      20000     /* usec the spinner runs */
+
+int                   ncarriers = 1;
+int                   verbose = 0;
+
+struct dthr_thread    main_th, th[NTHREADS],
+                      waiter_th[NSEMA + NEVENT + NSLEEP], spin_th, nap_th;
+struct dthr_semaphore lock, done_sema, wait_sema;
+struct dthr_event     go_ev;
+int                   all_go = 0;
+int                   errors = 0;
+
+void expect(char *what, long got, long want)
+{
+  if (got != want) {
+    fprintf(stderr,"%s:  got %ld, expected %ld\n",what,got,want);
+    errors++;
+  }
+}
+
+void expect_min(char *what, long got, long least)
+{
+  if (got < least) {
+    fprintf(stderr,"%s:  got %ld, expected at least %ld\n",what,got,least);
+    errors++;
+  }
+}
+
+void *contender(void *unused)
+{
+  dthr_semaphore_take(&lock);
+  while (!all_go)
+    dthr_event_wait(&go_ev,&lock);
+  dthr_thread_yield();
+  dthr_semaphore_drop(&lock);
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *sema_waiter(void *unused)
+{
+  dthr_semaphore_take(&wait_sema);
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *napper(void *arg)
+{
+  dthr_sleep((uintptr_t) arg);
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *spinner(void *unused)
+{
+  unsigned long long  start = dthr_time_now();
+
+  while (dthr_time_now() - start < SPIN)
+    dthr_thread_yield();
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+static void start(struct dthr_thread *t, void *(*fn)(void *), void *arg)
+{
+  (void) dthr_thread_init(t,fn,arg,STACKSIZE);
+  (void) dthr_thread_detach(dthr_thread_run(t));
+}
+
+void *goForIt(void *unused)
+{
+  struct dthr_sched_stats     before, after;
+  struct dthr_sched_snapshot  snap;
+  unsigned long long          deadline;
+  int                         i;
+
+  dthr_semaphore_init(&lock,1);
+  dthr_semaphore_init(&done_sema,0);
+  dthr_semaphore_init(&wait_sema,0);
+  dthr_event_init(&go_ev);
+
+  /* everyone queues on the event, then all fight for the lock */
+  (void) dthr_get_sched_stats(&before);
+  for (i = 0; i < NTHREADS; i++)
+    start(&th[i],contender,0);
+  while (dthr_event_waiters(&go_ev) < NTHREADS)
+    dthr_thread_yield();
+  dthr_semaphore_take(&lock);
+  all_go = 1;
+  dthr_event_broadcast_no_yield(&go_ev);
+  dthr_semaphore_drop(&lock);
+  for (i = 0; i < NTHREADS; i++)
+    dthr_semaphore_take(&done_sema);
+  /* done_sema is dropped before the exit; let the last ones finish */
+  deadline = dthr_time_now() + NAP;
+  do {
+    dthr_thread_yield();
+    (void) dthr_get_sched_stats(&after);
+  } while (after.threads_exited - before.threads_exited < NTHREADS
+           && dthr_time_now() < deadline);
+  printf("workload:  %lu switches, %lu semaphore waits, %lu event"
+         " wakeups\n",after.switches - before.switches,
+         after.sema_waits - before.sema_waits,
+         after.event_wakeups - before.event_wakeups);
+  expect("threads run",after.threads_run - before.threads_run,NTHREADS);
+  expect("threads started",after.threads_started - before.threads_started,
+         NTHREADS);
+  expect("threads exited",after.threads_exited - before.threads_exited,
+         NTHREADS);
+  /* the library's own launcher and reaper wait on events too */
+  expect_min("event waits",after.event_waits - before.event_waits,NTHREADS);
+  expect_min("event wakeups",after.event_wakeups - before.event_wakeups,
+             NTHREADS);
+  expect_min("semaphore waits",after.sema_waits - before.sema_waits,1);
+  expect_min("switches",after.switches - before.switches,NTHREADS);
+  expect_min("yields",after.yields - before.yields,NTHREADS);
+
+  /* park some on each kind of wait, then look */
+  for (i = 0; i < NSEMA; i++)
+    start(&waiter_th[i],sema_waiter,0);
+  all_go = 0;
+  for (i = 0; i < NEVENT; i++)
+    start(&waiter_th[NSEMA + i],contender,0);
+  for (i = 0; i < NSLEEP; i++)
+    start(&waiter_th[NSEMA + NEVENT + i],napper,(void *) NAP);
+  deadline = dthr_time_now() + NAP / 2;
+  do {
+    dthr_thread_yield();
+    (void) dthr_get_sched_snapshot(&snap);
+  } while ((snap.sema_waiting < NSEMA || snap.event_waiting < NEVENT
+            || snap.sleeping < NSLEEP) && dthr_time_now() < deadline);
+  if (verbose) dthr_print_sched_stats(stdout);
+  printf("snapshot:  %lu threads, %lu on semaphores, %lu on events,"
+         " %lu sleeping, %lu timers\n",snap.threads,snap.sema_waiting,
+         snap.event_waiting,snap.sleeping,snap.timers);
+  expect("semaphore waiters",dthr_semaphore_waiters(&wait_sema),NSEMA);
+  expect("event waiters",dthr_event_waiters(&go_ev),NEVENT);
+  expect("on semaphores",snap.sema_waiting,NSEMA);
+  expect("on events",snap.event_waiting,NEVENT);
+  expect("sleeping",snap.sleeping,NSLEEP);
+  expect_min("timers",snap.timers,NSLEEP);
+  expect_min("threads",snap.threads,NSEMA + NEVENT + NSLEEP + 1);
+  expect_min("runnable",snap.runnable,1);
+  expect("carriers",snap.carriers,ncarriers);
+  for (i = 0; i < NSEMA; i++)
+    dthr_semaphore_drop_no_yield(&wait_sema);
+  dthr_semaphore_take(&lock);
+  all_go = 1;
+  dthr_event_broadcast_no_yield(&go_ev);
+  dthr_semaphore_drop(&lock);
+  for (i = 0; i < NSEMA + NEVENT + NSLEEP; i++)
+    dthr_semaphore_take(&done_sema);
+
+  /* the spinner is charged for its spin, the napper for next to nothing */
+  dthr_set_run_accounting(1);
+  start(&spin_th,spinner,0);
+  start(&nap_th,napper,(void *) SPIN);
+  for (i = 0; i < 2; i++)
+    dthr_semaphore_take(&done_sema);
+  /* charged for the last stretch as they exit */
+  while (spin_th.state != DREAD_THREAD_TH_EXITED
+         || nap_th.state != DREAD_THREAD_TH_EXITED)
+    dthr_thread_yield();
+  dthr_set_run_accounting(0);
+  printf("run times:  spinner %llu usec, napper %llu usec\n",
+         spin_th.run_usec,nap_th.run_usec);
+  expect_min("spinner run time",(long) spin_th.run_usec,SPIN * 3 / 4);
+  if (ncarriers == 1 && nap_th.run_usec > SPIN / 4) {
+    fprintf(stderr,"napper charged %llu usec\n",nap_th.run_usec);
+    errors++;
+  }
+  if (!dthr_cur_thread->run_usec) {
+    fprintf(stderr,"main thread not charged while accounting\n");
+    errors++;
+  }
+
+  if (verbose) dthr_print_sched_stats(stdout);
+  (void) dthr_thread_detach(dthr_cur_thread);
+  return 0;
+}
+
+extern int  getopt();
+extern char *optarg;
+
+char    *me;
+
+void usage()
+{
+  fprintf(stderr,"Usage: %s [-C carriers] [-v]\n",me);
+}
+
+int main(int ac, char **av)
+{
+  int   opt;
+
+  if (!(me = strrchr(*av,'/'))) me = *av;
+  else ++me;
+
+  while ((opt = getopt(ac,av,"C:v")) != EOF) switch (opt) {
+  case 'C': ncarriers = atoi(optarg); break;
+  case 'v': verbose = 1;              break;
+  default:  usage(); exit(1);
+  }
+
+  dthr_init();
+  if (!dthr_set_carriers(ncarriers,0)) {
+    fprintf(stderr,"%s:  cannot use %d carriers\n",me,ncarriers);
+    exit(1);
+  }
+  (void) dthr_thread_init(&main_th,goForIt,(void *) 0,STACKSIZE);
+  dthr_thread_multithread(&main_th);
+  if (errors) fprintf(stderr,"%s:  %d errors\n",me,errors);
+  return errors != 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Timed waits:  sleepers must wake in deadline order and never early,
+ * timed takes and waits must time out when nobody wakes them and not
+ * when somebody does, and a process with everybody asleep must block
+ * rather than spin.  Also built as test_time_mt, with -C carriers.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dreadthread.h"
+
+#define NTHREADS  50
+#define UNIT      2000      /* usec between sleepers' deadlines */
+#define STACKSIZE (16 * 1024)
+
+int                   ncarriers = 1;
+int                   nthreads = NTHREADS;
+unsigned long         unit = UNIT;
+
+struct sleeper {
+  struct dthr_thread  th;
+  unsigned long long  wake_at;
+  int                 late;     /* deadline passed before it slept */
+};
+
+struct sleeper        *sleepers;
+struct dthr_semaphore go_sema, done_sema, never_sema, later_sema, ev_lock;
+struct dthr_event     go_ev, never_ev, later_ev;
+int                   all_go = 0;
+int                   nwoken = 0;
+int                   *wake_order;
+int                   errors = 0;
+
+void *sleeper(void *arg)
+{
+  struct sleeper      *s = &sleepers[(uintptr_t) arg];
+  unsigned long long  now;
+
+  dthr_semaphore_take(&go_sema);
+  while (!all_go)
+    dthr_event_wait(&go_ev,&go_sema);
+  dthr_semaphore_drop(&go_sema);
+
+  now = dthr_time_now();
+  s->late = s->wake_at <= now;
+  dthr_sleep(s->late ? 0 : s->wake_at - now);
+  /* recorded before anything yields */
+  wake_order[__sync_fetch_and_add(&nwoken,1)] = (uintptr_t) arg;
+  if ((now = dthr_time_now()) < s->wake_at) {
+    fprintf(stderr,"sleeper %d:  woke %llu usec early\n",
+            (int) (uintptr_t) arg,s->wake_at - now);
+    errors++;
+  }
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void *dropper(void *unused)
+{
+  dthr_sleep(unit);
+  dthr_semaphore_drop(&later_sema);
+  dthr_sleep(unit);
+  dthr_semaphore_take(&ev_lock);
+  dthr_event_signal_no_yield(&later_ev);
+  dthr_semaphore_drop(&ev_lock);
+  dthr_semaphore_drop(&done_sema);
+  return 0;
+}
+
+void check(char *what, int got, int want,
+           unsigned long long start, unsigned long min, unsigned long max)
+{
+  unsigned long long  took = dthr_time_now() - start;
+
+  printf("%s:  %s after %llu usec\n",what,got ? "succeeded" : "timed out",
+         took);
+  if (got != want || took < min || took > max) {
+    fprintf(stderr,"%s:  expected to %s after %lu to %lu usec\n",
+            what,want ? "succeed" : "time out",min,max);
+    errors++;
+  }
+}
+
+struct dthr_thread    main_th, dropper_th;
+
+void *goForIt(void *unused)
+{
+  unsigned long long  start;
+  clock_t             cpu;
+  int                 i, last, rv;
+
+  dthr_semaphore_init(&go_sema,1);
+  dthr_semaphore_init(&done_sema,0);
+  dthr_semaphore_init(&never_sema,0);
+  dthr_semaphore_init(&later_sema,0);
+  dthr_semaphore_init(&ev_lock,1);
+  dthr_event_init(&go_ev);
+  dthr_event_init(&never_ev);
+  dthr_event_init(&later_ev);
+
+  /* started latest deadline first, so wake order is not start order */
+  for (i = nthreads; --i >= 0; ) {
+    (void) dthr_thread_init(&sleepers[i].th,sleeper,(void *) (uintptr_t) i,
+                            STACKSIZE);
+    (void) dthr_thread_detach(dthr_thread_run(&sleepers[i].th));
+  }
+  start = dthr_time_now();
+  cpu = clock();
+  for (i = 0; i < nthreads; i++)
+    sleepers[i].wake_at = start + (i + 1) * unit;
+  dthr_semaphore_take(&go_sema);
+  all_go = 1;
+  dthr_semaphore_drop(&go_sema);
+  dthr_event_broadcast(&go_ev);
+  for (i = 0; i < nthreads; i++)
+    dthr_semaphore_take(&done_sema);
+  /* carriers race to record their wakeups */
+  for (last = -1, i = 0; ncarriers == 1 && i < nthreads; i++) {
+    if (sleepers[wake_order[i]].late) continue;
+    if (wake_order[i] < last) {
+      fprintf(stderr,"sleeper %d woke after sleeper %d\n",wake_order[i],last);
+      errors++;
+      break;
+    }
+    last = wake_order[i];
+  }
+  printf("%d sleepers:  %llu usec, %.0f usec cpu\n",nthreads,
+         dthr_time_now() - start,
+         (double) (clock() - cpu) * 1e6 / CLOCKS_PER_SEC);
+
+  start = dthr_time_now();
+  check("timedtake of idle semaphore",
+        dthr_semaphore_timedtake(&never_sema,3 * unit),0,start,3 * unit,
+        1000000);
+
+  dthr_semaphore_take(&ev_lock);
+  start = dthr_time_now();
+  rv = dthr_event_timedwait(&never_ev,&ev_lock,3 * unit);
+  check("timedwait on idle event",rv,0,start,3 * unit,1000000);
+  dthr_semaphore_drop(&ev_lock);
+
+  (void) dthr_thread_init(&dropper_th,dropper,(void *) 0,STACKSIZE);
+  (void) dthr_thread_detach(dthr_thread_run(&dropper_th));
+  start = dthr_time_now();
+  check("timedtake of dropped semaphore",
+        dthr_semaphore_timedtake(&later_sema,1000000),1,start,0,500000);
+  dthr_semaphore_take(&ev_lock);
+  start = dthr_time_now();
+  rv = dthr_event_timedwait(&later_ev,&ev_lock,1000000);
+  check("timedwait on signalled event",rv,1,start,0,500000);
+  dthr_semaphore_drop(&ev_lock);
+  dthr_semaphore_take(&done_sema);
+
+  (void) dthr_thread_detach(dthr_cur_thread);
+  return 0;
+}
+
+extern int  getopt();
+extern char *optarg;
+
+char    *me;
+
+void usage()
+{
+  fprintf(stderr,"Usage: %s [-C carriers] [-t nthreads] [-u usec]\n",me);
+}
+
+int main(int ac, char **av)
+{
+  int   opt;
+
+  if (!(me = strrchr(*av,'/'))) me = *av;
+  else ++me;
+
+  while ((opt = getopt(ac,av,"C:t:u:")) != EOF) switch (opt) {
+  case 'C': ncarriers = atoi(optarg); break;
+  case 't': nthreads = atoi(optarg);  break;
+  case 'u': unit = atol(optarg);      break;
+  default:  usage(); exit(1);
+  }
+
+  sleepers = (struct sleeper *) malloc(nthreads * sizeof *sleepers);
+  wake_order = (int *) malloc(nthreads * sizeof *wake_order);
+  if (!sleepers || !wake_order) {
+    perror(me);
+    fprintf(stderr,"%s:  insufficient space for thread descriptors\n", me);
+    exit(1);
+  }
+
+  dthr_init();
+  if (!dthr_set_carriers(ncarriers,0)) {
+    fprintf(stderr,"%s:  cannot use %d carriers\n",me,ncarriers);
+    exit(1);
+  }
+  (void) dthr_thread_init(&main_th,goForIt,(void *) 0,STACKSIZE);
+  dthr_thread_multithread(&main_th);
+  if (errors) fprintf(stderr,"%s:  %d errors\n",me,errors);
+  return errors != 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2014 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+#include_next <arpa/inet.h>
+
+#ifndef GLIBCEMU_ARPA_INET_H
+#define GLIBCEMU_ARPA_INET_H 1
+
+#include <sys/cdefs.h>
+#include <stddef.h>
+
+__BEGIN_DECLS
+
+/*
+ * inet_pton() each of count strings into an array of addresses; the
+ * address of a string that isn't one is left alone.  Returns the number
+ * that were, or -1 if af isn't supported.  valid, if not NULL, gets 1
+ * for each string that was an address and 0 for each one that wasn't.
+ */
+extern int inet_pton_bulk(int af, const char *const *src, size_t count,
+                          void *dst, unsigned char *valid);
+
+__END_DECLS
+
+#endif
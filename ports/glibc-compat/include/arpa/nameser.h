@@ -154,6 +154,28 @@ typedef	struct __ns_rr {
 #define ns_rr_rdlen(rr)	((rr).rdlength + 0)
 #define ns_rr_rdata(rr)	((rr).rdata + 0)
 
+/*
+ * This is a name compression context: the names packed into one message so
+ * far, indexed by a hash of each of their suffixes.  It is caller allocated
+ * and has no dynamic data.  Set it up with ns_cctx_init for each message and
+ * pass it to ns_name_cpack or ns_name_ccompress for every name put in it.
+ * Names packed after the table fills up are still compressed against the
+ * ones before, but are not found themselves.
+ */
+#define NS_CCTX_BUCKETS	256		/* a power of two */
+#define NS_CCTX_ENTRIES	1024
+
+typedef struct __ns_cctx {
+	const u_char	*_msg;
+	int		_count;
+	u_int16_t	_buckets[NS_CCTX_BUCKETS];	/* 1 + first entry */
+	struct {
+		u_int32_t	hash;
+		u_int16_t	offset;			/* from _msg */
+		u_int16_t	next;			/* 1 + next in bucket */
+	}		_entries[NS_CCTX_ENTRIES];
+} ns_cctx;
+
 /*
  * These don't have to be in the same order as in the packet flags word,
  * and they can even overlap in some cases, but they will need to be kept
@@ -489,6 +511,9 @@ typedef enum __ns_cert_types {
 #define	ns_name_pack		__ns_name_pack
 #define	ns_name_compress	__ns_name_compress
 #define	ns_name_uncompress	__ns_name_uncompress
+#define	ns_cctx_init		__ns_cctx_init
+#define	ns_name_cpack		__ns_name_cpack
+#define	ns_name_ccompress	__ns_name_ccompress
 
 __BEGIN_DECLS
 u_int		ns_get16(const u_char *);
@@ -516,6 +541,9 @@ int		ns_name_uncompress(const u_char *, const u_char *,
 int		ns_name_compress(const char *, u_char *, size_t,
 				 const u_char **, const u_char **);
 int		ns_name_skip(const u_char **, const u_char *);
+void		ns_cctx_init(ns_cctx *, const u_char *);
+int		ns_name_cpack(const u_char *, u_char *, int, ns_cctx *);
+int		ns_name_ccompress(const char *, u_char *, size_t, ns_cctx *);
 __END_DECLS
 
 #ifdef BIND_4_COMPAT
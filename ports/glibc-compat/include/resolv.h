@@ -98,6 +98,8 @@
 #define RES_MAXRETRY    	5       /* only for resolv.conf/RES_OPTIONS */
 #define RES_DFLRETRY		2       /* Default #/tries. */
 #define RES_MAXTIME 		65535   /* Infinity, in milliseconds. */
+#define RES_EDNSBUFSIZE		1232	/* UDP answer size asked for with
+					   EDNS0 */
 
 
 typedef enum { res_goahead, res_nextns, res_modified, res_done, res_error }
@@ -115,6 +117,11 @@ typedef res_sendhookact (*res_send_rhook) (const struct sockaddr_in *ns,
                                            int anssiz,
                                            int *resplen);
 
+/* See res_async.c. */
+struct res_async;
+typedef void (*res_async_callback) (void *arg, int herrno,
+                                    const u_char *answer, int anslen);
+
 
 struct __res_state {
 	int	retrans;	 	/* retransmition time interval */
@@ -180,6 +187,7 @@ struct __res_state_ext {
  *   */
 #define RES_F_VC        0x00000001      /* socket is TCP */
 #define RES_F_CONN      0x00000002      /* socket is connected */
+#define RES_F_EDNS0ERR  0x00000004      /* EDNS0 caused errors */
 
 /* res_findzonecut() options */
 #define RES_EXHAUSTIVE  0x00000001      /* always do all queries */
@@ -209,8 +217,15 @@ struct __res_state_ext {
                                            strings */
 #define RES_NOIP6DOTINT 0x00080000      /* Do not use .ip6.int in IPv6
                                            reverse lookup */
+#define RES_USE_EDNS0   0x00100000      /* use EDNS0 if the server takes
+                                           it */
+#define RES_SNGLKUP     0x00200000      /* one query at a time in
+                                           res_nquery2 */
+#define RES_USECACHE    0x10000000      /* answer res_query from the
+                                           in-process cache */
 
-#define RES_DEFAULT     (RES_RECURSE|RES_DEFNAMES|RES_DNSRCH|RES_NOIP6DOTINT)
+#define RES_DEFAULT     (RES_RECURSE|RES_DEFNAMES|RES_DNSRCH|RES_NOIP6DOTINT|\
+                         RES_USECACHE)
 
 /*
  * Resolver "pfcode" values.  Used by dig.
@@ -240,6 +255,20 @@ struct __res_state_ext {
     }                                           \
   while (0)
 
+/*
+ * Counters of the answer cache shared by all resolver states in the
+ * process.  See res_cache.c.
+ */
+struct res_cache_stats {
+	u_long	hits;			/* answered from the cache */
+	u_long	negative_hits;		/* of those, NXDOMAIN or NODATA */
+	u_long	misses;			/* went to the network */
+	u_long	expired;		/* of those, found but too old */
+	u_long	stores;			/* answers added */
+	u_long	evictions;		/* pushed out by newer ones */
+	u_int	entries;		/* held now */
+};
+
 struct res_sym {
 	int	number;		/* Identifying number, like T_MX */
 	char *	name;		/* Its symbolic name, like "MX" */
@@ -302,8 +331,10 @@ extern const struct res_sym __p_type_syms[];
 #define res_nclose              __res_nclose
 #define res_ninit               __res_ninit
 #define res_nmkquery            __res_nmkquery
+#define res_nopt                __res_nopt
 #define res_npquery             __res_npquery
 #define res_nquery              __res_nquery
+#define res_nquery2             __res_nquery2
 #define res_nquerydomain        __res_nquerydomain
 #define res_nsearch             __res_nsearch
 #define res_nsend               __res_nsend
@@ -314,6 +345,15 @@ extern const struct res_sym __p_type_syms[];
 #define	res_mkupdate	__res_mkupdate
 #define	res_mkupdrec	__res_mkupdrec
 #define	res_freeupdrec	__res_freeupdrec
+#define	res_cache_flush	__res_cache_flush
+#define	res_cache_getstats __res_cache_getstats
+#define	res_async_open	__res_async_open
+#define	res_async_fd	__res_async_fd
+#define	res_async_query	__res_async_query
+#define	res_async_timeout __res_async_timeout
+#define	res_async_process __res_async_process
+#define	res_async_cancel __res_async_cancel
+#define	res_async_close	__res_async_close
 
 __BEGIN_DECLS
 int		res_hnok(const char *);
@@ -365,19 +405,33 @@ int		res_nameinquery(const char *, int, int,
 void            res_npquery (const res_state, const u_char *, int, FILE *);
 const char *    res_hostalias (const res_state, const char *, char *, size_t);
 int             res_nquery (res_state, const char *, int, int, u_char *, int);
+int             res_nquery2 (res_state, const char *, int, int, int,
+                             u_char *, int, int *, u_char *, int, int *);
 int             res_nsearch (res_state, const char *, int, int, u_char *, int);
 int             res_nquerydomain (res_state, const char *, const char *, int,
                                   int, u_char *, int);
 int             res_nmkquery (res_state, int, const char *, int, int,
                               const u_char *, int, const u_char *, u_char *,
                               int);
+int             res_nopt (res_state, int, u_char *, int, int);
 int             res_nsend (res_state, const u_char *, int, u_char *, int);
+int             res_ninit (res_state);
 void            res_nclose (res_state);
 
 int		res_queriesmatch(const u_char *, const u_char *,
 				 const u_char *, const u_char *);
 void		res_close(void);
 int		res_opt(int, u_char *, int, int);
+void		res_cache_flush(void);
+void		res_cache_getstats(struct res_cache_stats *);
+struct res_async *res_async_open(res_state);
+int		res_async_fd(const struct res_async *);
+int		res_async_query(struct res_async *, const char *, int, int,
+				res_async_callback, void *);
+int		res_async_timeout(const struct res_async *);
+int		res_async_process(struct res_async *);
+int		res_async_cancel(struct res_async *, int);
+void		res_async_close(struct res_async *);
 const char *	p_section(int, int);
 /* XXX The following depend on the ns_updrec typedef in arpa/nameser.h */
 #ifdef _ARPA_NAMESER_H_
@@ -8,6 +8,7 @@
 #ifndef GLIBCEMU_STDLIB_H
 #define GLIBCEMU_STDLIB_H 1
 
+#include <stdint.h>
 #include <sys/cdefs.h>
 
 __BEGIN_DECLS
@@ -16,6 +17,39 @@ long int random(void);
 
 void srandom(unsigned int seed);
 
+char *initstate(unsigned int seed, char *statebuf, size_t statelen);
+
+char *setstate(char *statebuf);
+
+/*
+ * State for the reentrant versions, laid out as in glibc.  Each thread
+ * with its own random_data can call random_r() without taking a lock.
+ */
+struct random_data {
+  int32_t *fptr;
+  int32_t *rptr;
+  int32_t *state;
+  int rand_type;
+  int rand_deg;
+  int rand_sep;
+  int32_t *end_ptr;
+};
+
+extern int random_r(struct random_data *buf, int32_t *result);
+
+extern int srandom_r(unsigned int seed, struct random_data *buf);
+
+extern int initstate_r(unsigned int seed, char *statebuf, size_t statelen,
+                       struct random_data *buf);
+
+extern int setstate_r(char *statebuf, struct random_data *buf);
+
+/*
+ * realpath() remembers the directories it has found.  Call this after
+ * renaming or removing files or directories, or mounting, to forget them.
+ */
+extern void realpath_cache_invalidate(void);
+
 extern void qsort_r(void *base, size_t nmemb, size_t size,
                     int (*compar)(const void *, const void *, void *),
                     void *arg);
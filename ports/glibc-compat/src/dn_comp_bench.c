@@ -0,0 +1,115 @@
+/* Copyright 2014 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. */
+
+/*
+ * Times packing messages of many names, the way a zone transfer or a big
+ * referral is built: with dn_comp and a dnptrs array, with a compression
+ * context, and with no compression at all.  Each name is a host in one of
+ * a few subdomains, so most of it can point at a name already packed.
+ *
+ * Usage: dn_comp_bench [-m messages] [-n names per message]
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAXNAMES 4096
+
+enum { PTRS, CCTX, NONE };
+
+static char names[MAXNAMES][64];
+static u_char* dnptrs[MAXNAMES + 2];
+static ns_cctx cctx;
+static u_char msg[65536];
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Packs count names into msg, returning the message size. */
+static int pack(int how, int count) {
+  u_char* cp = msg + HFIXEDSZ;
+  u_char* eom = msg + sizeof(msg);
+  int i, n;
+
+  dnptrs[0] = msg;
+  dnptrs[1] = NULL;
+  ns_cctx_init(&cctx, msg);
+  for (i = 0; i < count; i++) {
+    if (how == PTRS)
+      n = dn_comp(names[i], cp, eom - cp, dnptrs, dnptrs + MAXNAMES + 2);
+    else if (how == CCTX)
+      n = ns_name_ccompress(names[i], cp, eom - cp, &cctx);
+    else
+      n = dn_comp(names[i], cp, eom - cp, NULL, NULL);
+    if (n < 0) {
+      fprintf(stderr, "cannot pack %s\n", names[i]);
+      exit(1);
+    }
+    /* the rest of a record, as the next name would follow it */
+    cp += n + RRFIXEDSZ + 4;
+  }
+  return cp - msg;
+}
+
+/* Nanoseconds per name, packing messages of count names. */
+static double time_pack(int how, int count, int messages, int* size) {
+  double start = now();
+  int i;
+
+  for (i = 0; i < messages; i++)
+    *size = pack(how, count);
+  return (now() - start) * 1e9 / messages / count;
+}
+
+int main(int argc, char** argv) {
+  static const char* how[] = {"dn_comp, dnptrs", "ns_name_ccompress",
+                              "no compression"};
+  int messages = 200, count = 800, sizes[3], c, i, opt;
+  double ns;
+
+  while ((opt = getopt(argc, argv, "m:n:")) != -1) {
+    switch (opt) {
+      case 'm': messages = atoi(optarg); break;
+      case 'n': count = atoi(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-m messages] [-n names per message]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (messages < 1 || count < 1 || count > MAXNAMES) {
+    fprintf(stderr, "%s: need a message and 1 to %d names\n", argv[0],
+            MAXNAMES);
+    return 1;
+  }
+  for (i = 0; i < MAXNAMES; i++)
+    snprintf(names[i], sizeof(names[i]), "host%d.rack%d.dc%d.example.com", i,
+             i % 16, i % 3);
+
+  for (c = count < 25 ? count : 25;; c = c * 4 < count ? c * 4 : count) {
+    printf("%d names per message:\n", c);
+    for (i = PTRS; i <= NONE; i++) {
+      ns = time_pack(i, c, messages, &sizes[i]);
+      printf("  %-18s %8.1f nsec per name, %6d byte message\n", how[i], ns,
+             sizes[i]);
+    }
+    if (sizes[PTRS] != sizes[CCTX]) {
+      fprintf(stderr, "dnptrs and context packed to different sizes\n");
+      return 1;
+    }
+    if (c == count)
+      break;
+  }
+  return 0;
+}
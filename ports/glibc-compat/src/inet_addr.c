@@ -72,6 +72,9 @@ static char sccsid[] = "@(#)inet_addr.c	8.1 (Berkeley) 6/17/93";
 #include <string.h>
 #include <stdlib.h>
 
+int		__inet_quad(const char *, u_char *, int);
+int		__inet_aton_bytewise(const char *, struct in_addr *);
+
 /*
  * ASCII internet address interpretation routine.
  * The value returned is in network order.
@@ -98,6 +101,28 @@ int
 inet_aton(cp, addr)
 	const char *cp;
 	struct in_addr *addr;
+{
+	struct in_addr tmp;
+
+	/* Plain dotted quads don't need strtoul(). */
+	switch (__inet_quad(cp, (u_char *)&tmp, 0)) {
+	case 1:
+		if (addr != NULL)
+			*addr = tmp;
+		return (1);
+	case 0:
+		return (0);
+	}
+	return (__inet_aton_bytewise(cp, addr));
+}
+
+/*
+ * inet_aton() without the fast path, for tests and benchmarks.
+ */
+int
+__inet_aton_bytewise(cp, addr)
+	const char *cp;
+	struct in_addr *addr;
 {
 	u_long parts[4];
 	in_addr_t val;
@@ -35,6 +35,8 @@
 
 static int	inet_pton4(const char *src, u_char *dst);
 static int	inet_pton6(const char *src, u_char *dst);
+static int	inet_pton6_fast(const char *src, u_char *dst);
+int		__inet_quad(const char *src, u_char *dst, int strict);
 
 /* int
  * inet_pton(af, src, dst)
@@ -52,6 +54,82 @@ inet_pton(af, src, dst)
 	int af;
 	const char *src;
 	void *dst;
+{
+	int n;
+
+	switch (af) {
+	case AF_INET:
+		if ((n = __inet_quad(src, dst, 1)) >= 0)
+			return (n);
+		return (inet_pton4(src, dst));
+	case AF_INET6:
+		if ((n = inet_pton6_fast(src, dst)) >= 0)
+			return (n);
+		return (inet_pton6(src, dst));
+	default:
+		errno = EAFNOSUPPORT;
+		return (-1);
+	}
+	/* NOTREACHED */
+}
+
+/* int
+ * inet_pton_bulk(af, src, count, dst, valid)
+ *	inet_pton() each of the `count' strings in `src' into the array of
+ *	addresses at `dst'.
+ * return:
+ *	the number of valid addresses, or -1 if `af' isn't supported.
+ * notice:
+ *	leaves the address of a string that isn't one untouched; `valid',
+ *	if not NULL, gets 1 for each string that was and 0 for the rest.
+ */
+int
+inet_pton_bulk(af, src, count, dst, valid)
+	int af;
+	const char * const *src;
+	size_t count;
+	void *dst;
+	u_char *valid;
+{
+	u_char *tp = dst;
+	size_t i;
+	int n, total = 0;
+
+	switch (af) {
+	case AF_INET:
+		for (i = 0; i < count; i++, tp += NS_INADDRSZ) {
+			if ((n = __inet_quad(src[i], tp, 1)) < 0)
+				n = inet_pton4(src[i], tp);
+			if (valid != NULL)
+				valid[i] = n;
+			total += n;
+		}
+		return (total);
+	case AF_INET6:
+		for (i = 0; i < count; i++, tp += NS_IN6ADDRSZ) {
+			if ((n = inet_pton6_fast(src[i], tp)) < 0)
+				n = inet_pton6(src[i], tp);
+			if (valid != NULL)
+				valid[i] = n;
+			total += n;
+		}
+		return (total);
+	default:
+		errno = EAFNOSUPPORT;
+		return (-1);
+	}
+	/* NOTREACHED */
+}
+
+/* int
+ * __inet_pton_bytewise(af, src, dst)
+ *	inet_pton() without the fast paths, for tests and benchmarks.
+ */
+int
+__inet_pton_bytewise(af, src, dst)
+	int af;
+	const char *src;
+	void *dst;
 {
 	switch (af) {
 	case AF_INET:
@@ -65,6 +143,102 @@ inet_pton(af, src, dst)
 	/* NOTREACHED */
 }
 
+/*
+ * Eight bytes of a string, the first in the low bits.
+ */
+static u_int64_t
+load64(p)
+	const u_char *p;
+{
+	return ((u_int64_t)p[0] | (u_int64_t)p[1] << 8 |
+		(u_int64_t)p[2] << 16 | (u_int64_t)p[3] << 24 |
+		(u_int64_t)p[4] << 32 | (u_int64_t)p[5] << 40 |
+		(u_int64_t)p[6] << 48 | (u_int64_t)p[7] << 56);
+}
+
+/*
+ * One bit for each byte of `w' whose top bit is set in `mask', the first
+ * byte in bit 0.
+ */
+static u_int
+bytemask(mask)
+	u_int64_t mask;
+{
+	return ((mask >> 7) * 0x0102040810204080ULL >> 56);
+}
+
+#define	ONES	0x0101010101010101ULL
+#define	HIGHS	0x8080808080808080ULL
+
+/* int
+ * __inet_quad(src, dst, strict)
+ *	parse a dotted quad of decimal octets of up to three digits each,
+ *	classifying eight bytes at a time as digits or dots.
+ * return:
+ *	1 if `src' is one, 0 if it can't be, or -1 if it takes the byte at a
+ *	time parser to tell.
+ * notice:
+ *	a leading zero is just a digit if `strict', as for inet_pton(), or
+ *	else leaves the octet to the caller, for whom it means octal.
+ *	Does not touch `dst' unless it's returning 1.
+ */
+int
+__inet_quad(src, dst, strict)
+	const char *src;
+	u_char *dst;
+	int strict;
+{
+	u_char buf[16], tmp[NS_INADDRSZ];
+	u_int64_t w, lo, digit, dot;
+	u_int digits, dots, i, n, start, end, val;
+	size_t len;
+
+	len = strnlen(src, sizeof(buf));
+	if (len < sizeof("1.2.3.4") - 1 || len >= sizeof(buf))
+		return (-1);
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, src, len);
+	digits = dots = 0;
+	for (i = 0; i < sizeof(buf); i += 8) {
+		w = load64(buf + i);
+		lo = w & ~HIGHS;
+		/* '0' <= c <= '9' and '.' == c, for c < 0x80 */
+		digit = (lo + 0x50 * ONES) & ~(lo + 0x46 * ONES);
+		dot = ~(((lo ^ 0x2e * ONES) + 0x7f * ONES) | (lo ^ 0x2e * ONES));
+		digits |= bytemask(digit & ~w & HIGHS) << i;
+		dots |= bytemask(dot & ~w & HIGHS) << i;
+	}
+	/* Anything else might still be a form inet_aton() takes. */
+	if ((digits | dots) != (1U << len) - 1 || __builtin_popcount(dots) != 3)
+		return (strict ? 0 : -1);
+	for (i = start = 0; i < NS_INADDRSZ; i++, start = end + 1) {
+		end = i < 3 ? __builtin_ctz(dots) : len;
+		dots &= dots - 1;
+		switch (n = end - start) {
+		case 1:
+			val = buf[start] - '0';
+			break;
+		case 2:
+		case 3:
+			if (buf[start] == '0' && !strict)
+				return (-1);
+			val = (buf[start] - '0') * 10 + buf[start + 1] - '0';
+			if (n == 3)
+				val = val * 10 + buf[start + 2] - '0';
+			if (val > 255)
+				return (0);
+			break;
+		case 0:
+			return (0);
+		default:
+			return (-1);
+		}
+		tmp[i] = val;
+	}
+	memcpy(dst, tmp, NS_INADDRSZ);
+	return (1);
+}
+
 /* int
  * inet_pton4(src, dst)
  *	like inet_aton() but without all the hexadecimal and shorthand.
@@ -214,6 +388,81 @@ inet_pton6(src, dst)
 	return (1);
 }
 
+/* int
+ * inet_pton6_fast(src, dst)
+ *	inet_pton6() for addresses without a dotted quad in them, telling
+ *	hex digits apart by their values rather than by looking them up.
+ * return:
+ *	1 if `src' is a valid address, 0 if it isn't, or -1 if it has a dot
+ *	in it, which is left to inet_pton6().
+ * notice:
+ *	does not touch `dst' unless it's returning 1.
+ */
+static int
+inet_pton6_fast(src, dst)
+	const char *src;
+	u_char *dst;
+{
+	u_char tmp[NS_IN6ADDRSZ], *tp, *endp, *colonp;
+	int ch, saw_xdigit;
+	u_int val, x;
+
+	memset((tp = tmp), '\0', NS_IN6ADDRSZ);
+	endp = tp + NS_IN6ADDRSZ;
+	colonp = NULL;
+	/* Leading :: requires some special handling. */
+	if (*src == ':')
+		if (*++src != ':')
+			return (0);
+	saw_xdigit = 0;
+	val = 0;
+	while ((ch = *src++) != '\0') {
+		if ((x = ch - '0') < 10 || (x = (ch | 0x20) - 'a' + 10) - 10 < 6) {
+			val = val << 4 | x;
+			if (val > 0xffff)
+				return (0);
+			saw_xdigit = 1;
+			continue;
+		}
+		if (ch == ':') {
+			if (!saw_xdigit) {
+				if (colonp)
+					return (0);
+				colonp = tp;
+				continue;
+			}
+			if (tp + NS_INT16SZ > endp)
+				return (0);
+			*tp++ = (u_char) (val >> 8) & 0xff;
+			*tp++ = (u_char) val & 0xff;
+			saw_xdigit = 0;
+			val = 0;
+			continue;
+		}
+		return (ch == '.' ? -1 : 0);
+	}
+	if (saw_xdigit) {
+		if (tp + NS_INT16SZ > endp)
+			return (0);
+		*tp++ = (u_char) (val >> 8) & 0xff;
+		*tp++ = (u_char) val & 0xff;
+	}
+	if (colonp != NULL) {
+		const int n = tp - colonp;
+
+		/* A "::" standing for no groups at all is inet_pton6()'s. */
+		if (tp == endp)
+			return (-1);
+		memmove(endp - n, colonp, n);
+		memset(colonp, 0, endp - n - colonp);
+		tp = endp;
+	}
+	if (tp != endp)
+		return (0);
+	memcpy(dst, tmp, NS_IN6ADDRSZ);
+	return (1);
+}
+
 #if 0
 /*
  * Weak aliases for applications that use certain private entry points,
@@ -0,0 +1,160 @@
+/* Copyright 2014 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. */
+
+/*
+ * Times parsing addresses the way a log or access list loader does: each
+ * string through the byte at a time parsers, through inet_pton and
+ * inet_aton with their fast paths, and all at once with inet_pton_bulk.
+ * IPv6 addresses are in the forms seen most, with and without "::".
+ *
+ * Usage: inet_pton_bench [-n addresses] [-r rounds]
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAXADDRS 65536
+
+int __inet_pton_bytewise(int af, const char* src, void* dst);
+int __inet_aton_bytewise(const char* cp, struct in_addr* addr);
+
+enum { BYTEWISE, FAST, BULK };
+
+static char v4[MAXADDRS][20];
+static char v6[MAXADDRS][48];
+static const char* v4p[MAXADDRS];
+static const char* v6p[MAXADDRS];
+static u_char out[MAXADDRS][16];
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_addresses(int count) {
+  int i, r;
+
+  for (i = 0; i < count; i++) {
+    snprintf(v4[i], sizeof(v4[i]), "%d.%d.%d.%d", 10 + rand() % 240,
+             rand() % 256, rand() % 256, rand() % 256);
+    r = rand();
+    switch (i % 3) {
+      case 0:
+        snprintf(v6[i], sizeof(v6[i]), "2001:db8:%x::%x", r & 0xffff,
+                 r >> 16 & 0xfff);
+        break;
+      case 1:
+        snprintf(v6[i], sizeof(v6[i]), "fe80::%x:%x:%x:%x", r & 0xffff,
+                 r >> 8 & 0xff, r >> 4 & 0xfff, rand() & 0xffff);
+        break;
+      default:
+        snprintf(v6[i], sizeof(v6[i]), "2001:db8:%x:%x:%x:%x:%x:%x",
+                 r & 0xffff, r >> 16 & 0xff, rand() & 0xffff, rand() & 0xfff,
+                 rand() & 0xffff, rand() & 0xff);
+        break;
+    }
+    v4p[i] = v4[i];
+    v6p[i] = v6[i];
+  }
+}
+
+/* Nanoseconds per address parsed with inet_pton. */
+static double time_pton(int how, int af, int count, int rounds) {
+  const char** src = af == AF_INET ? v4p : v6p;
+  double start = now();
+  int i, j, n = 0;
+
+  for (j = 0; j < rounds; j++) {
+    if (how == BULK) {
+      n += inet_pton_bulk(af, src, count, out, NULL);
+      continue;
+    }
+    for (i = 0; i < count; i++) {
+      if (how == BYTEWISE)
+        n += __inet_pton_bytewise(af, src[i], out[i]);
+      else
+        n += inet_pton(af, src[i], out[i]);
+    }
+  }
+  if (n != count * rounds) {
+    fprintf(stderr, "only %d of %d addresses parsed\n", n, count * rounds);
+    exit(1);
+  }
+  return (now() - start) * 1e9 / rounds / count;
+}
+
+/* Nanoseconds per address parsed with inet_aton. */
+static double time_aton(int how, int count, int rounds) {
+  double start = now();
+  int i, j, n = 0;
+
+  for (j = 0; j < rounds; j++) {
+    for (i = 0; i < count; i++) {
+      if (how == BYTEWISE)
+        n += __inet_aton_bytewise(v4p[i], (struct in_addr*)out[i]);
+      else
+        n += inet_aton(v4p[i], (struct in_addr*)out[i]);
+    }
+  }
+  if (n != count * rounds) {
+    fprintf(stderr, "only %d of %d addresses parsed\n", n, count * rounds);
+    exit(1);
+  }
+  return (now() - start) * 1e9 / rounds / count;
+}
+
+int main(int argc, char** argv) {
+  static const char* how[] = {"byte at a time", "fast path", "bulk"};
+  int count = 10000, rounds = 100, i, opt;
+  double base = 0;
+
+  while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+    switch (opt) {
+      case 'n': count = atoi(optarg); break;
+      case 'r': rounds = atoi(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-n addresses] [-r rounds]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (rounds < 1 || count < 1 || count > MAXADDRS) {
+    fprintf(stderr, "%s: need a round and 1 to %d addresses\n", argv[0],
+            MAXADDRS);
+    return 1;
+  }
+  srand(1);
+  make_addresses(count);
+
+  printf("%d addresses, %d rounds\n", count, rounds);
+  printf("inet_pton, AF_INET:\n");
+  for (i = BYTEWISE; i <= BULK; i++) {
+    double ns = time_pton(i, AF_INET, count, rounds);
+    if (i == BYTEWISE)
+      base = ns;
+    printf("  %-16s %8.1f nsec per address (%.1fx)\n", how[i], ns, base / ns);
+  }
+  printf("inet_pton, AF_INET6:\n");
+  for (i = BYTEWISE; i <= BULK; i++) {
+    double ns = time_pton(i, AF_INET6, count, rounds);
+    if (i == BYTEWISE)
+      base = ns;
+    printf("  %-16s %8.1f nsec per address (%.1fx)\n", how[i], ns, base / ns);
+  }
+  printf("inet_aton:\n");
+  for (i = BYTEWISE; i <= FAST; i++) {
+    double ns = time_aton(i, count, rounds);
+    if (i == BYTEWISE)
+      base = ns;
+    printf("  %-16s %8.1f nsec per address (%.1fx)\n", how[i], ns, base / ns);
+  }
+  return 0;
+}
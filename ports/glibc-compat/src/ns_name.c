@@ -29,19 +29,35 @@ static const char rcsid[] = "$BINDId: ns_name.c,v 8.15 2000/03/30 22:53:46 vixie
 #include <resolv.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include "libc-symbols.h"
 
 /* Data. */
 
+/* Most labels a name can have, not counting the root. */
+#define	MAXLABELS	(NS_MAXCDNAME / 2)
+
+/* Context following a caller's dnptrs array. */
+struct dnptrs_cctx {
+	ns_cctx		ctx;
+	const u_char	**dnptrs;	/* the array 'ctx' was built from */
+	int		nptrs;		/* names from it in 'ctx' */
+	const u_char	*last;		/* the last of them */
+};
+
+static pthread_once_t	dnptrs_once = PTHREAD_ONCE_INIT;
+static pthread_key_t	dnptrs_key;
+static int		dnptrs_keyok;
+
 static const char	digits[] = "0123456789";
 
 /* Forward. */
 
 static int		special(int);
 static int		printable(int);
-static int		dn_find(const u_char *, const u_char *,
-				const u_char * const *,
-				const u_char * const *);
+static int		cpack(const u_char *, u_char *, int, ns_cctx *, int);
+static struct dnptrs_cctx *dnptrs_cctx(const u_char **, int);
 
 /* Public. */
 
@@ -436,6 +452,10 @@ libresolv_hidden_def (ns_name_unpack)
  *	ends with NULL.
  *	'lastdnptr' is a pointer to the end of the array pointed to
  *	by 'dnptrs'.
+ *	The names in the array are looked up through a compression context
+ *	kept for the calling thread, which follows the array from one call
+ *	to the next and is rebuilt when the array is cut back or another
+ *	one is passed in.
  * Side effects:
  *	The list of pointers in dnptrs is updated for labels inserted into
  *	the message as we compress the name.  If 'dnptr' is NULL, we don't
@@ -446,92 +466,29 @@ int
 ns_name_pack(const u_char *src, u_char *dst, int dstsiz,
 	     const u_char **dnptrs, const u_char **lastdnptr)
 {
-	u_char *dstp;
-	const u_char **cpp, **lpp, *eob, *msg;
-	const u_char *srcp;
-	int n, l, first = 1;
-
-	srcp = src;
-	dstp = dst;
-	eob = dstp + dstsiz;
-	lpp = cpp = NULL;
-	if (dnptrs != NULL) {
-		if ((msg = *dnptrs++) != NULL) {
-			for (cpp = dnptrs; *cpp != NULL; cpp++)
-				(void)NULL;
-			lpp = cpp;	/* end of list to search */
-		}
-	} else
-		msg = NULL;
-
-	/* make sure the domain we are about to add is legal */
-	l = 0;
-	do {
-		n = *srcp;
-		if ((n & NS_CMPRSFLGS) != 0 && n != 0x41) {
-			__set_errno (EMSGSIZE);
-			return (-1);
-		}
-		if (n == 0x41)
-			n = *++srcp / 8;
-		l += n + 1;
-		if (l > MAXCDNAME) {
-			__set_errno (EMSGSIZE);
-			return (-1);
+	struct dnptrs_cctx *dc;
+	const u_char **cpp;
+	int n, save;
+
+	if (dnptrs == NULL || *dnptrs == NULL)
+		return (cpack(src, dst, dstsiz, NULL, 0));
+	for (cpp = dnptrs + 1; *cpp != NULL; cpp++)
+		(void)NULL;
+	save = lastdnptr != NULL && cpp < lastdnptr - 1 &&
+	    dst >= *dnptrs && (dst - *dnptrs) < 0x4000;
+	dc = dnptrs_cctx(dnptrs, cpp - dnptrs - 1);
+	n = cpack(src, dst, dstsiz, dc != NULL ? &dc->ctx : NULL, save);
+	/* Save it if it starts with a label that was not found. */
+	if (n > 0 && save && *dst != 0 &&
+	    (*dst & NS_CMPRSFLGS) != NS_CMPRSFLGS) {
+		*cpp++ = dst;
+		*cpp = NULL;
+		if (dc != NULL) {
+			dc->nptrs++;
+			dc->last = dst;
 		}
-		srcp += n + 1;
-	} while (n != 0);
-
-	/* from here on we need to reset compression pointer array on error */
-	srcp = src;
-	do {
-		/* Look to see if we can use pointers. */
-		n = *srcp;
-		if (n != 0 && n != 0x41 && msg != NULL) {
-			l = dn_find(srcp, msg, (const u_char * const *)dnptrs,
-				    (const u_char * const *)lpp);
-			if (l >= 0) {
-				if (dstp + 1 >= eob) {
-					goto cleanup;
-				}
-				*dstp++ = (l >> 8) | NS_CMPRSFLGS;
-				*dstp++ = l % 256;
-				return (dstp - dst);
-			}
-			/* Not found, save it. */
-			if (lastdnptr != NULL && cpp < lastdnptr - 1 &&
-			    (dstp - msg) < 0x4000 && first) {
-				*cpp++ = dstp;
-				*cpp = NULL;
-				first = 0;
-			}
-		}
-		/* copy label to buffer */
-		if ((n & NS_CMPRSFLGS) != 0 && n != 0x41) {		/* Should not happen. */
-			goto cleanup;
-		}
-		if (n == 0x41) {
-			n = *++srcp / 8;
-			if (dstp + 1 >= eob)
-				goto cleanup;
-			*dstp++ = 0x41;
-		}
-		if (dstp + 1 + n >= eob) {
-			goto cleanup;
-		}
-		memcpy(dstp, srcp, n + 1);
-		srcp += n + 1;
-		dstp += n + 1;
-	} while (n != 0);
-
-	if (dstp > eob) {
-cleanup:
-		if (msg != NULL)
-			*lpp = NULL;
-		__set_errno (EMSGSIZE);
-		return (-1);
 	}
-	return (dstp - dst);
+	return (n);
 }
 
 /*
@@ -581,6 +538,53 @@ ns_name_compress(const char *src, u_char *dst, size_t dstsiz,
 	return (ns_name_pack(tmp, dst, dstsiz, dnptrs, lastdnptr));
 }
 
+/*
+ * ns_cctx_init(ctx, msg)
+ *	Start a compression context for the message beginning at 'msg'.
+ */
+void
+ns_cctx_init(ns_cctx *ctx, const u_char *msg)
+{
+	ctx->_msg = msg;
+	ctx->_count = 0;
+	memset(ctx->_buckets, 0, sizeof ctx->_buckets);
+}
+
+/*
+ * ns_name_cpack(src, dst, dstsiz, ctx)
+ *	Pack domain name 'src' into 'dst', pointing at the longest of its
+ *	suffixes already in the message of 'ctx'.
+ * return:
+ *	Size of the compressed name, or -1 (with errno set).
+ * notes:
+ *	'dst' must lie in the message of 'ctx'.  If 'ctx' is NULL, we don't
+ *	try to compress the name.
+ * Side effects:
+ *	The suffixes written out for the name are added to 'ctx'.
+ */
+int
+ns_name_cpack(const u_char *src, u_char *dst, int dstsiz, ns_cctx *ctx)
+{
+	return (cpack(src, dst, dstsiz, ctx, 1));
+}
+
+/*
+ * ns_name_ccompress(src, dst, dstsiz, ctx)
+ *	Compress a domain name into wire format, using compression pointers
+ *	to the names in 'ctx'.
+ * return:
+ *	Number of bytes consumed in `dst' or -1 (with errno set).
+ */
+int
+ns_name_ccompress(const char *src, u_char *dst, size_t dstsiz, ns_cctx *ctx)
+{
+	u_char tmp[NS_MAXCDNAME];
+
+	if (ns_name_pton(src, tmp, sizeof tmp) == -1)
+		return (-1);
+	return (cpack(tmp, dst, (int)dstsiz, ctx, 1));
+}
+
 /*
  * Reset dnptrs so that there are no active references to pointers at or
  * after src.
@@ -682,67 +686,257 @@ mklower(int ch) {
 }
 
 /*
- * dn_find(domain, msg, dnptrs, lastdnptr)
- *	Search for the counted-label name in an array of compressed names.
+ * name_suffixes(name, labels, hashes, countp)
+ *	Find the labels of a counted-label name and hash each suffix of it
+ *	that can be compressed, ignoring case.  A suffix holding a bitstring
+ *	label never matches one in a message, so it is left out.
  * return:
- *	offset from msg if found, or -1.
- * notes:
- *	dnptrs is the pointer to the first name on the list,
- *	not the pointer to the start of the message.
+ *	index of the first suffix hashed; the number of labels, not
+ *	counting the root, is stored in *countp.
  */
 static int
-dn_find(const u_char *domain, const u_char *msg,
-	const u_char * const *dnptrs,
-	const u_char * const *lastdnptr)
+name_suffixes(const u_char *name, const u_char **labels, u_int32_t *hashes,
+	      int *countp)
 {
-	const u_char *dn, *cp, *sp;
-	const u_char * const *cpp;
-	u_int n;
+	const u_char *cp;
+	u_int32_t h;
+	int i, n, first;
 
-	for (cpp = dnptrs; cpp < lastdnptr; cpp++) {
-		sp = *cpp;
-		/*
-		 * terminate search on:
-		 * root label
-		 * compression pointer
-		 * unusable offset
-		 */
-		while (*sp != 0 && (*sp & NS_CMPRSFLGS) == 0 &&
-		       (sp - msg) < 0x4000) {
-			dn = domain;
-			cp = sp;
-			while ((n = *cp++) != 0) {
-				/*
-				 * check for indirection
-				 */
-				switch (n & NS_CMPRSFLGS) {
-				case 0:		/* normal case, n == len */
-					if (n != *dn++)
-						goto next;
-					for ((void)NULL; n > 0; n--)
-						if (mklower(*dn++) !=
-						    mklower(*cp++))
-							goto next;
-					/* Is next root for both ? */
-					if (*dn == '\0' && *cp == '\0')
-						return (sp - msg);
-					if (*dn)
-						continue;
-					goto next;
-
-				case NS_CMPRSFLGS:	/* indirection */
-					cp = msg + (((n & 0x3f) << 8) | *cp);
-					break;
-
-				default:	/* illegal type */
-					__set_errno (EMSGSIZE);
-					return (-1);
-				}
-			}
- next:
-			sp += *sp + 1;
+	first = 0;
+	for (i = 0, cp = name; (n = *cp) != 0; i++) {
+		labels[i] = cp;
+		if (n == 0x41) {
+			n = cp[1] / 8 + 1;
+			first = i + 1;
 		}
+		cp += n + 1;
+	}
+	*countp = i;
+	h = 2166136261U;		/* FNV-1a, a label at a time */
+	while (i-- > first) {
+		cp = labels[i];
+		for (n = *cp + 1; n > 0; n--)
+			h = (h ^ mklower(*cp++)) * 16777619U;
+		hashes[i] = h;
+	}
+	return (first);
+}
+
+/*
+ * name_eq(dn, msg, cp, eom)
+ *	Compare the counted-label name 'dn' with the compressed name at
+ *	'cp', which must lie wholly before 'eom'.
+ * return:
+ *	boolean.
+ */
+static int
+name_eq(const u_char *dn, const u_char *msg, const u_char *cp,
+	const u_char *eom)
+{
+	int n, hops;
+
+	hops = 0;
+	while (cp < eom) {
+		n = *cp++;
+		switch (n & NS_CMPRSFLGS) {
+		case 0:			/* normal case, n == len */
+			if (n != *dn++ || cp + n > eom)
+				return (0);
+			if (n == 0)
+				return (1);
+			for ((void)NULL; n > 0; n--)
+				if (mklower(*dn++) != mklower(*cp++))
+					return (0);
+			break;
+		case NS_CMPRSFLGS:	/* indirection */
+			if (cp >= eom || ++hops > MAXLABELS)
+				return (0);
+			cp = msg + (((n & 0x3f) << 8) | *cp);
+			break;
+		default:		/* bitstring or illegal type */
+			return (0);
+		}
+	}
+	return (0);
+}
+
+/*
+ * cctx_find(ctx, dn, hash, eom)
+ *	Search the context for a name before 'eom' equal to 'dn', whose
+ *	hash is 'hash'.
+ * return:
+ *	offset from the message if found, or -1.
+ */
+static int
+cctx_find(const ns_cctx *ctx, const u_char *dn, u_int32_t hash,
+	  const u_char *eom)
+{
+	int i, off;
+
+	for (i = ctx->_buckets[hash & (NS_CCTX_BUCKETS - 1)]; i != 0;
+	     i = ctx->_entries[i - 1].next) {
+		if (ctx->_entries[i - 1].hash != hash)
+			continue;
+		off = ctx->_entries[i - 1].offset;
+		if (ctx->_msg + off < eom &&
+		    name_eq(dn, ctx->_msg, ctx->_msg + off, eom))
+			return (off);
 	}
-	__set_errno (ENOENT);
 	return (-1);
 }
+
+/*
+ * cctx_enter(ctx, hash, cp)
+ *	Add the name at 'cp' in the message, whose hash is 'hash'.
+ */
+static void
+cctx_enter(ns_cctx *ctx, u_int32_t hash, const u_char *cp)
+{
+	u_int16_t *bucket;
+	int i;
+
+	if (ctx->_count >= NS_CCTX_ENTRIES || cp - ctx->_msg >= 0x4000)
+		return;
+	i = ctx->_count++;
+	bucket = &ctx->_buckets[hash & (NS_CCTX_BUCKETS - 1)];
+	ctx->_entries[i].hash = hash;
+	ctx->_entries[i].offset = cp - ctx->_msg;
+	ctx->_entries[i].next = *bucket;
+	*bucket = i + 1;
+}
+
+/*
+ * cctx_enter_name(ctx, cp)
+ *	Add the suffixes of the compressed name at 'cp' that are written
+ *	out there, up to any compression pointer.
+ */
+static void
+cctx_enter_name(ns_cctx *ctx, const u_char *cp)
+{
+	u_char tmp[NS_MAXCDNAME];
+	const u_char *labels[MAXLABELS];
+	u_int32_t hashes[MAXLABELS];
+	const u_char *sp;
+	int i, count;
+
+	if (cp < ctx->_msg ||
+	    ns_name_unpack(ctx->_msg, cp + NS_MAXCDNAME, cp, tmp,
+			   sizeof tmp) < 0)
+		return;
+	i = name_suffixes(tmp, labels, hashes, &count);
+	for ((void)NULL; i < count; i++) {
+		/* Labels before a pointer lie as they do in 'tmp'. */
+		for (sp = cp; sp < cp + (labels[i] - tmp); sp += *sp + 1)
+			if ((*sp & NS_CMPRSFLGS) != 0)
+				return;
+		if ((*sp & NS_CMPRSFLGS) != 0)
+			return;
+		cctx_enter(ctx, hashes[i], sp);
+	}
+}
+
+/*
+ * cpack(src, dst, dstsiz, ctx, enter)
+ *	Pack a domain name, compressing it against the names in 'ctx' if
+ *	that isn't NULL and adding its suffixes to it if 'enter' is set.
+ * return:
+ *	Size of the compressed name, or -1 (with errno set).
+ */
+static int
+cpack(const u_char *src, u_char *dst, int dstsiz, ns_cctx *ctx, int enter)
+{
+	const u_char *labels[MAXLABELS];
+	u_int32_t hashes[MAXLABELS];
+	const u_char *srcp;
+	int n, l, i, first, count, off;
+
+	/* make sure the domain we are about to add is legal */
+	srcp = src;
+	l = 0;
+	do {
+		n = *srcp;
+		if ((n & NS_CMPRSFLGS) != 0 && n != 0x41) {
+			__set_errno (EMSGSIZE);
+			return (-1);
+		}
+		if (n == 0x41)
+			n = *++srcp / 8;
+		l += n + 1;
+		if (l > MAXCDNAME) {
+			__set_errno (EMSGSIZE);
+			return (-1);
+		}
+		srcp += n + 1;
+	} while (n != 0);
+
+	/* Look for the longest suffix we can point at. */
+	if (ctx == NULL || ctx->_msg == NULL || dst < ctx->_msg)
+		ctx = NULL;
+	first = i = count = 0;
+	off = -1;
+	if (ctx != NULL)
+		for (i = first = name_suffixes(src, labels, hashes, &count);
+		     i < count; i++)
+			if ((off = cctx_find(ctx, labels[i], hashes[i],
+					     dst)) >= 0)
+				break;
+
+	/* A name copied whole keeps a byte spare, as it always has. */
+	l = (i < count ? labels[i] : srcp) - src;
+	if (l + (i < count ? 2 : 1) > dstsiz) {
+		__set_errno (EMSGSIZE);
+		return (-1);
+	}
+	memcpy(dst, src, l);
+	if (i < count) {
+		dst[l++] = (off >> 8) | NS_CMPRSFLGS;
+		dst[l++] = off % 256;
+	}
+	if (enter && ctx != NULL)
+		while (i-- > first)
+			cctx_enter(ctx, hashes[i], dst + (labels[i] - src));
+	return (l);
+}
+
+static void
+dnptrs_key_init(void)
+{
+	dnptrs_keyok = pthread_key_create(&dnptrs_key, free) == 0;
+}
+
+/*
+ * dnptrs_cctx(dnptrs, nptrs)
+ *	Bring the calling thread's context up to date with the 'nptrs'
+ *	names in 'dnptrs'.
+ * return:
+ *	the context, or NULL if there is none.
+ */
+static struct dnptrs_cctx *
+dnptrs_cctx(const u_char **dnptrs, int nptrs)
+{
+	struct dnptrs_cctx *dc;
+
+	if (pthread_once(&dnptrs_once, dnptrs_key_init) != 0 ||
+	    !dnptrs_keyok)
+		return (NULL);
+	if ((dc = pthread_getspecific(dnptrs_key)) == NULL) {
+		if ((dc = calloc(1, sizeof *dc)) == NULL)
+			return (NULL);
+		if (pthread_setspecific(dnptrs_key, dc) != 0) {
+			free(dc);
+			return (NULL);
+		}
+	}
+	/* A new message, or names taken back off this one. */
+	if (dc->dnptrs != dnptrs || dc->ctx._msg != dnptrs[0] ||
+	    nptrs < dc->nptrs ||
+	    (dc->nptrs > 0 && dnptrs[dc->nptrs] != dc->last)) {
+		ns_cctx_init(&dc->ctx, dnptrs[0]);
+		dc->dnptrs = dnptrs;
+		dc->nptrs = 0;
+	}
+	while (dc->nptrs < nptrs)
+		cctx_enter_name(&dc->ctx, dnptrs[++dc->nptrs]);
+	dc->last = nptrs > 0 ? dnptrs[nptrs] : NULL;
+	return (dc);
+}
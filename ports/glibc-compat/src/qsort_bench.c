@@ -0,0 +1,127 @@
+/* Copyright 2014 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. */
+
+/*
+ * Times qsort_r against the C library's qsort on random, sorted, reversed
+ * and many-duplicate inputs, for elements of several sizes.  With newlib
+ * qsort is the Bentley & McIlroy quicksort qsort_r was first copied from,
+ * so the two columns compare the old sort with the new one.
+ *
+ * Usage: qsort_bench [-n count] [-r rounds]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+void qsort_r(void *base, size_t nmemb, size_t size,
+             int (*compar)(const void *, const void *, void *), void *arg);
+
+/* Elements are ordered by the unsigned key in their first four bytes. */
+static int compare(const void *a, const void *b) {
+  uint32_t x, y;
+  memcpy(&x, a, sizeof(x));
+  memcpy(&y, b, sizeof(y));
+  return (x > y) - (x < y);
+}
+
+static int compare_r(const void *a, const void *b, void *arg) {
+  return compare(a, b);
+}
+
+static const char *pattern_names[] = {
+  "random", "sorted", "reversed", "duplicates"
+};
+
+static void fill(char *buf, size_t count, size_t size, int pattern) {
+  size_t i;
+  srand(1);
+  memset(buf, 0, count * size);
+  for (i = 0; i < count; i++) {
+    uint32_t key;
+    switch (pattern) {
+      case 0: key = rand(); break;
+      case 1: key = i; break;
+      case 2: key = count - i; break;
+      default: key = rand() % 16; break;
+    }
+    memcpy(buf + i * size, &key, sizeof(key));
+  }
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Best of rounds, in nanoseconds per element. */
+static double time_sort(const char *src, char *buf, size_t count, size_t size,
+                        int rounds, int use_qsort_r) {
+  double best = 0;
+  int i;
+  for (i = 0; i < rounds; i++) {
+    double start;
+    memcpy(buf, src, count * size);
+    start = now();
+    if (use_qsort_r)
+      qsort_r(buf, count, size, compare_r, NULL);
+    else
+      qsort(buf, count, size, compare);
+    start = now() - start;
+    if (i == 0 || start < best)
+      best = start;
+  }
+  return best * 1e9 / count;
+}
+
+int main(int argc, char **argv) {
+  static const size_t sizes[] = { 4, 8, 24, 6 };
+  size_t count = 100000;
+  int rounds = 5;
+  size_t s;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+    switch (opt) {
+      case 'n': count = strtoul(optarg, NULL, 0); break;
+      case 'r': rounds = atoi(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-n count] [-r rounds]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (count < 1 || rounds < 1) {
+    fprintf(stderr, "%s: count and rounds must be positive\n", argv[0]);
+    return 1;
+  }
+
+  printf("%zu elements, best of %d, ns per element\n", count, rounds);
+  printf("%-4s  %-10s  %10s  %10s  %7s\n", "size", "input", "qsort",
+         "qsort_r", "speedup");
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t size = sizes[s];
+    char *src = malloc(count * size);
+    char *buf = malloc(count * size);
+    int pattern;
+    if (!src || !buf) {
+      fprintf(stderr, "%s: out of memory\n", argv[0]);
+      return 1;
+    }
+    for (pattern = 0; pattern < 4; pattern++) {
+      double old_ns, new_ns;
+      fill(src, count, size, pattern);
+      old_ns = time_sort(src, buf, count, size, rounds, 0);
+      new_ns = time_sort(src, buf, count, size, rounds, 1);
+      printf("%-4zu  %-10s  %10.1f  %10.1f  %6.2fx\n", size,
+             pattern_names[pattern], old_ns, new_ns, old_ns / new_ns);
+    }
+    free(src);
+    free(buf);
+  }
+  return 0;
+}
@@ -1,9 +1,13 @@
 /*
- * This is an implementation of qsort_r that is copied from the newlib
- * implementation of qsort.
- *
- * The only difference is that it takes a fifth argument, an opaque pointer,
+ * This is an implementation of qsort_r that started as a copy of the newlib
+ * implementation of qsort, and takes a fifth argument, an opaque pointer,
  * which is passed to the comparison function as a third parameter.
+ *
+ * It has since become an introsort:  the Bentley & McIlroy quicksort is
+ * kept, but runs of a few elements are insertion sorted, a partition that
+ * went too deep falls back to heapsort so that no input can make it
+ * quadratic, and elements of four and eight bytes, or of any multiple of
+ * a long, are swapped a word at a time by code specialized for each.
  */
 
 /*
@@ -82,151 +86,312 @@ PORTABILITY
  * SUCH DAMAGE.
  */
 
-#include <_ansi.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
-#ifndef __GNUC__
-#define inline
+#ifdef __GNUC__
+#define always_inline   inline __attribute__((always_inline))
+#else
+#define always_inline
 #endif
 
-static inline char      *med3 _PARAMS((char *, char *, char *, int (*)(), void *));
-static inline void       swapfunc _PARAMS((char *, char *, int, int));
-
-#define min(a, b)       (a) < (b) ? a : b
+typedef int cmp_t(const void *, const void *, void *);
 
 /*
- * Qsort routine from Bentley & McIlroy's "Engineering a Sort Function".
+ * How elements are exchanged, picked once per call from the element size
+ * and the alignment of the array.  Each has its own copy of the sort.
  */
-#define swapcode(TYPE, parmi, parmj, n) {               \
-        long i = (n) / sizeof (TYPE);                   \
-        register TYPE *pi = (TYPE *) (parmi);           \
-        register TYPE *pj = (TYPE *) (parmj);           \
-        do {                                            \
-                register TYPE   t = *pi;                \
-                *pi++ = *pj;                            \
-                *pj++ = t;                              \
-        } while (--i > 0);                              \
-}
+#define SWAP_INT32      0       /* four byte elements, four byte aligned */
+#define SWAP_INT64      1       /* eight byte elements, eight byte aligned */
+#define SWAP_LONGS      2       /* multiples of a long, long aligned */
+#define SWAP_BYTES      3       /* anything else */
 
-#define SWAPINIT(a, es) swaptype = ((char *)a - (char *)0) % sizeof(long) || \
-        es % sizeof(long) ? 2 : es == sizeof(long)? 0 : 1;
+#define INSERTION_MAX   12      /* runs this short are insertion sorted */
+#define NINTHER_MIN     40      /* runs longer take the median of 3 medians */
 
-static inline void
-_DEFUN(swapfunc, (a, b, n, swaptype),
-        char *a _AND
-        char *b _AND
-        int n _AND
-        int swaptype)
+#define min(a, b)       (a) < (b) ? a : b
+
+static void sort_int32(char *, size_t, size_t, cmp_t *, void *, int);
+static void sort_int64(char *, size_t, size_t, cmp_t *, void *, int);
+static void sort_longs(char *, size_t, size_t, cmp_t *, void *, int);
+static void sort_bytes(char *, size_t, size_t, cmp_t *, void *, int);
+
+static always_inline void
+swap(char *a, char *b, size_t es, int swaptype)
 {
-        if(swaptype <= 1) 
-                swapcode(long, a, b, n)
-        else
-                swapcode(char, a, b, n)
+        switch (swaptype) {
+        case SWAP_INT32: {
+                uint32_t t, u;
+                memcpy(&t, a, 4);
+                memcpy(&u, b, 4);
+                memcpy(a, &u, 4);
+                memcpy(b, &t, 4);
+                break;
+        }
+        case SWAP_INT64: {
+                uint64_t t, u;
+                memcpy(&t, a, 8);
+                memcpy(&u, b, 8);
+                memcpy(a, &u, 8);
+                memcpy(b, &t, 8);
+                break;
+        }
+        case SWAP_LONGS: {
+                long *pa = (long *) a;
+                long *pb = (long *) b;
+                size_t i = es / sizeof (long);
+                do {
+                        long t = *pa;
+                        *pa++ = *pb;
+                        *pb++ = t;
+                } while (--i > 0);
+                break;
+        }
+        default: {
+                size_t i = es;
+                do {
+                        char t = *a;
+                        *a++ = *b;
+                        *b++ = t;
+                } while (--i > 0);
+                break;
+        }
+        }
+}
+
+/* Exchange the n bytes at a and b, a whole number of elements. */
+static always_inline void
+vecswap(char *a, char *b, size_t n, size_t es, int swaptype)
+{
+        for (; n > 0; n -= es, a += es, b += es)
+                swap(a, b, es, swaptype);
 }
 
-#define swap(a, b)                                      \
-        if (swaptype == 0) {                            \
-                long t = *(long *)(a);                  \
-                *(long *)(a) = *(long *)(b);            \
-                *(long *)(b) = t;                       \
-        } else                                          \
-                swapfunc(a, b, es, swaptype)
-
-#define vecswap(a, b, n)        if ((n) > 0) swapfunc(a, b, n, swaptype)
-
-static inline char *
-_DEFUN(med3, (a, b, c, cmp, arg),
-        char *a _AND
-        char *b _AND
-        char *c _AND
-        int (*cmp)() _AND
-        void *arg)
+static always_inline char *
+med3(char *a, char *b, char *c, cmp_t *cmp, void *arg)
 {
         return cmp(a, b, arg) < 0 ?
                (cmp(b, c, arg) < 0 ? b : (cmp(a, c, arg) < 0 ? c : a ))
               :(cmp(b, c, arg) > 0 ? b : (cmp(a, c, arg) < 0 ? a : c ));
 }
 
-void
-_DEFUN(qsort_r, (a, n, es, cmp, arg),
-        void *a _AND
-        size_t n _AND
-        size_t es _AND
-        int (*cmp)() _AND
-        void *arg)
+static always_inline void
+insertion_sort(char *a, size_t n, size_t es, cmp_t *cmp, void *arg,
+               int swaptype)
 {
-        char *pa, *pb, *pc, *pd, *pl, *pm, *pn;
-        int d, r, swaptype, swap_cnt;
-
-loop:   SWAPINIT(a, es);
-        swap_cnt = 0;
-        if (n < 7) {
-                for (pm = (char *) a + es; pm < (char *) a + n * es; pm += es)
-                        for (pl = pm; pl > (char *) a && cmp(pl - es, pl, arg) > 0;
-                             pl -= es)
-                                swap(pl, pl - es);
-                return;
+        char *pl, *pm;
+
+        for (pm = a + es; pm < a + n * es; pm += es)
+                for (pl = pm; pl > a && cmp(pl - es, pl, arg) > 0; pl -= es)
+                        swap(pl, pl - es, es, swaptype);
+}
+
+/*
+ * Insertion sort a run that looks sorted already, giving up once it has
+ * taken as many swaps as there are elements, so that a run that was not
+ * costs no more than another partition would.  Returns nonzero when the
+ * run is sorted; otherwise it is left a permutation of what it was.
+ */
+static always_inline int
+partial_insertion_sort(char *a, size_t n, size_t es, cmp_t *cmp, void *arg,
+                       int swaptype)
+{
+        char *pl, *pm;
+        size_t budget = n;
+
+        for (pm = a + es; pm < a + n * es; pm += es)
+                for (pl = pm; pl > a && cmp(pl - es, pl, arg) > 0; pl -= es) {
+                        if (budget-- == 0)
+                                return 0;
+                        swap(pl, pl - es, es, swaptype);
+                }
+        return 1;
+}
+
+static always_inline void
+sift_down(char *a, size_t root, size_t n, size_t es, cmp_t *cmp, void *arg,
+          int swaptype)
+{
+        size_t child;
+
+        while ((child = 2 * root + 1) < n) {
+                if (child + 1 < n &&
+                    cmp(a + child * es, a + (child + 1) * es, arg) < 0)
+                        child++;
+                if (cmp(a + root * es, a + child * es, arg) >= 0)
+                        return;
+                swap(a + root * es, a + child * es, es, swaptype);
+                root = child;
+        }
+}
+
+static always_inline void
+heap_sort(char *a, size_t n, size_t es, cmp_t *cmp, void *arg, int swaptype)
+{
+        size_t i;
+
+        for (i = n / 2; i > 0; i--)
+                sift_down(a, i - 1, n, es, cmp, arg, swaptype);
+        for (i = n - 1; i > 0; i--) {
+                swap(a, a + i * es, es, swaptype);
+                sift_down(a, 0, i, es, cmp, arg, swaptype);
         }
-        pm = (char *) a + (n / 2) * es;
-        if (n > 7) {
+}
+
+static always_inline void
+sort_part(char *a, size_t n, size_t es, cmp_t *cmp, void *arg, int depth,
+          int swaptype)
+{
+        switch (swaptype) {
+        case SWAP_INT32:
+                sort_int32(a, n, es, cmp, arg, depth);
+                break;
+        case SWAP_INT64:
+                sort_int64(a, n, es, cmp, arg, depth);
+                break;
+        case SWAP_LONGS:
+                sort_longs(a, n, es, cmp, arg, depth);
+                break;
+        default:
+                sort_bytes(a, n, es, cmp, arg, depth);
+                break;
+        }
+}
+
+/*
+ * Qsort routine from Bentley & McIlroy's "Engineering a Sort Function",
+ * bounded by depth:  once that many partitions deep the run is heapsorted.
+ */
+static always_inline void
+introsort(char *a, size_t n, size_t es, cmp_t *cmp, void *arg, int depth,
+          int swaptype)
+{
+        char *pa, *pb, *pc, *pd, *pl, *pm, *pn;
+        size_t d, nl, nr;
+        int r, swap_cnt;
+
+        while (n > INSERTION_MAX) {
+                if (depth-- == 0) {
+                        heap_sort(a, n, es, cmp, arg, swaptype);
+                        return;
+                }
+                swap_cnt = 0;
                 pl = a;
-                pn = (char *) a + (n - 1) * es;
-                if (n > 40) {
+                pm = a + (n / 2) * es;
+                pn = a + (n - 1) * es;
+                if (n > NINTHER_MIN) {
                         d = (n / 8) * es;
                         pl = med3(pl, pl + d, pl + 2 * d, cmp, arg);
                         pm = med3(pm - d, pm, pm + d, cmp, arg);
                         pn = med3(pn - 2 * d, pn - d, pn, cmp, arg);
                 }
                 pm = med3(pl, pm, pn, cmp, arg);
-        }
-        swap(a, pm);
-        pa = pb = (char *) a + es;
-
-        pc = pd = (char *) a + (n - 1) * es;
-        for (;;) {
-                while (pb <= pc && (r = cmp(pb, a, arg)) <= 0) {
-                        if (r == 0) {
-                                swap_cnt = 1;
-                                swap(pa, pb);
-                                pa += es;
+                swap(a, pm, es, swaptype);
+                pa = pb = a + es;
+
+                pc = pd = a + (n - 1) * es;
+                for (;;) {
+                        while (pb <= pc && (r = cmp(pb, a, arg)) <= 0) {
+                                if (r == 0) {
+                                        swap_cnt = 1;
+                                        swap(pa, pb, es, swaptype);
+                                        pa += es;
+                                }
+                                pb += es;
                         }
-                        pb += es;
-                }
-                while (pb <= pc && (r = cmp(pc, a, arg)) >= 0) {
-                        if (r == 0) {
-                                swap_cnt = 1;
-                                swap(pc, pd);
-                                pd -= es;
+                        while (pb <= pc && (r = cmp(pc, a, arg)) >= 0) {
+                                if (r == 0) {
+                                        swap_cnt = 1;
+                                        swap(pc, pd, es, swaptype);
+                                        pd -= es;
+                                }
+                                pc -= es;
                         }
+                        if (pb > pc)
+                                break;
+                        swap(pb, pc, es, swaptype);
+                        swap_cnt = 1;
+                        pb += es;
                         pc -= es;
                 }
-                if (pb > pc)
-                        break;
-                swap(pb, pc);
-                swap_cnt = 1;
-                pb += es;
-                pc -= es;
-        }
-        if (swap_cnt == 0) {  /* Switch to insertion sort */
-                for (pm = (char *) a + es; pm < (char *) a + n * es; pm += es)
-                        for (pl = pm; pl > (char *) a && cmp(pl - es, pl, arg) > 0; 
-                             pl -= es)
-                                swap(pl, pl - es);
-                return;
-        }
 
-        pn = (char *) a + n * es;
-        r = min(pa - (char *)a, pb - pa);
-        vecswap(a, pb - r, r);
-        r = min(pd - pc, pn - pd - es);
-        vecswap(pb, pn - r, r);
-        if ((r = pb - pa) > es)
-                qsort_r(a, r / es, es, cmp, arg);
-        if ((r = pd - pc) > es) { 
-                /* Iterate rather than recurse to save stack space */
-                a = pn - r;
-                n = r / es;
-                goto loop;
+                pn = a + n * es;
+                d = min((size_t) (pa - a), (size_t) (pb - pa));
+                vecswap(a, pb - d, d, es, swaptype);
+                d = min((size_t) (pd - pc), (size_t) (pn - pd) - es);
+                vecswap(pb, pn - d, d, es, swaptype);
+                nl = (pb - pa) / es;
+                nr = (pd - pc) / es;
+
+                /*
+                 * Nothing moved, so the input may have been in order:
+                 * try finishing both sides off by insertion, which gives
+                 * up quickly if they are not nearly sorted after all.
+                 */
+                if (swap_cnt == 0 &&
+                    partial_insertion_sort(a, nl, es, cmp, arg, swaptype) &&
+                    partial_insertion_sort(pn - nr * es, nr, es, cmp, arg,
+                                           swaptype))
+                        return;
+
+                /* Recurse into the smaller side, iterate on the larger */
+                if (nl < nr) {
+                        sort_part(a, nl, es, cmp, arg, depth, swaptype);
+                        a = pn - nr * es;
+                        n = nr;
+                } else {
+                        sort_part(pn - nr * es, nr, es, cmp, arg, depth,
+                                  swaptype);
+                        n = nl;
+                }
         }
-/*              qsort_r(pn - r, r / es, es, cmp, arg);*/
+        insertion_sort(a, n, es, cmp, arg, swaptype);
+}
+
+static void
+sort_int32(char *a, size_t n, size_t es, cmp_t *cmp, void *arg, int depth)
+{
+        introsort(a, n, es, cmp, arg, depth, SWAP_INT32);
+}
+
+static void
+sort_int64(char *a, size_t n, size_t es, cmp_t *cmp, void *arg, int depth)
+{
+        introsort(a, n, es, cmp, arg, depth, SWAP_INT64);
+}
+
+static void
+sort_longs(char *a, size_t n, size_t es, cmp_t *cmp, void *arg, int depth)
+{
+        introsort(a, n, es, cmp, arg, depth, SWAP_LONGS);
+}
+
+static void
+sort_bytes(char *a, size_t n, size_t es, cmp_t *cmp, void *arg, int depth)
+{
+        introsort(a, n, es, cmp, arg, depth, SWAP_BYTES);
+}
+
+void
+qsort_r(void *base, size_t n, size_t es, cmp_t *cmp, void *arg)
+{
+        uintptr_t align = (uintptr_t) base | es;
+        int depth = 0;
+        size_t s;
+
+        if (n < 2 || es == 0)
+                return;
+        /* 2 * log2(n) partitions deep before giving up on quicksort */
+        for (s = n; s > 1; s >>= 1)
+                depth += 2;
+        if (es == 4 && align % 4 == 0)
+                sort_int32(base, n, es, cmp, arg, depth);
+        else if (es == 8 && align % 8 == 0)
+                sort_int64(base, n, es, cmp, arg, depth);
+        else if (align % sizeof (long) == 0)
+                sort_longs(base, n, es, cmp, arg, depth);
+        else
+                sort_bytes(base, n, es, cmp, arg, depth);
 }
@@ -4,19 +4,238 @@
  * found in the LICENSE file.
  */
 
+/*
+ * random() and friends, giving the same numbers for the same seed and
+ * state sizes as glibc.  The generator is the BSD additive feedback one:
+ * with a state of deg words, x[i] = x[i - deg] + x[i - deg + sep], and the
+ * top 31 bits of each sum are returned.  A state of less than 32 bytes
+ * is the old linear congruential generator instead.
+ *
+ * random(), srandom(), initstate() and setstate() share one state behind
+ * a mutex, as they must for seeding in one thread to take effect in
+ * another.  Threads that each want their own numbers should give each its
+ * own struct random_data and call random_r(), which takes no lock.
+ *
+ * TODO(sbc): remove this once these get added to newlib.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+enum { TYPE_0, TYPE_1, TYPE_2, TYPE_3, TYPE_4, MAX_TYPES };
+
+/* Words of state, and the distance between the two taps, for each type. */
+static const int degrees[MAX_TYPES] = { 0, 7, 15, 31, 63 };
+static const int seps[MAX_TYPES] = { 0, 3, 1, 3, 1 };
+
+/* The smallest state, in bytes, that holds each type. */
+#define BREAK_0 8
+#define BREAK_1 32
+#define BREAK_2 64
+#define BREAK_3 128
+#define BREAK_4 256
+
+int random_r(struct random_data *buf, int32_t *result) __attribute__((weak));
+int random_r(struct random_data *buf, int32_t *result) {
+  int32_t *state;
+
+  if (buf == NULL || result == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  state = buf->state;
+  if (buf->rand_type == TYPE_0) {
+    *result = (state[0] * 1103515245U + 12345U) & 0x7fffffff;
+    state[0] = *result;
+  } else {
+    int32_t *fptr = buf->fptr;
+    int32_t *rptr = buf->rptr;
+    uint32_t val;
+
+    val = *fptr += (uint32_t)*rptr;
+    *result = val >> 1;
+    if (++fptr >= buf->end_ptr) {
+      fptr = state;
+      ++rptr;
+    } else if (++rptr >= buf->end_ptr) {
+      rptr = state;
+    }
+    buf->fptr = fptr;
+    buf->rptr = rptr;
+  }
+  return 0;
+}
+
+int srandom_r(unsigned int seed, struct random_data *buf)
+    __attribute__((weak));
+int srandom_r(unsigned int seed, struct random_data *buf) {
+  int32_t *state;
+  int32_t word, discard;
+  int i, kc;
+
+  if (buf == NULL || (unsigned int)buf->rand_type >= MAX_TYPES) {
+    errno = EINVAL;
+    return -1;
+  }
+  state = buf->state;
+  if (seed == 0)
+    seed = 1;
+  state[0] = seed;
+  if (buf->rand_type == TYPE_0)
+    return 0;
+
+  /* state[i] = 16807 * state[i - 1] % 2147483647, in 32 bits (Schrage). */
+  word = seed;
+  kc = buf->rand_deg;
+  for (i = 1; i < kc; i++) {
+    int32_t hi = word / 127773;
+    int32_t lo = word % 127773;
+    word = 16807 * lo - 2836 * hi;
+    if (word < 0)
+      word += 2147483647;
+    state[i] = word;
+  }
+  buf->fptr = &state[buf->rand_sep];
+  buf->rptr = &state[0];
+  for (kc *= 10; kc > 0; kc--)
+    random_r(buf, &discard);
+  return 0;
+}
+
 /*
- * Implemenat random/srandom in terms of rand/srand.
- * TODO(sbc): remove this once these get added to newlib.
+ * The word before a state records its type and where its rear tap is, so
+ * that setstate() can pick it up again.
+ */
+static void save_position(struct random_data *buf) {
+  if (buf->rand_type == TYPE_0)
+    buf->state[-1] = TYPE_0;
+  else
+    buf->state[-1] = MAX_TYPES * (buf->rptr - buf->state) + buf->rand_type;
+}
+
+int initstate_r(unsigned int seed, char *statebuf, size_t statelen,
+                struct random_data *buf) __attribute__((weak));
+int initstate_r(unsigned int seed, char *statebuf, size_t statelen,
+                struct random_data *buf) {
+  int32_t *state;
+  int type;
+
+  if (buf == NULL || statebuf == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  /* glibc saves the old position even when the new state is too small. */
+  if (buf->state != NULL)
+    save_position(buf);
+  if (statelen < BREAK_0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (statelen >= BREAK_3)
+    type = statelen < BREAK_4 ? TYPE_3 : TYPE_4;
+  else if (statelen >= BREAK_1)
+    type = statelen < BREAK_2 ? TYPE_1 : TYPE_2;
+  else
+    type = TYPE_0;
+
+  state = (int32_t *)statebuf + 1;
+  buf->rand_type = type;
+  buf->rand_deg = degrees[type];
+  buf->rand_sep = seps[type];
+  buf->state = state;
+  buf->end_ptr = &state[buf->rand_deg];
+  srandom_r(seed, buf);
+  save_position(buf);
+  return 0;
+}
+
+int setstate_r(char *statebuf, struct random_data *buf) __attribute__((weak));
+int setstate_r(char *statebuf, struct random_data *buf) {
+  int32_t *state;
+  int type, rear;
+
+  if (statebuf == NULL || buf == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (buf->state != NULL)
+    save_position(buf);
+  state = (int32_t *)statebuf + 1;
+  type = state[-1] % MAX_TYPES;
+  if (type < TYPE_0) {
+    errno = EINVAL;
+    return -1;
+  }
+  buf->rand_type = type;
+  buf->rand_deg = degrees[type];
+  buf->rand_sep = seps[type];
+  if (type != TYPE_0) {
+    rear = state[-1] / MAX_TYPES;
+    buf->rptr = &state[rear];
+    buf->fptr = &state[(rear + buf->rand_sep) % buf->rand_deg];
+  }
+  buf->state = state;
+  buf->end_ptr = &state[buf->rand_deg];
+  return 0;
+}
+
+/*
+ * The state random() starts with, 128 bytes as in glibc.  It is seeded
+ * with 1 on first use.
  */
+static pthread_mutex_t random_lock = PTHREAD_MUTEX_INITIALIZER;
+static int32_t randtbl[BREAK_3 / sizeof(int32_t)];
+static struct random_data random_state;
+
+static void random_state_init(void) {
+  if (random_state.state == NULL)
+    initstate_r(1, (char *)randtbl, sizeof(randtbl), &random_state);
+}
 
 long int random(void) __attribute__((weak));
 long int random(void) {
-  return rand();
+  int32_t result;
+
+  pthread_mutex_lock(&random_lock);
+  random_state_init();
+  random_r(&random_state, &result);
+  pthread_mutex_unlock(&random_lock);
+  return result;
 }
 
 void srandom(unsigned int seed) __attribute__((weak));
 void srandom(unsigned int seed) {
-  srand(seed);
+  pthread_mutex_lock(&random_lock);
+  random_state_init();
+  srandom_r(seed, &random_state);
+  pthread_mutex_unlock(&random_lock);
+}
+
+char *initstate(unsigned int seed, char *statebuf, size_t statelen)
+    __attribute__((weak));
+char *initstate(unsigned int seed, char *statebuf, size_t statelen) {
+  char *old;
+
+  pthread_mutex_lock(&random_lock);
+  random_state_init();
+  old = (char *)(random_state.state - 1);
+  if (initstate_r(seed, statebuf, statelen, &random_state) < 0)
+    old = NULL;
+  pthread_mutex_unlock(&random_lock);
+  return old;
+}
+
+char *setstate(char *statebuf) __attribute__((weak));
+char *setstate(char *statebuf) {
+  char *old;
+
+  pthread_mutex_lock(&random_lock);
+  random_state_init();
+  old = (char *)(random_state.state - 1);
+  if (setstate_r(statebuf, &random_state) < 0)
+    old = NULL;
+  pthread_mutex_unlock(&random_lock);
+  return old;
 }
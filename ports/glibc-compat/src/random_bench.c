@@ -0,0 +1,111 @@
+/* Copyright 2014 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. */
+
+/*
+ * Times drawing numbers from several threads at once the way a simulation
+ * does: through random(), which every thread shares behind a lock, through
+ * random_r() with a state for each thread, and through rand(), which is
+ * what random() used to be.
+ *
+ * Usage: random_bench [-n numbers per thread] [-t most threads]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAXTHREADS 64
+
+enum { RANDOM, RANDOM_R, RAND };
+
+struct worker {
+  pthread_t thread;
+  int how;
+  int count;
+  struct random_data data;
+  char state[128];
+  long sum;
+};
+
+static struct worker workers[MAXTHREADS];
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* work(void* arg) {
+  struct worker* w = arg;
+  int32_t r;
+  long sum = 0;
+  int i;
+
+  for (i = 0; i < w->count; i++) {
+    switch (w->how) {
+      case RANDOM: sum += random(); break;
+      case RANDOM_R: random_r(&w->data, &r); sum += r; break;
+      default: sum += rand(); break;
+    }
+  }
+  w->sum = sum;
+  return NULL;
+}
+
+/* Millions of numbers a second, from all the threads together. */
+static double time_threads(int how, int threads, int count) {
+  double start = now();
+  int i;
+
+  for (i = 0; i < threads; i++) {
+    struct worker* w = &workers[i];
+    w->how = how;
+    w->count = count;
+    w->data.state = NULL;
+    initstate_r(i + 1, w->state, sizeof(w->state), &w->data);
+    if (pthread_create(&w->thread, NULL, work, w) != 0) {
+      fprintf(stderr, "cannot start thread %d\n", i);
+      exit(1);
+    }
+  }
+  for (i = 0; i < threads; i++)
+    pthread_join(workers[i].thread, NULL);
+  return threads * (double)count / (now() - start) / 1e6;
+}
+
+int main(int argc, char** argv) {
+  static const char* how[] = {"random", "random_r", "rand"};
+  int count = 1000000, max_threads = 8, opt, t, i;
+
+  while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+    switch (opt) {
+      case 'n': count = atoi(optarg); break;
+      case 't': max_threads = atoi(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-n numbers per thread] [-t most threads]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (count < 1 || max_threads < 1 || max_threads > MAXTHREADS) {
+    fprintf(stderr, "%s: need a number and 1 to %d threads\n", argv[0],
+            MAXTHREADS);
+    return 1;
+  }
+
+  printf("%d numbers per thread, millions per second\n", count);
+  printf("threads %10s %10s %10s\n", how[RANDOM], how[RANDOM_R], how[RAND]);
+  for (t = 1;; t = t * 2 < max_threads ? t * 2 : max_threads) {
+    printf("%7d", t);
+    for (i = RANDOM; i <= RAND; i++)
+      printf(" %10.1f", time_threads(i, t, count));
+    printf("\n");
+    if (t == max_threads)
+      break;
+  }
+  return 0;
+}
@@ -11,11 +11,104 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+/*
+ * Directories realpath() has already stat'ed, so that resolving many paths
+ * under the same prefix (as build tools do) costs a stat for each new
+ * component only; on html5fs or httpfs every stat is a round trip.  Only
+ * the prefixes are taken from here: the whole path is always stat'ed, so a
+ * missing file is still reported, and a directory followed by ".." is
+ * stat'ed too, since going back up would hide its being gone.  The table
+ * is bounded, each slot holding whichever directory last hashed to it, and
+ * an entry is only good for the epoch it was made in.
+ * realpath_cache_invalidate() starts a new epoch and should be called
+ * after anything that removes or moves a directory: rename, unlink, rmdir,
+ * symlink or a mount.  A path that turns out to be missing starts one
+ * too, in case it was a cached prefix that went.
+ */
+#define DIR_CACHE_SIZE 256  // slots, a power of two
+
+struct dir_cache_entry {
+  unsigned epoch;
+  unsigned hash;
+  char* path;
+};
+
+static pthread_mutex_t dir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dir_cache_entry dir_cache[DIR_CACHE_SIZE];
+static unsigned dir_cache_epoch = 1;  // empty slots have epoch 0
+
+void realpath_cache_invalidate(void) {
+  pthread_mutex_lock(&dir_cache_lock);
+  if (++dir_cache_epoch == 0)
+    dir_cache_epoch = 1;
+  pthread_mutex_unlock(&dir_cache_lock);
+}
+
+static unsigned hash_path(const char* path) {
+  unsigned h = 2166136261U;  // FNV-1a
+  while (*path)
+    h = (h ^ (unsigned char)*path++) * 16777619U;
+  return h;
+}
+
+static int dir_cached(const char* path, unsigned hash) {
+  struct dir_cache_entry* e = &dir_cache[hash & (DIR_CACHE_SIZE - 1)];
+  int found;
+
+  pthread_mutex_lock(&dir_cache_lock);
+  found = e->epoch == dir_cache_epoch && e->hash == hash &&
+          strcmp(e->path, path) == 0;
+  pthread_mutex_unlock(&dir_cache_lock);
+  return found;
+}
+
+static void dir_cache_enter(const char* path, unsigned hash) {
+  struct dir_cache_entry* e = &dir_cache[hash & (DIR_CACHE_SIZE - 1)];
+  char* copy = strdup(path);
+
+  if (copy == NULL)
+    return;
+  pthread_mutex_lock(&dir_cache_lock);
+  free(e->path);
+  e->epoch = dir_cache_epoch;
+  e->hash = hash;
+  e->path = copy;
+  pthread_mutex_unlock(&dir_cache_lock);
+}
+
+/*
+ * Succeeds if path is a directory, from the cache if it can and use_cache
+ * is set.  Fails with errno set as by stat(), or to ENOTDIR.
+ */
+static int check_dir(const char* path, int use_cache) {
+  unsigned hash = hash_path(path);
+  struct stat statbuf;
+
+  if (use_cache && dir_cached(path, hash))
+    return 0;
+  if (stat(path, &statbuf) != 0)
+    return -1;
+  if (!S_ISDIR(statbuf.st_mode)) {
+    errno = ENOTDIR;
+    return -1;
+  }
+  dir_cache_enter(path, hash);
+  return 0;
+}
+
+// Is the next name in the rest of a path ".."?
+static int dotdot_next(const char* in) {
+  while (*in == '/')
+    in++;
+  return in[0] == '.' && in[1] == '.' && (in[2] == '/' || in[2] == 0);
+}
+
 char* realpath(const char* path, char* resolved_path) {
   if (path == NULL) {
     errno = EINVAL;
@@ -49,7 +142,7 @@ char* realpath(const char* path, char* resolved_path) {
     out += strlen(out);
   }
 
-  if (stat(resolved_path, &statbuf) != 0)
+  if (check_dir(resolved_path, !dotdot_next(in)) != 0)
     goto fail;
 
   while (!done) {
@@ -104,13 +197,17 @@ char* realpath(const char* path, char* resolved_path) {
 
     in = next_in;
 
-    if (stat(resolved_path, &statbuf) != 0)
-      goto fail;
-
     // If there is more to the path, then the current path must be a directory.
-    if (!done && !S_ISDIR(statbuf.st_mode)) {
-      errno = ENOTDIR;
-      goto fail;
+    if (!done) {
+      if (check_dir(resolved_path, !dotdot_next(in)) != 0)
+        goto fail;
+    } else {
+      if (stat(resolved_path, &statbuf) != 0) {
+        realpath_cache_invalidate();
+        goto fail;
+      }
+      if (S_ISDIR(statbuf.st_mode))
+        dir_cache_enter(resolved_path, hash_path(resolved_path));
     }
   }
 
@@ -0,0 +1,112 @@
+/* Copyright 2014 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. */
+
+/*
+ * Times realpath on many files in one deep directory, the way a build tool
+ * resolves its inputs: with realpath's directory cache forgotten before
+ * each call, so that every prefix is stat'ed as it used to be, and with it
+ * kept.  The tree is made under the given directory, which can be on a
+ * slow mount such as html5fs to see what the stats there cost.
+ *
+ * Usage: realpath_bench [-d directory] [-l levels] [-n files]
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Microseconds per path resolved. */
+static double time_realpath(const char* dir, int files, int cached) {
+  char path[PATH_MAX], resolved[PATH_MAX];
+  double start = now();
+  int i;
+
+  for (i = 0; i < files; i++) {
+    if (!cached)
+      realpath_cache_invalidate();
+    snprintf(path, sizeof(path), "%s/../d/file%d.c", dir, i);
+    if (realpath(path, resolved) == NULL) {
+      perror(path);
+      exit(1);
+    }
+  }
+  return (now() - start) * 1e6 / files;
+}
+
+int main(int argc, char** argv) {
+  char base[PATH_MAX] = "/tmp/realpath_bench_XXXXXX";
+  char dir[PATH_MAX];
+  int levels = 8, files = 1000, i, opt;
+  double uncached, cached;
+  FILE* f;
+
+  while ((opt = getopt(argc, argv, "d:l:n:")) != -1) {
+    switch (opt) {
+      case 'd':
+        snprintf(base, sizeof(base), "%s/realpath_bench_XXXXXX", optarg);
+        break;
+      case 'l': levels = atoi(optarg); break;
+      case 'n': files = atoi(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-d directory] [-l levels] [-n files]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (levels < 1 || levels > 64 || files < 1) {
+    fprintf(stderr, "%s: need 1 to 64 levels and a file\n", argv[0]);
+    return 1;
+  }
+  if (mkdtemp(base) == NULL) {
+    perror(base);
+    return 1;
+  }
+
+  snprintf(dir, sizeof(dir), "%s", base);
+  for (i = 0; i < levels; i++) {
+    snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "/d");
+    if (mkdir(dir, 0755) != 0) {
+      perror(dir);
+      return 1;
+    }
+  }
+  for (i = 0; i < files; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/file%d.c", dir, i);
+    if ((f = fopen(path, "w")) == NULL) {
+      perror(path);
+      return 1;
+    }
+    fclose(f);
+  }
+
+  printf("%d files, %d levels deep under %s\n", files, levels, base);
+  uncached = time_realpath(dir, files, 0);
+  printf("realpath, uncached:  %8.2f usec per path\n", uncached);
+  cached = time_realpath(dir, files, 1);
+  printf("realpath, cached:    %8.2f usec per path (%.1fx)\n", cached,
+         uncached / cached);
+
+  for (i = 0; i < files; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/file%d.c", dir, i);
+    unlink(path);
+  }
+  for (i = 0; i < levels; i++) {
+    rmdir(dir);
+    *strrchr(dir, '/') = '\0';
+  }
+  rmdir(base);
+  return 0;
+}
@@ -0,0 +1,552 @@
+/*
+ * Copyright (c) 2014 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * A resolver that does not block, for programs built around an event
+ * loop.  res_async_open takes the nameservers and options of a res_state
+ * and opens one datagram socket for them.  res_async_query formulates a
+ * query with res_nmkquery and sends it off.  The caller then polls
+ * res_async_fd for input, waiting no longer than res_async_timeout says,
+ * and calls res_async_process.  That reads whatever answers have come,
+ * matching them to their queries by id, sends the queries whose time is
+ * up to the next server, and calls back with each result.  Any number
+ * of queries may be in flight on the socket at once.
+ *
+ * A callback gets the h_errno that res_query would have left, and the
+ * answer if one came, which is valid until the callback returns.  It may
+ * start queries, cancel them and close the context, its own query and
+ * the context it is called from included; the close then waits until
+ * res_async_process returns.  Answers come from and go to the cache as
+ * for res_query, except that cached answers too big for UDP are not
+ * used.  There is no TCP here, but with RES_USE_EDNS0 answers of up to
+ * RES_EDNSBUFSIZE bytes come over UDP; a bigger one is handed back
+ * truncated, with tc set.  A query with OPT that is refused or times out
+ * is asked again without.  A context is for one thread at a time, and its
+ * res_state must outlive it.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <resolv.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "res_cache.h"
+
+#define ASYNC_BUCKETS	256		/* id hash chains, a power of two */
+#define ASYNC_MAXPACKET	65536		/* largest answer read */
+#define ASYNC_BACKOFF	10		/* msec, when the socket is full */
+/* with room for an OPT record */
+#define QUERYSIZE	(HFIXEDSZ + QFIXEDSZ + MAXCDNAME + 1 + 1 + RRFIXEDSZ)
+
+#define EXT(res) ((res)->_u._ext)
+
+struct async_query {
+	struct async_query *hnext;	/* id hash chain */
+	struct async_query *prev;	/* by deadline, soonest first */
+	struct async_query *next;
+	long long	deadline;	/* msec, by async_now() */
+	int		handle;
+	int		class;
+	int		type;
+	int		tries;		/* sends so far */
+	res_async_callback callback;
+	void		*arg;
+	u_char		*answer;	/* from the cache, to be handed back */
+	int		anslen;
+	int		qlen;
+	int		plainlen;	/* qlen without the OPT record */
+	u_char		query[QUERYSIZE];
+	char		name[1];
+};
+
+struct res_async {
+	res_state	statp;
+	int		fd;
+	int		nscount;
+	struct sockaddr_in6 nsaddrs[MAXNS];
+	socklen_t	nslens[MAXNS];
+	int		use_cache;
+	u_int32_t	scope;		/* of the cached answers */
+	int		next_handle;
+	int		pending;
+	int		processing;	/* in res_async_process */
+	int		closing;	/* closed by a callback */
+	struct async_query *buckets[ASYNC_BUCKETS];
+	struct async_query *head, *tail;
+	u_char		buf[ASYNC_MAXPACKET];
+};
+
+static long long
+async_now(void)
+{
+	struct timespec ts;
+	struct timeval tv;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (ts.tv_sec * 1000LL + ts.tv_nsec / 1000000);
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec * 1000LL + tv.tv_usec / 1000);
+}
+
+static u_int16_t
+query_id(const struct async_query *q)
+{
+	return (((const HEADER *) q->query)->id);
+}
+
+static struct async_query *
+find(struct res_async *ctx, u_int16_t id)
+{
+	struct async_query *q;
+
+	for (q = ctx->buckets[id & (ASYNC_BUCKETS - 1)]; q != NULL;
+	     q = q->hnext)
+		if (query_id(q) == id)
+			return (q);
+	return (NULL);
+}
+
+/* Put q on the deadline list, which mostly means at the end. */
+static void
+schedule(struct res_async *ctx, struct async_query *q, long long deadline)
+{
+	struct async_query *p;
+
+	q->deadline = deadline;
+	for (p = ctx->tail; p != NULL && p->deadline > deadline; p = p->prev)
+		;
+	q->prev = p;
+	q->next = p != NULL ? p->next : ctx->head;
+	if (q->next != NULL)
+		q->next->prev = q;
+	else
+		ctx->tail = q;
+	if (p != NULL)
+		p->next = q;
+	else
+		ctx->head = q;
+}
+
+static void
+unschedule(struct res_async *ctx, struct async_query *q)
+{
+	if (q->prev != NULL)
+		q->prev->next = q->next;
+	else
+		ctx->head = q->next;
+	if (q->next != NULL)
+		q->next->prev = q->prev;
+	else
+		ctx->tail = q->prev;
+}
+
+/* Forget q altogether. */
+static void
+drop(struct res_async *ctx, struct async_query *q)
+{
+	struct async_query **qp;
+
+	unschedule(ctx, q);
+	for (qp = &ctx->buckets[query_id(q) & (ASYNC_BUCKETS - 1)]; *qp != q;
+	     qp = &(*qp)->hnext)
+		;
+	*qp = q->hnext;
+	ctx->pending--;
+	free(q->answer);
+	free(q);
+}
+
+/*
+ * Send q to the server whose turn it is, and say when to give up on it.
+ * A round of the servers waits retrans seconds for each, and every round
+ * after the first twice as long as the one before.
+ */
+static void
+send_query(struct res_async *ctx, struct async_query *q, long long now)
+{
+	int ns = q->tries % ctx->nscount;
+	int round = q->tries / ctx->nscount;
+	long long deadline;
+
+	if (sendto(ctx->fd, q->query, q->qlen, 0,
+		   (struct sockaddr *) &ctx->nsaddrs[ns], ctx->nslens[ns])
+	    == q->qlen)
+		deadline = now + ((long long) ctx->statp->retrans * 1000
+				  << round);
+	else if (errno == EAGAIN || errno == EWOULDBLOCK ||
+		 errno == ENOBUFS || errno == EINTR) {
+		/* the socket is full; try the same server again soon */
+		unschedule(ctx, q);
+		schedule(ctx, q, now + ASYNC_BACKOFF);
+		return;
+	} else
+		deadline = now;	/* as good as a timeout; on to the next */
+	q->tries++;
+	unschedule(ctx, q);
+	schedule(ctx, q, deadline);
+}
+
+/* Take the OPT record off q, and off this res_state's queries to come. */
+static void
+drop_edns0(struct res_async *ctx, struct async_query *q)
+{
+	ctx->statp->_flags |= RES_F_EDNS0ERR;
+	((HEADER *) q->query)->arcount = htons(0);
+	q->qlen = q->plainlen;
+}
+
+/* The h_errno res_query would leave for an answer. */
+static int
+answer_status(const u_char *answer, int anslen)
+{
+	const HEADER *hp = (const HEADER *) answer;
+
+	if (answer == NULL || anslen < HFIXEDSZ)
+		return (TRY_AGAIN);
+	switch (hp->rcode) {
+	case NOERROR:
+		return (ntohs(hp->ancount) > 0 ? NETDB_SUCCESS : NO_DATA);
+	case NXDOMAIN:
+		return (HOST_NOT_FOUND);
+	case SERVFAIL:
+		return (TRY_AGAIN);
+	default:
+		return (NO_RECOVERY);
+	}
+}
+
+/* Take q off the books and tell its caller how it went. */
+static void
+finish(struct res_async *ctx, struct async_query *q, const u_char *answer,
+       int anslen)
+{
+	res_async_callback callback = q->callback;
+	void *arg = q->arg;
+	u_char *cached = q->answer;
+
+	q->answer = NULL;
+	drop(ctx, q);
+	(*callback)(arg, answer_status(answer, anslen), answer, anslen);
+	free(cached);
+}
+
+/* Is from one of our servers? */
+static int
+our_server(struct res_async *ctx, const struct sockaddr_in6 *from)
+{
+	const struct sockaddr_in *from4 = (const struct sockaddr_in *) from;
+	int ns;
+
+	for (ns = 0; ns < ctx->nscount; ns++) {
+		const struct sockaddr_in6 *sa6 = &ctx->nsaddrs[ns];
+		const struct sockaddr_in *sa4 =
+		    (const struct sockaddr_in *) sa6;
+
+		if (sa6->sin6_family != from->sin6_family)
+			continue;
+		if (sa6->sin6_family == AF_INET ?
+		    sa4->sin_port == from4->sin_port &&
+		    sa4->sin_addr.s_addr == from4->sin_addr.s_addr :
+		    sa6->sin6_port == from->sin6_port &&
+		    memcmp(&sa6->sin6_addr, &from->sin6_addr,
+			   sizeof from->sin6_addr) == 0)
+			return (1);
+	}
+	return (0);
+}
+
+/* Handle the answer of len bytes in ctx->buf, if it is one of ours. */
+static void
+receive(struct res_async *ctx, int len, const struct sockaddr_in6 *from,
+	long long now)
+{
+	const HEADER *hp = (const HEADER *) ctx->buf;
+	u_long options = ctx->statp->options;
+	struct async_query *q;
+
+	if (len < HFIXEDSZ || (q = find(ctx, hp->id)) == NULL ||
+	    q->answer != NULL)
+		return;		/* an old answer, or not one at all */
+	if (!(options & RES_INSECURE1) && !our_server(ctx, from))
+		return;
+	if (q->qlen != q->plainlen &&
+	    (hp->rcode == FORMERR || hp->rcode == NOTIMP)) {
+		/* the server will not have EDNS0; ask it again without */
+		drop_edns0(ctx, q);
+		q->tries--;
+		send_query(ctx, q, now);
+		return;
+	}
+	if (!(options & RES_INSECURE2) &&
+	    res_queriesmatch(q->query, q->query + q->qlen, ctx->buf,
+			     ctx->buf + len) <= 0)
+		return;
+	if ((hp->rcode == SERVFAIL || hp->rcode == NOTIMP ||
+	     hp->rcode == REFUSED) &&
+	    q->tries < ctx->statp->retry * ctx->nscount) {
+		/* ask the next server straight away */
+		send_query(ctx, q, now);
+		return;
+	}
+	if (ctx->use_cache && !hp->tc)
+		__res_cache_store(ctx->scope, q->name, q->class, q->type,
+				  ctx->buf, len);
+	finish(ctx, q, ctx->buf, len);
+}
+
+struct res_async *
+res_async_open(res_state statp)
+{
+	struct res_async *ctx;
+	struct sockaddr_in6 *sa6;
+	int family = AF_INET, ns, fl;
+
+	if ((statp->options & RES_INIT) == 0 && res_ninit(statp) == -1)
+		return (NULL);
+	if ((ctx = calloc(1, sizeof *ctx)) == NULL)
+		return (NULL);
+	ctx->statp = statp;
+	ctx->use_cache = (statp->options & RES_USECACHE) != 0 &&
+			 statp->qhook == NULL && statp->rhook == NULL;
+	if (ctx->use_cache)
+		ctx->scope = __res_cache_scope(statp);
+	ctx->next_handle = 1;
+
+	/* IPv6 servers are kept apart from nsaddr_list; see res_init.c */
+	for (ns = 0; ns < MAXNS; ns++) {
+		sa6 = EXT(statp).nsaddrs[ns];
+		if (sa6 != NULL && EXT(statp).nsmap[ns] == MAXNS + 1 &&
+		    sa6->sin6_family == AF_INET6)
+			family = AF_INET6;
+	}
+	ctx->fd = socket(family, SOCK_DGRAM, 0);
+	if (ctx->fd < 0 && family == AF_INET6)
+		ctx->fd = socket(family = AF_INET, SOCK_DGRAM, 0);
+	if (ctx->fd < 0) {
+		free(ctx);
+		return (NULL);
+	}
+	if ((fl = fcntl(ctx->fd, F_GETFL)) != -1)
+		fcntl(ctx->fd, F_SETFL, fl | O_NONBLOCK);
+
+	for (ns = 0; ns < statp->nscount && ctx->nscount < MAXNS; ns++) {
+		const struct sockaddr_in *sa4 = &statp->nsaddr_list[ns];
+
+		if (sa4->sin_family != AF_INET)
+			continue;
+		sa6 = &ctx->nsaddrs[ctx->nscount];
+		if (family == AF_INET6) {
+			/* IPv4-mapped, for the IPv6 socket */
+			sa6->sin6_family = AF_INET6;
+			sa6->sin6_port = sa4->sin_port;
+			sa6->sin6_addr.s6_addr[10] = 0xff;
+			sa6->sin6_addr.s6_addr[11] = 0xff;
+			memcpy(&sa6->sin6_addr.s6_addr[12], &sa4->sin_addr, 4);
+			ctx->nslens[ctx->nscount++] = sizeof *sa6;
+		} else {
+			memcpy(sa6, sa4, sizeof *sa4);
+			ctx->nslens[ctx->nscount++] = sizeof *sa4;
+		}
+	}
+	for (ns = 0; ns < MAXNS && family == AF_INET6 &&
+		     ctx->nscount < MAXNS; ns++) {
+		sa6 = EXT(statp).nsaddrs[ns];
+		if (sa6 != NULL && EXT(statp).nsmap[ns] == MAXNS + 1 &&
+		    sa6->sin6_family == AF_INET6) {
+			ctx->nsaddrs[ctx->nscount] = *sa6;
+			ctx->nslens[ctx->nscount++] = sizeof *sa6;
+		}
+	}
+	if (ctx->nscount == 0) {
+		close(ctx->fd);
+		free(ctx);
+		errno = ESRCH;
+		return (NULL);
+	}
+	return (ctx);
+}
+
+int
+res_async_fd(const struct res_async *ctx)
+{
+	return (ctx->fd);
+}
+
+/*
+ * Start a query like res_nquery's, with callback to be called by
+ * res_async_process once it is answered or given up on.  Returns a
+ * handle for res_async_cancel, or -1 with the error in H_ERRNO.
+ */
+int
+res_async_query(struct res_async *ctx, const char *name, int class,
+		int type, res_async_callback callback, void *arg)
+{
+	res_state statp = ctx->statp;
+	struct async_query *q;
+	size_t namelen = strlen(name);
+	u_char cached[RES_EDNSBUFSIZE];
+	u_int16_t id;
+	long long now = async_now();
+	int n, cachedlen = -1;
+
+	/* no bigger than an answer from the wire would be */
+	if (ctx->use_cache)
+		cachedlen = __res_cache_lookup(ctx->scope, name, class, type,
+					       cached, sizeof cached);
+	q = calloc(1, offsetof(struct async_query, name) + namelen + 1);
+	if (q == NULL) {
+		RES_SET_H_ERRNO(statp, NETDB_INTERNAL);
+		return (-1);
+	}
+	memcpy(q->name, name, namelen + 1);
+	q->class = class;
+	q->type = type;
+	q->callback = callback;
+	q->arg = arg;
+	n = res_nmkquery(statp, QUERY, name, class, type, NULL, 0, NULL,
+			 q->query, sizeof q->query);
+	if (n <= 0) {
+		free(q);
+		RES_SET_H_ERRNO(statp, NO_RECOVERY);
+		return (-1);
+	}
+	q->qlen = q->plainlen = n;
+	if ((statp->options & RES_USE_EDNS0) != 0 &&
+	    (statp->_flags & RES_F_EDNS0ERR) == 0 &&
+	    (n = res_nopt(statp, n, q->query, sizeof q->query,
+			  RES_EDNSBUFSIZE)) > 0)
+		q->qlen = n;
+
+	/* ids in flight must differ, for that is how answers find them */
+	id = query_id(q);
+	while (find(ctx, id) != NULL)
+		id = htons(res_randomid());
+	((HEADER *) q->query)->id = id;
+	q->hnext = ctx->buckets[id & (ASYNC_BUCKETS - 1)];
+	ctx->buckets[id & (ASYNC_BUCKETS - 1)] = q;
+	q->handle = ctx->next_handle++;
+	if (ctx->next_handle <= 0)
+		ctx->next_handle = 1;
+	ctx->pending++;
+
+	if (cachedlen > 0 && (q->answer = malloc(cachedlen)) != NULL) {
+		/* hand it back on the next res_async_process */
+		memcpy(q->answer, cached, cachedlen);
+		q->anslen = cachedlen;
+		schedule(ctx, q, now);
+		return (q->handle);
+	}
+	schedule(ctx, q, now);
+	send_query(ctx, q, now);
+	return (q->handle);
+}
+
+/*
+ * How many milliseconds the caller may wait for the descriptor to become
+ * readable before calling res_async_process, or -1 for as long as it
+ * likes.
+ */
+int
+res_async_timeout(const struct res_async *ctx)
+{
+	long long wait;
+
+	if (ctx->head == NULL)
+		return (-1);
+	wait = ctx->head->deadline - async_now();
+	if (wait <= 0)
+		return (0);
+	return (wait > INT_MAX ? INT_MAX : (int) wait);
+}
+
+/*
+ * Read the answers that have come, resend the queries that are due and
+ * call back with whatever is finished.  Returns how many queries are
+ * still pending.
+ */
+int
+res_async_process(struct res_async *ctx)
+{
+	struct sockaddr_in6 from;
+	socklen_t fromlen;
+	struct async_query *q;
+	long long now = async_now();
+	int n;
+
+	ctx->processing++;
+	while (!ctx->closing) {
+		fromlen = sizeof from;
+		n = recvfrom(ctx->fd, ctx->buf, sizeof ctx->buf, 0,
+			     (struct sockaddr *) &from, &fromlen);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		receive(ctx, n, &from, now);
+	}
+	while ((q = ctx->head) != NULL && q->deadline <= now) {
+		if (q->answer != NULL)
+			finish(ctx, q, q->answer, q->anslen);
+		else if (q->tries >= ctx->statp->retry * ctx->nscount &&
+			 q->qlen != q->plainlen) {
+			/* it may have been dropped for its OPT record */
+			drop_edns0(ctx, q);
+			q->tries = 0;
+			send_query(ctx, q, now);
+		} else if (q->tries >= ctx->statp->retry * ctx->nscount)
+			finish(ctx, q, NULL, 0);
+		else
+			send_query(ctx, q, now);
+	}
+	if (--ctx->processing == 0 && ctx->closing) {
+		res_async_close(ctx);
+		return (0);
+	}
+	return (ctx->pending);
+}
+
+/* Forget a query without calling back.  Returns -1 if it is not pending. */
+int
+res_async_cancel(struct res_async *ctx, int handle)
+{
+	struct async_query *q;
+
+	for (q = ctx->head; q != NULL; q = q->next)
+		if (q->handle == handle) {
+			drop(ctx, q);
+			return (0);
+		}
+	return (-1);
+}
+
+/*
+ * Close the socket and forget the pending queries, without calling back.
+ * From a callback, the context itself goes once res_async_process is done
+ * with it.
+ */
+void
+res_async_close(struct res_async *ctx)
+{
+	while (ctx->head != NULL)
+		drop(ctx, ctx->head);
+	if (ctx->processing) {
+		ctx->closing = 1;
+		return;
+	}
+	close(ctx->fd);
+	free(ctx);
+}
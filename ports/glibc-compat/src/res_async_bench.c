@@ -0,0 +1,235 @@
+/* Copyright 2014 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. */
+
+/*
+ * Times lookups made one after another with res_query against the same
+ * lookups made through res_async with many in flight at once.  The server
+ * is a thread answering over UDP on the loopback interface after a delay
+ * standing in for the network, holding back as many answers as it needs
+ * to so that no query waits on another.
+ *
+ * Usage: res_async_bench [-d delay usec] [-n lookups] [-w in flight]
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <resolv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TTL 300
+#define QUEUE 1024  /* answers the server can hold back at once */
+
+struct reply {
+  double due;
+  struct sockaddr_in to;
+  int len;
+  u_char buf[PACKETSZ];
+};
+
+static int server_fd;
+static int delay_usec = 2000;
+static struct reply queue[QUEUE];
+static int answered, failed;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static u_char* put16(u_char* cp, unsigned v) {
+  cp[0] = v >> 8;
+  cp[1] = v;
+  return cp + 2;
+}
+
+static u_char* put32(u_char* cp, unsigned long v) {
+  cp = put16(cp, v >> 16);
+  return put16(cp, v & 0xffff);
+}
+
+/* Turns the query in buf into an answer with one A record. */
+static int answer(u_char* buf, int len) {
+  HEADER* hp = (HEADER*)buf;
+  /* past the question, dropping any OPT record after it */
+  u_char* cp = buf + HFIXEDSZ + dn_skipname(buf + HFIXEDSZ, buf + len) +
+               QFIXEDSZ;
+
+  hp->qr = 1;
+  hp->ra = 1;
+  hp->arcount = 0;
+  hp->ancount = htons(1);
+  cp = put16(cp, 0xc000 | HFIXEDSZ);  /* the name in the question */
+  cp = put16(cp, ns_t_a);
+  cp = put16(cp, ns_c_in);
+  cp = put32(cp, TTL);
+  cp = put16(cp, 4);
+  cp = put32(cp, 0x0a000001);
+  return cp - buf;
+}
+
+/* Answers each query delay_usec after it came, without holding up others. */
+static void* serve(void* arg) {
+  struct pollfd pfd;
+  socklen_t tolen;
+  int head = 0, count = 0, timeout;
+
+  pfd.fd = server_fd;
+  pfd.events = POLLIN;
+  for (;;) {
+    timeout = -1;
+    if (count > 0) {
+      timeout = (queue[head].due - now()) * 1000 + 1;
+      if (timeout < 0)
+        timeout = 0;
+    }
+    if (poll(&pfd, 1, count < QUEUE ? timeout : 0) > 0 && count < QUEUE) {
+      struct reply* r = &queue[(head + count) % QUEUE];
+      tolen = sizeof(r->to);
+      r->len = recvfrom(server_fd, r->buf, PACKETSZ - 64, 0,
+                        (struct sockaddr*)&r->to, &tolen);
+      if (r->len >= HFIXEDSZ + QFIXEDSZ) {
+        r->len = answer(r->buf, r->len);
+        r->due = now() + delay_usec / 1e6;
+        count++;
+      }
+    }
+    while (count > 0 && queue[head].due <= now()) {
+      struct reply* r = &queue[head];
+      sendto(server_fd, r->buf, r->len, 0, (struct sockaddr*)&r->to,
+             sizeof(r->to));
+      head = (head + 1) % QUEUE;
+      count--;
+    }
+  }
+  return NULL;
+}
+
+static void done(void* arg, int herrno, const u_char* ans, int anslen) {
+  if (herrno == NETDB_SUCCESS)
+    answered++;
+  else
+    failed++;
+}
+
+/* Microseconds per lookup, made one at a time. */
+static double time_blocking(int count) {
+  u_char ans[PACKETSZ];
+  char name[64];
+  double start = now();
+  int i;
+
+  for (i = 0; i < count; i++) {
+    snprintf(name, sizeof(name), "block%d.example.com", i);
+    if (res_query(name, ns_c_in, ns_t_a, ans, sizeof(ans)) < 0) {
+      fprintf(stderr, "res_query(%s) failed: %d\n", name, h_errno);
+      exit(1);
+    }
+  }
+  return (now() - start) * 1e6 / count;
+}
+
+/* Microseconds per lookup, with up to window of them in flight. */
+static double time_async(int count, int window) {
+  struct res_async* ctx;
+  struct pollfd pfd;
+  char name[64];
+  double start = now();
+  int sent = 0, pending = 0;
+
+  if ((ctx = res_async_open(&_res)) == NULL) {
+    perror("res_async_open");
+    exit(1);
+  }
+  pfd.fd = res_async_fd(ctx);
+  pfd.events = POLLIN;
+  answered = failed = 0;
+  while (sent < count || pending > 0) {
+    while (sent < count && pending < window) {
+      snprintf(name, sizeof(name), "async%d.%d.example.com", window, sent++);
+      if (res_async_query(ctx, name, ns_c_in, ns_t_a, done, NULL) < 0) {
+        fprintf(stderr, "res_async_query(%s) failed: %d\n", name, h_errno);
+        exit(1);
+      }
+      pending++;
+    }
+    poll(&pfd, 1, res_async_timeout(ctx));
+    pending = res_async_process(ctx);
+  }
+  res_async_close(ctx);
+  if (answered != count) {
+    fprintf(stderr, "%d of %d async lookups failed\n", failed, count);
+    exit(1);
+  }
+  return (now() - start) * 1e6 / count;
+}
+
+int main(int argc, char** argv) {
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  pthread_t thread;
+  double blocking, async;
+  int count = 1000, window = 256, w;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:n:w:")) != -1) {
+    switch (opt) {
+      case 'd': delay_usec = atoi(optarg); break;
+      case 'n': count = atoi(optarg); break;
+      case 'w': window = atoi(optarg); break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [-d delay usec] [-n lookups] [-w in flight]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (count < 1 || window < 1 || window > QUEUE || delay_usec < 0) {
+    fprintf(stderr, "%s: need a lookup, a window of 1 to %d and a delay\n",
+            argv[0], QUEUE);
+    return 1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((server_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+      bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      getsockname(server_fd, (struct sockaddr*)&addr, &addrlen) < 0) {
+    perror("server socket");
+    return 1;
+  }
+  if (pthread_create(&thread, NULL, serve, NULL) != 0) {
+    fprintf(stderr, "%s: cannot start the server thread\n", argv[0]);
+    return 1;
+  }
+
+  res_init();
+  _res.options &= ~(RES_DNSRCH | RES_DEFNAMES | RES_USECACHE);
+  _res.nscount = 1;
+  _res.nsaddr_list[0] = addr;
+  printf("%d lookups, server delay %d usec\n", count, delay_usec);
+
+  blocking = time_blocking(count);
+  printf("res_query, one at a time:   %8.1f usec per lookup\n", blocking);
+  for (w = 1; w < window; w *= 4) {
+    async = time_async(count, w);
+    printf("res_async, %4d in flight:  %8.1f usec per lookup (%.1fx)\n", w,
+           async, blocking / async);
+  }
+  async = time_async(count, window);
+  printf("res_async, %4d in flight:  %8.1f usec per lookup (%.1fx)\n",
+         window, async, blocking / async);
+  return 0;
+}
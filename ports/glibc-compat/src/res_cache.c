@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) 2014 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * An in-process cache of res_query answers, so that ports which look up
+ * the same few hosts over and over go to the network once per TTL.
+ *
+ * Answers are keyed by name, class and type, and by a scope standing for
+ * the servers asked and the options that change what they say, so that a
+ * res_state with other servers, or asking without recursion, never gets
+ * another's answer.  They are kept whole.  A positive
+ * answer is kept for the smallest TTL in its answer section; a negative
+ * one (NXDOMAIN, or NOERROR with no answers) for the lesser of its SOA's
+ * TTL and minimum, as in RFC 2308, and not at all without an SOA.  Both
+ * are capped, and the TTLs in a copy handed out are counted down by the
+ * time it spent here.  The table is shared by every res_state, guarded
+ * by one mutex, and bounded:  once full, the least recently used answer
+ * goes.  res_query consults it when RES_USECACHE is set, which it is by
+ * default; "options no-cache" clears it.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <resolv.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "res_cache.h"
+
+#define CACHE_ENTRIES	256		/* answers held at most */
+#define CACHE_BUCKETS	256		/* hash chains, a power of two */
+#define CACHE_MAXANSWER	4096		/* larger answers are not kept */
+#define CACHE_MAXTTL	3600		/* seconds, for positive answers */
+#define CACHE_MAXNEGTTL	900		/* seconds, for negative ones */
+
+struct cache_entry {
+	struct cache_entry *hnext;	/* hash chain */
+	struct cache_entry *prev;	/* LRU list, most recent first */
+	struct cache_entry *next;
+	u_int32_t	hash;
+	u_int32_t	scope;
+	int		class;
+	int		type;
+	int		negative;
+	time_t		stored;		/* by cache_now() */
+	time_t		expires;
+	int		anslen;
+	u_char		*answer;	/* follows the name */
+	char		name[1];	/* lower case, no trailing dot */
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry *buckets[CACHE_BUCKETS];
+static struct cache_entry *lru_head, *lru_tail;
+static struct res_cache_stats stats;
+
+static time_t
+cache_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (ts.tv_sec);
+	return (time(NULL));
+}
+
+/*
+ * Copy name into key in lower case without its trailing dot.
+ * Returns the length, or -1 if it will not fit.
+ */
+static int
+normalize(const char *name, char *key)
+{
+	int n;
+
+	for (n = 0; name[n] != '\0'; n++) {
+		if (n >= MAXDNAME - 1)
+			return (-1);
+		key[n] = tolower((unsigned char) name[n]);
+	}
+	if (n > 0 && key[n - 1] == '.')
+		n--;
+	key[n] = '\0';
+	return (n);
+}
+
+/* FNV-1a, carried on from h */
+static u_int32_t
+hash_bytes(u_int32_t h, const void *p, size_t len)
+{
+	const u_char *cp = p;
+
+	while (len-- > 0)
+		h = (h ^ *cp++) * 16777619u;
+	return (h);
+}
+
+static u_int32_t
+hash_key(u_int32_t scope, const char *key, int class, int type)
+{
+	u_int32_t h = hash_bytes(2166136261u, key, strlen(key));
+
+	h = (h ^ scope) * 16777619u;
+	h = (h ^ (u_int32_t) class) * 16777619u;
+	h = (h ^ (u_int32_t) type) * 16777619u;
+	return (h);
+}
+
+/*
+ * The scope of statp's queries:  its servers, IPv4 and IPv6, and the
+ * options that change the answers they give.
+ */
+u_int32_t
+__res_cache_scope(res_state statp)
+{
+	u_long options = statp->options & (RES_RECURSE | RES_USE_EDNS0);
+	u_int32_t h = hash_bytes(2166136261u, &options, sizeof options);
+	const struct sockaddr_in6 *sa6;
+	int ns;
+
+	for (ns = 0; ns < statp->nscount && ns < MAXNS; ns++) {
+		const struct sockaddr_in *sa4 = &statp->nsaddr_list[ns];
+
+		h = hash_bytes(h, &sa4->sin_addr, sizeof sa4->sin_addr);
+		h = hash_bytes(h, &sa4->sin_port, sizeof sa4->sin_port);
+	}
+	/* IPv6 servers are kept apart from nsaddr_list; see res_init.c */
+	for (ns = 0; ns < MAXNS; ns++) {
+		sa6 = statp->_u._ext.nsaddrs[ns];
+		if (sa6 != NULL && statp->_u._ext.nsmap[ns] == MAXNS + 1 &&
+		    sa6->sin6_family == AF_INET6) {
+			h = hash_bytes(h, &sa6->sin6_addr,
+				       sizeof sa6->sin6_addr);
+			h = hash_bytes(h, &sa6->sin6_port,
+				       sizeof sa6->sin6_port);
+		}
+	}
+	return (h);
+}
+
+static struct cache_entry *
+find(u_int32_t hash, u_int32_t scope, const char *key, int class, int type)
+{
+	struct cache_entry *e;
+
+	for (e = buckets[hash & (CACHE_BUCKETS - 1)]; e != NULL; e = e->hnext)
+		if (e->hash == hash && e->scope == scope &&
+		    e->class == class && e->type == type &&
+		    strcmp(e->name, key) == 0)
+			return (e);
+	return (NULL);
+}
+
+static void
+lru_unlink(struct cache_entry *e)
+{
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		lru_head = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		lru_tail = e->prev;
+}
+
+static void
+lru_push(struct cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = lru_head;
+	if (lru_head != NULL)
+		lru_head->prev = e;
+	else
+		lru_tail = e;
+	lru_head = e;
+}
+
+static void
+drop(struct cache_entry *e)
+{
+	struct cache_entry **ep;
+
+	for (ep = &buckets[e->hash & (CACHE_BUCKETS - 1)]; *ep != e;
+	     ep = &(*ep)->hnext)
+		;
+	*ep = e->hnext;
+	lru_unlink(e);
+	stats.entries--;
+	free(e);
+}
+
+/*
+ * Step over the resource record at *cpp, returning its type, where its
+ * TTL is and the extent of its data.  Returns -1 if it runs past eom.
+ */
+static int
+next_rr(const u_char **cpp, const u_char *eom, int *type,
+	const u_char **ttlp, const u_char **rdata, int *rdlen)
+{
+	const u_char *cp = *cpp;
+	int n;
+
+	if ((n = dn_skipname(cp, eom)) < 0 || cp + n + RRFIXEDSZ > eom)
+		return (-1);
+	cp += n;
+	*type = ns_get16(cp);
+	*ttlp = cp + INT16SZ + INT16SZ;
+	*rdlen = ns_get16(cp + INT16SZ + INT16SZ + INT32SZ);
+	cp += RRFIXEDSZ;
+	if (cp + *rdlen > eom)
+		return (-1);
+	*rdata = cp;
+	*cpp = cp + *rdlen;
+	return (0);
+}
+
+/* Step over the question section.  Returns NULL if it does not parse. */
+static const u_char *
+skip_questions(const u_char *msg, const u_char *eom)
+{
+	const u_char *cp = msg + HFIXEDSZ;
+	int n, qdcount = ntohs(((const HEADER *) msg)->qdcount);
+
+	while (qdcount-- > 0) {
+		if ((n = dn_skipname(cp, eom)) < 0 || cp + n + QFIXEDSZ > eom)
+			return (NULL);
+		cp += n + QFIXEDSZ;
+	}
+	return (cp);
+}
+
+static u_int32_t
+get_ttl(const u_char *ttlp)
+{
+	u_int32_t ttl = ns_get32(ttlp);
+
+	/* RFC 2181: a TTL with the top bit set means zero */
+	return (ttl & 0x80000000u ? 0 : ttl);
+}
+
+/*
+ * How long an answer may be kept, or -1 if it may not.  Sets *negative
+ * for NXDOMAIN and NODATA answers.
+ */
+static long
+answer_ttl(const u_char *msg, int len, int *negative)
+{
+	const HEADER *hp = (const HEADER *) msg;
+	const u_char *eom = msg + len, *cp, *ttlp, *rdata;
+	int ancount, nscount, type, rdlen;
+	u_int32_t ttl, min_ttl = 0xffffffffu;
+
+	if (len < HFIXEDSZ || hp->tc || hp->opcode != QUERY)
+		return (-1);
+	ancount = ntohs(hp->ancount);
+	nscount = ntohs(hp->nscount);
+	if (hp->rcode == NOERROR && ancount > 0)
+		*negative = 0;
+	else if (hp->rcode == NXDOMAIN || hp->rcode == NOERROR)
+		*negative = 1;
+	else
+		return (-1);
+	if ((cp = skip_questions(msg, eom)) == NULL)
+		return (-1);
+	while (ancount-- > 0) {
+		if (next_rr(&cp, eom, &type, &ttlp, &rdata, &rdlen) < 0)
+			return (-1);
+		if (!*negative && (ttl = get_ttl(ttlp)) < min_ttl)
+			min_ttl = ttl;
+	}
+	if (!*negative)
+		return (min_ttl < CACHE_MAXTTL ? min_ttl : CACHE_MAXTTL);
+
+	while (nscount-- > 0) {
+		if (next_rr(&cp, eom, &type, &ttlp, &rdata, &rdlen) < 0)
+			return (-1);
+		if (type != T_SOA || rdlen < 5 * INT32SZ)
+			continue;
+		ttl = get_ttl(ttlp);
+		/* MINIMUM is the last field of the SOA */
+		if (get_ttl(rdata + rdlen - INT32SZ) < ttl)
+			ttl = get_ttl(rdata + rdlen - INT32SZ);
+		return (ttl < CACHE_MAXNEGTTL ? ttl : CACHE_MAXNEGTTL);
+	}
+	return (-1);
+}
+
+/* Count down every TTL in msg by age seconds. */
+static void
+age_ttls(u_char *msg, int len, u_int32_t age)
+{
+	const HEADER *hp = (const HEADER *) msg;
+	const u_char *eom = msg + len, *cp, *ttlp, *rdata;
+	int count, type, rdlen;
+	u_int32_t ttl;
+
+	count = ntohs(hp->ancount) + ntohs(hp->nscount) + ntohs(hp->arcount);
+	if ((cp = skip_questions(msg, eom)) == NULL)
+		return;
+	while (count-- > 0) {
+		if (next_rr(&cp, eom, &type, &ttlp, &rdata, &rdlen) < 0)
+			return;
+		if (type == T_OPT)	/* its TTL field holds flags */
+			continue;
+		ttl = get_ttl(ttlp);
+		ns_put32(ttl > age ? ttl - age : 0, msg + (ttlp - msg));
+	}
+}
+
+/*
+ * Copy the cached answer to a query of the given scope into answer, if
+ * there is one that fits in anslen bytes.  Returns its length, or -1.
+ */
+int
+__res_cache_lookup(u_int32_t scope, const char *name, int class, int type,
+		   u_char *answer, int anslen)
+{
+	char key[MAXDNAME];
+	struct cache_entry *e;
+	u_int32_t hash;
+	time_t now, age = 0;
+	int n = -1;
+
+	if (normalize(name, key) < 0)
+		return (-1);
+	hash = hash_key(scope, key, class, type);
+	now = cache_now();
+
+	pthread_mutex_lock(&cache_lock);
+	e = find(hash, scope, key, class, type);
+	if (e != NULL && e->expires <= now) {
+		stats.expired++;
+		drop(e);
+		e = NULL;
+	}
+	if (e == NULL || e->anslen > anslen) {
+		stats.misses++;
+	} else {
+		lru_unlink(e);
+		lru_push(e);
+		memcpy(answer, e->answer, e->anslen);
+		n = e->anslen;
+		age = now - e->stored;
+		stats.hits++;
+		if (e->negative)
+			stats.negative_hits++;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	if (n > 0 && age > 0)
+		age_ttls(answer, n, age);
+	return (n);
+}
+
+/*
+ * Keep the answer to a query, if it says how long it may be kept.
+ * Replaces any older answer to the same query.
+ */
+void
+__res_cache_store(u_int32_t scope, const char *name, int class, int type,
+		  const u_char *answer, int anslen)
+{
+	char key[MAXDNAME];
+	struct cache_entry *e, *old;
+	long ttl;
+	int n, negative;
+
+	if (anslen > CACHE_MAXANSWER ||
+	    (ttl = answer_ttl(answer, anslen, &negative)) <= 0 ||
+	    (n = normalize(name, key)) < 0)
+		return;
+	e = malloc(offsetof(struct cache_entry, name) + n + 1 + anslen);
+	if (e == NULL)
+		return;
+	memcpy(e->name, key, n + 1);
+	e->hash = hash_key(scope, key, class, type);
+	e->scope = scope;
+	e->class = class;
+	e->type = type;
+	e->negative = negative;
+	e->stored = cache_now();
+	e->expires = e->stored + ttl;
+	e->answer = (u_char *) e->name + n + 1;
+	e->anslen = anslen;
+	memcpy(e->answer, answer, anslen);
+
+	pthread_mutex_lock(&cache_lock);
+	if ((old = find(e->hash, scope, key, class, type)) != NULL)
+		drop(old);
+	while (stats.entries >= CACHE_ENTRIES) {
+		drop(lru_tail);
+		stats.evictions++;
+	}
+	e->hnext = buckets[e->hash & (CACHE_BUCKETS - 1)];
+	buckets[e->hash & (CACHE_BUCKETS - 1)] = e;
+	lru_push(e);
+	stats.entries++;
+	stats.stores++;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void
+res_cache_flush(void)
+{
+	pthread_mutex_lock(&cache_lock);
+	while (lru_head != NULL)
+		drop(lru_head);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void
+res_cache_getstats(struct res_cache_stats *sp)
+{
+	pthread_mutex_lock(&cache_lock);
+	*sp = stats;
+	pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,17 @@
+/*
+ * Copyright (c) 2014 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef _RES_CACHE_H_
+#define _RES_CACHE_H_
+
+/* Internal interface of the answer cache in res_cache.c. */
+
+u_int32_t __res_cache_scope(res_state);
+int	__res_cache_lookup(u_int32_t, const char *, int, int, u_char *, int);
+void	__res_cache_store(u_int32_t, const char *, int, int, const u_char *,
+			  int);
+
+#endif /* _RES_CACHE_H_ */
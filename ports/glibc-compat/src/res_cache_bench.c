@@ -0,0 +1,188 @@
+/* Copyright 2014 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. */
+
+/*
+ * Times repeated res_query lookups of a few hosts with the answer cache
+ * on and off.  A thread answers the queries over UDP on the loopback
+ * interface, after an optional delay standing in for a remote server:
+ * names starting with "nx" get NXDOMAIN with an SOA, the rest an A
+ * record, both with a TTL of 300 seconds.
+ *
+ * Usage: res_cache_bench [-d delay usec] [-h hosts] [-n lookups]
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <resolv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TTL 300
+
+static int server_fd;
+static int delay_usec;
+
+static u_char* put16(u_char* cp, unsigned v) {
+  cp[0] = v >> 8;
+  cp[1] = v;
+  return cp + 2;
+}
+
+static u_char* put32(u_char* cp, unsigned long v) {
+  cp = put16(cp, v >> 16);
+  return put16(cp, v & 0xffff);
+}
+
+/* Turns the query in buf into an answer, returning its length. */
+static int answer(u_char* buf, int len) {
+  HEADER* hp = (HEADER*)buf;
+  /* past the question, dropping any OPT record after it */
+  u_char* cp = buf + HFIXEDSZ + dn_skipname(buf + HFIXEDSZ, buf + len) +
+               QFIXEDSZ;
+  int nx = len > HFIXEDSZ + 3 && buf[HFIXEDSZ + 1] == 'n' &&
+           buf[HFIXEDSZ + 2] == 'x';
+
+  hp->qr = 1;
+  hp->ra = 1;
+  hp->arcount = 0;
+  cp = put16(cp, 0xc000 | HFIXEDSZ);  /* the name in the question */
+  if (nx) {
+    hp->rcode = NXDOMAIN;
+    hp->nscount = htons(1);
+    cp = put16(cp, ns_t_soa);
+    cp = put16(cp, ns_c_in);
+    cp = put32(cp, TTL);
+    cp = put16(cp, 2 + 2 + 5 * 4);
+    cp = put16(cp, 0xc000 | HFIXEDSZ);  /* mname */
+    cp = put16(cp, 0xc000 | HFIXEDSZ);  /* rname */
+    cp = put32(cp, 1);                  /* serial */
+    cp = put32(cp, 3600);               /* refresh */
+    cp = put32(cp, 600);                /* retry */
+    cp = put32(cp, 86400);              /* expire */
+    cp = put32(cp, TTL);                /* minimum */
+  } else {
+    hp->ancount = htons(1);
+    cp = put16(cp, ns_t_a);
+    cp = put16(cp, ns_c_in);
+    cp = put32(cp, TTL);
+    cp = put16(cp, 4);
+    cp = put32(cp, 0x0a000001);
+  }
+  return cp - buf;
+}
+
+static void* serve(void* arg) {
+  u_char buf[PACKETSZ + 64];
+  struct sockaddr_in from;
+  socklen_t fromlen;
+  int len;
+
+  for (;;) {
+    fromlen = sizeof(from);
+    len = recvfrom(server_fd, buf, PACKETSZ, 0, (struct sockaddr*)&from,
+                   &fromlen);
+    if (len < HFIXEDSZ)
+      continue;
+    if (delay_usec)
+      usleep(delay_usec);
+    len = answer(buf, len);
+    sendto(server_fd, buf, len, 0, (struct sockaddr*)&from, fromlen);
+  }
+  return NULL;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Microseconds per lookup, cycling through nhosts names. */
+static double time_lookups(int nhosts, int count) {
+  u_char ans[PACKETSZ];
+  char name[64];
+  double start = now();
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (i % nhosts == nhosts - 1)
+      snprintf(name, sizeof(name), "nx%d.example.com", i % nhosts);
+    else
+      snprintf(name, sizeof(name), "host%d.example.com", i % nhosts);
+    if (res_query(name, ns_c_in, ns_t_a, ans, sizeof(ans)) < 0 &&
+        h_errno != HOST_NOT_FOUND) {
+      fprintf(stderr, "res_query(%s) failed: %d\n", name, h_errno);
+      exit(1);
+    }
+  }
+  return (now() - start) * 1e6 / count;
+}
+
+int main(int argc, char** argv) {
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  struct res_cache_stats st;
+  pthread_t thread;
+  int nhosts = 4, count = 2000;
+  double off_usec, on_usec;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:h:n:")) != -1) {
+    switch (opt) {
+      case 'd': delay_usec = atoi(optarg); break;
+      case 'h': nhosts = atoi(optarg); break;
+      case 'n': count = atoi(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-d delay usec] [-h hosts] [-n lookups]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (nhosts < 1 || count < 1) {
+    fprintf(stderr, "%s: hosts and lookups must be positive\n", argv[0]);
+    return 1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((server_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+      bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      getsockname(server_fd, (struct sockaddr*)&addr, &addrlen) < 0) {
+    perror("server socket");
+    return 1;
+  }
+  if (pthread_create(&thread, NULL, serve, NULL) != 0) {
+    fprintf(stderr, "%s: cannot start the server thread\n", argv[0]);
+    return 1;
+  }
+
+  res_init();
+  _res.nscount = 1;
+  _res.nsaddr_list[0] = addr;
+  _res.options &= ~(RES_DNSRCH | RES_DEFNAMES);
+
+  _res.options &= ~RES_USECACHE;
+  off_usec = time_lookups(nhosts, count);
+  _res.options |= RES_USECACHE;
+  on_usec = time_lookups(nhosts, count);
+  res_cache_getstats(&st);
+
+  printf("%d lookups of %d hosts, server delay %d usec\n", count, nhosts,
+         delay_usec);
+  printf("no cache:  %8.2f usec per lookup\n", off_usec);
+  printf("cache:     %8.2f usec per lookup (%.1fx)\n", on_usec,
+         off_usec / on_usec);
+  printf("hits %lu (%lu negative), misses %lu, stores %lu, entries %u\n",
+         st.hits, st.negative_hits, st.misses, st.stores, st.entries);
+  return 0;
+}
@@ -72,6 +72,7 @@ static const char rcsid[] = "$BINDId: res_init.c,v 8.16 2000/05/09 07:10:12 vixi
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 
 #include <netinet/in.h>
@@ -83,8 +84,10 @@ static const char rcsid[] = "$BINDId: res_init.c,v 8.16 2000/05/09 07:10:12 vixi
 #ifndef __native_client__
 #include <stdio_ext.h>
 #endif
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <not-cancel.h>
@@ -117,6 +120,283 @@ static u_int32_t net_mask (struct in_addr) __THROW;
 unsigned long long int __res_initstamp attribute_hidden;
 #endif
 
+/*
+ * The parsed contents of the config file, shared by every resolver state
+ * so that setting one up doesn't read the file again.  A snapshot is not
+ * changed once made.  When the file changes a new one takes its place,
+ * and __res_initstamp is bumped so that states made from the old one are
+ * set up again.
+ */
+struct res_conf {
+	int		found;		/* the file exists */
+	dev_t		dev;		/* and this is it */
+	ino_t		ino;
+	off_t		size;
+	time_t		mtime;
+	int		nservall;	/* nameservers, IPv4 and IPv6 */
+	struct {
+		sa_family_t	family;
+		union {
+			struct in_addr	a4;
+			struct in6_addr	a6;
+		} addr;
+	}		nsaddrs[MAXNS];
+	int		havedomain;	/* defdname came from the file */
+	int		havesearch;	/* and so did dnsrch */
+	char		defdname[256];
+	char		*dnsrch[MAXDNSRCH+1];	/* into defdname */
+#ifdef RESOLVSORT
+	int		nsort;
+	struct {
+		struct in_addr	addr;
+		u_int32_t	mask;
+	}		sort_list[MAXRESOLVSORT];
+#endif
+	char		*options;	/* all "options" lines, run together */
+	char		hostdomain[256];	/* the domain gethostname has */
+};
+
+/* Snapshot used if none can be made. */
+static const struct res_conf res_conf_none;
+
+static pthread_mutex_t res_conf_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct res_conf *res_conf;	/* the current snapshot */
+static time_t res_conf_checked;		/* when the file was last looked at */
+
+/* Read the config file into a new snapshot. */
+static struct res_conf *
+res_conf_load(void) {
+	register FILE *fp;
+	register char *cp, **pp;
+	register int n;
+	struct res_conf *conf;
+	struct stat st;
+	char buf[BUFSIZ], *opts;
+	size_t len, optlen = 0;
+#ifdef RESOLVSORT
+	char *net;
+#endif
+
+	if ((conf = calloc(1, sizeof(*conf))) == NULL)
+		return (NULL);
+
+#define	MATCH(line, name) \
+	(!strncmp(line, name, sizeof(name) - 1) && \
+	(line[sizeof(name) - 1] == ' ' || \
+	 line[sizeof(name) - 1] == '\t'))
+
+	if ((fp = fopen(_PATH_RESCONF, "rc")) != NULL) {
+		/* No threads use this stream.  */
+		__fsetlocking (fp, FSETLOCKING_BYCALLER);
+		conf->found = 1;
+		if (fstat(fileno(fp), &st) == 0) {
+			conf->dev = st.st_dev;
+			conf->ino = st.st_ino;
+			conf->size = st.st_size;
+			conf->mtime = st.st_mtime;
+		}
+	    /* read the config file */
+	    while (fgets(buf, sizeof(buf), fp) != NULL) {
+		/* skip comments */
+		if (*buf == ';' || *buf == '#')
+			continue;
+		/* read default domain name */
+		if (MATCH(buf, "domain")) {
+		    cp = buf + sizeof("domain") - 1;
+		    while (*cp == ' ' || *cp == '\t')
+			    cp++;
+		    if ((*cp == '\0') || (*cp == '\n'))
+			    continue;
+		    strncpy(conf->defdname, cp, sizeof(conf->defdname) - 1);
+		    conf->defdname[sizeof(conf->defdname) - 1] = '\0';
+		    if ((cp = strpbrk(conf->defdname, " \t\n")) != NULL)
+			    *cp = '\0';
+		    conf->havedomain = 1;
+		    conf->havesearch = 0;
+		    continue;
+		}
+		/* set search list */
+		if (MATCH(buf, "search")) {
+		    cp = buf + sizeof("search") - 1;
+		    while (*cp == ' ' || *cp == '\t')
+			    cp++;
+		    if ((*cp == '\0') || (*cp == '\n'))
+			    continue;
+		    strncpy(conf->defdname, cp, sizeof(conf->defdname) - 1);
+		    conf->defdname[sizeof(conf->defdname) - 1] = '\0';
+		    if ((cp = strchr(conf->defdname, '\n')) != NULL)
+			    *cp = '\0';
+		    /*
+		     * Set search list to be blank-separated strings
+		     * on rest of line.
+		     */
+		    cp = conf->defdname;
+		    pp = conf->dnsrch;
+		    *pp++ = cp;
+		    for (n = 0; *cp && pp < conf->dnsrch + MAXDNSRCH; cp++) {
+			    if (*cp == ' ' || *cp == '\t') {
+				    *cp = 0;
+				    n = 1;
+			    } else if (n) {
+				    *pp++ = cp;
+				    n = 0;
+			    }
+		    }
+		    /* null terminate last domain if there are excess */
+		    while (*cp != '\0' && *cp != ' ' && *cp != '\t')
+			    cp++;
+		    *cp = '\0';
+		    *pp++ = 0;
+		    conf->havedomain = 1;
+		    conf->havesearch = 1;
+		    continue;
+		}
+		/* read nameservers to query */
+		if (MATCH(buf, "nameserver") && conf->nservall < MAXNS) {
+		    struct in_addr a;
+
+		    cp = buf + sizeof("nameserver") - 1;
+		    while (*cp == ' ' || *cp == '\t')
+			cp++;
+		    if ((*cp != '\0') && (*cp != '\n')
+			&& inet_aton(cp, &a)) {
+			conf->nsaddrs[conf->nservall].family = AF_INET;
+			conf->nsaddrs[conf->nservall].addr.a4 = a;
+			conf->nservall++;
+#ifdef _LIBC
+                    } else {
+                        struct in6_addr a6;
+                        char *el;
+
+                        if ((el = strchr(cp, '\n')) != NULL)
+                            *el = '\0';
+                        if ((*cp != '\0') &&
+                            (inet_pton(AF_INET6, cp, &a6) > 0)) {
+			    conf->nsaddrs[conf->nservall].family = AF_INET6;
+			    conf->nsaddrs[conf->nservall].addr.a6 = a6;
+			    conf->nservall++;
+                        }
+#endif
+		    }
+		    continue;
+		}
+#ifdef RESOLVSORT
+		if (MATCH(buf, "sortlist")) {
+		    struct in_addr a;
+
+		    cp = buf + sizeof("sortlist") - 1;
+		    while (conf->nsort < MAXRESOLVSORT) {
+			while (*cp == ' ' || *cp == '\t')
+			    cp++;
+			if (*cp == '\0' || *cp == '\n' || *cp == ';')
+			    break;
+			net = cp;
+			while (*cp && !ISSORTMASK(*cp) && *cp != ';' &&
+			       isascii(*cp) && !isspace(*cp))
+				cp++;
+			n = *cp;
+			*cp = 0;
+			if (inet_aton(net, &a)) {
+			    conf->sort_list[conf->nsort].addr = a;
+			    if (ISSORTMASK(n)) {
+				*cp++ = n;
+				net = cp;
+				while (*cp && *cp != ';' &&
+					isascii(*cp) && !isspace(*cp))
+				    cp++;
+				n = *cp;
+				*cp = 0;
+				if (inet_aton(net, &a)) {
+				    conf->sort_list[conf->nsort].mask =
+					a.s_addr;
+				} else {
+				    conf->sort_list[conf->nsort].mask =
+					net_mask(conf->sort_list[conf->nsort].addr);
+				}
+			    } else {
+				conf->sort_list[conf->nsort].mask =
+				    net_mask(conf->sort_list[conf->nsort].addr);
+			    }
+			    conf->nsort++;
+			}
+			*cp = n;
+		    }
+		    continue;
+		}
+#endif
+		if (MATCH(buf, "options")) {
+		    /* Kept to be run, in order, on each state. */
+		    cp = buf + sizeof("options") - 1;
+		    len = strlen(cp);
+		    if ((opts = realloc(conf->options,
+					optlen + len + 2)) == NULL) {
+			(void) fclose(fp);
+			free(conf->options);
+			free(conf);
+			return (NULL);
+		    }
+		    conf->options = opts;
+		    conf->options[optlen++] = ' ';
+		    memcpy(conf->options + optlen, cp, len + 1);
+		    optlen += len;
+		    continue;
+		}
+	    }
+	    (void) fclose(fp);
+	}
+	if (__gethostname(buf, sizeof(conf->hostdomain) - 1) == 0 &&
+	    (cp = strchr(buf, '.')) != NULL)
+		strcpy(conf->hostdomain, cp + 1);
+	return (conf);
+}
+
+/*
+ * Make a new snapshot if there is none, if 'force' is set or if the
+ * config file has changed.  The file is looked at once a second at most.
+ * Called with res_conf_lock held.
+ */
+static void
+res_conf_update(int force) {
+	struct res_conf *conf;
+	struct stat st;
+	time_t now;
+	int found;
+
+	now = time(NULL);
+	if (!force && res_conf != NULL) {
+		if (now == res_conf_checked)
+			return;
+		res_conf_checked = now;
+		found = stat(_PATH_RESCONF, &st) == 0;
+		if (found == res_conf->found &&
+		    (!found || (st.st_dev == res_conf->dev &&
+				st.st_ino == res_conf->ino &&
+				st.st_size == res_conf->size &&
+				st.st_mtime == res_conf->mtime)))
+			return;
+	}
+	if ((conf = res_conf_load()) == NULL)
+		return;
+	if (res_conf != NULL) {
+		free(res_conf->options);
+		free(res_conf);
+#ifdef _LIBC
+		/* Have every state set up again from the new one. */
+		__res_initstamp++;
+#endif
+	}
+	res_conf = conf;
+	res_conf_checked = now;
+}
+
+/* Bring the shared snapshot up to date, as __res_vinit does itself. */
+void
+__res_conf_check(int force) {
+	pthread_mutex_lock(&res_conf_lock);
+	res_conf_update(force);
+	pthread_mutex_unlock(&res_conf_lock);
+}
+
 /*
  * Resolver state default settings.
  */
@@ -155,26 +435,18 @@ libc_hidden_def (__res_ninit)
 /* This function has to be reachable by res_data.c but not publically. */
 int
 __res_vinit(res_state statp, int preinit) {
-	register FILE *fp;
+	register const struct res_conf *conf;
 	register char *cp, **pp;
 	register int n;
-	char buf[BUFSIZ];
 	int nserv = 0;    /* number of nameserver records read from file */
 #ifdef _LIBC
 	int nservall = 0; /* number of NS records read, nserv IPv4 only */
 #endif
 	int haveenv = 0;
 	int havesearch = 0;
-#ifdef RESOLVSORT
-	int nsort = 0;
-	char *net;
-#endif
 #ifndef RFC1535
 	int dots;
 #endif
-#ifdef _LIBC
-	statp->_u._ext.initstamp = __res_initstamp;
-#endif
 
 	if (!preinit) {
 		statp->retrans = RES_TIMEOUT;
@@ -242,163 +514,50 @@ __res_vinit(res_state statp, int preinit) {
 		*pp++ = 0;
 	}
 
-#define	MATCH(line, name) \
-	(!strncmp(line, name, sizeof(name) - 1) && \
-	(line[sizeof(name) - 1] == ' ' || \
-	 line[sizeof(name) - 1] == '\t'))
-
-	if ((fp = fopen(_PATH_RESCONF, "rc")) != NULL) {
-		/* No threads use this stream.  */
-		__fsetlocking (fp, FSETLOCKING_BYCALLER);
-	    /* read the config file */
-	    while (fgets(buf, sizeof(buf), fp) != NULL) {
-		/* skip comments */
-		if (*buf == ';' || *buf == '#')
-			continue;
-		/* read default domain name */
-		if (MATCH(buf, "domain")) {
-		    if (haveenv)	/* skip if have from environ */
-			    continue;
-		    cp = buf + sizeof("domain") - 1;
-		    while (*cp == ' ' || *cp == '\t')
-			    cp++;
-		    if ((*cp == '\0') || (*cp == '\n'))
-			    continue;
-		    strncpy(statp->defdname, cp, sizeof(statp->defdname) - 1);
-		    statp->defdname[sizeof(statp->defdname) - 1] = '\0';
-		    if ((cp = strpbrk(statp->defdname, " \t\n")) != NULL)
-			    *cp = '\0';
-		    havesearch = 0;
-		    continue;
-		}
-		/* set search list */
-		if (MATCH(buf, "search")) {
-		    if (haveenv)	/* skip if have from environ */
-			    continue;
-		    cp = buf + sizeof("search") - 1;
-		    while (*cp == ' ' || *cp == '\t')
-			    cp++;
-		    if ((*cp == '\0') || (*cp == '\n'))
-			    continue;
-		    strncpy(statp->defdname, cp, sizeof(statp->defdname) - 1);
-		    statp->defdname[sizeof(statp->defdname) - 1] = '\0';
-		    if ((cp = strchr(statp->defdname, '\n')) != NULL)
-			    *cp = '\0';
-		    /*
-		     * Set search list to be blank-separated strings
-		     * on rest of line.
-		     */
-		    cp = statp->defdname;
-		    pp = statp->dnsrch;
-		    *pp++ = cp;
-		    for (n = 0; *cp && pp < statp->dnsrch + MAXDNSRCH; cp++) {
-			    if (*cp == ' ' || *cp == '\t') {
-				    *cp = 0;
-				    n = 1;
-			    } else if (n) {
-				    *pp++ = cp;
-				    n = 0;
-			    }
-		    }
-		    /* null terminate last domain if there are excess */
-		    while (*cp != '\0' && *cp != ' ' && *cp != '\t')
-			    cp++;
-		    *cp = '\0';
-		    *pp++ = 0;
-		    havesearch = 1;
-		    continue;
-		}
-		/* read nameservers to query */
+	/* Copy what the config file says out of the shared snapshot. */
+	pthread_mutex_lock(&res_conf_lock);
+	res_conf_update(0);
+	conf = res_conf != NULL ? res_conf : &res_conf_none;
 #ifdef _LIBC
-		if (MATCH(buf, "nameserver") && nservall < MAXNS) {
-#else
-		if (MATCH(buf, "nameserver") && nserv < MAXNS) {
+	statp->_u._ext.initstamp = __res_initstamp;
 #endif
-		    struct in_addr a;
-
-		    cp = buf + sizeof("nameserver") - 1;
-		    while (*cp == ' ' || *cp == '\t')
-			cp++;
-		    if ((*cp != '\0') && (*cp != '\n')
-			&& inet_aton(cp, &a)) {
-			statp->nsaddr_list[nserv].sin_addr = a;
+	if (conf->found) {
+	    if (conf->havedomain && !haveenv) {
+		memcpy(statp->defdname, conf->defdname,
+		       sizeof(statp->defdname));
+		if (conf->havesearch) {
+		    for (pp = statp->dnsrch, n = 0;
+			 conf->dnsrch[n] != NULL; n++)
+			*pp++ = statp->defdname +
+				(conf->dnsrch[n] - conf->defdname);
+		    *pp = NULL;
+		}
+		havesearch = conf->havesearch;
+	    }
+	    for (n = 0; n < conf->nservall; n++) {
+		if (conf->nsaddrs[n].family == AF_INET) {
+			statp->nsaddr_list[nserv].sin_addr =
+				conf->nsaddrs[n].addr.a4;
 			statp->nsaddr_list[nserv].sin_family = AF_INET;
 			statp->nsaddr_list[nserv].sin_port =
 				htons(NAMESERVER_PORT);
 			nserv++;
 #ifdef _LIBC
 			nservall++;
-                    } else {
-                        struct in6_addr a6;
-                        char *el;
-
-                        if ((el = strchr(cp, '\n')) != NULL)
-                            *el = '\0';
-                        if ((*cp != '\0') &&
-                            (inet_pton(AF_INET6, cp, &a6) > 0)) {
-                            struct sockaddr_in6 *sa6;
+		} else {
+			struct sockaddr_in6 *sa6;
 
-                            sa6 = malloc(sizeof(*sa6));
-                            if (sa6 != NULL) {
-                                sa6->sin6_addr = a6;
-                                sa6->sin6_family = AF_INET6;
-                                sa6->sin6_port = htons(NAMESERVER_PORT);
+			sa6 = malloc(sizeof(*sa6));
+			if (sa6 != NULL) {
+				sa6->sin6_addr = conf->nsaddrs[n].addr.a6;
+				sa6->sin6_family = AF_INET6;
+				sa6->sin6_port = htons(NAMESERVER_PORT);
 				statp->_u._ext.nsaddrs[nservall] = sa6;
 				statp->_u._ext.nssocks[nservall] = -1;
 				statp->_u._ext.nsmap[nservall] = MAXNS + 1;
-                                nservall++;
-                            }
-                        }
-#endif
-		    }
-		    continue;
-		}
-#ifdef RESOLVSORT
-		if (MATCH(buf, "sortlist")) {
-		    struct in_addr a;
-
-		    cp = buf + sizeof("sortlist") - 1;
-		    while (nsort < MAXRESOLVSORT) {
-			while (*cp == ' ' || *cp == '\t')
-			    cp++;
-			if (*cp == '\0' || *cp == '\n' || *cp == ';')
-			    break;
-			net = cp;
-			while (*cp && !ISSORTMASK(*cp) && *cp != ';' &&
-			       isascii(*cp) && !isspace(*cp))
-				cp++;
-			n = *cp;
-			*cp = 0;
-			if (inet_aton(net, &a)) {
-			    statp->sort_list[nsort].addr = a;
-			    if (ISSORTMASK(n)) {
-				*cp++ = n;
-				net = cp;
-				while (*cp && *cp != ';' &&
-					isascii(*cp) && !isspace(*cp))
-				    cp++;
-				n = *cp;
-				*cp = 0;
-				if (inet_aton(net, &a)) {
-				    statp->sort_list[nsort].mask = a.s_addr;
-				} else {
-				    statp->sort_list[nsort].mask =
-					net_mask(statp->sort_list[nsort].addr);
-				}
-			    } else {
-				statp->sort_list[nsort].mask =
-				    net_mask(statp->sort_list[nsort].addr);
-			    }
-			    nsort++;
+				nservall++;
 			}
-			*cp = n;
-		    }
-		    continue;
-		}
 #endif
-		if (MATCH(buf, "options")) {
-		    res_setoptions(statp, buf + sizeof("options") - 1, "conf");
-		    continue;
 		}
 	    }
 	    if (nserv > 1)
@@ -408,14 +567,18 @@ __res_vinit(res_state statp, int preinit) {
 		statp->_u._ext.nscount6 = nservall - nserv;
 #endif
 #ifdef RESOLVSORT
-	    statp->nsort = nsort;
+	    for (n = 0; n < conf->nsort; n++) {
+		statp->sort_list[n].addr = conf->sort_list[n].addr;
+		statp->sort_list[n].mask = conf->sort_list[n].mask;
+	    }
+	    statp->nsort = conf->nsort;
 #endif
-	    (void) fclose(fp);
+	    if (conf->options != NULL)
+		res_setoptions(statp, conf->options, "conf");
 	}
-	if (statp->defdname[0] == 0 &&
-	    __gethostname(buf, sizeof(statp->defdname) - 1) == 0 &&
-	    (cp = strchr(buf, '.')) != NULL)
-		strcpy(statp->defdname, cp + 1);
+	if (statp->defdname[0] == 0)
+		strcpy(statp->defdname, conf->hostdomain);
+	pthread_mutex_unlock(&res_conf_lock);
 
 	/* find components of local domain that might be searched */
 	if (havesearch == 0) {
@@ -517,6 +680,19 @@ res_setoptions(res_state statp, const char *options, const char *source) {
 		} else if (!strncmp(cp, "no-check-names",
 				    sizeof("no-check-names") - 1)) {
 			statp->options |= RES_NOCHECKNAME;
+		} else if (!strncmp(cp, "single-request",
+				    sizeof("single-request") - 1)) {
+			statp->options |= RES_SNGLKUP;
+		} else if (!strncmp(cp, "blast", sizeof("blast") - 1)) {
+			statp->options |= RES_BLAST;
+		} else if (!strncmp(cp, "no-edns0", sizeof("no-edns0") - 1)) {
+			statp->options &= ~RES_USE_EDNS0;
+		} else if (!strncmp(cp, "edns0", sizeof("edns0") - 1)) {
+			statp->options |= RES_USE_EDNS0;
+		} else if (!strncmp(cp, "no-cache", sizeof("no-cache") - 1)) {
+			statp->options &= ~RES_USECACHE;
+		} else if (!strncmp(cp, "cache", sizeof("cache") - 1)) {
+			statp->options |= RES_USECACHE;
 		} else {
 			/* XXX - print a warning here? */
 		}
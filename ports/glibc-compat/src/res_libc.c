@@ -54,6 +54,7 @@ __libc_lock_define_initialized (static, lock);
 #endif
 
 extern int __res_vinit(res_state, int);
+extern void __res_conf_check(int);
 int
 res_init(void) {
 
@@ -98,6 +99,9 @@ res_init(void) {
 	if (!_res.id)
 		_res.id = res_randomid();
 
+	/* Read resolv.conf again even if it looks the same.  */
+	__res_conf_check (1);
+
 	atomicinclock (lock);
 	/* Request all threads to re-initialize their resolver states,
 	   resolv.conf might have changed.  */
@@ -108,11 +112,12 @@ res_init(void) {
 }
 
 /* Initialize resp if RES_INIT is not yet set or if res_init in some other
-   thread requested re-initializing.  */
+   thread, or a change to resolv.conf, requested re-initializing.  */
 int
 __res_maybe_init (res_state resp, int preinit)
 {
 	if (resp->options & RES_INIT) {
+		__res_conf_check (0);
 		if (__res_initstamp != resp->_u._ext.initstamp) {
 			if (resp->nscount > 0) {
 				__res_nclose (resp);
@@ -221,3 +221,44 @@ res_nmkquery(res_state statp,
 	return (cp - buf);
 }
 libresolv_hidden_def (res_nmkquery)
+
+/*
+ * Add an EDNS0 OPT pseudo-record (RFC 6891) to the query of n0 bytes in
+ * buf, advertising that answers of up to anslen bytes can be taken over
+ * UDP.  Returns the new size of the query, or -1 if it does not fit.
+ */
+int
+res_nopt(res_state statp,
+	 int n0,		/* current offset in buffer */
+	 u_char *buf,		/* buffer to put query */
+	 int buflen,		/* size of buffer */
+	 int anslen)		/* UDP answer buffer size */
+{
+	register HEADER *hp;
+	register u_char *cp;
+
+#ifdef DEBUG
+	if ((statp->options & RES_DEBUG) != 0U)
+		printf(";; res_nopt()\n");
+#endif
+	hp = (HEADER *) buf;
+	cp = buf + n0;
+	if (buflen - n0 < 1 + RRFIXEDSZ)
+		return (-1);
+	if (anslen > 0xffff)
+		anslen = 0xffff;
+	*cp++ = 0;				/* root domain */
+	__putshort(T_OPT, cp);
+	cp += INT16SZ;
+	__putshort(anslen, cp);			/* "class" is the UDP size */
+	cp += INT16SZ;
+	*cp++ = NOERROR;			/* extended RCODE */
+	*cp++ = 0;				/* EDNS version */
+	__putshort(0, cp);			/* flags */
+	cp += INT16SZ;
+	__putshort(0, cp);			/* RDLEN */
+	cp += INT16SZ;
+	hp->arcount = htons(ntohs(hp->arcount) + 1);
+	return (cp - buf);
+}
+libresolv_hidden_def (res_nopt)
@@ -82,6 +82,7 @@ static const char rcsid[] = "$BINDId: res_query.c,v 8.20 2000/02/29 05:39:12 vix
 #include <stdlib.h>
 #include <string.h>
 #include "libc-symbols.h"
+#include "res_cache.h"
 
 /* Options.  Leave them on. */
 /* #undef DEBUG */
@@ -92,12 +93,74 @@ static const char rcsid[] = "$BINDId: res_query.c,v 8.20 2000/02/29 05:39:12 vix
 #define MAXPACKET	65536
 #endif
 
-#define QUERYSIZE	(HFIXEDSZ + QFIXEDSZ + MAXCDNAME + 1)
+/* with room for an OPT record */
+#define QUERYSIZE	(HFIXEDSZ + QFIXEDSZ + MAXCDNAME + 1 + 1 + RRFIXEDSZ)
 
 static int
 __libc_res_nquerydomain(res_state statp, const char *name, const char *domain,
 			int class, int type, u_char *answer, int anslen,
 			u_char **answerp);
+extern int __libc_res_nsend(res_state, const u_char *, int, u_char *, int,
+			    u_char **);
+extern int __libc_res_nsend2(res_state, const u_char *, int, const u_char *,
+			     int, u_char *, int, u_char *, int, int *);
+
+/* Set H_ERRNO for an answer with an error, or without records. */
+static void
+set_h_errno(res_state statp, const HEADER *hp)
+{
+#ifdef DEBUG
+	if (statp->options & RES_DEBUG)
+		printf(";; rcode = %d, ancount=%d\n", hp->rcode,
+		    ntohs(hp->ancount));
+#endif
+	switch (hp->rcode) {
+	case NXDOMAIN:
+		RES_SET_H_ERRNO(statp, HOST_NOT_FOUND);
+		break;
+	case SERVFAIL:
+		RES_SET_H_ERRNO(statp, TRY_AGAIN);
+		break;
+	case NOERROR:
+		RES_SET_H_ERRNO(statp, NO_DATA);
+		break;
+	case FORMERR:
+	case NOTIMP:
+	case REFUSED:
+	default:
+		RES_SET_H_ERRNO(statp, NO_RECOVERY);
+		break;
+	}
+}
+
+/*
+ * Add an OPT record to the query of n bytes in buf, of buflen, asking
+ * for answers of up to anslen bytes over UDP, unless EDNS0 is off or has
+ * failed with this res_state's servers, or a plain query can already
+ * take answers that big.  Returns the new size of the query.
+ */
+static int
+add_edns0(res_state statp, int n, u_char *buf, int buflen, int anslen)
+{
+	int n2;
+
+	if ((statp->options & RES_USE_EDNS0) == 0 ||
+	    (statp->_flags & RES_F_EDNS0ERR) != 0 || anslen <= PACKETSZ)
+		return (n);
+	n2 = res_nopt(statp, n, buf, buflen,
+		      anslen < RES_EDNSBUFSIZE ? anslen : RES_EDNSBUFSIZE);
+	return (n2 > 0 ? n2 : n);
+}
+
+/* Did the server answer the query this way because it had an OPT record? */
+static int
+edns0_refused(const u_char *answer, int anslen)
+{
+	const HEADER *hp = (const HEADER *) answer;
+
+	return (anslen >= HFIXEDSZ &&
+		(hp->rcode == FORMERR || hp->rcode == NOTIMP));
+}
 
 /*
  * Formulate a normal query, send, and await answer.
@@ -106,6 +169,10 @@ __libc_res_nquerydomain(res_state statp, const char *name, const char *domain,
  * if no error is indicated and the answer count is nonzero.
  * Return the size of the response on success, -1 on error.
  * Error number is left in H_ERRNO.
+ * With RES_USECACHE the answer may come from, and goes to, the
+ * in-process cache (see res_cache.c).  With RES_USE_EDNS0 the query
+ * asks for answers as big as the buffer over UDP, and is asked again
+ * without EDNS0 if the server refuses it or the query times out.
  *
  * Caller must parse answer and determine whether it answers the question.
  */
@@ -117,19 +184,35 @@ __libc_res_nquery(res_state statp,
 		  int anslen,		/* size of answer buffer */
 		  u_char **answerp)	/* if buffer needs to be enlarged */
 {
-	u_char *buf;
+	u_char *buf, *ans;
 	HEADER *hp = (HEADER *) answer;
-	int n, use_malloc = 0;
+	int n, ansbuflen, use_malloc, edns;
+	/* hooks may want to see every query */
+	int use_cache = (statp->options & RES_USECACHE) != 0 &&
+			statp->qhook == NULL && statp->rhook == NULL;
+	u_int32_t scope = use_cache ? __res_cache_scope(statp) : 0;
 
 	hp->rcode = NOERROR;	/* default */
 
-	buf = alloca (QUERYSIZE);
-
 #ifdef DEBUG
 	if (statp->options & RES_DEBUG)
 		printf(";; res_query(%s, %d, %d)\n", name, class, type);
 #endif
 
+	if (use_cache &&
+	    (n = __res_cache_lookup(scope, name, class, type, answer,
+				    anslen)) > 0) {
+#ifdef DEBUG
+		if (statp->options & RES_DEBUG)
+			printf(";; res_query: answered from cache\n");
+#endif
+		goto answered;
+	}
+
+ again:
+	buf = alloca (QUERYSIZE);
+	use_malloc = 0;
+
 	n = res_nmkquery(statp, QUERY, name, class, type, NULL, 0, NULL,
 			 buf, QUERYSIZE);
 	if (__builtin_expect (n <= 0, 0)) {
@@ -152,9 +235,22 @@ __libc_res_nquery(res_state statp,
 			free (buf);
 		return (n);
 	}
+	edns = n;
+	n = add_edns0(statp, n, buf, use_malloc ? MAXPACKET : QUERYSIZE,
+		      answerp != NULL ? MAXPACKET : anslen);
+	edns = n != edns;
 	n = __libc_res_nsend(statp, buf, n, answer, anslen, answerp);
 	if (use_malloc)
 		free (buf);
+	if (n < 0 && edns && errno == ETIMEDOUT) {
+		/* some servers drop a query with OPT rather than refuse it */
+#ifdef DEBUG
+		if (statp->options & RES_DEBUG)
+			printf(";; res_query: EDNS0 timed out, retrying\n");
+#endif
+		statp->_flags |= RES_F_EDNS0ERR;
+		goto again;
+	}
 	if (n < 0) {
 #ifdef DEBUG
 		if (statp->options & RES_DEBUG)
@@ -163,36 +259,143 @@ __libc_res_nquery(res_state statp,
 		RES_SET_H_ERRNO(statp, TRY_AGAIN);
 		return (n);
 	}
-
-	if (hp->rcode != NOERROR || ntohs(hp->ancount) == 0) {
+	ans = answer;
+	ansbuflen = anslen;
+	if (answerp != NULL && *answerp != NULL && *answerp != answer) {
+		ans = *answerp;
+		ansbuflen = MAXPACKET;
+	}
+	hp = (HEADER *) ans;
+	if (edns && edns0_refused(ans, n)) {
 #ifdef DEBUG
 		if (statp->options & RES_DEBUG)
-			printf(";; rcode = %d, ancount=%d\n", hp->rcode,
-			    ntohs(hp->ancount));
+			printf(";; res_query: EDNS0 refused, retrying\n");
 #endif
-		switch (hp->rcode) {
-		case NXDOMAIN:
-			RES_SET_H_ERRNO(statp, HOST_NOT_FOUND);
-			break;
-		case SERVFAIL:
-			RES_SET_H_ERRNO(statp, TRY_AGAIN);
-			break;
-		case NOERROR:
-			RES_SET_H_ERRNO(statp, NO_DATA);
-			break;
-		case FORMERR:
-		case NOTIMP:
-		case REFUSED:
-		default:
-			RES_SET_H_ERRNO(statp, NO_RECOVERY);
-			break;
-		}
+		statp->_flags |= RES_F_EDNS0ERR;
+		goto again;
+	}
+	/* n is past the buffer if the answer was truncated */
+	if (use_cache && n <= ansbuflen)
+		__res_cache_store(scope, name, class, type, ans, n);
+
+ answered:
+	if (hp->rcode != NOERROR || ntohs(hp->ancount) == 0) {
+		set_h_errno(statp, hp);
 		return (-1);
 	}
 	return (n);
 }
 libresolv_hidden_def (__libc_res_nquery)
 
+/*
+ * Like res_nquery, but asks two questions about name, typically for its
+ * A and AAAA records.  Unless RES_SNGLKUP is set the two queries go out
+ * together, so that asking for both takes no longer than asking for one.
+ * The lengths of the answers go in *resplen and *resplen2, -1 for one
+ * that never came.  Returns 0 if either answer has records, else -1
+ * with the error in H_ERRNO.
+ */
+int
+res_nquery2(res_state statp,
+	    const char *name,		/* domain name */
+	    int class, int type, int type2, /* class and types of query */
+	    u_char *answer, int anslen, int *resplen,	/* first answer */
+	    u_char *answer2, int anslen2, int *resplen2) /* second one */
+{
+	u_char *buf, *buf2;
+	HEADER *hp;
+	int n, n2, fresh, fresh2, edns, edns2;
+	int use_cache = (statp->options & RES_USECACHE) != 0 &&
+			statp->qhook == NULL && statp->rhook == NULL;
+	u_int32_t scope = use_cache ? __res_cache_scope(statp) : 0;
+
+ again:
+	*resplen = *resplen2 = -1;
+	if (use_cache) {
+		*resplen = __res_cache_lookup(scope, name, class, type,
+					      answer, anslen);
+		*resplen2 = __res_cache_lookup(scope, name, class, type2,
+					       answer2, anslen2);
+	}
+	fresh = *resplen < 0;
+	fresh2 = *resplen2 < 0;
+
+	buf = alloca (QUERYSIZE);
+	buf2 = alloca (QUERYSIZE);
+	n = n2 = 0;
+	if (fresh)
+		n = res_nmkquery(statp, QUERY, name, class, type, NULL, 0,
+				 NULL, buf, QUERYSIZE);
+	if (fresh2)
+		n2 = res_nmkquery(statp, QUERY, name, class, type2, NULL, 0,
+				  NULL, buf2, QUERYSIZE);
+	if ((fresh && n <= 0) || (fresh2 && n2 <= 0)) {
+		RES_SET_H_ERRNO(statp, NO_RECOVERY);
+		return (-1);
+	}
+	/* each may or may not have an OPT record, by its answer's size */
+	edns = n;
+	edns2 = n2;
+	if (fresh)
+		n = add_edns0(statp, n, buf, QUERYSIZE, anslen);
+	if (fresh2)
+		n2 = add_edns0(statp, n2, buf2, QUERYSIZE, anslen2);
+	edns = n != edns;
+	edns2 = n2 != edns2;
+	if (fresh && fresh2) {
+		/* the answers are told apart by their ids */
+		if (((HEADER *) buf2)->id == ((HEADER *) buf)->id)
+			((HEADER *) buf2)->id ^= htons(1);
+		*resplen = __libc_res_nsend2(statp, buf, n, buf2, n2,
+					     answer, anslen, answer2, anslen2,
+					     resplen2);
+	} else if (fresh)
+		*resplen = __libc_res_nsend(statp, buf, n, answer, anslen,
+					    NULL);
+	else if (fresh2)
+		*resplen2 = __libc_res_nsend(statp, buf2, n2, answer2,
+					     anslen2, NULL);
+	/*
+	 * A query with OPT that went unanswered while its fellow was
+	 * answered, or that timed out, may have been dropped for the OPT.
+	 */
+	if (((edns && *resplen < 0) || (edns2 && *resplen2 < 0)) &&
+	    (*resplen > 0 || *resplen2 > 0 || errno == ETIMEDOUT)) {
+		statp->_flags |= RES_F_EDNS0ERR;
+		goto again;
+	}
+	if (*resplen < 0 && *resplen2 < 0) {
+		RES_SET_H_ERRNO(statp, TRY_AGAIN);
+		return (-1);
+	}
+	/* only the answer to a query with OPT says the server refused it */
+	if ((edns && edns0_refused(answer, *resplen)) ||
+	    (edns2 && edns0_refused(answer2, *resplen2))) {
+		statp->_flags |= RES_F_EDNS0ERR;
+		goto again;
+	}
+	/* a length past the buffer means the answer was truncated */
+	if (use_cache && fresh && *resplen > 0 && *resplen <= anslen)
+		__res_cache_store(scope, name, class, type, answer,
+				  *resplen);
+	if (use_cache && fresh2 && *resplen2 > 0 && *resplen2 <= anslen2)
+		__res_cache_store(scope, name, class, type2, answer2,
+				  *resplen2);
+
+	hp = (HEADER *) answer;
+	if (*resplen >= HFIXEDSZ && hp->rcode == NOERROR &&
+	    ntohs(hp->ancount) > 0)
+		return (0);
+	hp = (HEADER *) answer2;
+	if (*resplen2 >= HFIXEDSZ && hp->rcode == NOERROR &&
+	    ntohs(hp->ancount) > 0)
+		return (0);
+	set_h_errno(statp, (HEADER *) (*resplen >= HFIXEDSZ ? answer
+							      : answer2));
+	return (-1);
+}
+libresolv_hidden_def (res_nquery2)
+
 int
 res_nquery(res_state statp,
 	   const char *name,	/* domain name */
@@ -92,6 +92,7 @@ static const char rcsid[] = "$BINDId: res_send.c,v 8.38 2000/03/30 20:16:51 vixi
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <resolv.h>
 #include <signal.h>
 #include <stdio.h>
@@ -177,13 +178,29 @@ evNowTime(struct timespec *res) {
 
 #define EXT(res) ((res)->_u._ext)
 
+/*
+ * A query on its way out, and where its answer goes.  send_dg sends
+ * one or two of them to one or more nameservers at a time, and send_vc
+ * one or two to a nameserver over one connection.
+ */
+struct dg_query {
+	const u_char	*buf;
+	int		buflen;
+	u_char		*ans;
+	int		anssiz;
+	u_char		**anscp;	/* if the answer buffer may grow */
+	int		resplen;	/* > 0 once answered */
+	int		tc;		/* truncated; ask again over TCP */
+};
+
 /* Forward. */
 
-static int		send_vc(res_state, const u_char *, int,
-				u_char **, int *, int *, int, u_char **);
-static int		send_dg(res_state, const u_char *, int,
-				u_char **, int *, int *, int,
-				int *, int *, u_char **);
+static int		send_vc(res_state, struct dg_query *, int, int *,
+				int);
+static void		vc_park(res_state);
+static int		send_dg(res_state, struct dg_query *, int,
+				const int *, int, int, int *, int *,
+				int *, int *);
 #ifdef DEBUG
 static void		Aerror(const res_state, FILE *, const char *, int,
 			       const struct sockaddr *);
@@ -331,11 +348,173 @@ res_queriesmatch(const u_char *buf1, const u_char *eom1,
 }
 libresolv_hidden_def (res_queriesmatch)
 
-int
-__libc_res_nsend(res_state statp, const u_char *buf, int buflen,
-		 u_char *ans, int anssiz, u_char **ansp)
+/*
+ * Smoothed round trip times of the nameservers, shared by every
+ * res_state.  Unless RES_ROTATE is set, the servers are tried fastest
+ * first, so one that has stopped answering goes to the back of the line
+ * after a single timeout instead of costing one on every query.  Servers
+ * passed over when an earlier one answers are aged toward zero.  Once
+ * one that timed out has aged back to the front, it is asked alongside
+ * the best of the others rather than ahead of them, so that seeing
+ * whether it has recovered never costs a lookup a timeout.
+ */
+#define RTT_SLOTS	(4 * MAXNS)
+#define RTT_AGE_SHIFT	5		/* lose 1/32 when passed over */
+
+static struct rtt_slot {
+	struct sockaddr_in6	addr;
+	u_int			srtt;	/* usec; 0 until measured */
+	u_int			stamp;	/* last use, for replacement */
+	int			dead;	/* timed out, not heard from since */
+} rtt_slots[RTT_SLOTS];
+static u_int rtt_clock;
+static pthread_mutex_t rtt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Look a server up in rtt_slots, maybe taking the stalest slot for it. */
+static struct rtt_slot *
+rtt_find(struct sockaddr_in6 *addr, int create)
+{
+	struct rtt_slot *sp, *old = &rtt_slots[0];
+
+	for (sp = rtt_slots; sp < &rtt_slots[RTT_SLOTS]; sp++) {
+		if (sp->stamp != 0 && sock_eq(&sp->addr, addr)) {
+			sp->stamp = ++rtt_clock;
+			return (sp);
+		}
+		if (sp->stamp < old->stamp)
+			old = sp;
+	}
+	if (!create)
+		return (NULL);
+	memcpy(&old->addr, addr, sizeof old->addr);
+	old->srtt = 0;
+	old->stamp = ++rtt_clock;
+	old->dead = 0;
+	return (old);
+}
+
+/*
+ * Fold a round trip of usec into a server's.  One heard from again after
+ * a timeout starts afresh.
+ */
+static void
+rtt_update(struct sockaddr_in6 *addr, u_int usec)
+{
+	struct rtt_slot *sp;
+
+	pthread_mutex_lock(&rtt_lock);
+	sp = rtt_find(addr, 1);
+	if (sp->srtt == 0 || sp->dead)
+		sp->srtt = usec ? usec : 1;
+	else
+		sp->srtt = sp->srtt - sp->srtt / 8 + usec / 8;
+	sp->dead = 0;
+	pthread_mutex_unlock(&rtt_lock);
+}
+
+/* A server that timed out, or failed, goes straight to the back. */
+static void
+rtt_timeout(struct sockaddr_in6 *addr, int seconds)
+{
+	struct rtt_slot *sp;
+
+	pthread_mutex_lock(&rtt_lock);
+	sp = rtt_find(addr, 1);
+	if (sp->srtt < (u_int) seconds * 1000000)
+		sp->srtt = (u_int) seconds * 1000000;
+	sp->dead = 1;
+	pthread_mutex_unlock(&rtt_lock);
+}
+
+/* A dead server probed alongside another goes back if it said nothing. */
+static void
+rtt_probed(struct sockaddr_in6 *addr, int seconds)
+{
+	struct rtt_slot *sp;
+
+	pthread_mutex_lock(&rtt_lock);
+	if ((sp = rtt_find(addr, 0)) != NULL && sp->dead &&
+	    sp->srtt < (u_int) seconds * 1000000)
+		sp->srtt = (u_int) seconds * 1000000;
+	pthread_mutex_unlock(&rtt_lock);
+}
+
+/* Age the servers in order[0..n-1], which an answer came in without. */
+static void
+rtt_age(res_state statp, const int *order, int n)
+{
+	struct rtt_slot *sp;
+
+	pthread_mutex_lock(&rtt_lock);
+	while (n-- > 0)
+		if ((sp = rtt_find(EXT(statp).nsaddrs[*order++], 0)) != NULL)
+			sp->srtt -= sp->srtt >> RTT_AGE_SHIFT;
+	pthread_mutex_unlock(&rtt_lock);
+}
+
+/*
+ * Fill in order[] with our nameservers in the order they are to be
+ * tried, and return how many there are.  Servers not measured yet come
+ * first; ties keep the order of the list.  A dead server that would come
+ * first goes last instead, with *probe set for it to be asked along
+ * with the first.
+ */
+static int
+rtt_order(res_state statp, int *order, int *probe)
+{
+	struct rtt_slot *sp;
+	u_int srtt[MAXNS], key;
+	int dead[MAXNS], n = 0, ns, i, d;
+
+	pthread_mutex_lock(&rtt_lock);
+	for (ns = 0; ns < MAXNS; ns++) {
+		if (EXT(statp).nsaddrs[ns] == NULL)
+			continue;
+		key = 0;
+		d = 0;
+		if ((statp->options & RES_ROTATE) == 0 &&
+		    (sp = rtt_find(EXT(statp).nsaddrs[ns], 0)) != NULL) {
+			key = sp->srtt;
+			d = sp->dead;
+		}
+		for (i = n; i > 0 && srtt[i - 1] > key; i--) {
+			srtt[i] = srtt[i - 1];
+			dead[i] = dead[i - 1];
+			order[i] = order[i - 1];
+		}
+		srtt[i] = key;
+		dead[i] = d;
+		order[i] = ns;
+		n++;
+	}
+	pthread_mutex_unlock(&rtt_lock);
+	*probe = 0;
+	for (i = 1; i < n && dead[0]; i++)
+		if (!dead[i]) {
+			ns = order[0];
+			memmove(&order[0], &order[1], (n - 1) * sizeof *order);
+			order[n - 1] = ns;
+			*probe = 1;
+			break;
+		}
+	return (n);
+}
+
+/*
+ * Send buf, and buf2 too if it is not NULL, and wait for the answers.
+ * The two go out together, to each server in turn or with RES_BLAST
+ * to all of them at once.  Returns the length of the first answer, the
+ * second's going in *resplen2; either is -1 if it never came.
+ */
+static int
+res_nsend_pair(res_state statp, const u_char *buf, int buflen,
+	       const u_char *buf2, int buflen2, u_char *ans, int anssiz,
+	       u_char **ansp, u_char *ans2, int anssiz2, int *resplen2)
 {
 	int gotsomewhere, terrno, try, v_circuit, resplen, ns, n;
+	int order[MAXNS], norder, nrounds, nq, blast, seconds, i, k, first;
+	int probe, probing, pair[2];
+	struct dg_query q[2];
 
 	if (statp->nscount == 0) {
 		__set_errno (ESRCH);
@@ -465,13 +644,40 @@ __libc_res_nsend(res_state statp, const u_char *buf, int buflen,
 		}
 	}
 
+	memset(q, 0, sizeof q);
+	q[0].buf = buf;
+	q[0].buflen = buflen;
+	q[0].ans = ans;
+	q[0].anssiz = anssiz;
+	q[0].anscp = ansp;
+	q[1].buf = buf2;
+	q[1].buflen = buflen2;
+	q[1].ans = ans2;
+	q[1].anssiz = anssiz2;
+	nq = buf2 != NULL ? 2 : 1;
+
+	/*
+	 * Hooks want to see each server in turn; RES_BLAST asks them all
+	 * at once, in one round per try.  Otherwise a dead server due to
+	 * be probed is asked in the first round, along with the first.
+	 */
+	norder = rtt_order(statp, order, &probe);
+	blast = (statp->options & RES_BLAST) != 0 && norder > 1 &&
+		statp->qhook == NULL && statp->rhook == NULL;
+	nrounds = blast ? 1 : norder;
+	if (blast || statp->qhook != NULL || statp->rhook != NULL)
+		probe = 0;
+
 	/*
 	 * Send request, RETRY times, or until successful.
 	 */
 	for (try = 0; try < statp->retry; try++) {
-	    for (ns = 0; ns < MAXNS; ns++)
+	    for (i = 0; i < nrounds; i++)
 	    {
-		struct sockaddr_in6 *nsap = EXT(statp).nsaddrs[ns];
+		struct sockaddr_in6 *nsap;
+
+		ns = order[i];
+		nsap = EXT(statp).nsaddrs[ns];
 
 		if (nsap == NULL)
 			goto next_ns;
@@ -507,6 +713,8 @@ __libc_res_nsend(res_state statp, const u_char *buf, int buflen,
 					return (-1);
 				}
 			} while (!done);
+			q[0].buf = buf;
+			q[0].buflen = buflen;
 		}
 
 #ifdef DEBUG
@@ -520,25 +728,46 @@ __libc_res_nsend(res_state statp, const u_char *buf, int buflen,
 		if (v_circuit) {
 			/* Use VC; at most one attempt per server. */
 			try = statp->retry;
-			n = send_vc(statp, buf, buflen, &ans, &anssiz, &terrno,
-				    ns, ansp);
-			if (n < 0)
+			if (send_vc(statp, q, nq, &terrno, ns) < 0)
 				return (-1);
-			if (n == 0)
-				goto next_ns;
-			resplen = n;
 		} else {
-			/* Use datagrams. */
-			n = send_dg(statp, buf, buflen, &ans, &anssiz, &terrno,
-				    ns, &v_circuit, &gotsomewhere, ansp);
+			/* Use datagrams, for what is still unanswered. */
+			first = q[0].resplen > 0;
+			k = first || nq == 1 || q[1].resplen > 0 ? 1 : 2;
+			if (blast)
+				seconds = statp->retrans << try;
+			else {
+				seconds = (statp->retrans << i);
+				if (i > 0)
+					seconds /= statp->nscount;
+			}
+			if (seconds <= 0)
+				seconds = 1;
+			probing = probe && try == 0 && i == 0;
+			if (probing) {
+				pair[0] = order[0];
+				pair[1] = order[norder - 1];
+			}
+			n = send_dg(statp, &q[first], k,
+				    blast ? order : probing ? pair : &order[i],
+				    blast ? norder : probing ? 2 : 1, seconds,
+				    &terrno, &ns, &v_circuit, &gotsomewhere);
 			if (n < 0)
 				return (-1);
-			if (n == 0)
-				goto next_ns;
+			if (probing)
+				rtt_probed(EXT(statp).nsaddrs[pair[1]],
+					   seconds);
+			nsap = EXT(statp).nsaddrs[ns];
 			if (v_circuit)
 				goto same_ns;
-			resplen = n;
 		}
+		if (q[0].resplen <= 0 || (nq == 2 && q[1].resplen <= 0))
+			goto next_ns;
+		ans = q[0].ans;
+		anssiz = q[0].anssiz;
+		resplen = q[0].resplen;
+		if (!blast)
+			rtt_age(statp, &order[i + 1], norder - i - 1);
 
 		Dprint((statp->options & RES_DEBUG) ||
 		       ((statp->pfcode & RES_PRF_REPLY) &&
@@ -553,10 +782,12 @@ __libc_res_nsend(res_state statp, const u_char *buf, int buflen,
 		/*
 		 * If we have temporarily opened a virtual circuit,
 		 * or if we haven't been asked to keep a socket open,
-		 * close the socket.
+		 * close the sockets, keeping a virtual circuit for
+		 * the next lookup to this server.
 		 */
 		if ((v_circuit && (statp->options & RES_USEVC) == 0) ||
 		    (statp->options & RES_STAYOPEN) == 0) {
+			vc_park(statp);
 			res_nclose(statp);
 		}
 		if (statp->rhook) {
@@ -589,11 +820,19 @@ __libc_res_nsend(res_state statp, const u_char *buf, int buflen,
 			} while (!done);
 
 		}
+		if (resplen2 != NULL)
+			*resplen2 = q[1].resplen;
 		return (resplen);
  next_ns: ;
 	   } /*foreach ns*/
 	} /*foreach retry*/
 	res_nclose(statp);
+	if (resplen2 != NULL) {
+		/* one answer of the two is worth returning */
+		*resplen2 = q[1].resplen > 0 ? q[1].resplen : -1;
+		if (q[0].resplen > 0)
+			return (q[0].resplen);
+	}
 	if (!v_circuit) {
 		if (!gotsomewhere)
 			__set_errno (ECONNREFUSED);	/* no nameservers found */
@@ -604,6 +843,42 @@ __libc_res_nsend(res_state statp, const u_char *buf, int buflen,
 	return (-1);
 }
 
+int
+__libc_res_nsend(res_state statp, const u_char *buf, int buflen,
+		 u_char *ans, int anssiz, u_char **ansp)
+{
+	return res_nsend_pair(statp, buf, buflen, NULL, 0, ans, anssiz, ansp,
+			      NULL, 0, NULL);
+}
+
+/*
+ * Send two queries, typically for a name's A and AAAA records, and
+ * return the length of the first answer and put that of the second in
+ * *resplen2; either is -1 if it never came.  Both go out at once on the
+ * same socket, or over TCP on the same connection, unless RES_SNGLKUP is
+ * set or hooks are in use.
+ */
+int
+__libc_res_nsend2(res_state statp, const u_char *buf, int buflen,
+		  const u_char *buf2, int buflen2, u_char *ans, int anssiz,
+		  u_char *ans2, int anssiz2, int *resplen2)
+{
+	int n;
+
+	if ((statp->options & RES_SNGLKUP) != 0 ||
+	    statp->qhook != NULL || statp->rhook != NULL ||
+	    ((statp->options & RES_USEVC) == 0 &&
+	     (buflen > PACKETSZ || buflen2 > PACKETSZ))) {
+		n = res_nsend_pair(statp, buf, buflen, NULL, 0, ans, anssiz,
+				   NULL, NULL, 0, NULL);
+		*resplen2 = res_nsend_pair(statp, buf2, buflen2, NULL, 0,
+					   ans2, anssiz2, NULL, NULL, 0, NULL);
+		return (n);
+	}
+	return (res_nsend_pair(statp, buf, buflen, buf2, buflen2, ans, anssiz,
+			       NULL, ans2, anssiz2, resplen2));
+}
+
 int
 res_nsend(res_state statp,
 	  const u_char *buf, int buflen, u_char *ans, int anssiz)
@@ -615,61 +890,192 @@ libresolv_hidden_def (res_nsend)
 /* Private */
 #ifdef __native_client__
 static int
-send_vc(res_state statp,
-	const u_char *buf, int buflen, u_char **ansp, int *anssizp,
-	int *terrno, int ns, u_char **anscp)
+send_vc(res_state statp, struct dg_query *q, int nq, int *terrno, int ns)
 {
   fprintf(stderr, "Must not reach: send_vc()\n");
   abort();
   return 0;
 }
 
+static void
+vc_park(res_state statp)
+{
+}
+
 static int
-send_dg(res_state statp,
-	const u_char *buf, int buflen, u_char **ansp, int *anssizp,
-	int *terrno, int ns, int *v_circuit, int *gotsomewhere, u_char **anscp)
+send_dg(res_state statp, struct dg_query *q, int nq,
+	const int *nslist, int nns, int seconds, int *terrno, int *nsp,
+	int *v_circuit, int *gotsomewhere)
 {
   fprintf(stderr, "Must not reach: send_dg()\n");
   abort();
   return 0;
 }
 #else
+/*
+ * TCP connections kept open between lookups, shared by every res_state
+ * in the process.  Unless RES_STAYOPEN keeps it in the res_state, a
+ * connection that has answered is parked here rather than closed, and
+ * the next query to the same server over TCP takes it back instead of
+ * paying for a handshake.  A connection is used by one lookup at a time.
+ * One left idle for VC_IDLE seconds, or closed by the server meanwhile,
+ * is closed rather than reused; RFC 7766 leaves idle timeouts to the
+ * server, and servers keep them short.
+ */
+#define VC_SLOTS	(2 * MAXNS)
+#define VC_IDLE		10		/* seconds */
+
+static struct vc_slot {
+	struct sockaddr_in6	addr;
+	int			fd;
+	time_t			parked;	/* when; 0 if the slot is free */
+} vc_slots[VC_SLOTS];
+static pthread_mutex_t vc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Move statp's virtual circuit, if it has one, into vc_slots. */
+static void
+vc_park(res_state statp)
+{
+	struct vc_slot *sp, *old = &vc_slots[0];
+	struct sockaddr_in6 peer;
+	socklen_t size = sizeof peer;
+	struct timespec now;
+	int fd = statp->_vcsock, oldfd;
+
+	if (fd < 0 || (statp->_flags & RES_F_VC) == 0)
+		return;
+	statp->_vcsock = -1;
+	statp->_flags &= ~(RES_F_VC | RES_F_CONN);
+	if (getpeername(fd, (struct sockaddr *)&peer, &size) < 0) {
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	evNowTime(&now);
+	pthread_mutex_lock(&vc_lock);
+	for (sp = vc_slots; sp < &vc_slots[VC_SLOTS]; sp++)
+		if (sp->parked < old->parked)
+			old = sp;
+	oldfd = old->parked != 0 ? old->fd : -1;
+	old->addr = peer;
+	old->fd = fd;
+	old->parked = now.tv_sec;
+	pthread_mutex_unlock(&vc_lock);
+	if (oldfd >= 0)
+		close(oldfd);
+}
+
+/* Take a parked connection to nsap, returning -1 if there is none. */
 static int
-send_vc(res_state statp,
-	const u_char *buf, int buflen, u_char **ansp, int *anssizp,
-	int *terrno, int ns, u_char **anscp)
+vc_unpark(struct sockaddr_in6 *nsap)
 {
-	const HEADER *hp = (HEADER *) buf;
-	u_char *ans = *ansp;
-	int anssiz = *anssizp;
-	HEADER *anhp = (HEADER *) ans;
-	struct sockaddr_in6 *nsap = EXT(statp).nsaddrs[ns];
-	int truncating, connreset, resplen, n;
-	struct iovec iov[2];
-	u_short len;
-	u_char *cp;
+	struct vc_slot *sp;
+	struct pollfd pfd;
+	struct timespec now;
+	int fd, stale;
+
+	evNowTime(&now);
+	for (;;) {
+		fd = -1;
+		stale = 0;
+		pthread_mutex_lock(&vc_lock);
+		for (sp = vc_slots; sp < &vc_slots[VC_SLOTS]; sp++)
+			if (sp->parked != 0 && sock_eq(&sp->addr, nsap)) {
+				fd = sp->fd;
+				stale = now.tv_sec - sp->parked >= VC_IDLE;
+				sp->parked = 0;
+				break;
+			}
+		pthread_mutex_unlock(&vc_lock);
+		if (fd < 0)
+			return (-1);
+		/* Anything to read now means it was closed under us. */
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (!stale && poll(&pfd, 1, 0) == 0)
+			return (fd);
+		close(fd);
+	}
+}
+
+/* Read len bytes, returning len or what the last read did. */
+static int
+vc_read(int fd, u_char *cp, int len)
+{
+	int n, left = len;
+
+	while (left > 0) {
+		n = TEMP_FAILURE_RETRY (read(fd, (char *)cp, left));
+		if (n <= 0)
+			return (n);
+		cp += n;
+		left -= n;
+	}
+	return (len);
+}
+
+/* Read and throw away len bytes. */
+static int
+vc_skip(int fd, int len)
+{
+	u_char junk[PACKETSZ];
+	int n;
+
+	while (len > 0) {
+		n = vc_read(fd, junk, len > sizeof junk ? sizeof junk : len);
+		if (n <= 0)
+			return (n);
+		len -= n;
+	}
+	return (1);
+}
 
+/*
+ * Send the unanswered queries of q[0..nq-1] to nameserver ns over TCP,
+ * all at once, and read their answers, which may come in any order
+ * (RFC 7766).  Answers go in q[].resplen.  Returns -1 if there is no
+ * point trying another server, else 0.
+ */
+static int
+send_vc(res_state statp, struct dg_query *q, int nq, int *terrno, int ns)
+{
+	struct sockaddr_in6 *nsap = EXT(statp).nsaddrs[ns];
+	struct dg_query *qp;
+	struct iovec iov[4];
+	u_char lens[2][INT16SZ];
+	u_char lenbuf[INT16SZ];
+	u_char hdr[HFIXEDSZ];
+	int truncating, connreset, reused, resplen, pending, total, k, n;
+	int len;
+	u_char *ans;
+
+	assert(nq <= 2);
 	connreset = 0;
  same_ns:
-	truncating = 0;
+	reused = 0;
 
 	/* Are we still talking to whom we want to talk to? */
 	if (statp->_vcsock >= 0 && (statp->_flags & RES_F_VC) != 0) {
 		struct sockaddr_in6 peer;
-		int size = sizeof peer;
+		socklen_t size = sizeof peer;
 
 		if (getpeername(statp->_vcsock,
 				(struct sockaddr *)&peer, &size) < 0 ||
-		    !sock_eq(&peer, nsap)) {
-			res_nclose(statp);
-			statp->_flags &= ~RES_F_VC;
-		}
+		    !sock_eq(&peer, nsap))
+			vc_park(statp);
+		else
+			reused = 1;
 	}
 
 	if (statp->_vcsock < 0 || (statp->_flags & RES_F_VC) == 0) {
 		if (statp->_vcsock >= 0)
 			res_nclose(statp);
 
+		if (!connreset && (statp->_vcsock = vc_unpark(nsap)) >= 0) {
+			statp->_flags |= RES_F_VC;
+			reused = 1;
+			goto connected;
+		}
 		statp->_vcsock = socket(nsap->sin6_family, SOCK_STREAM, 0);
 		if (statp->_vcsock < 0) {
 			*terrno = errno;
@@ -687,376 +1093,483 @@ send_vc(res_state statp,
 		}
 		statp->_flags |= RES_F_VC;
 	}
+ connected:
 
 	/*
-	 * Send length & message
+	 * Send lengths & messages, pipelined
 	 */
-	putshort((u_short)buflen, (u_char*)&len);
-	evConsIovec(&len, INT16SZ, &iov[0]);
-	evConsIovec((void*)buf, buflen, &iov[1]);
-	if (TEMP_FAILURE_RETRY (writev(statp->_vcsock, iov, 2))
-	    != (INT16SZ + buflen)) {
-		*terrno = errno;
-		Perror(statp, stderr, "write failed", errno);
-		res_nclose(statp);
-		return (0);
+	pending = total = n = 0;
+	for (k = 0; k < nq; k++) {
+		if (q[k].resplen > 0)
+			continue;
+		putshort((u_short)q[k].buflen, lens[k]);
+		evConsIovec(lens[k], INT16SZ, &iov[n++]);
+		evConsIovec((void*)q[k].buf, q[k].buflen, &iov[n++]);
+		total += INT16SZ + q[k].buflen;
+		pending++;
 	}
-	/*
-	 * Receive length & response
-	 */
- read_len:
-	cp = ans;
-	len = INT16SZ;
-	while ((n = TEMP_FAILURE_RETRY (read(statp->_vcsock, (char *)cp,
-					     (int)len))) > 0) {
-		cp += n;
-		if ((len -= n) <= 0)
-			break;
+#ifdef MSG_NOSIGNAL
+	{
+		/* A parked connection the server closed must not kill us. */
+		struct msghdr msg;
+
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+		n = TEMP_FAILURE_RETRY (sendmsg(statp->_vcsock, &msg,
+						MSG_NOSIGNAL));
 	}
-	if (n <= 0) {
+#else
+	n = TEMP_FAILURE_RETRY (writev(statp->_vcsock, iov, n));
+#endif
+	if (n != total) {
 		*terrno = errno;
-		Perror(statp, stderr, "read failed", errno);
+		Perror(statp, stderr, "write failed", errno);
 		res_nclose(statp);
-		/*
-		 * A long running process might get its TCP
-		 * connection reset if the remote server was
-		 * restarted.  Requery the server instead of
-		 * trying a new one.  When there is only one
-		 * server, this means that a query might work
-		 * instead of failing.  We only allow one reset
-		 * per query to prevent looping.
-		 */
-		if (*terrno == ECONNRESET && !connreset) {
+		if (reused && !connreset) {
 			connreset = 1;
-			res_nclose(statp);
 			goto same_ns;
 		}
-		res_nclose(statp);
 		return (0);
 	}
-	resplen = ns_get16(ans);
-	if (resplen > anssiz) {
-		if (anscp) {
-			ans = malloc (MAXPACKET);
-			if (ans == NULL) {
-				*terrno = ENOMEM;
+
+	/*
+	 * Receive lengths & responses, matching them to the queries by id
+	 */
+	while (pending > 0) {
+		truncating = 0;
+		n = vc_read(statp->_vcsock, lenbuf, INT16SZ);
+		if (n > 0) {
+			resplen = ns_get16(lenbuf);
+			if (resplen < HFIXEDSZ) {
+				/*
+				 * Undersized message.
+				 */
+				Dprint(statp->options & RES_DEBUG,
+				       (stdout, ";; undersized: %d\n",
+					resplen));
+				*terrno = EMSGSIZE;
 				res_nclose(statp);
 				return (0);
 			}
-			anssiz = MAXPACKET;
-			*anssizp = MAXPACKET;
-			*ansp = ans;
-			*anscp = ans;
-			anhp = (HEADER *) ans;
-			len = resplen;
-		} else {
-			Dprint(statp->options & RES_DEBUG,
-				(stdout, ";; response truncated\n")
-			);
-			truncating = 1;
-			len = anssiz;
+			n = vc_read(statp->_vcsock, hdr, HFIXEDSZ);
 		}
-	} else
-		len = resplen;
-	if (len < HFIXEDSZ) {
-		/*
-		 * Undersized message.
-		 */
-		Dprint(statp->options & RES_DEBUG,
-		       (stdout, ";; undersized: %d\n", len));
-		*terrno = EMSGSIZE;
-		res_nclose(statp);
-		return (0);
-	}
-	cp = ans;
-	while (len != 0 && (n = read(statp->_vcsock, (char *)cp, (int)len)) > 0){
-		cp += n;
-		len -= n;
-	}
-	if (n <= 0) {
-		*terrno = errno;
-		Perror(statp, stderr, "read(vc)", errno);
-		res_nclose(statp);
-		return (0);
-	}
-	if (truncating) {
+		if (n <= 0) {
+			*terrno = n < 0 ? errno : ECONNRESET;
+			Perror(statp, stderr, "read failed", errno);
+			res_nclose(statp);
+			/*
+			 * A long running process might get its TCP
+			 * connection reset if the remote server was
+			 * restarted, or find one kept from an earlier
+			 * lookup closed.  Requery the server instead
+			 * of trying a new one.  When there is only one
+			 * server, this means that a query might work
+			 * instead of failing.  We only allow one reset
+			 * per query to prevent looping.
+			 */
+			if ((*terrno == ECONNRESET || reused) && !connreset) {
+				connreset = 1;
+				goto same_ns;
+			}
+			return (0);
+		}
+
 		/*
-		 * Flush rest of answer so connection stays in synch.
+		 * If the calling applicating has bailed out of
+		 * a previous call and failed to arrange to have
+		 * the circuit closed or the server has got
+		 * itself confused, then drop the packet and
+		 * wait for the correct one.
 		 */
-		anhp->tc = 1;
-		len = resplen - anssiz;
-		while (len != 0) {
-			char junk[PACKETSZ];
-
-			n = read(statp->_vcsock, junk,
-				 (len > sizeof junk) ? sizeof junk : len);
-			if (n > 0)
-				len -= n;
-			else
+		for (qp = q; qp < &q[nq]; qp++)
+			if (qp->resplen <= 0 &&
+			    ((HEADER *)qp->buf)->id == ((HEADER *)hdr)->id)
 				break;
+		if (qp == &q[nq]) {
+			Dprint(statp->options & RES_DEBUG,
+			       (stdout, ";; old answer (unexpected)\n"));
+			if (vc_skip(statp->_vcsock,
+				    resplen - HFIXEDSZ) <= 0) {
+				*terrno = errno;
+				res_nclose(statp);
+				return (0);
+			}
+			continue;
 		}
-	}
-	/*
-	 * If the calling applicating has bailed out of
-	 * a previous call and failed to arrange to have
-	 * the circuit closed or the server has got
-	 * itself confused, then drop the packet and
-	 * wait for the correct one.
-	 */
-	if (hp->id != anhp->id) {
-		DprintQ((statp->options & RES_DEBUG) ||
-			(statp->pfcode & RES_PRF_REPLY),
-			(stdout, ";; old answer (unexpected):\n"),
-			ans, (resplen > anssiz) ? anssiz: resplen);
-		goto read_len;
+
+		ans = qp->ans;
+		len = resplen;
+		if (resplen > qp->anssiz) {
+			if (qp->anscp) {
+				ans = malloc (MAXPACKET);
+				if (ans == NULL) {
+					*terrno = ENOMEM;
+					res_nclose(statp);
+					return (0);
+				}
+				qp->anssiz = MAXPACKET;
+				qp->ans = ans;
+				*qp->anscp = ans;
+			} else {
+				Dprint(statp->options & RES_DEBUG,
+					(stdout, ";; response truncated\n")
+				);
+				truncating = 1;
+				len = qp->anssiz;
+			}
+		}
+		memcpy(ans, hdr, HFIXEDSZ);
+		if (len > HFIXEDSZ &&
+		    vc_read(statp->_vcsock, ans + HFIXEDSZ,
+			    len - HFIXEDSZ) <= 0) {
+			*terrno = errno;
+			Perror(statp, stderr, "read(vc)", errno);
+			res_nclose(statp);
+			return (0);
+		}
+		if (truncating) {
+			/*
+			 * Flush rest of answer so connection stays in synch.
+			 */
+			((HEADER *)ans)->tc = 1;
+			if (vc_skip(statp->_vcsock, resplen - len) <= 0) {
+				*terrno = errno;
+				res_nclose(statp);
+				return (0);
+			}
+		}
+		qp->resplen = resplen;
+		pending--;
 	}
 
 	/*
 	 * All is well, or the error is fatal.  Signal that the
 	 * next nameserver ought not be tried.
 	 */
-	return (resplen);
+	return (0);
 }
 
+/*
+ * Open the datagram socket for nameserver ns, unless it is open already.
+ * Returns -1 if there are no sockets to be had, 0 if the server cannot
+ * be reached, and 1 if the socket is ready.
+ */
 static int
-send_dg(res_state statp,
-	const u_char *buf, int buflen, u_char **ansp, int *anssizp,
-	int *terrno, int ns, int *v_circuit, int *gotsomewhere, u_char **anscp)
+dg_socket(res_state statp, int ns, int *terrno)
 {
-	const HEADER *hp = (HEADER *) buf;
-	u_char *ans = *ansp;
-	int anssiz = *anssizp;
-	HEADER *anhp = (HEADER *) ans;
 	struct sockaddr_in6 *nsap = EXT(statp).nsaddrs[ns];
-	struct timespec now, timeout, finish;
-	struct pollfd pfd[1];
-        int ptimeout;
-	struct sockaddr_in6 from;
 	static int socket_pf = 0;
-	int fromlen, resplen, seconds, n;
-
-	if (EXT(statp).nssocks[ns] == -1) {
-		/* only try IPv6 if IPv6 NS and if not failed before */
-		if ((EXT(statp).nscount6 > 0) && (socket_pf != PF_INET)) {
-			EXT(statp).nssocks[ns] =
-			    socket(PF_INET6, SOCK_DGRAM, 0);
-			socket_pf = EXT(statp).nssocks[ns] < 0 ? PF_INET
-			                                       : PF_INET6;
-		}
-		if (EXT(statp).nssocks[ns] < 0)
-			EXT(statp).nssocks[ns] = socket(PF_INET, SOCK_DGRAM, 0);
-		if (EXT(statp).nssocks[ns] < 0) {
-			*terrno = errno;
-			Perror(statp, stderr, "socket(dg)", errno);
+
+	if (EXT(statp).nssocks[ns] != -1)
+		return (1);
+	/* only try IPv6 if IPv6 NS and if not failed before */
+	if ((EXT(statp).nscount6 > 0) && (socket_pf != PF_INET)) {
+		EXT(statp).nssocks[ns] =
+		    socket(PF_INET6, SOCK_DGRAM, 0);
+		socket_pf = EXT(statp).nssocks[ns] < 0 ? PF_INET
+		                                       : PF_INET6;
+	}
+	if (EXT(statp).nssocks[ns] < 0)
+		EXT(statp).nssocks[ns] = socket(PF_INET, SOCK_DGRAM, 0);
+	if (EXT(statp).nssocks[ns] < 0) {
+		*terrno = errno;
+		Perror(statp, stderr, "socket(dg)", errno);
+		return (-1);
+	}
+	/* If IPv6 socket and nsap is IPv4, make it IPv4-mapped */
+	if ((socket_pf == PF_INET6) && (nsap->sin6_family == AF_INET))
+		convaddr4to6(nsap);
+	/*
+	 * On a 4.3BSD+ machine (client and server,
+	 * actually), sending to a nameserver datagram
+	 * port with no nameserver will cause an
+	 * ICMP port unreachable message to be returned.
+	 * If our datagram socket is "connected" to the
+	 * server, we get an ECONNREFUSED error on the next
+	 * socket operation, and select returns if the
+	 * error message is received.  We can thus detect
+	 * the absence of a nameserver without timing out.
+	 */
+	if (connect(EXT(statp).nssocks[ns], (struct sockaddr *)nsap,
+		    sizeof *nsap) < 0) {
+		Aerror(statp, stderr, "connect(dg)", errno,
+		       (struct sockaddr *) nsap);
+		close(EXT(statp).nssocks[ns]);
+		EXT(statp).nssocks[ns] = -1;
+		return (0);
+	}
+	/* Make socket non-blocking.  */
+	int fl = fcntl (EXT(statp).nssocks[ns], F_GETFL);
+	if  (fl != -1)
+		fcntl (EXT(statp).nssocks[ns], F_SETFL,
+			 fl | O_NONBLOCK);
+	Dprint(statp->options & RES_DEBUG,
+	       (stdout, ";; new DG socket\n"))
+	return (1);
+}
+
+/* Give up on a nameserver for the rest of this send_dg. */
+static void
+dg_drop(res_state statp, struct pollfd *pfd, int ns)
+{
+	close(pfd->fd);
+	EXT(statp).nssocks[ns] = -1;
+	pfd->fd = -1;
+}
+
+/*
+ * Send the nq queries in q to each of the nns nameservers in nslist,
+ * all at once, and wait up to seconds for their answers, which go in q.
+ * An answer that is truncated sets *v_circuit, and *nsp to the server
+ * that sent it; otherwise *nsp is the server that answered last.
+ * Returns -1 if no socket can be had, else 0.
+ */
+static int
+send_dg(res_state statp, struct dg_query *q, int nq,
+	const int *nslist, int nns, int seconds, int *terrno, int *nsp,
+	int *v_circuit, int *gotsomewhere)
+{
+	struct pollfd pfd[MAXNS];
+	struct timespec now, timeout, finish, sent[MAXNS];
+	int server[MAXNS], nsent[MAXNS], heard[MAXNS];
+	struct sockaddr_in6 from;
+	u_char hdr[HFIXEDSZ];
+	HEADER *anhp;
+	int fromlen, resplen, ptimeout, npfd, live, pending, i, j, n;
+
+	for (npfd = i = 0; i < nns; i++) {
+		n = dg_socket(statp, nslist[i], terrno);
+		if (n < 0)
 			return (-1);
+		if (n == 0) {
+			rtt_timeout(EXT(statp).nsaddrs[nslist[i]], seconds);
+			continue;
 		}
-		/* If IPv6 socket and nsap is IPv4, make it IPv4-mapped */
-		if ((socket_pf == PF_INET6) && (nsap->sin6_family == AF_INET))
-			convaddr4to6(nsap);
-		/*
-		 * On a 4.3BSD+ machine (client and server,
-		 * actually), sending to a nameserver datagram
-		 * port with no nameserver will cause an
-		 * ICMP port unreachable message to be returned.
-		 * If our datagram socket is "connected" to the
-		 * server, we get an ECONNREFUSED error on the next
-		 * socket operation, and select returns if the
-		 * error message is received.  We can thus detect
-		 * the absence of a nameserver without timing out.
-		 */
-		if (connect(EXT(statp).nssocks[ns], (struct sockaddr *)nsap,
-			    sizeof *nsap) < 0) {
-			Aerror(statp, stderr, "connect(dg)", errno,
-			       (struct sockaddr *) nsap);
-			res_nclose(statp);
-			return (0);
-		}
-		/* Make socket non-blocking.  */
-		int fl = fcntl (EXT(statp).nssocks[ns], F_GETFL);
-		if  (fl != -1)
-			fcntl (EXT(statp).nssocks[ns], F_SETFL,
-				 fl | O_NONBLOCK);
-		Dprint(statp->options & RES_DEBUG,
-		       (stdout, ";; new DG socket\n"))
+		server[npfd] = nslist[i];
+		pfd[npfd].fd = EXT(statp).nssocks[nslist[i]];
+		pfd[npfd].events = POLLOUT;
+		nsent[npfd] = heard[npfd] = 0;
+		npfd++;
 	}
+	for (j = 0; j < nq; j++)
+		q[j].tc = 0;
+	live = npfd;
+	pending = nq;
 
 	/*
 	 * Compute time for the total operation.
 	 */
-	seconds = (statp->retrans << ns);
-	if (ns > 0)
-		seconds /= statp->nscount;
-	if (seconds <= 0)
-		seconds = 1;
 	evNowTime(&now);
 	evConsTime(&timeout, seconds, 0);
 	evAddTime(&finish, &now, &timeout);
-	int need_recompute = 0;
-	int nwritten = 0;
-	pfd[0].fd = EXT(statp).nssocks[ns];
-	pfd[0].events = POLLOUT;
- wait:
-	if (need_recompute) {
+	while (live > 0 && pending > 0) {
 		evNowTime(&now);
-		if (evCmpTime(finish, now) <= 0) {
-			Perror(statp, stderr, "select", errno);
-			res_nclose(statp);
-			return (0);
-		}
+		if (evCmpTime(finish, now) <= 0)
+			break;
 		evSubTime(&timeout, &finish, &now);
-	}
-        /* Convert struct timespec in milliseconds.  */
-	ptimeout = timeout.tv_sec * 1000 + timeout.tv_nsec / 1000000;
-
-	n = 0;
-	if (nwritten == 0)
-	  n = poll (pfd, 1, 0);
-	if (__builtin_expect (n == 0, 0)) {
-		n = poll (pfd, 1, ptimeout);
-		need_recompute = 1;
-	}
-	if (n == 0) {
-		Dprint(statp->options & RES_DEBUG, (stdout,
-						    ";; timeout sending\n"));
-		*gotsomewhere = 1;
-		return (0);
-	}
-	if (n < 0) {
-		if (errno == EINTR) {
-		recompute_resend:
-			evNowTime(&now);
-			if (evCmpTime(finish, now) > 0) {
-				evSubTime(&timeout, &finish, &now);
-				goto wait;
-			}
-		}
-		Perror(statp, stderr, "poll", errno);
-		res_nclose(statp);
-		return (0);
-	}
-	__set_errno (0);
-	if (pfd[0].revents & POLLOUT) {
-		if (send(pfd[0].fd, (char*)buf, buflen, 0) != buflen) {
-			if (errno == EINTR || errno == EAGAIN)
-				goto recompute_resend;
-			Perror(statp, stderr, "send", errno);
+		/* Convert struct timespec in milliseconds, rounding up.  */
+		ptimeout = timeout.tv_sec * 1000
+			   + (timeout.tv_nsec + 999999) / 1000000;
+		n = poll(pfd, npfd, ptimeout);
+		if (n == 0)
+			break;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			Perror(statp, stderr, "poll", errno);
 			res_nclose(statp);
 			return (0);
 		}
-		pfd[0].events = POLLIN;
-		++nwritten;
-		goto wait;
-	} else if (pfd[0].revents & POLLIN) {
-		fromlen = sizeof(struct sockaddr_in6);
-		if (anssiz < MAXPACKET
-		    && anscp
-		    && (ioctl (pfd[0].fd, FIONREAD, &resplen) < 0
-		|| anssiz < resplen)) {
-			ans = malloc (MAXPACKET);
-			if (ans == NULL)
-				ans = *ansp;
-			else {
-				anssiz = MAXPACKET;
-				*anssizp = MAXPACKET;
-				*ansp = ans;
-				*anscp = ans;
-				anhp = (HEADER *) ans;
+		for (i = 0; i < npfd; i++) {
+			if (pfd[i].fd < 0 || pfd[i].revents == 0)
+				continue;
+			if (pfd[i].revents & POLLOUT) {
+				/* Send all the queries back to back. */
+				if (nsent[i] == 0)
+					evNowTime(&sent[i]);
+				__set_errno (0);
+				for (; nsent[i] < nq; nsent[i]++) {
+					j = nsent[i];
+					if (q[j].resplen > 0 || q[j].tc)
+						continue;
+					if (send(pfd[i].fd, (char *)q[j].buf,
+						 q[j].buflen, 0) != q[j].buflen)
+						break;
+				}
+				if (nsent[i] == nq)
+					pfd[i].events = POLLIN;
+				else if (errno != EINTR && errno != EAGAIN) {
+					Perror(statp, stderr, "send", errno);
+					dg_drop(statp, &pfd[i], server[i]);
+					rtt_timeout(EXT(statp).nsaddrs
+						    [server[i]], seconds);
+					live--;
+				}
+				continue;
 			}
-		}
-		resplen = recvfrom(pfd[0].fd, (char*)ans, anssiz,0,
-				   (struct sockaddr *)&from, &fromlen);
-		if (resplen <= 0) {
-			if (errno == EINTR || errno == EAGAIN) {
-				need_recompute = 1;
-				goto wait;
+			if ((pfd[i].revents & POLLIN) == 0) {
+				/* Something went wrong.  Stop trying it. */
+				dg_drop(statp, &pfd[i], server[i]);
+				rtt_timeout(EXT(statp).nsaddrs[server[i]],
+					    seconds);
+				live--;
+				continue;
 			}
-			Perror(statp, stderr, "recvfrom", errno);
-			res_nclose(statp);
-			return (0);
+
+			/* See which query this answers before reading it. */
+			n = recv(pfd[i].fd, hdr, sizeof hdr, MSG_PEEK);
+			if (n < 0) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				Perror(statp, stderr, "recvfrom", errno);
+				dg_drop(statp, &pfd[i], server[i]);
+				rtt_timeout(EXT(statp).nsaddrs[server[i]],
+					    seconds);
+				live--;
+				continue;
+			}
+			*gotsomewhere = 1;
+			if (n < HFIXEDSZ) {
+				/*
+				 * Undersized message.
+				 */
+				Dprint(statp->options & RES_DEBUG,
+				       (stdout, ";; undersized: %d\n", n));
+				*terrno = EMSGSIZE;
+				dg_drop(statp, &pfd[i], server[i]);
+				live--;
+				continue;
+			}
+			for (j = 0; j < nq; j++)
+				if (q[j].resplen <= 0 && !q[j].tc &&
+				    ((HEADER *) q[j].buf)->id ==
+				    ((HEADER *) hdr)->id)
+					break;
+			if (j == nq) {
+				/*
+				 * response from old query, or to one
+				 * answered already; ignore it.
+				 */
+				(void) recv(pfd[i].fd, hdr, sizeof hdr, 0);
+				Dprint(statp->options & RES_DEBUG,
+				       (stdout, ";; old answer\n"));
+				continue;
+			}
+			if (q[j].anssiz < MAXPACKET
+			    && q[j].anscp
+			    && (ioctl (pfd[i].fd, FIONREAD, &resplen) < 0
+				|| q[j].anssiz < resplen)) {
+				u_char *ans = malloc (MAXPACKET);
+				if (ans != NULL) {
+					q[j].ans = ans;
+					q[j].anssiz = MAXPACKET;
+					*q[j].anscp = ans;
+				}
+			}
+			fromlen = sizeof(struct sockaddr_in6);
+			resplen = recvfrom(pfd[i].fd, (char*)q[j].ans,
+					   q[j].anssiz, 0,
+					   (struct sockaddr *)&from, &fromlen);
+			if (resplen <= 0) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				Perror(statp, stderr, "recvfrom", errno);
+				dg_drop(statp, &pfd[i], server[i]);
+				live--;
+				continue;
+			}
+			anhp = (HEADER *) q[j].ans;
+			if (!(statp->options & RES_INSECURE1) &&
+			    !res_ourserver_p(statp, &from)) {
+				/*
+				 * response from wrong server? ignore it.
+				 * XXX - potential security hazard could
+				 *	 be detected here.
+				 */
+				DprintQ((statp->options & RES_DEBUG) ||
+					(statp->pfcode & RES_PRF_REPLY),
+					(stdout, ";; not our server:\n"),
+					q[j].ans, resplen);
+				continue;
+			}
+			if ((anhp->rcode == FORMERR ||
+			     anhp->rcode == NOTIMP) &&
+			    (statp->options & RES_USE_EDNS0) != 0 &&
+			    ((HEADER *) q[j].buf)->arcount != 0) {
+				/*
+				 * The server will not have EDNS0, and
+				 * need not repeat the question to say
+				 * so.  The caller asks again without it.
+				 */
+				DprintQ(statp->options & RES_DEBUG,
+					(stdout, "server rejected EDNS0:\n"),
+					q[j].ans, resplen);
+				*nsp = server[i];
+				q[j].resplen = resplen;
+				pending--;
+				continue;
+			}
+			if (!(statp->options & RES_INSECURE2) &&
+			    !res_queriesmatch(q[j].buf, q[j].buf + q[j].buflen,
+					      q[j].ans, q[j].ans + resplen)) {
+				/*
+				 * response contains wrong query? ignore it.
+				 * XXX - potential security hazard could
+				 *	 be detected here.
+				 */
+				DprintQ((statp->options & RES_DEBUG) ||
+					(statp->pfcode & RES_PRF_REPLY),
+					(stdout, ";; wrong query name:\n"),
+					q[j].ans, resplen);
+				continue;
+			}
+			if (!heard[i]) {
+				heard[i] = 1;
+				evNowTime(&now);
+				evSubTime(&timeout, &now, &sent[i]);
+				rtt_update(EXT(statp).nsaddrs[server[i]],
+					   timeout.tv_sec * 1000000
+					   + timeout.tv_nsec / 1000);
+			}
+			if (anhp->rcode == SERVFAIL ||
+			    anhp->rcode == NOTIMP ||
+			    anhp->rcode == REFUSED) {
+				DprintQ(statp->options & RES_DEBUG,
+					(stdout, "server rejected query:\n"),
+					q[j].ans, resplen);
+				/* don't retry if called from dig */
+				if (!statp->pfcode) {
+					dg_drop(statp, &pfd[i], server[i]);
+					live--;
+					continue;
+				}
+			}
+			*nsp = server[i];
+			if (!(statp->options & RES_IGNTC) && anhp->tc) {
+				/*
+				 * To get the rest of answer,
+				 * use TCP with same server.
+				 */
+				Dprint(statp->options & RES_DEBUG,
+				       (stdout, ";; truncated answer\n"));
+				q[j].tc = 1;
+				*v_circuit = 1;
+			} else
+				q[j].resplen = resplen;
+			pending--;
 		}
+	}
+	if (pending > 0 && live > 0) {
+		Dprint(statp->options & RES_DEBUG,
+		       (stdout, ";; timeout\n"));
+		for (i = 0; i < npfd; i++)
+			if (pfd[i].fd >= 0 && !heard[i])
+				rtt_timeout(EXT(statp).nsaddrs[server[i]],
+					    seconds);
 		*gotsomewhere = 1;
-		if (resplen < HFIXEDSZ) {
-			/*
-			 * Undersized message.
-			 */
-			Dprint(statp->options & RES_DEBUG,
-			       (stdout, ";; undersized: %d\n",
-				resplen));
-			*terrno = EMSGSIZE;
-			res_nclose(statp);
-			return (0);
-		}
-		if (hp->id != anhp->id) {
-			/*
-			 * response from old query, ignore it.
-			 * XXX - potential security hazard could
-			 *	 be detected here.
-			 */
-			DprintQ((statp->options & RES_DEBUG) ||
-				(statp->pfcode & RES_PRF_REPLY),
-				(stdout, ";; old answer:\n"),
-				ans, (resplen > anssiz) ? anssiz : resplen);
-			goto wait;
-		}
-		if (!(statp->options & RES_INSECURE1) &&
-		    !res_ourserver_p(statp, &from)) {
-			/*
-			 * response from wrong server? ignore it.
-			 * XXX - potential security hazard could
-			 *	 be detected here.
-			 */
-			DprintQ((statp->options & RES_DEBUG) ||
-				(statp->pfcode & RES_PRF_REPLY),
-				(stdout, ";; not our server:\n"),
-				ans, (resplen > anssiz) ? anssiz : resplen);
-			goto wait;
-		}
-		if (!(statp->options & RES_INSECURE2) &&
-		    !res_queriesmatch(buf, buf + buflen,
-				      ans, ans + anssiz)) {
-			/*
-			 * response contains wrong query? ignore it.
-			 * XXX - potential security hazard could
-			 *	 be detected here.
-			 */
-			DprintQ((statp->options & RES_DEBUG) ||
-				(statp->pfcode & RES_PRF_REPLY),
-				(stdout, ";; wrong query name:\n"),
-				ans, (resplen > anssiz) ? anssiz : resplen);
-			goto wait;
-		}
-		if (anhp->rcode == SERVFAIL ||
-		    anhp->rcode == NOTIMP ||
-		    anhp->rcode == REFUSED) {
-			DprintQ(statp->options & RES_DEBUG,
-				(stdout, "server rejected query:\n"),
-				ans, (resplen > anssiz) ? anssiz : resplen);
-			res_nclose(statp);
-			/* don't retry if called from dig */
-			if (!statp->pfcode)
-				return (0);
-		}
-		if (!(statp->options & RES_IGNTC) && anhp->tc) {
-			/*
-			 * To get the rest of answer,
-			 * use TCP with same server.
-			 */
-			Dprint(statp->options & RES_DEBUG,
-			       (stdout, ";; truncated answer\n"));
-			*v_circuit = 1;
-			res_nclose(statp);
-			return (1);
-		}
-		/*
-		 * All is well, or the error is fatal.  Signal that the
-		 * next nameserver ought not be tried.
-		 */
-		return (resplen);
-	} else if (pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
-		/* Something went wrong.  We can stop trying.  */
-		res_nclose(statp);
-		return (0);
 	}
+	return (0);
 }
 
 #ifdef DEBUG
@@ -1082,7 +1595,6 @@ Aerror(const res_state statp, FILE *file, const char *string, int error,
 	}
 	__set_errno (save);
 }
-#endif
 
 static void
 Perror(const res_state statp, FILE *file, const char *string, int error) {
@@ -1094,6 +1606,7 @@ Perror(const res_state statp, FILE *file, const char *string, int error) {
 	__set_errno (save);
 }
 #endif
+#endif
 
 static int
 sock_eq(struct sockaddr_in6 *a1, struct sockaddr_in6 *a2) {
@@ -0,0 +1,408 @@
+/* Copyright 2014 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. */
+
+/*
+ * Times res_send with a dead nameserver listed ahead of a live one, first
+ * asking them in turn and then all at once (RES_BLAST), and times A and
+ * AAAA lookups made one after the other against res_nquery2 making them
+ * together, over UDP and then over TCP, and times lookups with answers
+ * too big for 512 bytes with and without EDNS0.  The live server answers on the
+ * loopback interface after a delay standing in for the network, with a
+ * thread for UDP and one for each TCP connection, and counts the
+ * connections; the dead one is a socket nobody reads.
+ *
+ * Usage: res_send_bench [-d delay usec] [-n lookups] [-t timeout sec]
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <resolv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TTL 300
+#define QUEUE 64  /* answers the server can hold back at once */
+#define MAXMSG 2048
+#define TXT_RECORDS 4  /* of TXT_LEN bytes, for about 900 in all */
+#define TXT_LEN 200
+
+struct reply {
+  double due;
+  struct sockaddr_in to;
+  int len;
+  u_char buf[MAXMSG];
+};
+
+/* A socket the server answers on, and the answers it holds back. */
+struct endpoint {
+  int fd;
+  int stream;  /* TCP, with lengths before the messages */
+  struct reply queue[QUEUE];
+};
+
+static int delay_usec = 2000;
+static int connections;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static u_char* put16(u_char* cp, unsigned v) {
+  cp[0] = v >> 8;
+  cp[1] = v;
+  return cp + 2;
+}
+
+static u_char* put32(u_char* cp, unsigned long v) {
+  cp = put16(cp, v >> 16);
+  return put16(cp, v & 0xffff);
+}
+
+/*
+ * Turns the query in buf into an answer with one A or AAAA record, or
+ * with TXT records too big for 512 bytes.  Over UDP those are left out,
+ * with tc set, unless an OPT record in the query makes room for them.
+ */
+static int answer(u_char* buf, int len, int stream) {
+  HEADER* hp = (HEADER*)buf;
+  u_char* cp = buf + HFIXEDSZ + dn_skipname(buf + HFIXEDSZ, buf + len);
+  int type = ns_get16(cp), room = stream ? MAXMSG : PACKETSZ, i;
+
+  cp += QFIXEDSZ;
+  if (hp->arcount != 0 && cp + 1 + RRFIXEDSZ <= buf + len &&
+      ns_get16(cp + 1) == ns_t_opt && !stream)
+    room = ns_get16(cp + 3);  /* the UDP size it asks for */
+  hp->qr = 1;
+  hp->ra = 1;
+  hp->arcount = 0;
+  if (type == ns_t_txt) {
+    if (room < (cp - buf) + TXT_RECORDS * (RRFIXEDSZ + 3 + TXT_LEN)) {
+      hp->tc = 1;
+      return cp - buf;
+    }
+    hp->ancount = htons(TXT_RECORDS);
+    for (i = 0; i < TXT_RECORDS; i++) {
+      cp = put16(cp, 0xc000 | HFIXEDSZ);
+      cp = put16(cp, ns_t_txt);
+      cp = put16(cp, ns_c_in);
+      cp = put32(cp, TTL);
+      cp = put16(cp, 1 + TXT_LEN);
+      *cp++ = TXT_LEN;
+      memset(cp, 'x', TXT_LEN);
+      cp += TXT_LEN;
+    }
+    return cp - buf;
+  }
+  hp->ancount = htons(1);
+  cp = put16(cp, 0xc000 | HFIXEDSZ);  /* the name in the question */
+  cp = put16(cp, type);
+  cp = put16(cp, ns_c_in);
+  cp = put32(cp, TTL);
+  if (type == ns_t_aaaa) {
+    cp = put16(cp, 16);
+    memset(cp, 0, 16);
+    cp[0] = 0xfd;
+    cp[15] = 1;
+    cp += 16;
+  } else {
+    cp = put16(cp, 4);
+    cp = put32(cp, 0x0a000001);
+  }
+  return cp - buf;
+}
+
+static int read_all(int fd, u_char* buf, int len) {
+  int n, got = 0;
+
+  while (got < len) {
+    if ((n = read(fd, buf + got, len - got)) <= 0)
+      return -1;
+    got += n;
+  }
+  return len;
+}
+
+/* Reads a query into r, returning its length or -1 at the end. */
+static int receive(struct endpoint* ep, struct reply* r) {
+  socklen_t tolen = sizeof(r->to);
+  u_char len[2];
+
+  if (!ep->stream)
+    return recvfrom(ep->fd, r->buf, PACKETSZ - 64, 0,
+                    (struct sockaddr*)&r->to, &tolen);
+  if (read_all(ep->fd, len, 2) < 0 || ns_get16(len) > PACKETSZ - 64)
+    return -1;
+  return read_all(ep->fd, r->buf, ns_get16(len));
+}
+
+static void reply(struct endpoint* ep, struct reply* r) {
+  u_char msg[2 + MAXMSG];
+
+  if (!ep->stream) {
+    sendto(ep->fd, r->buf, r->len, 0, (struct sockaddr*)&r->to,
+           sizeof(r->to));
+    return;
+  }
+  put16(msg, r->len);
+  memcpy(msg + 2, r->buf, r->len);
+  if (write(ep->fd, msg, 2 + r->len) != 2 + r->len)
+    perror("server write");
+}
+
+/* Answers each query delay_usec after it came, without holding up others. */
+static void* serve(void* arg) {
+  struct endpoint* ep = arg;
+  struct reply* queue = ep->queue;
+  struct pollfd pfd;
+  int head = 0, count = 0, timeout;
+
+  pfd.fd = ep->fd;
+  pfd.events = POLLIN;
+  for (;;) {
+    timeout = -1;
+    if (count > 0) {
+      timeout = (queue[head].due - now()) * 1000 + 1;
+      if (timeout < 0)
+        timeout = 0;
+    }
+    if (poll(&pfd, 1, timeout) > 0 && count < QUEUE) {
+      struct reply* r = &queue[(head + count) % QUEUE];
+      r->len = receive(ep, r);
+      if (r->len >= HFIXEDSZ + QFIXEDSZ) {
+        r->len = answer(r->buf, r->len, ep->stream);
+        r->due = now() + delay_usec / 1e6;
+        count++;
+      } else if (ep->stream) {
+        break;
+      }
+    }
+    while (count > 0 && queue[head].due <= now()) {
+      reply(ep, &queue[head]);
+      head = (head + 1) % QUEUE;
+      count--;
+    }
+  }
+  close(ep->fd);
+  free(ep);
+  return NULL;
+}
+
+/* Starts a thread to serve each TCP connection to the live server. */
+static void* accept_loop(void* arg) {
+  int listen_fd = *(int*)arg;
+  struct endpoint* ep;
+  pthread_t thread;
+  int fd, one = 1;
+
+  for (;;) {
+    if ((fd = accept(listen_fd, NULL, NULL)) < 0)
+      continue;
+    /* Answers go out as they fall due, not when the last is acked. */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    __sync_fetch_and_add(&connections, 1);
+    ep = calloc(1, sizeof(*ep));
+    ep->fd = fd;
+    ep->stream = 1;
+    if (pthread_create(&thread, NULL, serve, ep) != 0) {
+      close(fd);
+      free(ep);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  return NULL;
+}
+
+static int open_socket(struct sockaddr_in* addr, int type) {
+  socklen_t addrlen = sizeof(*addr);
+  int fd;
+
+  if (type == SOCK_DGRAM) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  }
+  if ((fd = socket(AF_INET, type, 0)) < 0 ||
+      bind(fd, (struct sockaddr*)addr, sizeof(*addr)) < 0 ||
+      getsockname(fd, (struct sockaddr*)addr, &addrlen) < 0) {
+    perror("server socket");
+    exit(1);
+  }
+  return fd;
+}
+
+static void lookup(const char* name, int type) {
+  u_char ans[PACKETSZ];
+
+  if (res_query(name, ns_c_in, type, ans, sizeof(ans)) < 0) {
+    fprintf(stderr, "res_query(%s) failed: %d\n", name, h_errno);
+    exit(1);
+  }
+}
+
+/* Milliseconds for the first lookup and on average for the rest. */
+static void time_dead_first(int count, double* first_ms, double* rest_ms) {
+  char name[64];
+  double start, t;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    snprintf(name, sizeof(name), "dead%d.example.com", i);
+    start = now();
+    lookup(name, ns_t_a);
+    t = (now() - start) * 1e3;
+    if (i == 0)
+      *first_ms = t;
+    else
+      *rest_ms += t / (count - 1);
+  }
+}
+
+/* Microseconds per lookup of TXT records too big for 512 bytes. */
+static double time_big(int count) {
+  u_char ans[MAXMSG];
+  char name[64];
+  double start = now();
+  int i;
+
+  for (i = 0; i < count; i++) {
+    snprintf(name, sizeof(name), "big%d.example.com", i);
+    if (res_query(name, ns_c_in, ns_t_txt, ans, sizeof(ans)) < 0) {
+      fprintf(stderr, "res_query(%s) failed: %d\n", name, h_errno);
+      exit(1);
+    }
+  }
+  return (now() - start) * 1e6 / count;
+}
+
+/* Microseconds per name to get both its A and AAAA records. */
+static double time_pairs(int count, int together) {
+  u_char ans[PACKETSZ], ans2[PACKETSZ];
+  char name[64];
+  double start = now();
+  int i, len, len2;
+
+  for (i = 0; i < count; i++) {
+    snprintf(name, sizeof(name), "pair%d.example.com", i);
+    if (!together) {
+      lookup(name, ns_t_a);
+      lookup(name, ns_t_aaaa);
+    } else if (res_nquery2(&_res, name, ns_c_in, ns_t_a, ns_t_aaaa,
+                           ans, sizeof(ans), &len, ans2, sizeof(ans2),
+                           &len2) < 0 || len < 0 || len2 < 0) {
+      fprintf(stderr, "res_nquery2(%s) failed: %d\n", name, h_errno);
+      exit(1);
+    }
+  }
+  return (now() - start) * 1e6 / count;
+}
+
+int main(int argc, char** argv) {
+  struct sockaddr_in live, dead;
+  struct endpoint* udp = calloc(1, sizeof(*udp));
+  pthread_t thread, tcp_thread;
+  double first_ms, rest_ms, apart, together, single;
+  int count = 200, timeout = 1, listen_fd, before;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:n:t:")) != -1) {
+    switch (opt) {
+      case 'd': delay_usec = atoi(optarg); break;
+      case 'n': count = atoi(optarg); break;
+      case 't': timeout = atoi(optarg); break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [-d delay usec] [-n lookups] [-t timeout sec]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (count < 2 || timeout < 1 || delay_usec < 0) {
+    fprintf(stderr, "%s: need two lookups, a timeout and a delay\n",
+            argv[0]);
+    return 1;
+  }
+
+  udp->fd = open_socket(&live, SOCK_DGRAM);
+  (void)open_socket(&dead, SOCK_DGRAM);
+  listen_fd = open_socket(&live, SOCK_STREAM);
+  if (listen(listen_fd, 16) < 0) {
+    perror("listen");
+    return 1;
+  }
+  if (pthread_create(&thread, NULL, serve, udp) != 0 ||
+      pthread_create(&tcp_thread, NULL, accept_loop, &listen_fd) != 0) {
+    fprintf(stderr, "%s: cannot start the server thread\n", argv[0]);
+    return 1;
+  }
+
+  res_init();
+  _res.options &= ~(RES_DNSRCH | RES_DEFNAMES | RES_USECACHE);
+  _res.retrans = timeout;
+  _res.nscount = 2;
+  _res.nsaddr_list[0] = dead;
+  _res.nsaddr_list[1] = live;
+  printf("%d lookups, server delay %d usec, timeout %d sec\n", count,
+         delay_usec, timeout);
+
+  first_ms = rest_ms = 0;
+  _res.options |= RES_BLAST;
+  time_dead_first(count, &first_ms, &rest_ms);
+  printf("dead first, all at once:  first %8.2f ms, then %6.2f ms each\n",
+         first_ms, rest_ms);
+  first_ms = rest_ms = 0;
+  _res.options &= ~RES_BLAST;
+  time_dead_first(count, &first_ms, &rest_ms);
+  printf("dead first, in turn:      first %8.2f ms, then %6.2f ms each\n",
+         first_ms, rest_ms);
+
+  _res.nscount = 1;
+  _res.nsaddr_list[0] = live;
+  apart = time_pairs(count, 0);
+  together = time_pairs(count, 1);
+  _res.options |= RES_SNGLKUP;
+  single = time_pairs(count, 1);
+  printf("A and AAAA, res_query twice:   %8.1f usec per name\n", apart);
+  printf("A and AAAA, res_nquery2:       %8.1f usec per name (%.2fx)\n",
+         together, apart / together);
+  printf("A and AAAA, single-request:    %8.1f usec per name\n", single);
+
+  _res.options |= RES_USEVC;
+  before = connections;
+  apart = time_pairs(count, 1);
+  printf("TCP, one after the other:      %8.1f usec per name, "
+         "%d connections\n", apart, connections - before);
+  _res.options &= ~RES_SNGLKUP;
+  before = connections;
+  together = time_pairs(count, 1);
+  printf("TCP, pipelined:                %8.1f usec per name (%.2fx), "
+         "%d connections\n", together, apart / together,
+         connections - before);
+
+  _res.options &= ~(RES_USEVC | RES_USE_EDNS0);
+  before = connections;
+  apart = time_big(count);
+  printf("TXT of %d bytes, without EDNS0: %7.1f usec per lookup, "
+         "%d connections\n", TXT_RECORDS * (RRFIXEDSZ + 3 + TXT_LEN),
+         apart, connections - before);
+  _res.options |= RES_USE_EDNS0;
+  before = connections;
+  together = time_big(count);
+  printf("TXT of %d bytes, with EDNS0:    %7.1f usec per lookup (%.2fx), "
+         "%d connections\n", TXT_RECORDS * (RRFIXEDSZ + 3 + TXT_LEN),
+         together, apart / together, connections - before);
+  return 0;
+}
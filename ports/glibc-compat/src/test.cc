@@ -5,15 +5,38 @@
 #include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #ifndef __GLIBC__
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netdb.h>
+#include <resolv.h>
 #include <sys/endian.h>
+
+extern "C" {
+int __res_cache_lookup(u_int32_t, const char*, int, int, u_char*, int);
+void __res_cache_store(u_int32_t, const char*, int, int, const u_char*, int);
+int __inet_pton_bytewise(int, const char*, void*);
+int __inet_aton_bytewise(const char*, struct in_addr*);
+}
 #endif
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
 #include "gtest/gtest.h"
 
 TEST(TestMktemp, mkdtemp_errors) {
@@ -92,6 +115,1382 @@ TEST(TestEndian, byte_swap) {
 }
 #endif
 
+static int CompareInts(const void* a, const void* b, void* arg) {
+  int x = *(const int*)a;
+  int y = *(const int*)b;
+  int sign = *(int*)arg;
+  return sign * ((x > y) - (x < y));
+}
+
+TEST(TestQsortR, passes_arg) {
+  int nums[] = { 5, 3, 9, 1, 7, 2, 8, 6, 4, 0, 3, 5, 12, 11, 10, 13 };
+  size_t count = sizeof(nums) / sizeof(nums[0]);
+  int descending = -1;
+  qsort_r(nums, count, sizeof(nums[0]), CompareInts, &descending);
+  for (size_t i = 1; i < count; i++)
+    ASSERT_GE(nums[i - 1], nums[i]);
+  int ascending = 1;
+  qsort_r(nums, count, sizeof(nums[0]), CompareInts, &ascending);
+  for (size_t i = 1; i < count; i++)
+    ASSERT_LE(nums[i - 1], nums[i]);
+}
+
+static int CompareBytes(const void* a, const void* b, void* arg) {
+  return memcmp(a, b, *(size_t*)arg);
+}
+
+TEST(TestQsortR, element_sizes) {
+  // Covers each swap strategy, aligned and not, on each kind of input.
+  const size_t sizes[] = { 1, 3, 4, 5, 8, 12, 16, 24 };
+  const size_t count = 1000;
+  std::vector<char> buf((count + 1) * 24 + 1);
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t size = sizes[s];
+    for (int pattern = 0; pattern < 4; pattern++) {
+      for (size_t offset = 0; offset < 2; offset++) {
+        char* base = &buf[offset];
+        std::vector<std::string> want;
+        srand(size * 8 + pattern);
+        for (size_t i = 0; i < count; i++) {
+          unsigned key;
+          switch (pattern) {
+            case 0: key = rand(); break;
+            case 1: key = i; break;
+            case 2: key = count - i; break;
+            default: key = rand() % 8; break;
+          }
+          char* elem = base + i * size;
+          for (size_t j = 0; j < size; j++)
+            elem[j] = j < 4 ? key >> (8 * (3 - j)) : rand();
+          want.push_back(std::string(elem, size));
+        }
+        std::sort(want.begin(), want.end());
+        qsort_r(base, count, size, CompareBytes, &size);
+        for (size_t i = 0; i < count; i++)
+          ASSERT_EQ(0, memcmp(want[i].data(), base + i * size, size))
+              << "size " << size << " pattern " << pattern << " offset "
+              << offset << " index " << i;
+      }
+    }
+  }
+}
+
+// McIlroy's "A Killer Adversary for Quicksort": the comparison decides
+// values only as the sort looks at them, so as to make a quicksort pick
+// bad pivots every time.
+struct Adversary {
+  std::vector<int> val;
+  int gas;
+  int nsolid;
+  int candidate;
+  long ncmp;
+};
+
+static int CompareAdversary(const void* a, const void* b, void* arg) {
+  Adversary* adv = (Adversary*)arg;
+  int x = *(const int*)a;
+  int y = *(const int*)b;
+  adv->ncmp++;
+  if (adv->val[x] == adv->gas && adv->val[y] == adv->gas) {
+    if (x == adv->candidate)
+      adv->val[x] = adv->nsolid++;
+    else
+      adv->val[y] = adv->nsolid++;
+  }
+  if (adv->val[x] == adv->gas)
+    adv->candidate = x;
+  else if (adv->val[y] == adv->gas)
+    adv->candidate = y;
+  return adv->val[x] - adv->val[y];
+}
+
+TEST(TestQsortR, not_quadratic) {
+  const int count = 4096;
+  Adversary adv;
+  adv.val.assign(count, count);
+  adv.gas = count;
+  adv.nsolid = 0;
+  adv.candidate = 0;
+  adv.ncmp = 0;
+  std::vector<int> ptr(count);
+  for (int i = 0; i < count; i++)
+    ptr[i] = i;
+  qsort_r(&ptr[0], count, sizeof(int), CompareAdversary, &adv);
+  // n log2 n is 49152; a quadratic sort needs millions.
+  ASSERT_LT(adv.ncmp, 8 * 49152);
+}
+
+TEST(TestRandom, glibc_sequence) {
+  srandom(1);
+  ASSERT_EQ(1804289383, random());
+  ASSERT_EQ(846930886, random());
+  ASSERT_EQ(1681692777, random());
+  // A seed of 0 is taken as 1.
+  srandom(0);
+  ASSERT_EQ(1804289383, random());
+  // Fewer than 32 bytes of state is the linear congruential generator.
+  int32_t small[2];
+  char* old = initstate(1, (char*)small, sizeof(small));
+  ASSERT_TRUE(old != NULL);
+  ASSERT_EQ(1103527590, random());
+  // The old state picks up where it left off.
+  ASSERT_EQ((char*)small, setstate(old));
+  ASSERT_EQ(846930886, random());
+  ASSERT_EQ(NULL, initstate(1, (char*)small, 4));
+}
+
+TEST(TestRandom, setstate) {
+  char a[256], b[64];
+  char* old = initstate(42, a, sizeof(a));
+  std::vector<long> first;
+  for (int i = 0; i < 100; i++)
+    first.push_back(random());
+  initstate(42, a, sizeof(a));
+  for (int i = 0; i < 50; i++)
+    ASSERT_EQ(first[i], random());
+  // Another state is used and put away without disturbing this one.
+  ASSERT_EQ(a, initstate(7, b, sizeof(b)));
+  random();
+  ASSERT_EQ(b, setstate(a));
+  for (int i = 50; i < 100; i++)
+    ASSERT_EQ(first[i], random());
+  setstate(old);
+}
+
+TEST(TestRandom, random_r) {
+  char state[128], a[128];
+  struct random_data data;
+  memset(&data, 0, sizeof(data));
+  ASSERT_EQ(0, initstate_r(99, state, sizeof(state), &data));
+  char* old = initstate(99, a, sizeof(a));
+  for (int i = 0; i < 1000; i++) {
+    int32_t r;
+    ASSERT_EQ(0, random_r(&data, &r));
+    ASSERT_EQ(random(), r);
+  }
+  setstate(old);
+}
+
+#ifndef __GLIBC__
+// Builds the answer to an A query for name: one record with the given
+// TTL, or with rcode set, no answer and an SOA if soa_minimum is not 0.
+static int MakeAnswer(u_char* buf, const char* name, int rcode, u_int32_t ttl,
+                      u_int32_t soa_minimum) {
+  int len = res_mkquery(QUERY, name, C_IN, T_A, NULL, 0, NULL, buf,
+                        PACKETSZ);
+  if (len < 0)
+    return len;
+  HEADER* hp = (HEADER*)buf;
+  u_char* cp = buf + len;
+  hp->qr = 1;
+  hp->rcode = rcode;
+  ns_put16(0xc000 | HFIXEDSZ, cp);
+  cp += NS_INT16SZ;
+  if (rcode == NOERROR && soa_minimum == 0) {
+    hp->ancount = htons(1);
+    ns_put16(T_A, cp);
+    ns_put16(C_IN, cp + 2);
+    ns_put32(ttl, cp + 4);
+    ns_put16(4, cp + 8);
+    ns_put32(0x0a000001, cp + 10);
+    return cp + 14 - buf;
+  }
+  if (soa_minimum == (u_int32_t)-1)
+    return cp - NS_INT16SZ - buf;
+  hp->nscount = htons(1);
+  ns_put16(T_SOA, cp);
+  ns_put16(C_IN, cp + 2);
+  ns_put32(ttl, cp + 4);
+  ns_put16(4 + 5 * 4, cp + 8);
+  cp += 10;
+  ns_put16(0xc000 | HFIXEDSZ, cp);
+  ns_put16(0xc000 | HFIXEDSZ, cp + 2);
+  for (int i = 0; i < 5; i++)
+    ns_put32(i == 4 ? soa_minimum : 1000, cp + 4 + 4 * i);
+  return cp + 24 - buf;
+}
+
+// Builds the answer to the query of qlen bytes: one record of the type
+// asked for, whose data is zeros but for a last byte of n (10.0.0.n for
+// an A record).
+static int AnswerQuery(const u_char* query, int qlen, u_char* buf, int n) {
+  char name[MAXDNAME];
+  int len = dn_expand(query, query + qlen, query + HFIXEDSZ, name,
+                      sizeof(name));
+  if (len < 0 || HFIXEDSZ + len + QFIXEDSZ > qlen)
+    return -1;
+  len += HFIXEDSZ + QFIXEDSZ;
+  memcpy(buf, query, len);
+  int type = ns_get16(query + len - QFIXEDSZ);
+  int rdlen = type == T_A ? 4 : 16;
+  HEADER* hp = (HEADER*)buf;
+  hp->qr = 1;
+  hp->ancount = htons(1);
+  hp->nscount = hp->arcount = 0;
+  u_char* cp = buf + len;
+  ns_put16(0xc000 | HFIXEDSZ, cp);
+  ns_put16(type, cp + 2);
+  ns_put16(C_IN, cp + 4);
+  ns_put32(300, cp + 6);
+  ns_put16(rdlen, cp + 10);
+  memset(cp + 12, 0, rdlen);
+  if (type == T_A)
+    cp[12] = 10;
+  cp[12 + rdlen - 1] = n;
+  return cp + 12 + rdlen - buf;
+}
+
+static long long NowMsec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+// A nameserver on the loopback interface, on a thread of its own, that
+// answers queries as AnswerQuery does.  Once a query comes it waits
+// delay_msec, then answers all that have come by then, or none if
+// silent.  With swap it answers them last first; with bad_id each answer
+// is preceded by one with the wrong id and a last byte of 99.  Queries
+// without an OPT record get plain_rcode, if it is set.  With tcp it
+// takes one connection at a time instead, and answers the queries that
+// come together on it as above; with close_after it closes a connection
+// that has answered that many, straight away or, with close_late, when
+// the next query comes.
+struct FakeServer {
+  int n;
+  int delay_msec;
+  bool silent, swap, bad_id;
+  bool drop_opt;                // leave queries with OPT unanswered
+  int plain_rcode;
+  bool tcp;
+  int close_after;
+  bool close_late;
+  volatile int accepts;         // connections taken so far
+  int fd;
+  struct sockaddr_in addr;
+  pthread_t thread;
+  volatile bool stop;
+  volatile int queries;         // received so far
+  volatile int answers;         // sent so far, the bad ones aside
+  int answered_at[8];           // how many had been sent as each came
+};
+
+static void SendAnswer(FakeServer* s, const u_char* query, int qlen,
+                       const struct sockaddr_in* to) {
+  u_char answer[PACKETSZ];
+  if (s->drop_opt && ((const HEADER*)query)->arcount != 0)
+    return;
+  int len = AnswerQuery(query, qlen, answer, s->n);
+  if (len < 0)
+    return;
+  if (s->plain_rcode && ((const HEADER*)query)->arcount == 0)
+    ((HEADER*)answer)->rcode = s->plain_rcode;
+  if (s->bad_id) {
+    ((HEADER*)answer)->id ^= htons(0x5a5a);
+    answer[len - 1] = 99;
+    sendto(s->fd, answer, len, 0, (const struct sockaddr*)to, sizeof(*to));
+    ((HEADER*)answer)->id ^= htons(0x5a5a);
+    answer[len - 1] = s->n;
+  }
+  sendto(s->fd, answer, len, 0, (const struct sockaddr*)to, sizeof(*to));
+  s->answers++;
+}
+
+static void* ServeQueries(void* arg) {
+  FakeServer* s = (FakeServer*)arg;
+  u_char query[4][PACKETSZ];
+  struct sockaddr_in from[4];
+  int len[4];
+  while (!s->stop) {
+    struct pollfd pfd = { s->fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 20) <= 0)
+      continue;
+    if (s->delay_msec)
+      usleep(s->delay_msec * 1000);
+    int n = 0;
+    while (n < 4) {
+      socklen_t fromlen = sizeof(from[n]);
+      len[n] = recvfrom(s->fd, query[n], sizeof(query[n]), MSG_DONTWAIT,
+                        (struct sockaddr*)&from[n], &fromlen);
+      if (len[n] < 0)
+        break;
+      if (len[n] < HFIXEDSZ)
+        continue;
+      if (s->queries < 8)
+        s->answered_at[s->queries] = s->answers;
+      s->queries++;
+      n++;
+    }
+    for (int i = 0; i < n && !s->silent; i++) {
+      int j = s->swap ? n - 1 - i : i;
+      SendAnswer(s, query[j], len[j], &from[j]);
+    }
+  }
+  return NULL;
+}
+
+static bool ReadFully(int fd, u_char* buf, int len) {
+  while (len > 0) {
+    int n = read(fd, buf, len);
+    if (n <= 0)
+      return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Reads a message framed by its length from a TCP connection.  Returns
+// its length, or 0 if the connection is closed.
+static int ReadMessage(int fd, u_char* buf, int size) {
+  u_char lenbuf[INT16SZ];
+  if (!ReadFully(fd, lenbuf, INT16SZ))
+    return 0;
+  int len = ns_get16(lenbuf);
+  if (len > size || !ReadFully(fd, buf, len))
+    return 0;
+  return len;
+}
+
+static void SendAnswerVc(FakeServer* s, int conn, const u_char* query,
+                         int qlen) {
+  u_char answer[INT16SZ + PACKETSZ];
+  int len = AnswerQuery(query, qlen, answer + INT16SZ, s->n);
+  if (len < 0)
+    return;
+  ns_put16(len, answer);
+  if (write(conn, answer, INT16SZ + len) == INT16SZ + len)
+    s->answers++;
+}
+
+// Serves one connection until it is closed, by either side.
+static void ServeConnection(FakeServer* s, int conn) {
+  u_char query[2][PACKETSZ];
+  int len[2];
+  int answered = 0;
+  struct pollfd pfd = { conn, POLLIN, 0 };
+  while (!s->stop) {
+    if (poll(&pfd, 1, 20) <= 0)
+      continue;
+    // Pipelined queries come in one write; wait a little for a second
+    // only if the order of the answers matters.
+    int n = 0;
+    do {
+      len[n] = ReadMessage(conn, query[n], sizeof(query[n]));
+      if (len[n] < HFIXEDSZ)
+        return;
+      if (s->queries < 8)
+        s->answered_at[s->queries] = s->answers;
+      s->queries++;
+      n++;
+    } while (n < 2 && poll(&pfd, 1, s->swap ? 100 : 0) > 0);
+    if (s->close_after && s->close_late && answered >= s->close_after)
+      return;
+    for (int i = 0; i < n && !s->silent; i++) {
+      int j = s->swap ? n - 1 - i : i;
+      SendAnswerVc(s, conn, query[j], len[j]);
+      answered++;
+    }
+    if (s->close_after && !s->close_late && answered >= s->close_after)
+      return;
+  }
+}
+
+static void* ServeConnections(void* arg) {
+  FakeServer* s = (FakeServer*)arg;
+  while (!s->stop) {
+    struct pollfd pfd = { s->fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 20) <= 0)
+      continue;
+    int conn = accept(s->fd, NULL, NULL);
+    if (conn < 0)
+      continue;
+    s->accepts++;
+    ServeConnection(s, conn);
+    close(conn);
+  }
+  return NULL;
+}
+
+// Starts s, as set up, on a port of its own.  Returns false if there is
+// no network to be had, as under sel_ldr.
+static bool StartServer(FakeServer* s) {
+  socklen_t len = sizeof(s->addr);
+  s->fd = socket(AF_INET, s->tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+  if (s->fd < 0)
+    return false;
+  memset(&s->addr, 0, sizeof(s->addr));
+  s->addr.sin_family = AF_INET;
+  s->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(s->fd, (struct sockaddr*)&s->addr, sizeof(s->addr)) < 0 ||
+      getsockname(s->fd, (struct sockaddr*)&s->addr, &len) < 0 ||
+      (s->tcp && listen(s->fd, 4) < 0)) {
+    close(s->fd);
+    return false;
+  }
+  s->stop = false;
+  s->queries = s->answers = s->accepts = 0;
+  pthread_create(&s->thread, NULL, s->tcp ? ServeConnections : ServeQueries,
+                 s);
+  return true;
+}
+
+static void StopServer(FakeServer* s) {
+  s->stop = true;
+  pthread_join(s->thread, NULL);
+  close(s->fd);
+}
+
+// Sets up state to ask the n servers alone, once each, waiting a second
+// for the first, and without the cache.
+static void UseServers(struct __res_state* state, FakeServer* servers,
+                       int n) {
+  memset(state, 0, sizeof(*state));
+  res_ninit(state);
+  // IPv6 servers from resolv.conf would be asked as well.
+  for (int i = 0; i < MAXNS; i++)
+    if (state->_u._ext.nsmap[i] == MAXNS + 1) {
+      free(state->_u._ext.nsaddrs[i]);
+      state->_u._ext.nsaddrs[i] = NULL;
+      state->_u._ext.nsmap[i] = MAXNS;
+    }
+  state->_u._ext.nscount6 = 0;
+  state->options &= ~RES_USECACHE;
+  state->retrans = 1;
+  state->retry = 1;
+  state->nscount = n;
+  for (int i = 0; i < n; i++)
+    state->nsaddr_list[i] = servers[i].addr;
+}
+
+TEST(TestResCache, positive) {
+  u_char answer[PACKETSZ], got[PACKETSZ];
+  struct res_cache_stats before, after;
+  res_cache_flush();
+  res_cache_getstats(&before);
+  ASSERT_EQ(-1, __res_cache_lookup(0, "cached.example.com", C_IN, T_A, got,
+                                   sizeof(got)));
+  int len = MakeAnswer(answer, "cached.example.com", NOERROR, 300, 0);
+  ASSERT_GT(len, 0);
+  __res_cache_store(0, "cached.example.com", C_IN, T_A, answer, len);
+  // Names match without regard to case or a trailing dot, but the type
+  // has to match.
+  ASSERT_EQ(len, __res_cache_lookup(0, "Cached.Example.COM.", C_IN, T_A, got,
+                                    sizeof(got)));
+  ASSERT_EQ(0, memcmp(answer, got, len));
+  ASSERT_EQ(-1, __res_cache_lookup(0, "cached.example.com", C_IN, T_AAAA, got,
+                                   sizeof(got)));
+  // Nor is it handed out to a buffer too small for it.
+  ASSERT_EQ(-1, __res_cache_lookup(0, "cached.example.com", C_IN, T_A, got,
+                                   len - 1));
+  res_cache_getstats(&after);
+  ASSERT_EQ(1u, after.hits - before.hits);
+  ASSERT_EQ(3u, after.misses - before.misses);
+  ASSERT_EQ(1u, after.stores - before.stores);
+  ASSERT_EQ(1u, after.entries);
+  res_cache_flush();
+  res_cache_getstats(&after);
+  ASSERT_EQ(0u, after.entries);
+}
+
+TEST(TestResCache, ttl) {
+  u_char answer[PACKETSZ], got[PACKETSZ];
+  struct res_cache_stats before, after;
+  res_cache_flush();
+  res_cache_getstats(&before);
+  int len = MakeAnswer(answer, "long.example.com", NOERROR, 300, 0);
+  __res_cache_store(0, "long.example.com", C_IN, T_A, answer, len);
+  int short_len = MakeAnswer(answer, "short.example.com", NOERROR, 1, 0);
+  __res_cache_store(0, "short.example.com", C_IN, T_A, answer, short_len);
+  sleep(2);
+  // The TTL handed out has been counted down; the answer that outlived
+  // its own is gone.
+  ASSERT_EQ(len, __res_cache_lookup(0, "long.example.com", C_IN, T_A, got,
+                                    sizeof(got)));
+  u_int32_t ttl = ns_get32(got + len - 10);
+  ASSERT_LE(ttl, 298u);
+  ASSERT_GE(ttl, 296u);
+  ASSERT_EQ(-1, __res_cache_lookup(0, "short.example.com", C_IN, T_A, got,
+                                   sizeof(got)));
+  res_cache_getstats(&after);
+  ASSERT_EQ(1u, after.expired - before.expired);
+  res_cache_flush();
+}
+
+TEST(TestResCache, not_kept) {
+  u_char answer[PACKETSZ], got[PACKETSZ];
+  res_cache_flush();
+  // A zero TTL, a server failure and a negative answer without an SOA
+  // all say nothing about how long they may be kept.
+  int len = MakeAnswer(answer, "zero.example.com", NOERROR, 0, 0);
+  __res_cache_store(0, "zero.example.com", C_IN, T_A, answer, len);
+  len = MakeAnswer(answer, "fail.example.com", SERVFAIL, 300, 100);
+  __res_cache_store(0, "fail.example.com", C_IN, T_A, answer, len);
+  len = MakeAnswer(answer, "nosoa.example.com", NXDOMAIN, 300, -1);
+  __res_cache_store(0, "nosoa.example.com", C_IN, T_A, answer, len);
+  struct res_cache_stats st;
+  res_cache_getstats(&st);
+  ASSERT_EQ(0u, st.entries);
+  ASSERT_EQ(-1, __res_cache_lookup(0, "zero.example.com", C_IN, T_A, got,
+                                   sizeof(got)));
+}
+
+TEST(TestResCache, negative) {
+  u_char answer[PACKETSZ], got[PACKETSZ];
+  struct res_cache_stats before, after;
+  res_cache_flush();
+  res_cache_getstats(&before);
+  int len = MakeAnswer(answer, "nx.example.com", NXDOMAIN, 300, 60);
+  __res_cache_store(0, "nx.example.com", C_IN, T_A, answer, len);
+  ASSERT_EQ(len, __res_cache_lookup(0, "nx.example.com", C_IN, T_A, got,
+                                    sizeof(got)));
+  ASSERT_EQ(NXDOMAIN, ((HEADER*)got)->rcode);
+  res_cache_getstats(&after);
+  ASSERT_EQ(1u, after.negative_hits - before.negative_hits);
+  res_cache_flush();
+}
+
+TEST(TestResCache, lru_eviction) {
+  u_char answer[PACKETSZ], got[PACKETSZ];
+  char name[64];
+  struct res_cache_stats st;
+  res_cache_flush();
+  for (int i = 0; i < 300; i++) {
+    snprintf(name, sizeof(name), "host%d.example.com", i);
+    int len = MakeAnswer(answer, name, NOERROR, 300, 0);
+    __res_cache_store(0, name, C_IN, T_A, answer, len);
+    // Keep the first one in use.
+    ASSERT_GT(__res_cache_lookup(0, "host0.example.com", C_IN, T_A, got,
+                                 sizeof(got)), 0);
+  }
+  res_cache_getstats(&st);
+  ASSERT_EQ(256u, st.entries);
+  ASSERT_GT(__res_cache_lookup(0, "host299.example.com", C_IN, T_A, got,
+                               sizeof(got)), 0);
+  ASSERT_EQ(-1, __res_cache_lookup(0, "host1.example.com", C_IN, T_A, got,
+                                   sizeof(got)));
+  res_cache_flush();
+}
+
+TEST(TestResCache, option) {
+  struct __res_state state;
+  memset(&state, 0, sizeof(state));
+  setenv("RES_OPTIONS", "no-cache", 1);
+  res_ninit(&state);
+  ASSERT_EQ(0u, state.options & RES_USECACHE);
+  res_nclose(&state);
+  memset(&state, 0, sizeof(state));
+  unsetenv("RES_OPTIONS");
+  res_ninit(&state);
+  ASSERT_NE(0u, state.options & RES_USECACHE);
+  res_nclose(&state);
+}
+
+TEST(TestResSend, options) {
+  struct __res_state state;
+  memset(&state, 0, sizeof(state));
+  unsetenv("RES_OPTIONS");
+  res_ninit(&state);
+  ASSERT_EQ(0u, state.options & (RES_BLAST | RES_SNGLKUP));
+  res_nclose(&state);
+  memset(&state, 0, sizeof(state));
+  setenv("RES_OPTIONS", "single-request blast", 1);
+  res_ninit(&state);
+  ASSERT_NE(0u, state.options & RES_BLAST);
+  ASSERT_NE(0u, state.options & RES_SNGLKUP);
+  res_nclose(&state);
+  unsetenv("RES_OPTIONS");
+}
+
+// Under sel_ldr there is no send_dg to talk to a server with.
+#ifndef __native_client__
+TEST(TestResSend, pair_out_of_order) {
+  FakeServer server = FakeServer();
+  server.n = 1;
+  server.delay_msec = 50;
+  server.swap = true;
+  if (!StartServer(&server))
+    return;
+  struct __res_state state;
+  u_char answer[PACKETSZ], answer2[PACKETSZ];
+  int len, len2;
+  UseServers(&state, &server, 1);
+  ASSERT_EQ(0, res_nquery2(&state, "pair.example.com", C_IN, T_A, T_AAAA,
+                           answer, sizeof(answer), &len, answer2,
+                           sizeof(answer2), &len2));
+  StopServer(&server);
+  res_nclose(&state);
+  // The AAAA answer came first, and both were taken.
+  ASSERT_EQ(2, server.queries);
+  ASSERT_GT(len, 0);
+  ASSERT_EQ(len + 12, len2);
+  ASSERT_EQ(T_A, ns_get16(answer + len - 4 - 10));
+  ASSERT_EQ(T_AAAA, ns_get16(answer2 + len2 - 16 - 10));
+}
+
+TEST(TestResSend, slow_server_moved_back) {
+  FakeServer servers[2] = { FakeServer(), FakeServer() };
+  servers[0].n = 1;
+  servers[0].delay_msec = 200;
+  servers[1].n = 2;
+  if (!StartServer(&servers[0]))
+    return;
+  ASSERT_TRUE(StartServer(&servers[1]));
+  struct __res_state state;
+  u_char answer[PACKETSZ];
+  UseServers(&state, servers, 2);
+  state.options &= ~RES_ROTATE;
+  int from[3];
+  for (int i = 0; i < 3; i++) {
+    int len = res_nquery(&state, "rtt.example.com", C_IN, T_A, answer,
+                         sizeof(answer));
+    ASSERT_GT(len, 0);
+    from[i] = answer[len - 1];
+  }
+  StopServer(&servers[0]);
+  StopServer(&servers[1]);
+  res_nclose(&state);
+  // Once timed, the slow one is asked after the other.
+  ASSERT_EQ(1, from[0]);
+  ASSERT_EQ(2, from[1]);
+  ASSERT_EQ(2, from[2]);
+  ASSERT_EQ(1, servers[0].queries);
+}
+
+TEST(TestResSend, dead_server_probed) {
+  FakeServer servers[2] = { FakeServer(), FakeServer() };
+  servers[0].n = 1;
+  servers[0].silent = true;
+  servers[1].n = 2;
+  servers[1].delay_msec = 1;
+  if (!StartServer(&servers[0]))
+    return;
+  ASSERT_TRUE(StartServer(&servers[1]));
+  struct __res_state state;
+  u_char answer[PACKETSZ];
+  UseServers(&state, servers, 2);
+  state.options &= ~RES_ROTATE;
+  // The first lookup waits out the silent server.
+  ASSERT_GT(res_nquery(&state, "dead.example.com", C_IN, T_A, answer,
+                       sizeof(answer)), 0);
+  // Passed over, it ages back to the front, and is asked again; but
+  // alongside the live one, so no lookup waits for it.
+  long long slowest = 0;
+  for (int i = 0; i < 400; i++) {
+    long long start = NowMsec();
+    ASSERT_GT(res_nquery(&state, "dead.example.com", C_IN, T_A, answer,
+                         sizeof(answer)), 0);
+    slowest = std::max(slowest, NowMsec() - start);
+  }
+  StopServer(&servers[0]);
+  StopServer(&servers[1]);
+  res_nclose(&state);
+  ASSERT_GT(servers[0].queries, 1);
+  ASSERT_LT(slowest, 500);
+}
+
+TEST(TestResSend, single_request) {
+  FakeServer servers[2] = { FakeServer(), FakeServer() };
+  servers[0].n = 1;
+  servers[0].delay_msec = 50;
+  servers[1].n = 2;
+  servers[1].delay_msec = 50;
+  if (!StartServer(&servers[0]))
+    return;
+  ASSERT_TRUE(StartServer(&servers[1]));
+  struct __res_state state;
+  u_char answer[PACKETSZ], answer2[PACKETSZ];
+  int len, len2;
+  // The two questions go together, or with single-request one after
+  // the other.
+  UseServers(&state, &servers[0], 1);
+  ASSERT_EQ(0, res_nquery2(&state, "single.example.com", C_IN, T_A, T_AAAA,
+                           answer, sizeof(answer), &len, answer2,
+                           sizeof(answer2), &len2));
+  res_nclose(&state);
+  UseServers(&state, &servers[1], 1);
+  state.options |= RES_SNGLKUP;
+  ASSERT_EQ(0, res_nquery2(&state, "single.example.com", C_IN, T_A, T_AAAA,
+                           answer, sizeof(answer), &len, answer2,
+                           sizeof(answer2), &len2));
+  res_nclose(&state);
+  StopServer(&servers[0]);
+  StopServer(&servers[1]);
+  ASSERT_EQ(2, servers[0].queries);
+  ASSERT_EQ(0, servers[0].answered_at[1]);
+  ASSERT_EQ(2, servers[1].queries);
+  ASSERT_EQ(1, servers[1].answered_at[1]);
+}
+
+TEST(TestResSend, blast) {
+  FakeServer servers[2] = { FakeServer(), FakeServer() };
+  servers[0].n = 1;
+  servers[0].silent = true;
+  servers[1].n = 2;
+  if (!StartServer(&servers[0]))
+    return;
+  ASSERT_TRUE(StartServer(&servers[1]));
+  struct __res_state state;
+  u_char answer[PACKETSZ];
+  UseServers(&state, servers, 2);
+  state.options |= RES_BLAST;
+  // Both are asked at once, so the silent one costs no time.
+  long long start = NowMsec();
+  int len = res_nquery(&state, "blast.example.com", C_IN, T_A, answer,
+                       sizeof(answer));
+  long long took = NowMsec() - start;
+  StopServer(&servers[0]);
+  StopServer(&servers[1]);
+  res_nclose(&state);
+  ASSERT_GT(len, 0);
+  ASSERT_EQ(2, answer[len - 1]);
+  ASSERT_EQ(1, servers[0].queries);
+  ASSERT_LT(took, 500);
+}
+
+TEST(TestResQuery, edns0_pair) {
+  FakeServer server = FakeServer();
+  server.n = 1;
+  server.plain_rcode = FORMERR;
+  if (!StartServer(&server))
+    return;
+  struct __res_state state;
+  u_char answer[1024], answer2[PACKETSZ];
+  int len, len2;
+  UseServers(&state, &server, 1);
+  state.options |= RES_USE_EDNS0;
+  // Only the first has room for EDNS0, and the server's error to the
+  // second is no refusal of it.
+  ASSERT_EQ(0, res_nquery2(&state, "edns.example.com", C_IN, T_A, T_AAAA,
+                           answer, sizeof(answer), &len, answer2,
+                           sizeof(answer2), &len2));
+  StopServer(&server);
+  ASSERT_EQ(0, state._flags & RES_F_EDNS0ERR);
+  res_nclose(&state);
+  ASSERT_EQ(2, server.queries);
+  ASSERT_EQ(NOERROR, ((HEADER*)answer)->rcode);
+  ASSERT_GT(len2, 0);
+  ASSERT_EQ(FORMERR, ((HEADER*)answer2)->rcode);
+}
+
+TEST(TestResQuery, edns0_dropped) {
+  FakeServer server = FakeServer();
+  server.n = 1;
+  server.drop_opt = true;
+  if (!StartServer(&server))
+    return;
+  struct __res_state state;
+  u_char answer[1024];
+  UseServers(&state, &server, 1);
+  // EDNS0 is asked for, not had by default.
+  ASSERT_EQ(0u, state.options & RES_USE_EDNS0);
+  state.options |= RES_USE_EDNS0;
+  // The query with OPT times out, and the one without is answered.
+  int len = res_nquery(&state, "dropped.example.com", C_IN, T_A, answer,
+                       sizeof(answer));
+  ASSERT_GT(len, 0);
+  ASSERT_EQ(1, answer[len - 1]);
+  ASSERT_NE(0, state._flags & RES_F_EDNS0ERR);
+  ASSERT_EQ(2, server.queries);
+  // After which the state asks without it.
+  len = res_nquery(&state, "dropped.example.com", C_IN, T_A, answer,
+                   sizeof(answer));
+  StopServer(&server);
+  res_nclose(&state);
+  ASSERT_GT(len, 0);
+  ASSERT_EQ(3, server.queries);
+}
+
+// Asks server over TCP for name, returning the answer's last byte.
+static int QueryVc(struct __res_state* state, const char* name) {
+  u_char answer[PACKETSZ];
+  int len = res_nquery(state, name, C_IN, T_A, answer, sizeof(answer));
+  return len > 0 ? answer[len - 1] : -1;
+}
+
+TEST(TestResSend, vc_parked) {
+  FakeServer server = FakeServer();
+  server.n = 1;
+  server.tcp = true;
+  if (!StartServer(&server))
+    return;
+  struct __res_state state;
+  UseServers(&state, &server, 1);
+  state.options |= RES_USEVC;
+  // The connection outlives the lookup, and the next one takes it up.
+  ASSERT_EQ(1, QueryVc(&state, "vc1.example.com"));
+  ASSERT_EQ(-1, state._vcsock);
+  ASSERT_EQ(1, QueryVc(&state, "vc2.example.com"));
+  StopServer(&server);
+  res_nclose(&state);
+  ASSERT_EQ(2, server.queries);
+  ASSERT_EQ(1, server.accepts);
+}
+
+TEST(TestResSend, vc_closed_idle) {
+  FakeServer server = FakeServer();
+  server.n = 1;
+  server.tcp = true;
+  server.close_after = 1;
+  if (!StartServer(&server))
+    return;
+  struct __res_state state;
+  UseServers(&state, &server, 1);
+  state.options |= RES_USEVC;
+  // A parked connection the server has closed is not a failure.
+  ASSERT_EQ(1, QueryVc(&state, "vc1.example.com"));
+  usleep(100 * 1000);
+  ASSERT_EQ(1, QueryVc(&state, "vc2.example.com"));
+  StopServer(&server);
+  res_nclose(&state);
+  ASSERT_EQ(2, server.queries);
+  ASSERT_EQ(2, server.accepts);
+}
+
+TEST(TestResSend, vc_closed_retry) {
+  FakeServer server = FakeServer();
+  server.n = 1;
+  server.tcp = true;
+  server.close_after = 1;
+  server.close_late = true;
+  if (!StartServer(&server))
+    return;
+  struct __res_state state;
+  UseServers(&state, &server, 1);
+  state.options |= RES_USEVC;
+  // Closed only once the query is on it, the parked connection is
+  // given up and the query asked again on a new one, once.
+  ASSERT_EQ(1, QueryVc(&state, "vc1.example.com"));
+  ASSERT_EQ(1, QueryVc(&state, "vc2.example.com"));
+  ASSERT_EQ(3, server.queries);
+  ASSERT_EQ(2, server.accepts);
+  // But when the new connection is closed under it too, it fails.
+  server.close_after = -1;
+  ASSERT_EQ(-1, QueryVc(&state, "vc3.example.com"));
+  StopServer(&server);
+  res_nclose(&state);
+  ASSERT_EQ(5, server.queries);
+  ASSERT_EQ(3, server.accepts);
+}
+
+TEST(TestResSend, vc_idle_expiry) {
+  FakeServer server = FakeServer();
+  server.n = 1;
+  server.tcp = true;
+  if (!StartServer(&server))
+    return;
+  struct __res_state state;
+  UseServers(&state, &server, 1);
+  state.options |= RES_USEVC;
+  // A connection parked for VC_IDLE (10) seconds is not taken up again.
+  ASSERT_EQ(1, QueryVc(&state, "vc1.example.com"));
+  sleep(11);
+  ASSERT_EQ(1, QueryVc(&state, "vc2.example.com"));
+  StopServer(&server);
+  res_nclose(&state);
+  ASSERT_EQ(2, server.queries);
+  ASSERT_EQ(2, server.accepts);
+}
+
+TEST(TestResSend, vc_pipelined) {
+  FakeServer server = FakeServer();
+  server.n = 1;
+  server.tcp = true;
+  server.swap = true;
+  if (!StartServer(&server))
+    return;
+  struct __res_state state;
+  u_char answer[PACKETSZ], answer2[PACKETSZ];
+  int len, len2;
+  UseServers(&state, &server, 1);
+  state.options |= RES_USEVC;
+  // Both queries go out before either answer comes back, and the
+  // answers, the AAAA first, are told apart by their ids.
+  ASSERT_EQ(0, res_nquery2(&state, "pipe.example.com", C_IN, T_A, T_AAAA,
+                           answer, sizeof(answer), &len, answer2,
+                           sizeof(answer2), &len2));
+  StopServer(&server);
+  res_nclose(&state);
+  ASSERT_EQ(2, server.queries);
+  ASSERT_EQ(1, server.accepts);
+  ASSERT_EQ(0, server.answered_at[1]);
+  ASSERT_GT(len, 0);
+  ASSERT_EQ(len + 12, len2);
+  ASSERT_EQ(10, answer[len - 4]);
+  ASSERT_EQ(0, answer2[len2 - 16]);
+}
+
+TEST(TestResCache, scoped_to_servers) {
+  FakeServer servers[2] = { FakeServer(), FakeServer() };
+  servers[0].n = 1;
+  servers[1].n = 2;
+  if (!StartServer(&servers[0]))
+    return;
+  StartServer(&servers[1]);
+  struct __res_state a, b;
+  u_char answer[PACKETSZ];
+  UseServers(&a, &servers[0], 1);
+  UseServers(&b, &servers[1], 1);
+  a.options |= RES_USECACHE;
+  b.options |= RES_USECACHE;
+  res_cache_flush();
+  // The same name asked of other servers is not answered from the cache.
+  int len = res_nquery(&a, "scoped.example.com", C_IN, T_A, answer,
+                       sizeof(answer));
+  ASSERT_GT(len, 0);
+  ASSERT_EQ(1, answer[len - 1]);
+  len = res_nquery(&b, "scoped.example.com", C_IN, T_A, answer,
+                   sizeof(answer));
+  ASSERT_GT(len, 0);
+  ASSERT_EQ(2, answer[len - 1]);
+  // Nor is a question asked without recursion.
+  b.options &= ~RES_RECURSE;
+  len = res_nquery(&b, "scoped.example.com", C_IN, T_A, answer,
+                   sizeof(answer));
+  ASSERT_GT(len, 0);
+  // But each state's own answers are.
+  b.options |= RES_RECURSE;
+  len = res_nquery(&a, "scoped.example.com", C_IN, T_A, answer,
+                   sizeof(answer));
+  ASSERT_EQ(1, answer[len - 1]);
+  len = res_nquery(&b, "scoped.example.com", C_IN, T_A, answer,
+                   sizeof(answer));
+  ASSERT_EQ(2, answer[len - 1]);
+  StopServer(&servers[0]);
+  StopServer(&servers[1]);
+  res_nclose(&a);
+  res_nclose(&b);
+  res_cache_flush();
+  ASSERT_EQ(1, servers[0].queries);
+  ASSERT_EQ(2, servers[1].queries);
+}
+#endif
+
+TEST(TestResInit, shared_config) {
+  struct __res_state a, b;
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+  setenv("LOCALDOMAIN", "one.example two.example", 1);
+  ASSERT_EQ(0, res_ninit(&a));
+  unsetenv("LOCALDOMAIN");
+  ASSERT_EQ(0, res_ninit(&b));
+  ASSERT_STREQ("one.example", a.defdname);
+  ASSERT_EQ(a.defdname, a.dnsrch[0]);
+  ASSERT_STREQ("two.example", a.dnsrch[1]);
+  // Each state has its own copy of what came from resolv.conf.
+  ASSERT_EQ(a.nscount, b.nscount);
+  for (int i = 0; i < a.nscount; i++)
+    ASSERT_EQ(a.nsaddr_list[i].sin_addr.s_addr,
+              b.nsaddr_list[i].sin_addr.s_addr);
+  for (int i = 0; b.dnsrch[i] != NULL; i++) {
+    ASSERT_GE(b.dnsrch[i], b.defdname);
+    ASSERT_LT(b.dnsrch[i], b.defdname + sizeof(b.defdname));
+  }
+  res_nclose(&a);
+  res_nclose(&b);
+}
+
+TEST(TestResMkquery, opt_record) {
+  struct __res_state state;
+  u_char buf[PACKETSZ];
+  memset(&state, 0, sizeof(state));
+  res_ninit(&state);
+  int n = res_nmkquery(&state, QUERY, "example.com", C_IN, T_A, NULL, 0,
+                       NULL, buf, sizeof(buf));
+  ASSERT_GT(n, 0);
+  ASSERT_EQ(n + 1 + RRFIXEDSZ, res_nopt(&state, n, buf, sizeof(buf), 4096));
+  ASSERT_EQ(1, ntohs(((HEADER*)buf)->arcount));
+  ASSERT_EQ(0, buf[n]);
+  ASSERT_EQ(T_OPT, ns_get16(buf + n + 1));
+  ASSERT_EQ(4096, ns_get16(buf + n + 3));
+  ASSERT_EQ(-1, res_nopt(&state, n, buf, n + RRFIXEDSZ, 4096));
+  res_nclose(&state);
+}
+
+TEST(TestResMkquery, edns0_option) {
+  struct __res_state state;
+  memset(&state, 0, sizeof(state));
+  unsetenv("RES_OPTIONS");
+  res_ninit(&state);
+  ASSERT_EQ(0u, state.options & RES_USE_EDNS0);
+  res_nclose(&state);
+  memset(&state, 0, sizeof(state));
+  setenv("RES_OPTIONS", "edns0", 1);
+  res_ninit(&state);
+  ASSERT_NE(0u, state.options & RES_USE_EDNS0);
+  res_nclose(&state);
+  unsetenv("RES_OPTIONS");
+}
+
+TEST(TestResAsync, no_servers) {
+  struct __res_state state;
+  memset(&state, 0, sizeof(state));
+  res_ninit(&state);
+  state.nscount = 0;
+  ASSERT_EQ(NULL, res_async_open(&state));
+  res_nclose(&state);
+}
+
+// What a res_async callback was told, or -1s.
+struct AsyncResult {
+  int calls;
+  int herrno;
+  int from;                     // the answer's last byte
+  struct res_async* close;      // to be closed by the callback
+};
+
+static void AsyncDone(void* arg, int herrno, const u_char* answer,
+                      int anslen) {
+  AsyncResult* r = (AsyncResult*)arg;
+  r->calls++;
+  r->herrno = herrno;
+  r->from = answer != NULL ? answer[anslen - 1] : -1;
+  if (r->close != NULL)
+    res_async_close(r->close);
+}
+
+// Runs ctx for up to msec, or until nothing is pending.  Returns how
+// many queries are.
+static int RunAsync(struct res_async* ctx, int msec) {
+  long long end = NowMsec() + msec;
+  int pending = 1;
+  while (pending > 0 && NowMsec() < end) {
+    struct pollfd pfd = { res_async_fd(ctx), POLLIN, 0 };
+    int wait = res_async_timeout(ctx);
+    poll(&pfd, 1, wait < 0 || wait > 100 ? 100 : wait);
+    pending = res_async_process(ctx);
+  }
+  return pending;
+}
+
+TEST(TestResAsync, answer) {
+  FakeServer server = FakeServer();
+  server.n = 1;
+  if (!StartServer(&server))
+    return;
+  struct __res_state state;
+  UseServers(&state, &server, 1);
+  state.options |= RES_USECACHE;
+  res_cache_flush();
+  struct res_async* ctx = res_async_open(&state);
+  ASSERT_TRUE(ctx != NULL);
+  AsyncResult r = { 0, -1, -1, NULL };
+  ASSERT_GT(res_async_query(ctx, "async.example.com", C_IN, T_A, AsyncDone,
+                            &r), 0);
+  ASSERT_EQ(0, RunAsync(ctx, 2000));
+  ASSERT_EQ(1, r.calls);
+  ASSERT_EQ(NETDB_SUCCESS, r.herrno);
+  ASSERT_EQ(1, r.from);
+  // Asked again, it comes from the cache.
+  ASSERT_GT(res_async_query(ctx, "async.example.com", C_IN, T_A, AsyncDone,
+                            &r), 0);
+  ASSERT_EQ(0, res_async_timeout(ctx));
+  ASSERT_EQ(0, RunAsync(ctx, 2000));
+  ASSERT_EQ(2, r.calls);
+  ASSERT_EQ(1, r.from);
+  res_async_close(ctx);
+  StopServer(&server);
+  res_nclose(&state);
+  res_cache_flush();
+  ASSERT_EQ(1, server.queries);
+}
+
+TEST(TestResAsync, edns0_dropped) {
+  FakeServer server = FakeServer();
+  server.n = 1;
+  server.drop_opt = true;
+  if (!StartServer(&server))
+    return;
+  struct __res_state state;
+  UseServers(&state, &server, 1);
+  state.options |= RES_USE_EDNS0;
+  struct res_async* ctx = res_async_open(&state);
+  ASSERT_TRUE(ctx != NULL);
+  AsyncResult r = { 0, -1, -1, NULL };
+  ASSERT_GT(res_async_query(ctx, "dropped.example.com", C_IN, T_A,
+                            AsyncDone, &r), 0);
+  ASSERT_EQ(0, RunAsync(ctx, 3000));
+  res_async_close(ctx);
+  StopServer(&server);
+  ASSERT_NE(0, state._flags & RES_F_EDNS0ERR);
+  res_nclose(&state);
+  ASSERT_EQ(1, r.calls);
+  ASSERT_EQ(NETDB_SUCCESS, r.herrno);
+  ASSERT_EQ(1, r.from);
+  ASSERT_EQ(2, server.queries);
+}
+
+TEST(TestResAsync, wrong_id) {
+  FakeServer server = FakeServer();
+  server.n = 1;
+  server.bad_id = true;
+  if (!StartServer(&server))
+    return;
+  struct __res_state state;
+  UseServers(&state, &server, 1);
+  struct res_async* ctx = res_async_open(&state);
+  ASSERT_TRUE(ctx != NULL);
+  AsyncResult r = { 0, -1, -1, NULL };
+  ASSERT_GT(res_async_query(ctx, "id.example.com", C_IN, T_A, AsyncDone,
+                            &r), 0);
+  ASSERT_EQ(0, RunAsync(ctx, 2000));
+  res_async_close(ctx);
+  StopServer(&server);
+  res_nclose(&state);
+  // The answer with the wrong id went before the right one, unheeded.
+  ASSERT_EQ(1, r.calls);
+  ASSERT_EQ(1, r.from);
+}
+
+TEST(TestResAsync, silent_server) {
+  FakeServer servers[2] = { FakeServer(), FakeServer() };
+  servers[0].n = 1;
+  servers[0].silent = true;
+  servers[1].n = 2;
+  if (!StartServer(&servers[0]))
+    return;
+  ASSERT_TRUE(StartServer(&servers[1]));
+  struct __res_state state;
+  // The silent server's second is up before the next is asked.
+  UseServers(&state, servers, 2);
+  struct res_async* ctx = res_async_open(&state);
+  ASSERT_TRUE(ctx != NULL);
+  AsyncResult r = { 0, -1, -1, NULL };
+  ASSERT_GT(res_async_query(ctx, "silent.example.com", C_IN, T_A, AsyncDone,
+                            &r), 0);
+  int wait = res_async_timeout(ctx);
+  ASSERT_GT(wait, 500);
+  ASSERT_LE(wait, 1000);
+  ASSERT_EQ(0, RunAsync(ctx, 3000));
+  res_async_close(ctx);
+  res_nclose(&state);
+  ASSERT_EQ(1, r.calls);
+  ASSERT_EQ(NETDB_SUCCESS, r.herrno);
+  ASSERT_EQ(2, r.from);
+  // With no one else to ask, the query is given up on.
+  UseServers(&state, servers, 1);
+  ctx = res_async_open(&state);
+  ASSERT_TRUE(ctx != NULL);
+  ASSERT_GT(res_async_query(ctx, "silent.example.com", C_IN, T_A, AsyncDone,
+                            &r), 0);
+  ASSERT_EQ(0, RunAsync(ctx, 3000));
+  res_async_close(ctx);
+  res_nclose(&state);
+  StopServer(&servers[0]);
+  StopServer(&servers[1]);
+  ASSERT_EQ(2, r.calls);
+  ASSERT_EQ(TRY_AGAIN, r.herrno);
+  ASSERT_EQ(-1, r.from);
+  ASSERT_EQ(2, servers[0].queries);
+  ASSERT_EQ(1, servers[1].queries);
+}
+
+TEST(TestResAsync, close_in_callback) {
+  FakeServer server = FakeServer();
+  server.n = 1;
+  if (!StartServer(&server))
+    return;
+  struct __res_state state;
+  UseServers(&state, &server, 1);
+  struct res_async* ctx = res_async_open(&state);
+  ASSERT_TRUE(ctx != NULL);
+  // The first answer closes the context, and the second query with it.
+  AsyncResult r = { 0, -1, -1, ctx };
+  ASSERT_GT(res_async_query(ctx, "one.example.com", C_IN, T_A, AsyncDone,
+                            &r), 0);
+  ASSERT_GT(res_async_query(ctx, "two.example.com", C_IN, T_A, AsyncDone,
+                            &r), 0);
+  ASSERT_EQ(0, RunAsync(ctx, 2000));
+  StopServer(&server);
+  res_nclose(&state);
+  ASSERT_EQ(1, r.calls);
+}
+
+TEST(TestNsName, ccompress) {
+  u_char msg[PACKETSZ];
+  char name[MAXDNAME];
+  ns_cctx ctx;
+  ns_cctx_init(&ctx, msg);
+  u_char* cp = msg + HFIXEDSZ;
+  ASSERT_EQ(17, ns_name_ccompress("www.example.com", cp, 64, &ctx));
+  // The longest suffix is pointed at, whatever its case.
+  ASSERT_EQ(7, ns_name_ccompress("mail.EXAMPLE.com", cp + 17, 64, &ctx));
+  ASSERT_EQ(HFIXEDSZ + 4, ns_get16(cp + 22) & 0x3fff);
+  ASSERT_EQ(2, ns_name_ccompress("Mail.Example.Com", cp + 24, 64, &ctx));
+  ASSERT_EQ(HFIXEDSZ + 17, ns_get16(cp + 24) & 0x3fff);
+  ASSERT_EQ(5, ns_name_ccompress("org", cp + 26, 64, &ctx));
+  ASSERT_EQ(2, dn_expand(msg, cp + 31, cp + 24, name, sizeof(name)));
+  ASSERT_STREQ("mail.example.com", name);
+  ASSERT_EQ(-1, ns_name_ccompress("www.example.net", cp + 31, 16, &ctx));
+}
+
+TEST(TestNsName, dnptrs) {
+  u_char msg[PACKETSZ];
+  const u_char* dnptrs[4] = {msg, NULL};
+  u_char* cp = msg + HFIXEDSZ;
+  ASSERT_EQ(17, ns_name_compress("www.example.com", cp, 64, dnptrs,
+                                 dnptrs + 4));
+  ASSERT_EQ(cp, dnptrs[1]);
+  ASSERT_EQ(6, ns_name_compress("ftp.example.com", cp + 17, 64, dnptrs,
+                                dnptrs + 4));
+  ASSERT_EQ(cp + 17, dnptrs[2]);
+  ASSERT_EQ(NULL, dnptrs[3]);
+  // The list is full, so these are not kept.
+  ASSERT_EQ(2, ns_name_compress("ftp.example.com", cp + 23, 64, dnptrs,
+                                dnptrs + 4));
+  ASSERT_EQ(5, ns_name_compress("a.b", cp + 25, 64, dnptrs, dnptrs + 4));
+  ASSERT_EQ(5, ns_name_compress("a.b", cp + 30, 64, dnptrs, dnptrs + 4));
+  ASSERT_EQ(NULL, dnptrs[3]);
+  // Names taken back off the list are no longer pointed at.
+  dnptrs[2] = NULL;
+  ASSERT_EQ(17, ns_name_compress("ftp.example.net", cp + 17, 64, dnptrs,
+                                 dnptrs + 4));
+  ASSERT_EQ(2, ns_name_compress("FTP.example.net", cp + 34, 64, dnptrs,
+                                dnptrs + 4));
+  ASSERT_EQ(HFIXEDSZ + 17, ns_get16(cp + 34) & 0x3fff);
+}
+
+TEST(TestInetPton, fast_paths) {
+  u_char addr[16];
+  struct in_addr in;
+  ASSERT_EQ(1, inet_pton(AF_INET, "192.168.001.255", addr));
+  ASSERT_EQ(0, memcmp(addr, "\xc0\xa8\x01\xff", 4));
+  ASSERT_EQ(0, inet_pton(AF_INET, "192.168.1.256", addr));
+  ASSERT_EQ(0, inet_pton(AF_INET, "192.168..1", addr));
+  ASSERT_EQ(0, inet_pton(AF_INET, "1.2.3.4.5", addr));
+  // inet_aton takes a leading zero as octal, and a short form.
+  ASSERT_EQ(1, inet_aton("10.010.0x10.1", &in));
+  ASSERT_EQ(htonl(0x0a081001), in.s_addr);
+  ASSERT_EQ(1, inet_aton("10.1", &in));
+  ASSERT_EQ(htonl(0x0a000001), in.s_addr);
+  ASSERT_EQ(htonl(0x7f000001), inet_addr("127.0.0.1"));
+  ASSERT_EQ(1, inet_pton(AF_INET6, "2001:DB8::ff:1", addr));
+  ASSERT_EQ(0, memcmp(addr, "\x20\x01\x0d\xb8\0\0\0\0", 8));
+  ASSERT_EQ(0, memcmp(addr + 8, "\0\0\0\0\0\xff\0\x01", 8));
+  ASSERT_EQ(1, inet_pton(AF_INET6, "::ffff:10.0.0.1", addr));
+  ASSERT_EQ(0, memcmp(addr + 10, "\xff\xff\x0a\0\0\x01", 6));
+  ASSERT_EQ(0, inet_pton(AF_INET6, "1::2::3", addr));
+  ASSERT_EQ(0, inet_pton(AF_INET6, "12345::", addr));
+}
+
+// Strings near enough to addresses to reach every branch of the parsers.
+static std::string FuzzAddress(unsigned int* seed) {
+  static const char alphabet[] = "0123456789abcdefABCDEF:.x \t-+";
+  char buf[64];
+  std::string s;
+  switch (rand_r(seed) % 3) {
+    case 0:
+      snprintf(buf, sizeof(buf), "%d.%d.%d.%d", rand_r(seed) % 300,
+               rand_r(seed) % 300, rand_r(seed) % 10, rand_r(seed) % 1000);
+      s = buf;
+      break;
+    case 1:
+      snprintf(buf, sizeof(buf), "%x:%x::%x:%x", rand_r(seed) % 0x10000,
+               rand_r(seed) % 0x100, rand_r(seed) % 20,
+               rand_r(seed) % 0x20000);
+      s = buf;
+      break;
+    default:
+      for (int n = rand_r(seed) % 24; n > 0; n--)
+        s += alphabet[rand_r(seed) % (sizeof(alphabet) - 1)];
+      return s;
+  }
+  for (int n = rand_r(seed) % 3; n > 0; n--) {
+    size_t pos = rand_r(seed) % (s.size() + 1);
+    char c = alphabet[rand_r(seed) % (sizeof(alphabet) - 1)];
+    switch (rand_r(seed) % 3) {
+      case 0: s.erase(pos, 1); break;
+      case 1: s.insert(pos, 1, c); break;
+      default: if (pos < s.size()) s[pos] = c; break;
+    }
+  }
+  return s;
+}
+
+TEST(TestInetPton, same_as_bytewise) {
+  unsigned int seed = 1;
+  int valid = 0;
+  for (int i = 0; i < 200000; i++) {
+    std::string s = FuzzAddress(&seed);
+    const int families[] = {AF_INET, AF_INET6};
+    for (int j = 0; j < 2; j++) {
+      u_char fast[16], slow[16];
+      memset(fast, 0x55, sizeof(fast));
+      memset(slow, 0x55, sizeof(slow));
+      int n = inet_pton(families[j], s.c_str(), fast);
+      ASSERT_EQ(__inet_pton_bytewise(families[j], s.c_str(), slow), n)
+          << "\"" << s << "\"";
+      ASSERT_EQ(0, memcmp(fast, slow, sizeof(fast))) << "\"" << s << "\"";
+      valid += n;
+    }
+    struct in_addr fast, slow;
+    fast.s_addr = slow.s_addr = 0x55555555;
+    int n = inet_aton(s.c_str(), &fast);
+    ASSERT_EQ(__inet_aton_bytewise(s.c_str(), &slow), n) << "\"" << s << "\"";
+    ASSERT_EQ(slow.s_addr, fast.s_addr) << "\"" << s << "\"";
+    valid += n;
+  }
+  // Enough of them were addresses for the fast paths to have been taken.
+  ASSERT_LT(20000, valid);
+}
+
+TEST(TestInetPton, bulk) {
+  const char* src[] = {"10.0.0.1", "10.0.0", "255.255.255.255"};
+  u_char addrs[3][4];
+  u_char valid[3];
+  memset(addrs, 0x55, sizeof(addrs));
+  ASSERT_EQ(2, inet_pton_bulk(AF_INET, src, 3, addrs, valid));
+  ASSERT_EQ(0, memcmp(addrs[0], "\x0a\0\0\x01", 4));
+  ASSERT_EQ(0, memcmp(addrs[1], "\x55\x55\x55\x55", 4));
+  ASSERT_EQ(0, memcmp(addrs[2], "\xff\xff\xff\xff", 4));
+  ASSERT_EQ(1, valid[0]);
+  ASSERT_EQ(0, valid[1]);
+  ASSERT_EQ(1, valid[2]);
+  const char* src6[] = {"::1", "fe80::1%eth0"};
+  u_char addrs6[2][16];
+  ASSERT_EQ(1, inet_pton_bulk(AF_INET6, src6, 2, addrs6, NULL));
+  ASSERT_EQ(1, addrs6[0][15]);
+  errno = 0;
+  ASSERT_EQ(-1, inet_pton_bulk(AF_UNIX, src, 3, addrs, valid));
+  ASSERT_EQ(EAFNOSUPPORT, errno);
+}
+
+TEST(TestRealpath, cache) {
+  char dir[] = "realpath_XXXXXX";
+  char resolved[PATH_MAX];
+  ASSERT_NE((char*)NULL, mkdtemp(dir));
+  std::string sub = std::string(dir) + "/sub";
+  std::string file = std::string(dir) + "/file";
+  ASSERT_EQ(0, mkdir(sub.c_str(), 0755));
+  ASSERT_EQ(0, close(open(file.c_str(), O_CREAT | O_WRONLY, 0644)));
+
+  std::string via_sub = sub + "/../file";
+  ASSERT_NE((char*)NULL, realpath(via_sub.c_str(), resolved));
+  ASSERT_EQ('/', resolved[0]);
+  std::string expected = resolved;
+  // The whole path is always checked, cached prefix or not.
+  ASSERT_EQ(NULL, realpath((sub + "/missing").c_str(), resolved));
+  ASSERT_EQ(ENOENT, errno);
+  ASSERT_EQ(NULL, realpath((file + "/x").c_str(), resolved));
+  ASSERT_EQ(ENOTDIR, errno);
+
+  // A removed directory is missed even where ".." steps back out of it.
+  ASSERT_EQ(0, rmdir(sub.c_str()));
+  ASSERT_EQ(NULL, realpath(via_sub.c_str(), resolved));
+  ASSERT_EQ(ENOENT, errno);
+  ASSERT_EQ(NULL, realpath((sub + "/..").c_str(), resolved));
+  ASSERT_EQ(ENOENT, errno);
+  ASSERT_EQ(0, mkdir(sub.c_str(), 0755));
+  realpath_cache_invalidate();
+  ASSERT_NE((char*)NULL, realpath(via_sub.c_str(), resolved));
+  ASSERT_STREQ(expected.c_str(), resolved);
+  ASSERT_EQ(0, rmdir(sub.c_str()));
+
+  ASSERT_EQ(0, unlink(file.c_str()));
+  ASSERT_EQ(0, rmdir(dir));
+}
+#endif
+
 TEST(TestLockf, lockf) {
   // The fcntl() method underlying lockf() is not implemented in NaCl.
   ASSERT_EQ(-1, lockf(1, F_LOCK, 1));
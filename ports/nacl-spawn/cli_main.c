@@ -14,7 +14,10 @@
 
 int cli_main(int argc, char* argv[]) {
   nacl_setup_env();
-  return nacl_main(argc, argv);
+  nacl_trace_event("nacl_main", 'B');
+  int rtn = nacl_main(argc, argv);
+  nacl_trace_event("nacl_main", 'E');
+  return rtn;
 }
 
 PPAPI_SIMPLE_REGISTER_MAIN(cli_main)
@@ -8,14 +8,23 @@
 #include <string>
 #include <vector>
 
+// Called with the paths of shared objects as soon as they are found, before
+// the rest of the dependencies have been resolved, so that the caller can
+// start fetching them early.
+typedef void (*LibrariesFoundCallback)(const std::vector<std::string>& paths,
+                                       void* data);
+
 // Finds shared objects which are necessary to run |filename|.
 // Also finds the architecture string |arch|.
 // Output paths will be stored in |dependencies|. |filename| will be
 // in |dependencies| if |filename| is dynamically linked. Otherwise,
 // |dependencies| will be empty. Returns false and update errno
-// appropriately on error.
+// appropriately on error. Libraries needed at the same depth are read
+// concurrently, and |on_found| (if not NULL) is called after each depth.
 bool FindArchAndLibraryDependencies(const std::string& filename,
                                     std::string* arch,
-                                    std::vector<std::string>* dependencies);
+                                    std::vector<std::string>* dependencies,
+                                    LibrariesFoundCallback on_found = NULL,
+                                    void* on_found_data = NULL);
 
 #endif  // NACL_SPAWN_LIBRARY_DEPENDENCIES_H_
@@ -43,6 +43,14 @@ extern int nacl_startup_untar(
 
 extern void nacl_setup_env();
 
+/*
+ * Record a trace event for the current process when NACL_TRACE=1 is set
+ * in the environment (naclprocess.js sets it while tracing is active).
+ * |phase| is a Chrome trace-event phase such as 'B' (begin), 'E' (end)
+ * or 'i' (instant).
+ */
+extern void nacl_trace_event(const char* name, char phase);
+
 __END_DECLS
 
 #endif /* NACL_SPAWN_NACL_MAIN_H_ */
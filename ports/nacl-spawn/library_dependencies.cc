@@ -4,13 +4,14 @@
 
 #include "library_dependencies.h"
 
-#include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <set>
 
 #include "elf_reader.h"
@@ -27,23 +28,49 @@ static bool GetLibraryPaths(std::vector<std::string>* paths) {
   return true;
 }
 
-static bool FindArchAndLibraryDependenciesImpl(
-    const std::string& filename,
-    const std::vector<std::string>& paths,
-    std::string* arch,
-    std::set<std::string>* dependencies) {
-  if (!dependencies->insert(filename).second) {
-    // We have already added this file.
-    return true;
-  }
-
-  ElfReader elf_reader(filename.c_str());
+// Maximum number of libraries whose headers are read concurrently.
+static const size_t kMaxLookupThreads = 8;
+
+// A shared object to locate in the library paths and whose ELF headers
+// are to be read. Lookups of all libraries needed at the same depth run
+// on separate threads, as each access() and read may be a round trip on
+// httpfs or html5fs.
+struct LibraryLookup {
+  std::string name;
+  const std::vector<std::string>* paths;
+  bool found;
+  std::string path;
+  ElfReader* elf_reader;
+};
+
+static void* LookupLibrary(void* arg) {
+  LibraryLookup* lookup = static_cast<LibraryLookup*>(arg);
+  lookup->found = GetFileInPaths(lookup->name, *lookup->paths, &lookup->path);
+  if (lookup->found)
+    lookup->elf_reader = new ElfReader(lookup->path.c_str());
+  return NULL;
+}
 
-  if (!elf_reader.is_valid()) {
-    errno = ENOEXEC;
-    return false;
+static void LookupLibraries(std::vector<LibraryLookup>* lookups) {
+  for (size_t start = 0; start < lookups->size();
+       start += kMaxLookupThreads) {
+    size_t end = std::min(start + kMaxLookupThreads, lookups->size());
+    std::vector<pthread_t> threads(end - start);
+    std::vector<bool> started(end - start);
+    for (size_t i = start; i < end; i++) {
+      started[i - start] = pthread_create(&threads[i - start], NULL,
+                                          LookupLibrary, &(*lookups)[i]) == 0;
+      if (!started[i - start])
+        LookupLibrary(&(*lookups)[i]);
+    }
+    for (size_t i = start; i < end; i++) {
+      if (started[i - start])
+        pthread_join(threads[i - start], NULL);
+    }
   }
+}
 
+static bool CheckMachine(const ElfReader& elf_reader, std::string* arch) {
   Elf64_Half machine = elf_reader.machine();
   if (machine != EM_X86_64 && machine != EM_386 && machine != EM_ARM) {
     errno = ENOEXEC;
@@ -58,23 +85,17 @@ static bool FindArchAndLibraryDependenciesImpl(
       *arch = "arm";
     }
   }
+  return true;
+}
 
-  if (elf_reader.is_static()) {
-    assert(!dependencies->empty());
-    if (dependencies->size() == 1) {
-      // The main binary is statically linked.
-      dependencies->clear();
-      return true;
-    } else {
-      fprintf(stderr, "%s: unexpected static binary\n", filename.c_str());
-      errno = ENOEXEC;
-      return false;
-    }
-  }
-
+// Queues the DT_NEEDED entries of |elf_reader| which have not been seen
+// yet for the next round of lookups.
+static void AddNeededs(const ElfReader& elf_reader,
+                       const std::vector<std::string>& paths,
+                       std::set<std::string>* seen_names,
+                       std::vector<LibraryLookup>* lookups) {
   for (size_t i = 0; i < elf_reader.neededs().size(); i++) {
     const std::string& needed_name = elf_reader.neededs()[i];
-    std::string needed_path;
     if (needed_name == "ld-nacl-x86-32.so.1" ||
         needed_name == "ld-nacl-x86-64.so.1") {
       // Our sdk includes ld-nacl-x86-*.so.1, for link time. However,
@@ -83,28 +104,93 @@ static bool FindArchAndLibraryDependenciesImpl(
       // as the initial nexe by nacl). Since all glibc NMFs include
       // ld-runnable.so (which has ld-nacl-*.so.1 as its SONAME), they will
       // already have this dependency, so we can ignore it.
-    } else if (GetFileInPaths(needed_name, paths, &needed_path)) {
-      if (!FindArchAndLibraryDependenciesImpl(
-            needed_path, paths, NULL, dependencies))
-        return false;
-    } else {
-      fprintf(stderr, "%s: library not found\n", needed_name.c_str());
-      errno = ENOENT;
-      return false;
+      continue;
     }
+    if (!seen_names->insert(needed_name).second)
+      continue;
+    LibraryLookup lookup;
+    lookup.name = needed_name;
+    lookup.paths = &paths;
+    lookup.found = false;
+    lookup.elf_reader = NULL;
+    lookups->push_back(lookup);
   }
-  return true;
+}
+
+static bool FindArchAndLibraryDependenciesImpl(
+    const std::string& filename,
+    const std::vector<std::string>& paths,
+    std::string* arch,
+    std::set<std::string>* dependencies,
+    LibrariesFoundCallback on_found,
+    void* on_found_data) {
+  ElfReader elf_reader(filename.c_str());
+
+  if (!elf_reader.is_valid()) {
+    errno = ENOEXEC;
+    return false;
+  }
+  if (!CheckMachine(elf_reader, arch))
+    return false;
+  if (elf_reader.is_static()) {
+    // The main binary is statically linked.
+    return true;
+  }
+  dependencies->insert(filename);
+
+  // Walk the dependency graph breadth first so that all libraries needed
+  // at one depth are looked up concurrently.
+  std::set<std::string> seen_names;
+  std::vector<LibraryLookup> lookups;
+  AddNeededs(elf_reader, paths, &seen_names, &lookups);
+  bool ok = true;
+  while (ok && !lookups.empty()) {
+    LookupLibraries(&lookups);
+
+    std::vector<LibraryLookup> next_lookups;
+    std::vector<std::string> found;
+    for (size_t i = 0; i < lookups.size(); i++) {
+      LibraryLookup& lookup = lookups[i];
+      if (ok) {
+        if (!lookup.found) {
+          fprintf(stderr, "%s: library not found\n", lookup.name.c_str());
+          errno = ENOENT;
+          ok = false;
+        } else if (!lookup.elf_reader->is_valid()) {
+          errno = ENOEXEC;
+          ok = false;
+        } else if (!CheckMachine(*lookup.elf_reader, NULL)) {
+          ok = false;
+        } else if (lookup.elf_reader->is_static()) {
+          fprintf(stderr, "%s: unexpected static binary\n",
+                  lookup.path.c_str());
+          errno = ENOEXEC;
+          ok = false;
+        } else if (dependencies->insert(lookup.path).second) {
+          found.push_back(lookup.path);
+          AddNeededs(*lookup.elf_reader, paths, &seen_names, &next_lookups);
+        }
+      }
+      delete lookup.elf_reader;
+    }
+    if (ok && on_found && !found.empty())
+      on_found(found, on_found_data);
+    lookups.swap(next_lookups);
+  }
+  return ok;
 }
 
 bool FindArchAndLibraryDependencies(const std::string& filename,
                                     std::string* arch,
-                                    std::vector<std::string>* dependencies) {
+                                    std::vector<std::string>* dependencies,
+                                    LibrariesFoundCallback on_found,
+                                    void* on_found_data) {
   std::vector<std::string> paths;
   GetLibraryPaths(&paths);
 
   std::set<std::string> dep_set;
   if (!FindArchAndLibraryDependenciesImpl(
-        filename.c_str(), paths, arch, &dep_set))
+        filename.c_str(), paths, arch, &dep_set, on_found, on_found_data))
     return false;
   dependencies->assign(dep_set.begin(), dep_set.end());
 
@@ -30,10 +30,12 @@
 #include <sys/mount.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <set>
 #include <string>
 #include <vector>
 
@@ -376,6 +378,46 @@ static struct PP_Var SendRequest(struct PP_Var req_var) {
   return reply.result_var;
 }
 
+// Whether trace events should be sent to JavaScript. -1 means not yet
+// determined from the NACL_TRACE environment variable.
+static int trace_enabled = -1;
+static int trace_next_tid = 0;
+static NACL_SPAWN_TLS int trace_tid = 0;
+
+static bool TraceEnabled() {
+  if (trace_enabled == -1) {
+    const char* trace_env = getenv("NACL_TRACE");
+    trace_enabled = PSGetInstanceId() != 0 && trace_env != NULL &&
+        strcmp(trace_env, "1") == 0;
+  }
+  return trace_enabled;
+}
+
+// Posts a trace event to JavaScript without waiting for a reply.
+// Timestamps are microseconds since the epoch so that naclprocess.js can
+// merge events from all processes onto one timeline.
+static void TraceEvent(const char* name, char phase) {
+  if (!TraceEnabled()) {
+    return;
+  }
+  if (trace_tid == 0) {
+    trace_tid = __sync_add_and_fetch(&trace_next_tid, 1);
+  }
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  char phase_str[2] = { phase, '\0' };
+
+  struct PP_Var req_var = VarDictionaryCreate();
+  VarDictionarySetString(req_var, "command", "nacl_trace");
+  VarDictionarySetString(req_var, "name", name);
+  VarDictionarySetString(req_var, "ph", phase_str);
+  VarDictionarySet(req_var, "ts",
+                   PP_MakeDouble(tv.tv_sec * 1e6 + tv.tv_usec));
+  SetInt(req_var, "tid", trace_tid);
+  PSInterfaceMessaging()->PostMessage(PSGetInstanceId(), req_var);
+  VarRelease(req_var);
+}
+
 static void restore_pipes(void) {
   int old_pipes[MAX_OLD_PIPES][3];
   int old_pipe_count = 0;
@@ -448,7 +490,9 @@ static int apipe_read(
   SetInt(req_var, "pipe_id", info->fh);
   SetInt(req_var, "count", count);
 
+  TraceEvent("apipe_read", 'B');
   struct PP_Var result_var = SendRequest(req_var);
+  TraceEvent("apipe_read", 'E');
   struct PP_Var data = VarDictionaryGet(result_var, "data");
   assert(data.type == PP_VARTYPE_ARRAY_BUFFER);
   uint32_t len;
@@ -495,7 +539,9 @@ static int apipe_write(
   PSInterfaceVarArrayBuffer()->Unmap(data);
   VarDictionarySet(req_var, "data", data);
 
+  TraceEvent("apipe_write", 'B');
   struct PP_Var result_var = SendRequest(req_var);
+  TraceEvent("apipe_write", 'E');
   int ret = GetInt(result_var, "count");
   VarRelease(result_var);
 
@@ -585,6 +631,50 @@ static void AddFileToNmf(const std::string& key,
   VarDictionarySet(dict_var, key.c_str(), arch_dict_var);
 }
 
+// Returns true if |abspath| is on one of the html5fs mounts made in
+// nacl_setup_env, which JavaScript reads from the browser's own storage
+// rather than over http.
+static bool IsOnHtml5Fs(const std::string& abspath) {
+  const char* home = getenv("HOME");
+  const std::string mounts[] = {
+    "/mnt/html5/", "/tmp/", std::string(home ? home : "/home/user") + '/',
+  };
+  for (size_t i = 0; i < sizeof(mounts) / sizeof(mounts[0]); i++) {
+    if (abspath.compare(0, mounts[i].size(), mounts[i]) == 0)
+      return true;
+  }
+  return false;
+}
+
+// Asks JavaScript to start fetching shared objects while the rest of the
+// NMF is still being built. No reply is expected. Only libraries fetched
+// over http are worth it, and each only the first time this process
+// finds it.
+static void PrefetchLibraries(const std::vector<std::string>& paths,
+                              void* data) {
+  static std::set<std::string> hinted;
+  static pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+  std::vector<std::string> files;
+  pthread_mutex_lock(&mu);
+  for (size_t i = 0; i < paths.size(); i++) {
+    std::string abspath = GetAbsPath(paths[i]);
+    if (!IsOnHtml5Fs(abspath) && hinted.insert(abspath).second)
+      files.push_back(abspath);
+  }
+  pthread_mutex_unlock(&mu);
+  if (files.empty())
+    return;
+
+  struct PP_Var req_var = VarDictionaryCreate();
+  VarDictionarySetString(req_var, "command", "nacl_prefetch");
+  struct PP_Var files_var = VarArrayCreate();
+  for (size_t i = 0; i < files.size(); i++)
+    VarArrayAppendString(files_var, files[i].c_str());
+  VarDictionarySet(req_var, "files", files_var);
+  PSInterfaceMessaging()->PostMessage(PSGetInstanceId(), req_var);
+  VarRelease(req_var);
+}
+
 static void AddNmfToRequestForShared(
     std::string prog,
     const std::string& arch,
@@ -780,7 +870,8 @@ static bool AddNmfToRequest(std::string prog, struct PP_Var req_var) {
 
   std::string arch;
   std::vector<std::string> dependencies;
-  if (!FindArchAndLibraryDependencies(prog, &arch, &dependencies))
+  if (!FindArchAndLibraryDependencies(prog, &arch, &dependencies,
+                                      PrefetchLibraries, NULL))
     return false;
   if (!dependencies.empty()) {
     AddNmfToRequestForShared(prog, arch, dependencies, req_var);
@@ -930,12 +1021,19 @@ static int spawnve_impl(int mode,
   VarDictionarySet(req_var, "envs", envs_var);
   VarDictionarySetString(req_var, "cwd", GetCwd().c_str());
 
-  if (!AddNmfToRequest(path, req_var)) {
+  TraceEvent("nacl_spawn", 'B');
+  TraceEvent("build_nmf", 'B');
+  bool nmf_ok = AddNmfToRequest(path, req_var);
+  TraceEvent("build_nmf", 'E');
+  if (!nmf_ok) {
+    TraceEvent("nacl_spawn", 'E');
     errno = ENOENT;
     return -1;
   }
 
-  return GetIntAndRelease(SendRequest(req_var), "pid");
+  int pid = GetIntAndRelease(SendRequest(req_var), "pid");
+  TraceEvent("nacl_spawn", 'E');
+  return pid;
 }
 
 // Spawn a new NaCl process. This is an alias for
@@ -959,7 +1057,9 @@ static pid_t waitpid_impl(int pid, int* status, int options) {
   VarDictionarySet(req_var, "pid", PP_MakeInt32(pid));
   VarDictionarySet(req_var, "options", PP_MakeInt32(options));
 
+  TraceEvent("waitpid", 'B');
   struct PP_Var result_var = SendRequest(req_var);
+  TraceEvent("waitpid", 'E');
   int result_pid = GetInt(result_var, "pid");
 
   // WEXITSTATUS(s) is defined as ((s >> 8) & 0xff).
@@ -1234,6 +1334,10 @@ void nacl_spawn_vfork_exit(int status) {
   }
 }
 
+void nacl_trace_event(const char* name, char phase) {
+  TraceEvent(name, phase);
+}
+
 void nacl_setup_env() {
   // If we running in sel_ldr then don't do any the filesystem/nacl_io
   // setup. We detect sel_ldr by the absence of the Pepper Instance.
@@ -1241,10 +1345,13 @@ void nacl_setup_env() {
     return;
   }
 
+  TraceEvent("nacl_setup_env", 'B');
+  TraceEvent("setup_anonymous_pipes", 'B');
   umount("/");
   do_mount("", "/", "memfs", 0, NULL);
 
   setup_anonymous_pipes();
+  TraceEvent("setup_anonymous_pipes", 'E');
 
   // Setup common environment variables, but don't override those
   // set already by ppapi_simple.
@@ -1263,6 +1370,7 @@ void nacl_setup_env() {
   mkdir_checked("/mnt/http");
   mkdir_checked("/mnt/html5");
 
+  TraceEvent("mount_filesystems", 'B');
   const char* data_url = getenv("NACL_DATA_URL");
   if (!data_url)
     data_url = "./";
@@ -1296,6 +1404,7 @@ void nacl_setup_env() {
   }
 
   mountfs();
+  TraceEvent("mount_filesystems", 'E');
 
   /* naclprocess.js sends the current working directory using this
    * environment variable. */
@@ -1332,7 +1441,10 @@ void nacl_setup_env() {
   nacl_spawn_pid = getenv_as_int("NACL_PID");
   nacl_spawn_ppid = getenv_as_int("NACL_PPID");
 
+  TraceEvent("restore_pipes", 'B');
   restore_pipes();
+  TraceEvent("restore_pipes", 'E');
+  TraceEvent("nacl_setup_env", 'E');
 }
 
 #define VARG_TO_ARGV_START \